@@ -0,0 +1,2863 @@
+//
+//  VoodooUSBBenchmark.cpp
+//  VoodooUSBProvider Simulator
+//
+//  Drives the real VoodooUSBDevice / VoodooUSBInterface / VoodooUSBPipe code and the helpers built
+//  on them through the simulated host, and reports throughput and latency for each path.
+//  Every benchmark also checks the result it measured, so `make check` doubles as a regression run.
+//
+//  Usage: VoodooUSBBenchmark [--quick] [--verbose] [--filter substring]
+//
+
+#include "VoodooUSBProvider.h"
+#include "VoodooHCICommandEngine.h"
+#include "VoodooHCIEventReassembler.h"
+#include "VoodooHCIAclScheduler.h"
+#include "VoodooHCICapture.h"
+#include "VoodooFirmwareDownloader.h"
+#include "VoodooBcmPatchLoader.h"
+#include "VoodooIntelSfiLoader.h"
+#include "VoodooFirmwareCache.h"
+#include <IOUSBHostSimulator.h>
+#include <machine/machine_routines.h>
+
+#include <chrono>
+#include <functional>
+#include <thread>
+#include <vector>
+
+static bool     gQuick   = false;
+static UInt32   gFailures = 0;
+
+#define BenchCheck(condition, args...)                                                      \
+    do                                                                                      \
+    {                                                                                       \
+        if (!(condition))                                                                   \
+        {                                                                                   \
+            fprintf(stdout, "    FAILED: " args);                                           \
+            fprintf(stdout, "\n");                                                          \
+            ++gFailures;                                                                    \
+        }                                                                                   \
+    } while (0)
+
+static UInt32 iterations(UInt32 full)
+{
+    return gQuick ? (full / 10 ? full / 10 : 1) : full;
+}
+
+static UInt64 elapsedNS(UInt64 startTime)
+{
+    UInt64 elapsed;
+    absolutetime_to_nanoseconds(mach_absolute_time() - startTime, &elapsed);
+    return elapsed;
+}
+
+static void report(const char * name, UInt32 count, UInt64 durationNS, UInt64 bytes = 0)
+{
+    double perOp = count ? (double) durationNS / count / 1000.0 : 0;
+    double rate  = durationNS ? (double) count * 1e9 / durationNS : 0;
+
+    if (bytes)
+    {
+        printf("    %-44s %8u ops %10.2f us/op %10.0f ops/s %9.2f MB/s\n", name, count, perOp, rate, (double) bytes * 1e3 / durationNS);
+    }
+    else
+    {
+        printf("    %-44s %8u ops %10.2f us/op %10.0f ops/s\n", name, count, perOp, rate);
+    }
+}
+
+static void reportHistogram(const char * name, OSDictionary * statistics)
+{
+    if (!statistics)
+    {
+        return;
+    }
+
+    const char * keys[] = { "Count", "Errors", "P50US", "P99US", "MaxUS" };
+    UInt64 values[ARRAY_SIZE(keys)];
+    for (UInt32 i = 0; i < ARRAY_SIZE(keys); ++i)
+    {
+        OSNumber * number = OSDynamicCast(OSNumber, statistics->getObject(keys[i]));
+        values[i] = number ? number->unsigned64BitValue() : 0;
+    }
+    printf("    %-44s count %llu, errors %llu, p50 <= %llu us, p99 <= %llu us, max %llu us\n", name,
+           (unsigned long long) values[0], (unsigned long long) values[1], (unsigned long long) values[2], (unsigned long long) values[3], (unsigned long long) values[4]);
+}
+
+static UInt64 histogramValue(OSDictionary * statistics, const char * histogram, const char * key)
+{
+    OSDictionary * dictionary = statistics ? OSDynamicCast(OSDictionary, statistics->getObject(histogram)) : NULL;
+    OSNumber * number = dictionary ? OSDynamicCast(OSNumber, dictionary->getObject(key)) : NULL;
+    return number ? number->unsigned64BitValue() : 0;
+}
+
+/* Gives the controller thread the CPU; IODelay() spins, which starves it on a single core */
+static void benchYield()
+{
+    std::this_thread::sleep_for(std::chrono::microseconds(50));
+}
+
+/* Waits on a counter bumped from completions, which run on the controller thread */
+static bool waitFor(volatile UInt32 * counter, UInt32 target, UInt32 timeoutMS = 10000)
+{
+    UInt64 deadline = mach_absolute_time() + (UInt64) timeoutMS * kMillisecondScale;
+    while (__atomic_load_n(counter, __ATOMIC_SEQ_CST) < target)
+    {
+        if (mach_absolute_time() > deadline)
+        {
+            return false;
+        }
+        benchYield();
+    }
+    return true;
+}
+
+/*
+ * One simulated controller with the provider classes attached to it, opened the way a
+ * Bluetooth driver opens its provider.
+ */
+class BenchDevice
+{
+public:
+    BenchDevice(const IOUSBHostSimConfig & config, IOUSBHostSimBluetoothModel * customModel = NULL) : device(NULL), client(NULL), controller(NULL)
+    {
+        interfaces[0] = interfaces[1] = NULL;
+
+        client = new IOService;
+        client->init();
+
+        device = new VoodooUSBDevice;
+        device->init();
+        if (!device->simStart(config, customModel ? customModel : &model))
+        {
+            return;
+        }
+        controller = device->simGetController();
+
+        OSIterator * iterator = device->getChildIterator(gIOServicePlane);
+        OSObject * child;
+        while (iterator && (child = iterator->getNextObject()))
+        {
+            VoodooUSBInterface * interface = OSDynamicCast(VoodooUSBInterface, child);
+            if (interface && interface->getInterfaceNumber() < 2)
+            {
+                interface->retain();
+                interfaces[interface->getInterfaceNumber()] = interface;
+            }
+        }
+        OSSafeReleaseNULL(iterator);
+
+        device->open(client);
+        for (int i = 0; i < 2; ++i)
+        {
+            if (interfaces[i])
+            {
+                interfaces[i]->open(client);
+            }
+        }
+    }
+
+    ~BenchDevice()
+    {
+        for (int i = 0; i < 2; ++i)
+        {
+            if (interfaces[i])
+            {
+                interfaces[i]->close(client);
+                OSSafeReleaseNULL(interfaces[i]);
+            }
+        }
+
+        // The interfaces hold the device as their provider; simStop() detaches them
+        device->close(client);
+        device->simStop();
+        OSSafeReleaseNULL(device);
+        OSSafeReleaseNULL(client);
+    }
+
+    bool valid() const
+    {
+        return controller && interfaces[0];
+    }
+
+    IOUSBHostSimStatistics simStatistics()
+    {
+        IOUSBHostSimStatistics statistics;
+        controller->getStatistics(&statistics);
+        return statistics;
+    }
+
+    VoodooUSBDevice            * device;
+    VoodooUSBInterface         * interfaces[2];
+    IOService                  * client;
+    IOUSBHostSimController     * controller;
+    IOUSBHostSimBluetoothModel   model;
+};
+
+static IOUSBHostSimConfig benchConfig()
+{
+    IOUSBHostSimConfig config = IOUSBHostSimDefaultConfig();
+    if (gQuick)
+    {
+        config.controlLatencyNS     /= 4;
+        config.transferLatencyNS    /= 4;
+        config.hciResponseLatencyNS /= 4;
+    }
+    return config;
+}
+
+/* ---- Control path ---- */
+
+static void benchControl()
+{
+    BenchDevice bench(benchConfig());
+    BenchCheck(bench.valid(), "device did not start");
+    if (!bench.valid())
+    {
+        return;
+    }
+
+    UInt32 count = iterations(2000);
+    UInt32 failed = 0;
+    UInt8 state;
+
+    UInt64 startTime = mach_absolute_time();
+    for (UInt32 i = 0; i < count; ++i)
+    {
+        if (bench.device->sendVendorRequestIn(bench.client, VENDOR_GETSTATE, &state, sizeof(state)) != kIOReturnSuccess)
+        {
+            ++failed;
+        }
+    }
+    report("sendVendorRequestIn (1 byte)", count, elapsedNS(startTime));
+
+    startTime = mach_absolute_time();
+    for (UInt32 i = 0; i < count; ++i)
+    {
+        if (bench.device->sendHCIRequestOut(bench.client, HCI_OP_RESET, 0, NULL) != kIOReturnSuccess)
+        {
+            ++failed;
+        }
+    }
+    report("sendHCIRequestOut (pooled buffer)", count, elapsedNS(startTime));
+
+    OSDictionary * statistics = bench.device->copyStatistics();
+    reportHistogram("Control histogram", OSDynamicCast(OSDictionary, statistics->getObject("Control")));
+    reportHistogram("HCI histogram", OSDynamicCast(OSDictionary, statistics->getObject("HCI")));
+
+    BenchCheck(!failed, "%u control transfers failed", failed);
+    BenchCheck(histogramValue(statistics, "Control", "Count") >= count, "control histogram missed transfers");
+    BenchCheck(histogramValue(statistics, "HCI", "Count") == count, "HCI histogram counted %llu of %u", (unsigned long long) histogramValue(statistics, "HCI", "Count"), count);
+    OSSafeReleaseNULL(statistics);
+}
+
+static void benchControlBatch()
+{
+    BenchDevice bench(benchConfig());
+    if (!bench.valid())
+    {
+        BenchCheck(false, "device did not start");
+        return;
+    }
+
+    // A vendor bring-up sequence: 16 writes, each with its own wValue / wIndex
+    const UInt32 steps = 16;
+    VoodooUSBControlStep sequence[steps];
+    VoodooUSBControlResult results[steps];
+    std::vector<UInt32> expected;
+    for (UInt32 i = 0; i < steps; ++i)
+    {
+        sequence[i] = { VoodooUSBRequestType(kRequestDirectionOut, kRequestTypeVendor, kRequestRecipientDevice), 0x20, (UInt16) i, (UInt16) (0x100 + i), 0, NULL, 0 };
+        expected.push_back((i << 16) | (0x100 + i));
+    }
+
+    UInt32 rounds = iterations(200);
+    UInt32 failed = 0;
+    bench.model.vendorRequestsOut.clear();
+    UInt64 startTime = mach_absolute_time();
+    for (UInt32 r = 0; r < rounds; ++r)
+    {
+        for (UInt32 i = 0; i < steps; ++i)
+        {
+            failed += bench.device->sendRequest(bench.client, sequence[i].bRequest, NULL, 0, kRequestDirectionOut, kRequestTypeVendor, kRequestRecipientDevice, sequence[i].wValue, sequence[i].wIndex) != kIOReturnSuccess;
+        }
+    }
+    report("16 vendor requests, one by one", rounds * steps, elapsedNS(startTime));
+    BenchCheck(!failed && bench.model.vendorRequestsOut.size() == rounds * steps && std::equal(expected.begin(), expected.end(), bench.model.vendorRequestsOut.end() - steps),
+               "%u failed, %zu logged, wValue / wIndex not passed through", failed, bench.model.vendorRequestsOut.size());
+
+    bench.model.vendorRequestsOut.clear();
+    startTime = mach_absolute_time();
+    for (UInt32 r = 0; r < rounds; ++r)
+    {
+        failed += bench.device->sendRequestBatchSync(bench.client, sequence, steps, results) != kIOReturnSuccess;
+    }
+    report("16 vendor requests, batched", rounds * steps, elapsedNS(startTime));
+
+    bool ordered = bench.model.vendorRequestsOut.size() == rounds * steps;
+    for (UInt32 i = 0; ordered && i < rounds * steps; ++i)
+    {
+        ordered = bench.model.vendorRequestsOut[i] == expected[i % steps];
+    }
+    BenchCheck(!failed && ordered, "%u batches failed, requests reached the device out of order", failed);
+    BenchCheck(results[steps - 1].status == kIOReturnSuccess, "last step reported 0x%08x", results[steps - 1].status);
+}
+
+static void benchControlBatchErrors()
+{
+    IOUSBHostSimConfig config = benchConfig();
+    config.failEvery = 7;
+
+    BenchDevice bench(config);
+    if (!bench.valid())
+    {
+        BenchCheck(false, "device did not start");
+        return;
+    }
+
+    // Steps after a failure already on the bus still run; from the barrier on nothing more goes out
+    const UInt32 steps = 16;
+    const UInt32 barrier = 8;
+    VoodooUSBControlStep sequence[steps];
+    VoodooUSBControlResult results[steps];
+    for (UInt32 i = 0; i < steps; ++i)
+    {
+        sequence[i] = { VoodooUSBRequestType(kRequestDirectionOut, kRequestTypeVendor, kRequestRecipientDevice), 0x20, (UInt16) i, 0, 0, NULL, (UInt8) (i == barrier ? kVoodooUSBControlStepBarrier : 0) };
+    }
+
+    UInt32 rounds = iterations(50);
+    UInt32 wrong = 0;
+    for (UInt32 r = 0; r < rounds; ++r)
+    {
+        IOReturn status = bench.device->sendRequestBatchSync(bench.client, sequence, steps, results);
+        UInt32 first = 0;
+        while (first < steps && results[first].status == kIOReturnSuccess)
+        {
+            ++first;
+        }
+        if (first == steps || status != results[first].status)
+        {
+            ++wrong;
+            continue;
+        }
+        for (UInt32 i = first + 1; i < steps; ++i)
+        {
+            // Before the barrier a step was already sent and may fail or not; after it, none were
+            bool sent = first < barrier && i < barrier;
+            wrong += !sent && results[i].status != kIOReturnAborted;
+            wrong += sent && results[i].status == kIOReturnAborted;
+        }
+    }
+    BenchCheck(!wrong, "%u results out of place in batches stopped by an error", wrong);
+
+    // Ignoring errors runs every step however many fail
+    for (UInt32 i = 0; i < steps; ++i)
+    {
+        sequence[i].flags = kVoodooUSBControlStepIgnoreError;
+    }
+    IOReturn status = bench.device->sendRequestBatchSync(bench.client, sequence, steps, results);
+    UInt32 aborted = 0;
+    UInt32 errors = 0;
+    for (UInt32 i = 0; i < steps; ++i)
+    {
+        aborted += results[i].status == kIOReturnAborted;
+        errors  += results[i].status != kIOReturnSuccess;
+    }
+    BenchCheck(status == kIOReturnSuccess && !aborted && errors >= 2, "ignoring errors: 0x%08x, %u aborted, %u failed", status, aborted, errors);
+}
+
+/* ---- String descriptors ---- */
+
+static void benchStrings()
+{
+    BenchDevice bench(benchConfig());
+    if (!bench.valid())
+    {
+        BenchCheck(false, "device did not start");
+        return;
+    }
+
+    UInt32 count = iterations(1000);
+    UInt8 index = bench.device->getProductStringIndex();
+    char string[VOODOO_USB_STRING_MAX];
+
+    // open() prefetched the three strings
+    bench.controller->resetStatistics();
+    UInt64 startTime = mach_absolute_time();
+    for (UInt32 i = 0; i < count; ++i)
+    {
+        bench.device->getStringDescriptor(index, string, sizeof(string));
+    }
+    report("getStringDescriptor (cached)", count, elapsedNS(startTime));
+    BenchCheck(!bench.simStatistics().stringFetches, "cached lookups went to the device %llu times", (unsigned long long) bench.simStatistics().stringFetches);
+    BenchCheck(!strcmp(string, "Simulated Bluetooth Controller"), "product string decoded as \"%s\"", string);
+
+    UInt32 uncached = iterations(200);
+    bench.controller->resetStatistics();
+    startTime = mach_absolute_time();
+    for (UInt32 i = 0; i < uncached; ++i)
+    {
+        bench.device->invalidateStringCache();
+        bench.device->getStringDescriptor(index, string, sizeof(string));
+    }
+    report("getStringDescriptor (invalidated)", uncached, elapsedNS(startTime));
+    BenchCheck(bench.simStatistics().stringFetches == uncached, "expected %u device reads, saw %llu", uncached, (unsigned long long) bench.simStatistics().stringFetches);
+}
+
+/* ---- Endpoint lookup ---- */
+
+static void benchFindPipe()
+{
+    BenchDevice bench(benchConfig());
+    if (!bench.valid())
+    {
+        BenchCheck(false, "device did not start");
+        return;
+    }
+
+    UInt32 count = iterations(1000000);
+    VoodooUSBPipe * pipe = NULL;
+    UInt32 found = 0;
+
+    UInt64 startTime = mach_absolute_time();
+    for (UInt32 i = 0; i < count; ++i)
+    {
+        found += bench.interfaces[0]->findPipe(pipe, kUSBBulk, kUSBIn);
+    }
+    report("findPipe (bulk in)", count, elapsedNS(startTime));
+    BenchCheck(found == count && pipe && pipe->getEndpointDescriptor()->bEndpointAddress == 0x82, "bulk in pipe not found");
+    OSSafeReleaseNULL(pipe);
+
+    // Switching alternate settings rebuilds the table on the next lookup
+    VoodooUSBInterface * sco = bench.interfaces[1];
+    if (sco)
+    {
+        UInt32 switches = iterations(200);
+        const UInt16 expected[] = { 9, 17, 25, 33, 49 };
+        UInt32 mismatched = 0;
+
+        startTime = mach_absolute_time();
+        for (UInt32 i = 0; i < switches; ++i)
+        {
+            UInt8 setting = 1 + i % ARRAY_SIZE(expected);
+            sco->selectAlternateSetting(bench.client, setting);
+            VoodooUSBEndpointEntry entry;
+            if (!sco->copyEndpointEntry(kUSBIsoc, kUSBOut, &entry))
+            {
+                ++mismatched;
+                continue;
+            }
+            mismatched += entry.maxPacketSize != expected[setting - 1];
+            entry.pipe->release();
+        }
+        report("selectAlternateSetting + copyEndpointEntry", switches, elapsedNS(startTime));
+        BenchCheck(!mismatched, "%u lookups returned a stale endpoint after switching", mismatched);
+    }
+}
+
+// What a lookup costs without the model: walk the descriptors every time
+static const StandardUSB::InterfaceDescriptor * walkForInterface(const StandardUSB::ConfigurationDescriptor * configuration, UInt8 interfaceNumber, UInt8 alternateSetting)
+{
+    const StandardUSB::InterfaceDescriptor * interface = NULL;
+    while ((interface = StandardUSB::getNextInterfaceDescriptor(configuration, interface)))
+    {
+        if (interface->bInterfaceNumber == interfaceNumber && interface->bAlternateSetting == alternateSetting)
+        {
+            return interface;
+        }
+    }
+    return NULL;
+}
+
+static void benchInterfaceLookup()
+{
+    IOUSBHostSimConfig config = benchConfig();
+    BenchDevice bench(config);
+    if (!bench.valid())
+    {
+        BenchCheck(false, "device did not start");
+        return;
+    }
+
+    const StandardUSB::ConfigurationDescriptor * descriptor = bench.device->getFullConfigurationDescriptor(0);
+    const VoodooUSBConfigurationModel * model = bench.device->getConfigurationModel();
+    UInt8 settings = config.isochronousSettings;
+    BenchCheck(model && model->settingCount == 1 + settings && model->endpointCount == 3 + 2 * settings && model->interfaceCount == (settings ? 2 : 1),
+               "model has %u settings, %u endpoints", model ? model->settingCount : 0, model ? model->endpointCount : 0);
+    if (!model)
+    {
+        return;
+    }
+
+    UInt32 count = iterations(200000);
+    VoodooUSBConfigurationModel scratch;
+    UInt64 startTime = mach_absolute_time();
+    for (UInt32 i = 0; i < count; ++i)
+    {
+        scratch.parse(descriptor);
+    }
+    report("VoodooUSBConfigurationModel::parse", count, elapsedNS(startTime), (UInt64) count * USBToHost16(descriptor->wTotalLength));
+
+    // The last alternate setting is the worst case for both
+    UInt8 lastSetting = settings ? settings - 1 : 0;
+    UInt8 interfaceNumber = settings ? 1 : 0;
+    UInt32 found = 0;
+    count = iterations(1000000);
+    startTime = mach_absolute_time();
+    for (UInt32 i = 0; i < count; ++i)
+    {
+        found += walkForInterface(descriptor, interfaceNumber, lastSetting) != NULL;
+    }
+    report("descriptor walk (last setting)", count, elapsedNS(startTime));
+
+    startTime = mach_absolute_time();
+    for (UInt32 i = 0; i < count; ++i)
+    {
+        found += model->findSetting(interfaceNumber, lastSetting) != VOODOO_USB_CONFIG_NOT_FOUND;
+    }
+    report("findSetting (last setting)", count, elapsedNS(startTime));
+    BenchCheck(found == 2 * count, "%u of %u lookups found the setting", found, 2 * count);
+
+    UInt8 setting = model->findSetting(0xE0, 0x01, 0x01);
+    UInt8 bulkIn  = model->findEndpoint(setting, kUSBBulk, kUSBIn);
+    BenchCheck(setting == 0 && bulkIn != VOODOO_USB_CONFIG_NOT_FOUND && model->endpointAddress[bulkIn] == 0x82, "Bluetooth interface or its bulk in endpoint not found");
+    BenchCheck(model->findSetting(0xFF, VOODOO_USB_CONFIG_MATCH_ANY, VOODOO_USB_CONFIG_MATCH_ANY) == VOODOO_USB_CONFIG_NOT_FOUND, "a vendor class interface was found");
+
+    // A whole lookup down to the interface object, and one for an interface that is not there
+    VoodooUSBInterface * interface = NULL;
+    count = iterations(100000);
+    found = 0;
+    startTime = mach_absolute_time();
+    for (UInt32 i = 0; i < count; ++i)
+    {
+        found += bench.device->findFirstInterface(interface);
+    }
+    report("findFirstInterface", count, elapsedNS(startTime));
+    BenchCheck(found == count && interface == bench.interfaces[0], "findFirstInterface returned %p, expected %p", interface, bench.interfaces[0]);
+    BenchCheck(!bench.device->findInterface(interface, 0xFF) && !interface, "findInterface found an interface that does not exist");
+
+    // A descriptor that runs past its own length is rejected and the model kept
+    std::vector<UInt8> broken((const UInt8 *) descriptor, (const UInt8 *) descriptor + USBToHost16(descriptor->wTotalLength));
+    broken[sizeof(StandardUSB::ConfigurationDescriptor)] = 0;
+    scratch.parse(descriptor);
+    IOReturn result = scratch.parse((const StandardUSB::ConfigurationDescriptor *) broken.data());
+    BenchCheck(result != kIOReturnSuccess && scratch.valid && scratch.settingCount == model->settingCount, "malformed descriptor: 0x%08x, %u settings kept", result, scratch.settingCount);
+
+    // The model follows the configuration: nothing to find while unconfigured, the new interfaces once set again
+    bench.device->setConfiguration(bench.client, 0);
+    bool unconfigured = !bench.device->getConfigurationModel() && !bench.device->findFirstInterface(interface);
+    bench.device->setConfiguration(bench.client, 1);
+    bool reconfigured = bench.device->findFirstInterface(interface) && interface != bench.interfaces[0];
+    BenchCheck(unconfigured && reconfigured, "model kept across configurations: %s while unconfigured, %s after", unconfigured ? "nothing" : "found", reconfigured ? "new interface" : "stale");
+    OSSafeReleaseNULL(interface);
+}
+
+/* ---- HCI event reassembly and command pipelining ---- */
+
+struct CommandCounter
+{
+    volatile UInt32 completed;
+    volatile UInt32 failed;
+};
+
+static void countCommand(void * owner, void * refCon, IOReturn status, const HciEventHdr * event, UInt16 eventLength)
+{
+    CommandCounter * counter = (CommandCounter *) refCon;
+    __atomic_add_fetch(status == kIOReturnSuccess ? &counter->completed : &counter->failed, 1, __ATOMIC_SEQ_CST);
+}
+
+static void benchCommandEngine(UInt8 credits)
+{
+    IOUSBHostSimConfig config = benchConfig();
+    config.hciCommandCredits = credits;
+
+    BenchDevice bench(config);
+    if (!bench.valid())
+    {
+        BenchCheck(false, "device did not start");
+        return;
+    }
+
+    VoodooUSBPipe * interruptPipe = NULL;
+    bench.interfaces[0]->findPipe(interruptPipe, kUSBInterrupt, kUSBIn);
+
+    VoodooHCIEventReassembler * reassembler = VoodooHCIEventReassembler::withPipe(interruptPipe);
+    VoodooHCICommandEngine * engine = VoodooHCICommandEngine::withDevice(bench.device, bench.client);
+    if (!reassembler || !engine)
+    {
+        BenchCheck(false, "unable to create the reassembler or engine");
+        OSSafeReleaseNULL(reassembler);
+        OSSafeReleaseNULL(engine);
+        OSSafeReleaseNULL(interruptPipe);
+        return;
+    }
+
+    reassembler->subscribe(HCI_EV_CMD_COMPLETE, VoodooHCICommandEngine::handleEventAction, engine);
+    reassembler->subscribe(HCI_EV_CMD_STATUS, VoodooHCICommandEngine::handleEventAction, engine);
+    reassembler->start();
+
+    UInt32 count = iterations(2000);
+    CommandCounter counter = { 0, 0 };
+    VoodooHCICommandCompletion completion = { engine, countCommand, &counter };
+    char name[64];
+
+    UInt64 startTime = mach_absolute_time();
+    for (UInt32 i = 0; i < count; ++i)
+    {
+        // 32 slots; wait for one to retire rather than failing the enqueue
+        while (engine->enqueueCommand(HCI_OP_READ_LOCAL_VERSION, 0, NULL, &completion) == kIOReturnNoResources)
+        {
+            benchYield();
+        }
+    }
+    bool drained = waitFor(&counter.completed, count);
+    snprintf(name, sizeof(name), "enqueueCommand (%u credit%s)", credits, credits > 1 ? "s" : "");
+    report(name, count, elapsedNS(startTime));
+    BenchCheck(drained && !counter.failed, "%u of %u commands completed, %u failed", counter.completed, count, counter.failed);
+
+    if (credits == 1)
+    {
+        UInt32 syncCount = iterations(500);
+        UInt8 response[HCI_MAX_EVENT_SIZE];
+        UInt32 failed = 0;
+
+        startTime = mach_absolute_time();
+        for (UInt32 i = 0; i < syncCount; ++i)
+        {
+            UInt16 length = sizeof(response);
+            if (engine->sendCommandSync(HCI_OP_READ_BUFFER_SIZE, 0, NULL, response, &length) != kIOReturnSuccess || length != 13)
+            {
+                ++failed;
+            }
+        }
+        report("sendCommandSync (Read Buffer Size)", syncCount, elapsedNS(startTime));
+        BenchCheck(!failed, "%u synchronous commands failed", failed);
+    }
+
+    OSDictionary * statistics = bench.device->copyStatistics();
+    reportHistogram("HCI response histogram", OSDynamicCast(OSDictionary, statistics->getObject("HCIResponse")));
+    OSSafeReleaseNULL(statistics);
+
+    VoodooHCIEventStatistics eventStatistics;
+    reassembler->getStatistics(&eventStatistics);
+    BenchCheck(!eventStatistics.malformed && !eventStatistics.truncated, "reassembler saw %u malformed and %u truncated frames", eventStatistics.malformed, eventStatistics.truncated);
+
+    reassembler->stop();
+    OSSafeReleaseNULL(engine);
+    OSSafeReleaseNULL(reassembler);
+    OSSafeReleaseNULL(interruptPipe);
+}
+
+static void countEvent(void * owner, void * refCon, const HciEventHdr * event, UInt16 length)
+{
+    __atomic_add_fetch((volatile UInt32 *) refCon, 1, __ATOMIC_SEQ_CST);
+}
+
+static void benchReassembler()
+{
+    IOUSBHostSimConfig config = benchConfig();
+    config.transferLatencyNS   = 2 * kMicrosecondScale;
+    config.packetLatencyNS     = 0;
+    config.completionLatencyNS = 2 * kMicrosecondScale;
+
+    BenchDevice bench(config);
+    if (!bench.valid())
+    {
+        BenchCheck(false, "device did not start");
+        return;
+    }
+
+    VoodooUSBPipe * interruptPipe = NULL;
+    bench.interfaces[0]->findPipe(interruptPipe, kUSBInterrupt, kUSBIn);
+    VoodooHCIEventReassembler * reassembler = VoodooHCIEventReassembler::withPipe(interruptPipe);
+    volatile UInt32 frames = 0;
+
+    reassembler->subscribe(VOODOO_HCI_EVENT_ANY, countEvent, NULL, (void *) &frames);
+    reassembler->start();
+
+    // Number Of Completed Packets with 4 handles: 19 bytes, two interrupt packets
+    UInt8 event[] = { HCI_EV_NUM_COMP_PKTS, 17, 4, 0x01, 0x00, 0x01, 0x00, 0x02, 0x00, 0x01, 0x00, 0x03, 0x00, 0x01, 0x00, 0x04, 0x00, 0x01, 0x00 };
+    UInt32 count = iterations(20000);
+
+    UInt64 startTime = mach_absolute_time();
+    for (UInt32 i = 0; i < count; ++i)
+    {
+        bench.controller->queueEvent(event, sizeof(event));
+    }
+    bool drained = waitFor(&frames, count);
+    UInt64 duration = elapsedNS(startTime);
+    report("event reassembly (19 byte events)", count, duration, (UInt64) count * sizeof(event));
+
+    VoodooHCIEventStatistics statistics;
+    reassembler->getStatistics(&statistics);
+    BenchCheck(drained && statistics.frames == count, "%llu of %u events delivered", (unsigned long long) statistics.frames, count);
+    BenchCheck(!statistics.malformed, "%u malformed frames", statistics.malformed);
+
+    reassembler->stop();
+    OSSafeReleaseNULL(reassembler);
+    OSSafeReleaseNULL(interruptPipe);
+}
+
+/* Synchronous command round trips with the waiter blocking, then spinning first on the event pipe */
+static void benchPollMode()
+{
+    BenchDevice bench(benchConfig());
+    if (!bench.valid())
+    {
+        BenchCheck(false, "device did not start");
+        return;
+    }
+    
+    VoodooUSBPipe * interruptPipe = NULL;
+    bench.interfaces[0]->findPipe(interruptPipe, kUSBInterrupt, kUSBIn);
+    
+    VoodooHCIEventReassembler * reassembler = VoodooHCIEventReassembler::withPipe(interruptPipe);
+    VoodooHCICommandEngine * engine = VoodooHCICommandEngine::withDevice(bench.device, bench.client);
+    if (!reassembler || !engine)
+    {
+        BenchCheck(false, "unable to create the reassembler or engine");
+        OSSafeReleaseNULL(reassembler);
+        OSSafeReleaseNULL(engine);
+        OSSafeReleaseNULL(interruptPipe);
+        return;
+    }
+    reassembler->subscribe(HCI_EV_CMD_COMPLETE, VoodooHCICommandEngine::handleEventAction, engine);
+    reassembler->subscribe(HCI_EV_CMD_STATUS, VoodooHCICommandEngine::handleEventAction, engine);
+    reassembler->start();
+    engine->setPollPipe(interruptPipe);
+    
+    UInt32 count = iterations(400);
+    UInt32 windowUS = (UInt32) (benchConfig().hciResponseLatencyNS / 1000) * 4;
+    UInt32 failures = 0;
+    UInt64 blockingNS = 0;
+    UInt64 pollingNS = 0;
+    VoodooUSBPollStatistics statistics;
+    
+    for (UInt32 i = 0; i < count; ++i)
+    {
+        UInt64 startTime = mach_absolute_time();
+        failures += engine->sendCommandSync(HCI_OP_READ_LOCAL_VERSION, 0, NULL) != kIOReturnSuccess;
+        blockingNS += elapsedNS(startTime);
+    }
+    report("sync command, blocking", count, blockingNS);
+    
+    // The init burst: plenty of budget, every wait spins first
+    interruptPipe->setPollWindow(windowUS, count * windowUS);
+    for (UInt32 i = 0; i < count; ++i)
+    {
+        UInt64 startTime = mach_absolute_time();
+        failures += engine->sendCommandSync(HCI_OP_READ_LOCAL_VERSION, 0, NULL) != kIOReturnSuccess;
+        pollingNS += elapsedNS(startTime);
+    }
+    report("sync command, hybrid poll", count, pollingNS);
+    
+    interruptPipe->getPollStatistics(&statistics);
+    printf("    %-44s %llu hits, %llu misses, %.0f us spun per command\n", "", (unsigned long long) statistics.hits, (unsigned long long) statistics.misses, statistics.spinNS / 1000.0 / count);
+    BenchCheck(failures == 0, "%u commands failed", failures);
+    
+    if (ml_get_max_cpus() < 2)
+    {
+        BenchCheck(statistics.hits + statistics.misses + statistics.overBudget == 0, "spun on a single CPU");
+    }
+    else
+    {
+        BenchCheck(statistics.hits + statistics.misses == count && statistics.overBudget == 0, "%llu hits, %llu misses, %llu over budget for %u commands",
+                   (unsigned long long) statistics.hits, (unsigned long long) statistics.misses, (unsigned long long) statistics.overBudget, count);
+        
+        // A phase with a small budget spins until it is spent, then only blocks
+        VoodooUSBPollStatistics before = statistics;
+        UInt32 budgetUS = windowUS * 2;
+        interruptPipe->setPollWindow(windowUS, budgetUS);
+        for (UInt32 i = 0; i < 10; ++i)
+        {
+            failures += engine->sendCommandSync(HCI_OP_READ_LOCAL_VERSION, 0, NULL) != kIOReturnSuccess;
+        }
+        interruptPipe->getPollStatistics(&statistics);
+        UInt64 spentUS = (statistics.spinNS - before.spinNS) / 1000;
+        BenchCheck(failures == 0 && statistics.overBudget - before.overBudget > 0 && spentUS <= budgetUS + windowUS, "small budget: %llu us spun of %u, %llu waits over budget",
+                   (unsigned long long) spentUS, budgetUS, (unsigned long long) (statistics.overBudget - before.overBudget));
+    }
+    
+    // Off again after the phase
+    VoodooUSBPollStatistics before = statistics;
+    interruptPipe->setPollWindow(0, 0);
+    failures += engine->sendCommandSync(HCI_OP_READ_LOCAL_VERSION, 0, NULL) != kIOReturnSuccess;
+    interruptPipe->getPollStatistics(&statistics);
+    BenchCheck(failures == 0 && statistics.hits + statistics.misses + statistics.overBudget == before.hits + before.misses + before.overBudget, "poll counters moved with polling off");
+    
+    reassembler->stop();
+    engine->setPollPipe(NULL);
+    OSSafeReleaseNULL(engine);
+    OSSafeReleaseNULL(reassembler);
+    OSSafeReleaseNULL(interruptPipe);
+}
+
+/* ---- HCI timers ---- */
+
+struct TimerRecord
+{
+    VoodooHCITimer      timer;
+    UInt64              deadline;       /* absolute time it may fire at the earliest */
+    UInt64              firedAt;
+    volatile UInt32   * fired;
+};
+
+static void recordTimer(void * owner, void * refCon)
+{
+    TimerRecord * record = (TimerRecord *) refCon;
+    record->firedAt = mach_absolute_time();
+    __atomic_add_fetch(record->fired, 1, __ATOMIC_SEQ_CST);
+}
+
+static void emptyThreadCall(thread_call_param_t param0, thread_call_param_t param1)
+{
+}
+
+static void benchTimerWheel()
+{
+    VoodooHCITimerWheel * wheel = VoodooHCITimerWheel::withTick();
+    if (!wheel)
+    {
+        BenchCheck(false, "unable to create the timer wheel");
+        return;
+    }
+
+    // Arm and cancel, the common case for command timeouts answered in time
+    const UInt32 population = 1024;
+    std::vector<TimerRecord> records(population);
+    volatile UInt32 fired = 0;
+    for (UInt32 i = 0; i < population; ++i)
+    {
+        VoodooHCITimerWheel::initTimer(&records[i].timer, recordTimer, NULL, &records[i]);
+        records[i].fired = &fired;
+    }
+
+    UInt32 count = iterations(200000);
+    UInt64 startTime = mach_absolute_time();
+    for (UInt32 i = 0; i < count; ++i)
+    {
+        wheel->armTimer(&records[i % population].timer, HCI_CMD_TIMEOUT + (i % 64) * 1000);
+        if (i >= population / 2)
+        {
+            wheel->cancelTimer(&records[(i - population / 2) % population].timer);
+        }
+    }
+    report("timer wheel arm + cancel", count, elapsedNS(startTime));
+    for (UInt32 i = 0; i < population; ++i)
+    {
+        wheel->cancelTimer(&records[i].timer);
+    }
+
+    // One thread call per pending deadline, which is what clients do today
+    std::vector<thread_call_t> calls(population);
+    for (UInt32 i = 0; i < population; ++i)
+    {
+        calls[i] = thread_call_allocate(emptyThreadCall, NULL);
+    }
+    startTime = mach_absolute_time();
+    for (UInt32 i = 0; i < count; ++i)
+    {
+        UInt64 deadline;
+        clock_interval_to_deadline(HCI_CMD_TIMEOUT + (i % 64) * 1000, kMillisecondScale, &deadline);
+        thread_call_enter_delayed(calls[i % population], deadline);
+        if (i >= population / 2)
+        {
+            thread_call_cancel(calls[(i - population / 2) % population]);
+        }
+    }
+    report("thread call per timer, enter + cancel", count, elapsedNS(startTime));
+    for (UInt32 i = 0; i < population; ++i)
+    {
+        thread_call_cancel_wait(calls[i]);
+        thread_call_free(calls[i]);
+    }
+
+    // A scan and pair storm: hundreds of deadlines expiring close together
+    UInt32 storm = gQuick ? 256 : population;
+    UInt32 tickMS = wheel->getTickMS();
+    fired = 0;
+    startTime = mach_absolute_time();
+    for (UInt32 i = 0; i < storm; ++i)
+    {
+        UInt32 timeoutMS = 20 + (i * 7) % 180;
+        clock_interval_to_deadline(timeoutMS, kMillisecondScale, &records[i].deadline);
+        records[i].firedAt = 0;
+        wheel->armTimer(&records[i].timer, timeoutMS);
+    }
+    bool drained = waitFor(&fired, storm, 5000);
+    report("timer storm, 20 - 200 ms deadlines", storm, elapsedNS(startTime));
+
+    UInt32 early = 0;
+    UInt64 worstLateNS = 0;
+    for (UInt32 i = 0; i < storm; ++i)
+    {
+        if (records[i].firedAt < records[i].deadline)
+        {
+            ++early;
+            continue;
+        }
+        UInt64 late;
+        absolutetime_to_nanoseconds(records[i].firedAt - records[i].deadline, &late);
+        worstLateNS = late > worstLateNS ? late : worstLateNS;
+    }
+
+    VoodooHCITimerStatistics statistics;
+    wheel->getStatistics(&statistics);
+    printf("    %-44s %llu batches, largest %u, %u late ticks, worst %.2f ms late\n", "", (unsigned long long) statistics.batches, statistics.maxBatch, statistics.lateTicks, worstLateNS / 1e6);
+    BenchCheck(drained && fired == storm, "%u of %u timers fired", fired, storm);
+    BenchCheck(!early, "%u timers fired early", early);
+    BenchCheck(worstLateNS < 10ULL * tickMS * 1000000ULL, "a timer fired %llu ms late", (unsigned long long) (worstLateNS / 1000000));
+    BenchCheck(statistics.batches < storm, "%llu batches for %u timers", (unsigned long long) statistics.batches, storm);
+    BenchCheck(!wheel->getPending(), "%u timers left pending", wheel->getPending());
+    OSSafeReleaseNULL(wheel);
+
+    // Commands nobody answers time out on the device's wheel, without anyone polling
+    BenchDevice bench(benchConfig());
+    if (!bench.valid() || !bench.device->getTimerWheel())
+    {
+        BenchCheck(false, "device did not start or has no timer wheel");
+        return;
+    }
+
+    VoodooHCICommandEngine * engine = VoodooHCICommandEngine::withDevice(bench.device, bench.client);
+    CommandCounter counter = { 0, 0 };
+    VoodooHCICommandCompletion completion = { engine, countCommand, &counter };
+    const UInt32 timeoutMS = 30;
+    const UInt32 commands = 4;
+
+    engine->setCommandTimeout(timeoutMS);
+    startTime = mach_absolute_time();
+    for (UInt32 i = 0; i < commands; ++i)
+    {
+        engine->enqueueCommand(HCI_OP_READ_LOCAL_VERSION, 0, NULL, &completion);
+    }
+    bool timedOut = waitFor(&counter.failed, commands, 2000);
+    UInt64 duration = elapsedNS(startTime);
+    report("unanswered commands timed out", counter.failed, duration);
+    BenchCheck(timedOut && !counter.completed, "%u of %u commands timed out, %u completed", counter.failed, commands, counter.completed);
+    BenchCheck(duration >= (UInt64) commands * timeoutMS * 1000000ULL, "commands timed out after %llu ms", (unsigned long long) (duration / 1000000));
+    OSSafeReleaseNULL(engine);
+}
+
+/* ---- Bulk data ---- */
+
+struct PumpCounter
+{
+    volatile UInt32 transfers;
+    volatile UInt64 bytes;
+};
+
+static void countPumpRead(void * owner, void * refCon, IOReturn status, IOBufferMemoryDescriptor * buffer, UInt32 length)
+{
+    PumpCounter * counter = (PumpCounter *) refCon;
+    __atomic_add_fetch(&counter->bytes, length, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&counter->transfers, 1, __ATOMIC_SEQ_CST);
+}
+
+static void benchReadPump(UInt32 depth)
+{
+    BenchDevice bench(benchConfig());
+    if (!bench.valid())
+    {
+        BenchCheck(false, "device did not start");
+        return;
+    }
+
+    VoodooUSBPipe * bulkPipe = NULL;
+    bench.interfaces[0]->findPipe(bulkPipe, kUSBBulk, kUSBIn);
+
+    // ACL packets of 1021 bytes plus the 4 byte header, all waiting in the controller
+    const UInt32 packetSize = 1025;
+    UInt32 count = iterations(2000);
+    std::vector<UInt8> packet(packetSize, 0xA5);
+    for (UInt32 i = 0; i < count; ++i)
+    {
+        bench.controller->queueInData(0x82, packet.data(), packetSize);
+    }
+
+    PumpCounter counter = { 0, 0 };
+    char name[64];
+
+    UInt64 startTime = mach_absolute_time();
+    IOReturn result = bulkPipe->startReadPump(depth, packetSize, countPumpRead, NULL, &counter);
+    bool drained = waitFor(&counter.transfers, count);
+    UInt64 duration = elapsedNS(startTime);
+
+    snprintf(name, sizeof(name), "read pump, depth %u", depth);
+    report(name, count, duration, counter.bytes);
+
+    bulkPipe->stopReadPump();
+    BenchCheck(result == kIOReturnSuccess && drained && counter.bytes == (UInt64) count * packetSize, "read %llu of %llu bytes", (unsigned long long) counter.bytes, (unsigned long long) count * packetSize);
+    OSSafeReleaseNULL(bulkPipe);
+}
+
+struct BatchCounter
+{
+    volatile UInt32 transfers;
+    volatile UInt32 callbacks;
+    volatile UInt64 bytes;
+};
+
+static void countReadBatch(void * owner, void * refCon, const VoodooUSBReadCompletion * completions, UInt32 count)
+{
+    BatchCounter * counter = (BatchCounter *) refCon;
+    for (UInt32 i = 0; i < count; ++i)
+    {
+        __atomic_add_fetch(&counter->bytes, completions[i].length, __ATOMIC_SEQ_CST);
+    }
+    __atomic_add_fetch(&counter->callbacks, 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&counter->transfers, count, __ATOMIC_SEQ_CST);
+}
+
+static void benchCoalescedPump(UInt32 maxBatch)
+{
+    BenchDevice bench(benchConfig());
+    if (!bench.valid())
+    {
+        BenchCheck(false, "device did not start");
+        return;
+    }
+
+    VoodooUSBPipe * bulkPipe = NULL;
+    bench.interfaces[0]->findPipe(bulkPipe, kUSBBulk, kUSBIn);
+
+    const UInt32 depth = 16;
+    const UInt32 latencyUS = 2000;
+    const UInt32 packetSize = 1025;
+    UInt32 count = iterations(2000);
+    std::vector<UInt8> packet(packetSize, 0x5A);
+    for (UInt32 i = 0; i < count; ++i)
+    {
+        bench.controller->queueInData(0x82, packet.data(), packetSize);
+    }
+
+    // Sustained load: batches fill up long before the latency bound
+    BatchCounter counter = { 0, 0, 0 };
+    VoodooUSBReadPumpStatistics statistics;
+    char name[64];
+
+    UInt64 startTime = mach_absolute_time();
+    IOReturn result = bulkPipe->startCoalescedReadPump(depth, packetSize, maxBatch, latencyUS, countReadBatch, NULL, &counter);
+    bool drained = waitFor(&counter.transfers, count);
+    UInt64 duration = elapsedNS(startTime);
+    bulkPipe->getReadPumpStatistics(&statistics);
+    bulkPipe->stopReadPump();
+
+    snprintf(name, sizeof(name), "coalesced read pump, batches of %u", maxBatch);
+    report(name, count, duration, counter.bytes);
+    printf("    %-44s %u callbacks, %.2f reads per callback, %u flushed by timer\n", "", counter.callbacks,
+           counter.callbacks ? (double) counter.transfers / counter.callbacks : 0, statistics.timerFlushes);
+
+    UInt64 batched = 0;
+    for (UInt32 size = 1; size <= VOODOO_USB_READ_PUMP_MAX_BATCH; ++size)
+    {
+        batched += (UInt64) size * statistics.batchSizes[size];
+    }
+    BenchCheck(result == kIOReturnSuccess && drained && counter.bytes == (UInt64) count * packetSize, "read %llu of %llu bytes", (unsigned long long) counter.bytes, (unsigned long long) count * packetSize);
+    BenchCheck(batched == count && statistics.batches == counter.callbacks && !statistics.batchSizes[0], "batch sizes add up to %llu reads in %llu batches", (unsigned long long) batched, (unsigned long long) statistics.batches);
+    BenchCheck(maxBatch == 1 || counter.callbacks < count, "%u reads took %u callbacks", count, counter.callbacks);
+
+    // A trickle: every read waits for the latency bound, and no longer than that
+    const UInt32 trickle = 5;
+    counter = { 0, 0, 0 };
+    result = bulkPipe->startCoalescedReadPump(depth, packetSize, maxBatch, latencyUS, countReadBatch, NULL, &counter);
+    UInt64 worstNS = 0;
+    for (UInt32 i = 0; i < trickle && result == kIOReturnSuccess; ++i)
+    {
+        startTime = mach_absolute_time();
+        bench.controller->queueInData(0x82, packet.data(), packetSize);
+        if (!waitFor(&counter.transfers, i + 1, 1000))
+        {
+            break;
+        }
+        UInt64 waited = elapsedNS(startTime);
+        worstNS = waited > worstNS ? waited : worstNS;
+    }
+    bulkPipe->getReadPumpStatistics(&statistics);
+    bulkPipe->stopReadPump();
+
+    printf("    %-44s %u single reads, slowest delivered after %.0f us\n", "", counter.transfers, worstNS / 1000.0);
+    BenchCheck(counter.transfers == trickle && worstNS < (latencyUS + 20000) * 1000ULL, "%u of %u single reads delivered, slowest after %llu us", counter.transfers, trickle, (unsigned long long) worstNS / 1000);
+    BenchCheck(maxBatch == 1 || statistics.timerFlushes == trickle, "%u of %u single reads flushed by the timer", statistics.timerFlushes, trickle);
+    OSSafeReleaseNULL(bulkPipe);
+}
+
+static void benchFirmwareDownload(UInt32 depth)
+{
+    BenchDevice bench(benchConfig());
+    if (!bench.valid())
+    {
+        BenchCheck(false, "device did not start");
+        return;
+    }
+
+    VoodooUSBPipe * bulkPipe = NULL;
+    bench.interfaces[0]->findPipe(bulkPipe, kUSBBulk, kUSBOut);
+
+    UInt32 imageSize = gQuick ? 64 * 1024 : 512 * 1024;
+    OSData * image = OSData::withCapacity(imageSize);
+    for (UInt32 i = 0; i < imageSize; i += sizeof(UInt32))
+    {
+        image->appendBytes(&i, sizeof(UInt32));
+    }
+
+    VoodooFirmwareDownloader * downloader = VoodooFirmwareDownloader::withPipe(bulkPipe, QCA_DFU_PACKET_LEN, depth);
+    char name[64];
+
+    bench.controller->resetStatistics();
+    UInt64 startTime = mach_absolute_time();
+    IOReturn result = downloader->downloadQcaImage(bench.device, bench.client, image, 28);
+    UInt64 duration = elapsedNS(startTime);
+
+    snprintf(name, sizeof(name), "firmware download, depth %u", depth);
+    report(name, (imageSize - 28 + QCA_DFU_PACKET_LEN - 1) / QCA_DFU_PACKET_LEN, duration, imageSize);
+
+    VoodooFirmwareStatistics statistics;
+    downloader->getStatistics(&statistics);
+    IOUSBHostSimStatistics simStatistics = bench.simStatistics();
+    BenchCheck(result == kIOReturnSuccess, "download failed: 0x%08x", result);
+    BenchCheck(simStatistics.bytesOut == imageSize, "device received %llu of %u bytes", (unsigned long long) simStatistics.bytesOut, imageSize);
+    BenchCheck(statistics.peakInFlight == depth, "peak of %u segments in flight, expected %u", statistics.peakInFlight, depth);
+
+    OSSafeReleaseNULL(downloader);
+    OSSafeReleaseNULL(image);
+    OSSafeReleaseNULL(bulkPipe);
+}
+
+/* Write RAM records of up to 251 parameter bytes, like the ones in a Broadcom .hcd file */
+static OSData * patchramImage(UInt32 records, bool launchRam)
+{
+    OSData * image = OSData::withCapacity(records * (HCI_COMMAND_HDR_SIZE + 251) + HCI_VSC_END_OF_RECORD.size());
+    UInt8 record[HCI_COMMAND_HDR_SIZE + 251];
+    
+    for (UInt32 i = 0; i < records; ++i)
+    {
+        UInt8 dataLength = (UInt8) (64 + (i * 37) % 184);
+        UInt32 address = 0x00200000 + i * 248;
+        
+        record[0] = (UInt8) HCI_OP_BCM_WRITE_RAM;
+        record[1] = (UInt8) (HCI_OP_BCM_WRITE_RAM >> 8);
+        record[2] = 4 + dataLength;
+        memcpy(record + HCI_COMMAND_HDR_SIZE, &address, sizeof(address));
+        memset(record + HCI_COMMAND_HDR_SIZE + 4, (int) i, dataLength);
+        image->appendBytes(record, HCI_COMMAND_HDR_SIZE + 4 + dataLength);
+    }
+    if (launchRam)
+    {
+        image->appendBytes(HCI_VSC_END_OF_RECORD.bytes, HCI_VSC_END_OF_RECORD.size());
+    }
+    return image;
+}
+
+static void benchPatchram(UInt8 credits)
+{
+    IOUSBHostSimConfig config = benchConfig();
+    config.hciCommandCredits = credits;
+    
+    BenchDevice bench(config);
+    if (!bench.valid())
+    {
+        BenchCheck(false, "device did not start");
+        return;
+    }
+    
+    VoodooUSBPipe * interruptPipe = NULL;
+    bench.interfaces[0]->findPipe(interruptPipe, kUSBInterrupt, kUSBIn);
+    
+    VoodooHCIEventReassembler * reassembler = VoodooHCIEventReassembler::withPipe(interruptPipe);
+    VoodooHCICommandEngine * engine = VoodooHCICommandEngine::withDevice(bench.device, bench.client);
+    VoodooBcmPatchLoader * loader = engine ? VoodooBcmPatchLoader::withEngine(engine) : NULL;
+    if (!reassembler || !engine || !loader)
+    {
+        BenchCheck(false, "unable to create the reassembler, engine or loader");
+        OSSafeReleaseNULL(loader);
+        OSSafeReleaseNULL(reassembler);
+        OSSafeReleaseNULL(engine);
+        OSSafeReleaseNULL(interruptPipe);
+        return;
+    }
+    
+    reassembler->subscribe(HCI_EV_CMD_COMPLETE, VoodooHCICommandEngine::handleEventAction, engine);
+    reassembler->subscribe(HCI_EV_CMD_STATUS, VoodooHCICommandEngine::handleEventAction, engine);
+    reassembler->start();
+    
+    // The firmware delays are the controller's business, the simulated one needs none
+    loader->setDelays(0, 0);
+    
+    UInt32 records = iterations(1000);
+    OSData * image = patchramImage(records, true);
+    const UInt8 * bytes = (const UInt8 *) image->getBytesNoCopy();
+    char name[64];
+    
+    if (credits == 1)
+    {
+        // What a loader without the engine pipeline does: one record, one wait
+        UInt32 failed = 0;
+        UInt64 startTime = mach_absolute_time();
+        for (UInt32 offset = 0; offset < image->getLength(); offset += HCI_COMMAND_HDR_SIZE + bytes[offset + 2])
+        {
+            const FwCommandHdr * header = (const FwCommandHdr *) (bytes + offset);
+            failed += engine->sendCommandSync(header->opCode, header->pLength, bytes + offset + HCI_COMMAND_HDR_SIZE) != kIOReturnSuccess;
+        }
+        report("patchram, one record at a time", records + 1, elapsedNS(startTime), image->getLength());
+        BenchCheck(!failed, "%u records failed", failed);
+    }
+    
+    UInt64 commandsBefore = bench.simStatistics().hciCommands;
+    UInt64 startTime = mach_absolute_time();
+    IOReturn result = loader->load(image);
+    UInt64 duration = elapsedNS(startTime);
+    
+    snprintf(name, sizeof(name), "patchram loader (%u credit%s)", credits, credits > 1 ? "s" : "");
+    report(name, records + 3, duration, image->getLength());
+    
+    VoodooBcmPatchStatistics statistics;
+    loader->getStatistics(&statistics);
+    UInt64 commands = bench.simStatistics().hciCommands - commandsBefore;
+    BenchCheck(result == kIOReturnSuccess, "load failed: 0x%08x", result);
+    BenchCheck(statistics.records == records && statistics.bytes == image->getLength(), "loaded %u of %u records, %llu of %u bytes", statistics.records, records, (unsigned long long) statistics.bytes, image->getLength());
+    BenchCheck(commands == records + 3, "controller saw %llu commands, expected %u", (unsigned long long) commands, records + 3);
+    BenchCheck(statistics.peakInFlight == VOODOO_BCM_PATCH_DEPTH_DEFAULT, "peak of %u records in flight, expected %u", statistics.peakInFlight, VOODOO_BCM_PATCH_DEPTH_DEFAULT);
+    
+    if (credits == 1)
+    {
+        // A file without Launch RAM gets the end of record address, a file cut short is never sent
+        OSData * unterminated = patchramImage(16, false);
+        commandsBefore = bench.simStatistics().hciCommands;
+        result = loader->load(unterminated);
+        commands = bench.simStatistics().hciCommands - commandsBefore;
+        BenchCheck(result == kIOReturnSuccess && commands == 16 + 3, "unterminated file: 0x%08x after %llu commands", result, (unsigned long long) commands);
+        
+        OSData * truncated = OSData::withBytes(bytes, 2 * HCI_COMMAND_HDR_SIZE + bytes[2] + 1);
+        commandsBefore = bench.simStatistics().hciCommands;
+        result = loader->load(truncated);
+        commands = bench.simStatistics().hciCommands - commandsBefore;
+        BenchCheck(result == kIOReturnUnderrun && !commands, "truncated file: 0x%08x after %llu commands", result, (unsigned long long) commands);
+        
+        OSSafeReleaseNULL(truncated);
+        OSSafeReleaseNULL(unterminated);
+    }
+    
+    reassembler->stop();
+    OSSafeReleaseNULL(image);
+    OSSafeReleaseNULL(loader);
+    OSSafeReleaseNULL(engine);
+    OSSafeReleaseNULL(reassembler);
+    OSSafeReleaseNULL(interruptPipe);
+}
+
+/* Keeps what the bootloader received per secure send type, and answers like one */
+class IntelBootloaderModel : public IOUSBHostSimBluetoothModel
+{
+public:
+    IntelBootloaderModel(UInt32 payloadLength) : payloadLength(payloadLength), fragments(0), bootAddress(0) {}
+    
+    virtual IOReturn controlRequest(IOUSBHostSimController * controller, const StandardUSB::DeviceRequest & request, UInt8 * data, UInt32 & length) override
+    {
+        IOReturn result = IOUSBHostSimBluetoothModel::controlRequest(controller, request, data, length);
+        if (result != kIOReturnSuccess || length < HCI_COMMAND_HDR_SIZE)
+        {
+            return result;
+        }
+        
+        UInt16 opCode = OSReadLittleInt16(data, 0);
+        UInt64 afterAnswer = controller->getConfig().hciResponseLatencyNS * 2;
+        if (opCode == HCI_OP_INTEL_SECURE_SEND && data[2] >= 1 && data[3] <= INTEL_SECURE_SEND_PUBLIC_KEY)
+        {
+            received[data[3]].insert(received[data[3]].end(), data + 4, data + HCI_COMMAND_HDR_SIZE + data[2]);
+            ++fragments;
+            
+            // The whole payload is in: the bootloader checks it and reports
+            if (data[3] == INTEL_SECURE_SEND_DATA && received[data[3]].size() == payloadLength)
+            {
+                const UInt8 event[] = { HCI_EV_VENDOR, 5, INTEL_EV_SECURE_SEND_RESULT, 0x00, 0x09, 0xfc, 0x00 };
+                controller->queueEvent(event, sizeof(event), afterAnswer);
+            }
+        }
+        else if (opCode == HCI_OP_INTEL_RESET && data[2] == 8)
+        {
+            const UInt8 event[] = { HCI_EV_VENDOR, 2, INTEL_EV_BOOTUP, 0x00 };
+            bootAddress = OSReadLittleInt32(data, HCI_COMMAND_HDR_SIZE + 4);
+            controller->queueEvent(event, sizeof(event), afterAnswer);
+        }
+        return result;
+    }
+    
+    UInt32 payloadLength;
+    std::vector<UInt8> received[INTEL_SECURE_SEND_PUBLIC_KEY + 1];     /* controller thread only, read once the load returned */
+    UInt32 fragments;
+    UInt32 bootAddress;
+};
+
+/* RSA header with recognisable key and signature bytes, and a payload of commands ending in Write Boot Params */
+static OSData * intelSfiImage(UInt32 commands, UInt32 bootAddress)
+{
+    OSData * image = OSData::withCapacity(VOODOO_INTEL_SFI_PAYLOAD_OFFSET + commands * 128);
+    UInt8 header[VOODOO_INTEL_SFI_PAYLOAD_OFFSET];
+    UInt8 command[HCI_COMMAND_HDR_SIZE + 255];
+    
+    for (UInt32 i = 0; i < sizeof(header); ++i)
+    {
+        header[i] = (UInt8) (i * 7);
+    }
+    OSWriteLittleInt32(header, VOODOO_INTEL_SFI_CSS_VERSION_OFFSET, VOODOO_INTEL_SFI_CSS_VERSION);
+    image->appendBytes(header, sizeof(header));
+    
+    UInt32 blockLength = 0;
+    for (UInt32 i = 0; i < commands; ++i)
+    {
+        UInt8 paramLength = (UInt8) (1 + (i * 53) % 250);
+        OSWriteLittleInt16(command, 0, 0xfc8e);
+        command[2] = paramLength;
+        memset(command + HCI_COMMAND_HDR_SIZE, (int) i, paramLength);
+        image->appendBytes(command, HCI_COMMAND_HDR_SIZE + paramLength);
+        blockLength += HCI_COMMAND_HDR_SIZE + paramLength;
+    }
+    
+    // Padded so the last block ends on a word
+    UInt8 paramLength = (UInt8) (4 + (4 - (blockLength + HCI_COMMAND_HDR_SIZE + 4) % 4) % 4);
+    OSWriteLittleInt16(command, 0, HCI_OP_INTEL_WRITE_BOOT_PARAMS);
+    command[2] = paramLength;
+    bzero(command + HCI_COMMAND_HDR_SIZE, paramLength);
+    OSWriteLittleInt32(command, HCI_COMMAND_HDR_SIZE, bootAddress);
+    image->appendBytes(command, HCI_COMMAND_HDR_SIZE + paramLength);
+    return image;
+}
+
+static void benchIntelSfi(UInt8 credits, UInt32 depth)
+{
+    IOUSBHostSimConfig config = benchConfig();
+    config.hciCommandCredits = credits;
+    
+    const UInt32 bootAddress = 0x00023800;
+    OSData * image = intelSfiImage(iterations(1000), bootAddress);
+    const UInt8 * bytes = (const UInt8 *) image->getBytesNoCopy();
+    UInt32 payloadLength = image->getLength() - VOODOO_INTEL_SFI_PAYLOAD_OFFSET;
+    
+    IntelBootloaderModel model(payloadLength);
+    BenchDevice bench(config, &model);
+    if (!bench.valid())
+    {
+        BenchCheck(false, "device did not start");
+        OSSafeReleaseNULL(image);
+        return;
+    }
+    
+    VoodooUSBPipe * interruptPipe = NULL;
+    bench.interfaces[0]->findPipe(interruptPipe, kUSBInterrupt, kUSBIn);
+    
+    VoodooHCIEventReassembler * reassembler = VoodooHCIEventReassembler::withPipe(interruptPipe);
+    VoodooHCICommandEngine * engine = VoodooHCICommandEngine::withDevice(bench.device, bench.client);
+    VoodooIntelSfiLoader * loader = (engine && reassembler) ? VoodooIntelSfiLoader::withEngine(engine, reassembler, depth) : NULL;
+    if (!reassembler || !engine || !loader)
+    {
+        BenchCheck(false, "unable to create the reassembler, engine or loader");
+        OSSafeReleaseNULL(loader);
+        OSSafeReleaseNULL(reassembler);
+        OSSafeReleaseNULL(engine);
+        OSSafeReleaseNULL(interruptPipe);
+        OSSafeReleaseNULL(image);
+        return;
+    }
+    
+    reassembler->subscribe(HCI_EV_CMD_COMPLETE, VoodooHCICommandEngine::handleEventAction, engine);
+    reassembler->subscribe(HCI_EV_CMD_STATUS, VoodooHCICommandEngine::handleEventAction, engine);
+    reassembler->start();
+    
+    UInt32 fragments = 0;
+    VoodooIntelSfiLoader::validate(image, &fragments);
+    
+    UInt64 startTime = mach_absolute_time();
+    IOReturn result = loader->load(image);
+    UInt64 duration = elapsedNS(startTime);
+    
+    char name[64];
+    snprintf(name, sizeof(name), "Intel SFI load (%u credit%s, depth %u)", credits, credits > 1 ? "s" : "", depth);
+    report(name, fragments, duration, image->getLength());
+    
+    VoodooIntelSfiStatistics statistics;
+    loader->getStatistics(&statistics);
+    const char * phases[kVoodooIntelSfiPhaseCount] = { "CSS header", "public key", "signature", "payload" };
+    for (UInt32 i = 0; i < kVoodooIntelSfiPhaseCount; ++i)
+    {
+        printf("    %-44s %u fragments in %.0f us\n", phases[i], statistics.phaseFragments[i], statistics.phaseNS[i] / 1000.0);
+    }
+    printf("    %-44s %.0f us\n", "reset to bootup", statistics.bootNS / 1000.0);
+    
+    BenchCheck(result == kIOReturnSuccess, "load failed: 0x%08x", result);
+    BenchCheck(statistics.fragments == fragments && model.fragments == fragments, "sent %u and the controller saw %u of %u fragments", statistics.fragments, model.fragments, fragments);
+    BenchCheck(statistics.peakInFlight == depth, "peak of %u fragments in flight, expected %u", statistics.peakInFlight, depth);
+    BenchCheck(model.bootAddress == bootAddress && statistics.bootAddress == bootAddress, "booted at 0x%08x, expected 0x%08x", model.bootAddress, bootAddress);
+    
+    // Every block arrived whole and in order, the exponent was left out
+    bool headerMatches = model.received[INTEL_SECURE_SEND_CSS_HEADER].size() == VOODOO_INTEL_SFI_CSS_HEADER_LENGTH &&
+                         !memcmp(model.received[INTEL_SECURE_SEND_CSS_HEADER].data(), bytes, VOODOO_INTEL_SFI_CSS_HEADER_LENGTH);
+    bool keyMatches = model.received[INTEL_SECURE_SEND_PUBLIC_KEY].size() == VOODOO_INTEL_SFI_PUBLIC_KEY_LENGTH &&
+                      !memcmp(model.received[INTEL_SECURE_SEND_PUBLIC_KEY].data(), bytes + VOODOO_INTEL_SFI_PUBLIC_KEY_OFFSET, VOODOO_INTEL_SFI_PUBLIC_KEY_LENGTH);
+    bool signatureMatches = model.received[INTEL_SECURE_SEND_SIGNATURE].size() == VOODOO_INTEL_SFI_SIGNATURE_LENGTH &&
+                            !memcmp(model.received[INTEL_SECURE_SEND_SIGNATURE].data(), bytes + VOODOO_INTEL_SFI_SIGNATURE_OFFSET, VOODOO_INTEL_SFI_SIGNATURE_LENGTH);
+    bool payloadMatches = model.received[INTEL_SECURE_SEND_DATA].size() == payloadLength &&
+                          !memcmp(model.received[INTEL_SECURE_SEND_DATA].data(), bytes + VOODOO_INTEL_SFI_PAYLOAD_OFFSET, payloadLength);
+    BenchCheck(headerMatches && keyMatches && signatureMatches && payloadMatches, "controller received header %d, key %d, signature %d, payload %d", headerMatches, keyMatches, signatureMatches, payloadMatches);
+    
+    if (credits == 1)
+    {
+        // A payload cut in the middle of a block never reaches the controller
+        OSData * truncated = OSData::withBytes(bytes, image->getLength() - 2);
+        UInt32 before = model.fragments;
+        result = loader->load(truncated);
+        BenchCheck(result == kIOReturnUnderrun && model.fragments == before, "truncated image: 0x%08x after %u fragments", result, model.fragments - before);
+        OSSafeReleaseNULL(truncated);
+    }
+    
+    reassembler->stop();
+    OSSafeReleaseNULL(loader);
+    OSSafeReleaseNULL(engine);
+    OSSafeReleaseNULL(reassembler);
+    OSSafeReleaseNULL(interruptPipe);
+    OSSafeReleaseNULL(image);
+}
+
+/* ROME 3.2, as the sim model reports by default */
+static const QCADeviceInfo kBenchQcaInfo = { 0x302, 28, 4, 16 };
+
+struct FirmwareFetchCounter
+{
+    volatile UInt32 fetches;
+    UInt32          imageSize;
+    UInt32          delayMS;        /* stands in for reading the file */
+};
+
+static VoodooFirmwareImage * fetchBenchFirmware(void * owner, void * refCon, const VoodooFirmwareKey * key)
+{
+    FirmwareFetchCounter * counter = (FirmwareFetchCounter *) refCon;
+    __atomic_add_fetch(&counter->fetches, 1, __ATOMIC_SEQ_CST);
+    if (counter->delayMS)
+    {
+        IOSleep(counter->delayMS);
+    }
+    
+    OSData * data = OSData::withCapacity(counter->imageSize);
+    for (UInt32 i = 0; i < counter->imageSize; i += sizeof(UInt32))
+    {
+        UInt32 word = i ^ key->romVersion;
+        data->appendBytes(&word, sizeof(UInt32));
+    }
+    VoodooFirmwareImage * image = VoodooFirmwareImage::withQcaData(data, key->kind, &kBenchQcaInfo);
+    OSSafeReleaseNULL(data);
+    return image;
+}
+
+static UInt64 downloadCachedFirmware(VoodooFirmwareCache * cache, const VoodooFirmwareKey & key, FirmwareFetchCounter * counter, IOReturn * result, UInt64 * bytesOut)
+{
+    BenchDevice bench(benchConfig());
+    if (!bench.valid())
+    {
+        *result = kIOReturnNoDevice;
+        return 0;
+    }
+    
+    VoodooUSBPipe * bulkPipe = NULL;
+    bench.interfaces[0]->findPipe(bulkPipe, kUSBBulk, kUSBOut);
+    VoodooFirmwareDownloader * downloader = VoodooFirmwareDownloader::withPipe(bulkPipe, QCA_DFU_PACKET_LEN, 4);
+    
+    bench.controller->resetStatistics();
+    UInt64 startTime = mach_absolute_time();
+    VoodooFirmwareImage * image = cache->copyImage(key, fetchBenchFirmware, NULL, counter);
+    *result = image ? downloader->downloadQcaImage(bench.device, bench.client, image) : kIOReturnNotFound;
+    UInt64 duration = elapsedNS(startTime);
+    *bytesOut = bench.simStatistics().bytesOut;
+    
+    OSSafeReleaseNULL(image);
+    OSSafeReleaseNULL(downloader);
+    OSSafeReleaseNULL(bulkPipe);
+    return duration;
+}
+
+static void benchFirmwareCache()
+{
+    UInt32 imageSize = gQuick ? 64 * 1024 : 512 * 1024;
+    FirmwareFetchCounter counter = { 0, imageSize, 2 };
+    VoodooFirmwareCache * cache = VoodooFirmwareCache::copySharedCache();
+    QCAVersion version = { 0, 0x302, 0, 0, 0 };
+    VoodooFirmwareKey key = VoodooFirmwareQcaKey(version, kVoodooFirmwareRamPatch);
+    VoodooFirmwareCacheStatistics before, after;
+    IOReturn result;
+    UInt64 bytesOut;
+    
+    // First attach parses the image, the reset and the second adapter after it only download it
+    cache->remove(key);
+    cache->getStatistics(&before);
+    UInt64 coldNS = downloadCachedFirmware(cache, key, &counter, &result, &bytesOut);
+    report("firmware cache, cold attach", 1, coldNS, imageSize);
+    BenchCheck(result == kIOReturnSuccess && bytesOut == imageSize, "cold download: 0x%08x, %llu of %u bytes", result, (unsigned long long) bytesOut, imageSize);
+    
+    UInt64 warmNS = downloadCachedFirmware(cache, key, &counter, &result, &bytesOut);
+    report("firmware cache, warm attach", 1, warmNS, imageSize);
+    BenchCheck(result == kIOReturnSuccess && bytesOut == imageSize, "warm download: 0x%08x, %llu of %u bytes", result, (unsigned long long) bytesOut, imageSize);
+    cache->getStatistics(&after);
+    BenchCheck(counter.fetches == 1 && after.hits - before.hits == 1 && after.misses - before.misses == 1, "%u fetches, %llu hits, %llu misses for two attaches", counter.fetches, (unsigned long long) (after.hits - before.hits), (unsigned long long) (after.misses - before.misses));
+    
+    VoodooFirmwareImage * first = cache->copyImage(key);
+    VoodooFirmwareImage * second = cache->copyImage(key);
+    QCARamPatchVersion patchVersion;
+    BenchCheck(first && first == second && first->getHeaderLength() == kBenchQcaInfo.ramPatchHdr && first->getRamPatchVersion(&patchVersion), "cached image not shared or not parsed");
+    OSSafeReleaseNULL(first);
+    OSSafeReleaseNULL(second);
+    
+    // The second adapter holds the same cache; it goes once both are done with it, so the kext can unload
+    VoodooFirmwareCache * secondCache = VoodooFirmwareCache::copySharedCache();
+    BenchCheck(secondCache == cache, "second adapter got cache %p, first %p", secondCache, cache);
+    VoodooFirmwareCache::releaseSharedCache(secondCache);
+    VoodooFirmwareCache::releaseSharedCache(cache);
+    cache = VoodooFirmwareCache::copySharedCache();
+    cache->getStatistics(&after);
+    BenchCheck(after.entries == 0 && after.hits == 0 && after.misses == 0, "cache kept after its last holder: %u entries, %llu hits", after.entries, (unsigned long long) after.hits);
+    VoodooFirmwareCache::releaseSharedCache(cache);
+    
+    // Identical adapters attaching together fetch once
+    VoodooFirmwareCache * privateCache = VoodooFirmwareCache::withBudget(imageSize * 2 + imageSize / 2);
+    FirmwareFetchCounter concurrent = { 0, imageSize, 20 };
+    VoodooFirmwareImage * images[4] = { };
+    std::vector<std::thread> threads;
+    for (UInt32 i = 0; i < ARRAY_SIZE(images); ++i)
+    {
+        threads.emplace_back([&, i] () { images[i] = privateCache->copyImage(key, fetchBenchFirmware, NULL, &concurrent); });
+    }
+    for (std::thread & thread : threads)
+    {
+        thread.join();
+    }
+    privateCache->getStatistics(&after);
+    bool same = true;
+    for (UInt32 i = 0; i < ARRAY_SIZE(images); ++i)
+    {
+        same = same && images[i] && images[i] == images[0];
+    }
+    for (UInt32 i = 0; i < ARRAY_SIZE(images); ++i)
+    {
+        OSSafeReleaseNULL(images[i]);
+    }
+    printf("    %-44s %u fetches for %u concurrent attaches, %llu waited\n", "", concurrent.fetches, (UInt32) ARRAY_SIZE(images), (unsigned long long) after.shared);
+    BenchCheck(concurrent.fetches == 1 && same && after.shared == ARRAY_SIZE(images) - 1, "%u fetches, %llu shared for %u concurrent attaches", concurrent.fetches, (unsigned long long) after.shared, (UInt32) ARRAY_SIZE(images));
+    
+    // Over budget, the least recently used image goes
+    VoodooFirmwareKey nvmKey = VoodooFirmwareQcaKey(version, kVoodooFirmwareNvm);
+    version.romVersion = 0x320;
+    VoodooFirmwareKey otherKey = VoodooFirmwareQcaKey(version, kVoodooFirmwareRamPatch);
+    concurrent.delayMS = 0;
+    images[0] = privateCache->copyImage(nvmKey, fetchBenchFirmware, NULL, &concurrent);
+    OSSafeReleaseNULL(images[0]);
+    images[0] = privateCache->copyImage(key);
+    OSSafeReleaseNULL(images[0]);
+    images[0] = privateCache->copyImage(otherKey, fetchBenchFirmware, NULL, &concurrent);
+    OSSafeReleaseNULL(images[0]);
+    images[0] = privateCache->copyImage(key);
+    images[1] = privateCache->copyImage(nvmKey);
+    privateCache->getStatistics(&after);
+    BenchCheck(images[0] && !images[1] && after.evictions == 1 && after.entries == 2 && after.bytes <= imageSize * 2 + imageSize / 2, "LRU eviction: %llu evictions, %u entries, %llu bytes", (unsigned long long) after.evictions, after.entries, (unsigned long long) after.bytes);
+    OSSafeReleaseNULL(images[0]);
+    OSSafeReleaseNULL(images[1]);
+    
+    privateCache->setBudget(0);
+    privateCache->getStatistics(&after);
+    BenchCheck(after.entries == 0 && after.bytes == 0, "%u entries, %llu bytes left after a zero budget", after.entries, (unsigned long long) after.bytes);
+    OSSafeReleaseNULL(privateCache);
+}
+
+struct GatherCounter
+{
+    volatile UInt32 transfers;
+    UInt32          mismatches;
+    const UInt8   * expected;
+};
+
+static void checkLoopedAcl(void * owner, void * refCon, IOReturn status, IOBufferMemoryDescriptor * buffer, UInt32 length)
+{
+    GatherCounter * counter = (GatherCounter *) refCon;
+    counter->mismatches += memcmp(buffer->getBytesNoCopy(), counter->expected, length) != 0;
+    __atomic_add_fetch(&counter->transfers, 1, __ATOMIC_SEQ_CST);
+}
+
+static void countGatherWrite(void * owner, void * parameter, IOReturn status, UInt32 bytesTransferred)
+{
+    GatherCounter * counter = (GatherCounter *) parameter;
+    counter->mismatches += status != kIOReturnSuccess;
+    __atomic_add_fetch(&counter->transfers, 1, __ATOMIC_SEQ_CST);
+}
+
+static void benchGatherWrite(UInt16 payloadLength)
+{
+    BenchDevice bench(benchConfig());
+    if (!bench.valid())
+    {
+        BenchCheck(false, "device did not start");
+        return;
+    }
+
+    VoodooUSBPipe * outPipe = NULL;
+    VoodooUSBPipe * inPipe  = NULL;
+    bench.interfaces[0]->findPipe(outPipe, kUSBBulk, kUSBOut);
+    bench.interfaces[0]->findPipe(inPipe, kUSBBulk, kUSBIn);
+    bench.model.aclLoopback = true;
+
+    // ACL header, L2CAP basic header and a payload the stack already holds in its own buffer
+    const UInt32 length = HCI_ACL_HDR_SIZE + 4 + payloadLength;
+    UInt8 aclHeader[HCI_ACL_HDR_SIZE] = { 0x01, 0x20, (UInt8) (length - HCI_ACL_HDR_SIZE), (UInt8) ((length - HCI_ACL_HDR_SIZE) >> 8) };
+    UInt8 l2capHeader[4] = { (UInt8) payloadLength, (UInt8) (payloadLength >> 8), 0x40, 0x00 };
+    std::vector<UInt8> payload(payloadLength);
+    std::vector<UInt8> expected;
+    for (UInt32 i = 0; i < payloadLength; ++i)
+    {
+        payload[i] = (UInt8) (i * 7);
+    }
+    expected.insert(expected.end(), aclHeader, aclHeader + sizeof(aclHeader));
+    expected.insert(expected.end(), l2capHeader, l2capHeader + sizeof(l2capHeader));
+    expected.insert(expected.end(), payload.begin(), payload.end());
+
+    IOMemoryDescriptor * segments[3] =
+    {
+        IOMemoryDescriptor::withAddress(aclHeader, sizeof(aclHeader), kIODirectionOut),
+        IOMemoryDescriptor::withAddress(l2capHeader, sizeof(l2capHeader), kIODirectionOut),
+        IOMemoryDescriptor::withAddress(payload.data(), payloadLength, kIODirectionOut),
+    };
+
+    UInt32 count = iterations(1000);
+    GatherCounter looped = { 0, 0, expected.data() };
+    BenchCheck(inPipe->startReadPump(4, length, checkLoopedAcl, NULL, &looped) == kIOReturnSuccess, "unable to start the read pump");
+    char name[64];
+
+    // What a client does today: copy the pieces into one buffer, then write it
+    IOBufferMemoryDescriptor * bounce = IOBufferMemoryDescriptor::withCapacity(length, kIODirectionOut);
+    bounce->prepare();
+    UInt64 startTime = mach_absolute_time();
+    UInt64 copyNS = 0;
+    for (UInt32 i = 0; i < count; ++i)
+    {
+        UInt64 copyStart = mach_absolute_time();
+        UInt8 * bytes = (UInt8 *) bounce->getBytesNoCopy();
+        memcpy(bytes, aclHeader, sizeof(aclHeader));
+        memcpy(bytes + sizeof(aclHeader), l2capHeader, sizeof(l2capHeader));
+        memcpy(bytes + sizeof(aclHeader) + sizeof(l2capHeader), payload.data(), payloadLength);
+        copyNS += elapsedNS(copyStart);
+        outPipe->write(bounce, 0, 0, length);
+    }
+    UInt64 duration = elapsedNS(startTime);
+    snprintf(name, sizeof(name), "ACL write, copied, %u bytes", length);
+    report(name, count, duration, (UInt64) count * length);
+    printf("    %-44s %10.2f us/op copying\n", "", (double) copyNS / count / 1000.0);
+    bounce->complete();
+    OSSafeReleaseNULL(bounce);
+
+    // The same packets gathered straight from the three pieces
+    IOUSBHostSimStatistics before = bench.simStatistics();
+    IOReturn result = kIOReturnSuccess;
+    startTime = mach_absolute_time();
+    for (UInt32 i = 0; i < count && result == kIOReturnSuccess; ++i)
+    {
+        result = outPipe->writeSegments(segments, 3, 0);
+    }
+    duration = elapsedNS(startTime);
+    snprintf(name, sizeof(name), "ACL write, gathered, %u bytes", length);
+    report(name, count, duration, (UInt64) count * length);
+
+    // And asynchronously, several in flight
+    GatherCounter written = { 0, 0, NULL };
+    USBCompletion completion = { NULL, countGatherWrite, &written };
+    startTime = mach_absolute_time();
+    for (UInt32 i = 0; i < count && result == kIOReturnSuccess; ++i)
+    {
+        while (i - __atomic_load_n(&written.transfers, __ATOMIC_SEQ_CST) >= 8)
+        {
+            benchYield();
+        }
+        result = outPipe->writeSegments(segments, 3, 0, &completion);
+    }
+    bool done = waitFor(&written.transfers, count);
+    duration = elapsedNS(startTime);
+    snprintf(name, sizeof(name), "ACL write, gathered async, %u bytes", length);
+    report(name, count, duration, (UInt64) count * length);
+
+    bool drained = waitFor(&looped.transfers, 3 * count);
+    IOUSBHostSimStatistics after = bench.simStatistics();
+    UInt64 zeroLengthPackets = after.zeroLengthPackets - before.zeroLengthPackets;
+    UInt64 expectedZeroLength = outPipe->needsZeroLengthPacket(length) ? 2 * count : 0;
+
+    inPipe->stopReadPump();
+    BenchCheck(result == kIOReturnSuccess && done && !written.mismatches, "gathered writes failed: 0x%08x, %u of %u completed", result, written.transfers, count);
+    BenchCheck(drained && !looped.mismatches, "%u of %u packets looped back, %u differ", looped.transfers, 3 * count, looped.mismatches);
+    BenchCheck(zeroLengthPackets == expectedZeroLength, "%llu zero length packets, expected %llu", (unsigned long long) zeroLengthPackets, (unsigned long long) expectedZeroLength);
+
+    for (IOMemoryDescriptor * segment : segments)
+    {
+        OSSafeRelease(segment);
+    }
+    OSSafeReleaseNULL(outPipe);
+    OSSafeReleaseNULL(inPipe);
+}
+
+/* ---- ACL transmit scheduling ---- */
+
+struct AclCounter
+{
+    VoodooHCIAclScheduler * scheduler;
+    volatile UInt32         completed;
+    volatile UInt32         failed;
+    volatile UInt32         resend;     /* packets still to queue again from the completion */
+};
+
+static void countAclPacket(void * owner, void * refCon, IOReturn status, UInt16 handle, IOMemoryDescriptor * packet)
+{
+    AclCounter * counter = (AclCounter *) refCon;
+    if (status != kIOReturnSuccess)
+    {
+        __atomic_add_fetch(&counter->failed, 1, __ATOMIC_SEQ_CST);
+    }
+    __atomic_add_fetch(&counter->completed, 1, __ATOMIC_SEQ_CST);
+
+    // Keeps the bulk connection's queue full for as long as the run lasts; completions all run on the controller thread
+    if (counter->resend)
+    {
+        --counter->resend;
+        VoodooHCIAclCompletion completion = { owner, countAclPacket, refCon };
+        counter->scheduler->sendPacket(packet, &completion);
+    }
+}
+
+static IOBufferMemoryDescriptor * aclPacket(UInt16 handle, UInt16 payloadLength)
+{
+    IOBufferMemoryDescriptor * packet = IOBufferMemoryDescriptor::withCapacity(HCI_ACL_HDR_SIZE + payloadLength, kIODirectionOut);
+    UInt8 * bytes = (UInt8 *) packet->getBytesNoCopy();
+
+    memset(bytes, 0x5a, HCI_ACL_HDR_SIZE + payloadLength);
+    OSWriteLittleInt16(bytes, 0, handle | 0x2000);
+    OSWriteLittleInt16(bytes, 2, payloadLength);
+    packet->setLength(HCI_ACL_HDR_SIZE + payloadLength);
+    return packet;
+}
+
+static void benchAclScheduler()
+{
+    BenchDevice bench(benchConfig());
+    if (!bench.valid())
+    {
+        BenchCheck(false, "device did not start");
+        return;
+    }
+
+    // Longer on the air than a maximum size packet takes on the bus, so the controller's buffers fill
+    const UInt64 packetNS = 500 * kMicrosecondScale;
+    bench.model.aclCompletedPackets = true;
+    bench.model.aclPacketNS         = packetNS;
+
+    VoodooUSBPipe * interruptPipe = NULL;
+    VoodooUSBPipe * outPipe       = NULL;
+    bench.interfaces[0]->findPipe(interruptPipe, kUSBInterrupt, kUSBIn);
+    bench.interfaces[0]->findPipe(outPipe, kUSBBulk, kUSBOut);
+
+    VoodooHCIEventReassembler * reassembler = VoodooHCIEventReassembler::withPipe(interruptPipe);
+    VoodooHCIAclScheduler * scheduler = VoodooHCIAclScheduler::withPipe(outPipe, 1021, bench.model.aclBufferPackets, bench.device->getTimerWheel());
+    if (!reassembler || !scheduler)
+    {
+        BenchCheck(false, "unable to create the reassembler or scheduler");
+        OSSafeReleaseNULL(reassembler);
+        OSSafeReleaseNULL(scheduler);
+        OSSafeReleaseNULL(interruptPipe);
+        OSSafeReleaseNULL(outPipe);
+        return;
+    }
+
+    reassembler->subscribe(HCI_EV_NUM_COMP_PKTS, VoodooHCIAclScheduler::handleEventAction, scheduler);
+    reassembler->subscribe(HCI_EV_DISCONN_COMPLETE, VoodooHCIAclScheduler::handleEventAction, scheduler);
+    reassembler->start();
+
+    // A file transfer on one link and a keyboard sized packet now and then on another
+    scheduler->addConnection(0x001);
+    scheduler->addConnection(0x002);
+    IOBufferMemoryDescriptor * bulkPacket        = aclPacket(0x001, 1021);
+    IOBufferMemoryDescriptor * interactivePacket = aclPacket(0x002, 16);
+
+    UInt32 count = iterations(400);
+    UInt32 backlog = VOODOO_HCI_ACL_QUEUE_DEPTH / 2;
+    AclCounter bulk = { scheduler, 0, 0, count - backlog };
+    AclCounter interactive = { scheduler, 0, 0, 0 };
+    VoodooHCIAclCompletion bulkCompletion = { scheduler, countAclPacket, &bulk };
+    VoodooHCIAclCompletion interactiveCompletion = { scheduler, countAclPacket, &interactive };
+
+    UInt64 startTime = mach_absolute_time();
+    for (UInt32 i = 0; i < backlog; ++i)
+    {
+        scheduler->sendPacket(bulkPacket, &bulkCompletion);
+    }
+
+    UInt32 interactiveCount = iterations(50);
+    UInt64 worstNS = 0;
+    UInt64 totalNS = 0;
+    for (UInt32 i = 0; i < interactiveCount; ++i)
+    {
+        UInt64 sendTime = mach_absolute_time();
+        scheduler->sendPacket(interactivePacket, &interactiveCompletion);
+        waitFor(&interactive.completed, i + 1);
+        UInt64 latency = elapsedNS(sendTime);
+        worstNS = latency > worstNS ? latency : worstNS;
+        totalNS += latency;
+        std::this_thread::sleep_for(std::chrono::nanoseconds(2 * packetNS));
+    }
+
+    bool drained = waitFor(&bulk.completed, count);
+    UInt64 duration = elapsedNS(startTime);
+    report("ACL scheduled, 1025 bytes on a busy link", bulk.completed, duration, (UInt64) bulk.completed * (HCI_ACL_HDR_SIZE + 1021));
+    printf("    %-44s %10.2f us avg %10.2f us worst\n", "interactive link latency", (double) totalNS / interactiveCount / 1000.0, (double) worstNS / 1000.0);
+
+    // Sharing by rounds: the small packets never wait behind the bulk backlog
+    BenchCheck(drained && !bulk.failed && interactive.completed == interactiveCount && !interactive.failed, "%u of %u bulk and %u of %u interactive packets sent, %u failed",
+               bulk.completed, count, interactive.completed, interactiveCount, bulk.failed + interactive.failed);
+    BenchCheck(totalNS / interactiveCount < backlog * packetNS, "interactive packets waited %llu us on average", (unsigned long long) (totalNS / interactiveCount / 1000));
+    BenchCheck(!bench.model.aclOverflows, "controller buffers overflowed %u times", bench.model.aclOverflows);
+
+    UInt64 deadline = mach_absolute_time() + 1000 * kMillisecondScale;
+    while (scheduler->getCredits() != bench.model.aclBufferPackets && mach_absolute_time() < deadline)
+    {
+        benchYield();
+    }
+    BenchCheck(scheduler->getCredits() == bench.model.aclBufferPackets, "%u of %u credits returned", scheduler->getCredits(), bench.model.aclBufferPackets);
+
+    VoodooHCIAclStatistics statistics;
+    scheduler->getStatistics(&statistics);
+    printf("    %-44s %u credit stalls\n", "", statistics.creditStalls);
+
+    // The same link written straight to the pipe runs past the controller's buffers
+    UInt32 blast = 4 * bench.model.aclBufferPackets;
+    startTime = mach_absolute_time();
+    for (UInt32 i = 0; i < blast; ++i)
+    {
+        outPipe->write(bulkPacket, 0, 0, bulkPacket->getLength());
+    }
+    report("ACL unscheduled, 1025 bytes", blast, elapsedNS(startTime), (UInt64) blast * bulkPacket->getLength());
+    BenchCheck(bench.model.aclOverflows, "writing without credits did not overflow the controller");
+    std::this_thread::sleep_for(std::chrono::nanoseconds((blast + 1) * packetNS));
+
+    // A controller that stops returning packets stalls the link, not the scheduler
+    bench.model.aclCompletedPackets = false;
+    UInt32 stalled = interactive.completed + 3;
+    for (UInt32 i = 0; i < 3; ++i)
+    {
+        scheduler->sendPacket(interactivePacket, &interactiveCompletion);
+    }
+    waitFor(&interactive.completed, stalled);
+    BenchCheck(scheduler->checkTimeouts(1000) == 0, "connection timed out early");
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    BenchCheck(scheduler->checkTimeouts(2) == 1, "stalled connection did not time out");
+    BenchCheck(scheduler->getCredits() == bench.model.aclBufferPackets, "%u of %u credits reclaimed", scheduler->getCredits(), bench.model.aclBufferPackets);
+
+    // On the device's timer wheel the stall times out without anyone calling checkTimeouts()
+    VoodooHCIAclStatistics stalledStatistics;
+    scheduler->getStatistics(&statistics);
+    scheduler->setTxTimeout(20);
+    stalled += 3;
+    startTime = mach_absolute_time();
+    for (UInt32 i = 0; i < 3; ++i)
+    {
+        scheduler->sendPacket(interactivePacket, &interactiveCompletion);
+    }
+    waitFor(&interactive.completed, stalled);
+    deadline = mach_absolute_time() + 1000 * kMillisecondScale;
+    do
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        scheduler->getStatistics(&stalledStatistics);
+    }
+    while (stalledStatistics.timeouts == statistics.timeouts && mach_absolute_time() < deadline);
+    UInt64 stallNS = elapsedNS(startTime);
+    printf("    %-44s %10.2f ms for a 20 ms TX timeout\n", "stall detected", (double) stallNS / 1000000.0);
+    BenchCheck(stalledStatistics.timeouts == statistics.timeouts + 1 && stallNS >= 20 * kMillisecondScale, "%u timeouts after %llu us", stalledStatistics.timeouts - statistics.timeouts, (unsigned long long) (stallNS / 1000));
+    BenchCheck(scheduler->getCredits() == bench.model.aclBufferPackets, "%u of %u credits reclaimed by the timer", scheduler->getCredits(), bench.model.aclBufferPackets);
+    scheduler->setTxTimeout(HCI_ACL_TX_TIMEOUT);
+
+    // Disconnection Complete removes the connection
+    const UInt8 disconnect[] = { HCI_EV_DISCONN_COMPLETE, 4, 0x00, 0x02, 0x00, 0x13 };
+    bench.controller->queueEvent(disconnect, sizeof(disconnect));
+    IOReturn result = kIOReturnSuccess;
+    deadline = mach_absolute_time() + 1000 * kMillisecondScale;
+    while ((result = scheduler->sendPacket(interactivePacket, &interactiveCompletion)) == kIOReturnSuccess && mach_absolute_time() < deadline)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    BenchCheck(result == kIOReturnNotFound, "connection still present after disconnection: 0x%08x", result);
+
+    reassembler->stop();
+    OSSafeReleaseNULL(reassembler);
+    OSSafeReleaseNULL(scheduler);
+    OSSafeReleaseNULL(bulkPacket);
+    OSSafeReleaseNULL(interactivePacket);
+    OSSafeReleaseNULL(interruptPipe);
+    OSSafeReleaseNULL(outPipe);
+}
+
+/* ---- Traffic capture ---- */
+
+struct BtsnoopSummary
+{
+    bool    valid;
+    UInt32  records[5];         /* by packet indicator */
+    UInt32  received;
+    UInt32  outOfOrder;
+    UInt32  lastDrops;
+};
+
+static UInt32 readBig32(const UInt8 * bytes)
+{
+    return ((UInt32) bytes[0] << 24) | ((UInt32) bytes[1] << 16) | ((UInt32) bytes[2] << 8) | bytes[3];
+}
+
+// Walks a capture file the way an analyzer would, checking the framing on the way
+static BtsnoopSummary parseBtsnoop(OSData * data)
+{
+    BtsnoopSummary summary;
+    bzero(&summary, sizeof(summary));
+
+    const UInt8 * bytes = (const UInt8 *) data->getBytesNoCopy();
+    UInt32 length = data->getLength();
+    if (length < 16 || memcmp(bytes, "btsnoop\0", 8) || readBig32(bytes + 8) != 1 || readBig32(bytes + 12) != 1002)
+    {
+        return summary;
+    }
+
+    UInt64 lastTime = 0;
+    UInt32 offset = 16;
+    while (offset + 24 <= length)
+    {
+        const UInt8 * header = bytes + offset;
+        UInt32 originalLength = readBig32(header);
+        UInt32 includedLength = readBig32(header + 4);
+        UInt32 flags          = readBig32(header + 8);
+        UInt64 timestamp      = ((UInt64) readBig32(header + 16) << 32) | readBig32(header + 20);
+        UInt8  type           = header[24];
+
+        if (!includedLength || includedLength > originalLength || offset + 24 + includedLength > length || !type || type > 4)
+        {
+            return summary;
+        }
+        // Commands and events carry the command / event flag, data does not
+        if (((flags & 2) != 0) != (type == 1 || type == 4))
+        {
+            return summary;
+        }
+
+        ++summary.records[type];
+        summary.received   += flags & 1;
+        summary.outOfOrder += timestamp < lastTime;
+        summary.lastDrops   = readBig32(header + 12);
+        lastTime = timestamp;
+        offset  += 24 + includedLength;
+    }
+    summary.valid = offset == length;
+    return summary;
+}
+
+static void benchCapture()
+{
+    IOUSBHostSimConfig config = benchConfig();
+    config.hciCommandCredits = 4;
+
+    BenchDevice bench(config);
+    VoodooHCICapture * capture = VoodooHCICapture::withCapacity(8192);
+    if (!bench.valid() || !capture)
+    {
+        BenchCheck(false, "device did not start or capture could not be created");
+        OSSafeReleaseNULL(capture);
+        return;
+    }
+
+    VoodooUSBPipe * interruptPipe = NULL;
+    VoodooUSBPipe * outPipe = NULL;
+    VoodooUSBPipe * inPipe  = NULL;
+    bench.interfaces[0]->findPipe(interruptPipe, kUSBInterrupt, kUSBIn);
+    bench.interfaces[0]->findPipe(outPipe, kUSBBulk, kUSBOut);
+    bench.interfaces[0]->findPipe(inPipe, kUSBBulk, kUSBIn);
+    bench.device->setCapture(capture);
+    interruptPipe->setCapture(capture);
+    outPipe->setCapture(capture);
+    inPipe->setCapture(capture);
+    bench.model.aclLoopback = true;
+
+    // What a single record costs the path that makes it, and what a disabled capture costs
+    UInt8 packet[HCI_ACL_HDR_SIZE + 60] = { 0x01, 0x20, 60, 0 };
+    UInt32 count = iterations(200000);
+    UInt64 startTime = mach_absolute_time();
+    for (UInt32 i = 0; i < count; ++i)
+    {
+        capture->record(kVoodooHCICaptureAcl, false, packet, sizeof(packet));
+    }
+    report("record (64 byte ACL)", count, elapsedNS(startTime));
+
+    capture->setEnabled(false);
+    startTime = mach_absolute_time();
+    for (UInt32 i = 0; i < count; ++i)
+    {
+        capture->record(kVoodooHCICaptureAcl, false, packet, sizeof(packet));
+    }
+    report("record (disabled)", count, elapsedNS(startTime));
+    capture->setEnabled(true);
+
+    OSData * data = capture->copyBtsnoop();
+    VoodooHCICaptureStatistics statistics;
+    capture->getStatistics(&statistics);
+    BenchCheck(data && statistics.drained + statistics.overwritten == count, "%llu drained and %llu overwritten of %u recorded", (unsigned long long) statistics.drained, (unsigned long long) statistics.overwritten, count);
+    OSSafeReleaseNULL(data);
+
+    // Real traffic: commands, the events answering them, and ACL looped back through both bulk pipes
+    VoodooHCIEventReassembler * reassembler = VoodooHCIEventReassembler::withPipe(interruptPipe);
+    VoodooHCICommandEngine * engine = VoodooHCICommandEngine::withDevice(bench.device, bench.client);
+    GatherCounter looped = { 0, 0, packet };
+    UInt32 commands = iterations(1000);
+    UInt32 packets  = iterations(1000);
+    CommandCounter counter = { 0, 0 };
+    VoodooHCICommandCompletion completion = { engine, countCommand, &counter };
+
+    reassembler->subscribe(HCI_EV_CMD_COMPLETE, VoodooHCICommandEngine::handleEventAction, engine);
+    reassembler->subscribe(HCI_EV_CMD_STATUS, VoodooHCICommandEngine::handleEventAction, engine);
+    reassembler->start();
+    BenchCheck(inPipe->startReadPump(4, sizeof(packet), checkLoopedAcl, NULL, &looped) == kIOReturnSuccess, "unable to start the read pump");
+
+    IOBufferMemoryDescriptor * buffer = IOBufferMemoryDescriptor::withCapacity(sizeof(packet), kIODirectionOut);
+    buffer->prepare();
+    memcpy(buffer->getBytesNoCopy(), packet, sizeof(packet));
+
+    startTime = mach_absolute_time();
+    for (UInt32 i = 0; i < commands; ++i)
+    {
+        while (engine->enqueueCommand(HCI_OP_READ_LOCAL_VERSION, 0, NULL, &completion) == kIOReturnNoResources)
+        {
+            benchYield();
+        }
+    }
+    for (UInt32 i = 0; i < packets; ++i)
+    {
+        outPipe->write(buffer, 0, 0, sizeof(packet));
+    }
+    bool drained = waitFor(&counter.completed, commands) && waitFor(&looped.transfers, packets);
+    report("captured commands and ACL", commands + packets, elapsedNS(startTime));
+    BenchCheck(drained && !counter.failed && !looped.mismatches, "%u of %u commands, %u of %u packets", counter.completed, commands, looped.transfers, packets);
+
+    inPipe->stopReadPump();
+
+    // An asynchronous read() outside the pump is recorded from its completion
+    IOBufferMemoryDescriptor * inBuffer = IOBufferMemoryDescriptor::withCapacity(sizeof(packet), kIODirectionIn);
+    inBuffer->prepare();
+    GatherCounter readBack = { 0, 0, NULL };
+    USBCompletion readCompletion = { NULL, countGatherWrite, &readBack };
+    UInt32 reads = 16;
+    bool readAll = true;
+    for (UInt32 i = 0; i < reads && readAll; ++i)
+    {
+        readAll = inPipe->read(inBuffer, 0, 0, sizeof(packet), &readCompletion) == kIOReturnSuccess &&
+                  outPipe->write(buffer, 0, 0, sizeof(packet)) == kIOReturnSuccess &&
+                  waitFor(&readBack.transfers, i + 1);
+    }
+    BenchCheck(readAll && !readBack.mismatches, "%u of %u asynchronous reads", readBack.transfers, reads);
+    inBuffer->complete();
+    OSSafeReleaseNULL(inBuffer);
+    reassembler->stop();
+
+    startTime = mach_absolute_time();
+    data = capture->copyBtsnoop();
+    report("copyBtsnoop", 1, elapsedNS(startTime), data ? data->getLength() : 0);
+
+    BtsnoopSummary summary = parseBtsnoop(data);
+    BenchCheck(summary.valid, "the btsnoop file is malformed");
+    BenchCheck(summary.records[kVoodooHCICaptureCommand] == commands && summary.records[kVoodooHCICaptureEvent] >= commands, "%u commands and %u events captured for %u commands", summary.records[kVoodooHCICaptureCommand], summary.records[kVoodooHCICaptureEvent], commands);
+    BenchCheck(summary.records[kVoodooHCICaptureAcl] == 2 * (packets + reads), "%u ACL packets captured, expected %u", summary.records[kVoodooHCICaptureAcl], 2 * (packets + reads));
+    BenchCheck(summary.received == summary.records[kVoodooHCICaptureEvent] + packets + reads, "%u records marked received", summary.received);
+    BenchCheck(!summary.outOfOrder, "%u records out of time order", summary.outOfOrder);
+    OSSafeReleaseNULL(data);
+
+    buffer->complete();
+    OSSafeReleaseNULL(buffer);
+    OSSafeReleaseNULL(engine);
+    OSSafeReleaseNULL(reassembler);
+    bench.device->setCapture(NULL);
+    OSSafeReleaseNULL(interruptPipe);
+    OSSafeReleaseNULL(outPipe);
+    OSSafeReleaseNULL(inPipe);
+    OSSafeReleaseNULL(capture);
+
+    // A ring that wraps between drains loses the oldest records and says so
+    capture = VoodooHCICapture::withCapacity(16);
+    for (UInt32 i = 0; i < 100; ++i)
+    {
+        capture->record(kVoodooHCICaptureEvent, true, packet, 4);
+    }
+    data = capture->copyBtsnoop();
+    summary = parseBtsnoop(data);
+    capture->getStatistics(&statistics);
+    BenchCheck(summary.valid && summary.records[kVoodooHCICaptureEvent] <= 16 && summary.lastDrops == statistics.overwritten, "%u records kept, %u drops reported, %llu overwritten", summary.records[kVoodooHCICaptureEvent], summary.lastDrops, (unsigned long long) statistics.overwritten);
+    BenchCheck(statistics.drained + statistics.overwritten == 100, "%llu drained and %llu overwritten of 100", (unsigned long long) statistics.drained, (unsigned long long) statistics.overwritten);
+    OSSafeReleaseNULL(data);
+    OSSafeReleaseNULL(capture);
+
+    // Writers on every thread while another drains; nothing may be lost or torn
+    capture = VoodooHCICapture::withCapacity(1024);
+    const UInt32 writers = 4;
+    UInt32 perWriter = iterations(50000);
+    volatile UInt32 running = writers;
+    UInt32 drainedRecords = 0;
+    UInt32 torn = 0;
+    std::vector<std::thread> threads;
+
+    startTime = mach_absolute_time();
+    for (UInt32 t = 0; t < writers; ++t)
+    {
+        threads.emplace_back([capture, t, perWriter, &running] ()
+        {
+            UInt8 bytes[32];
+            for (UInt32 i = 0; i < perWriter; ++i)
+            {
+                memset(bytes, (UInt8) (t * 64 + i % 64), sizeof(bytes));
+                capture->record(kVoodooHCICaptureAcl, t & 1, bytes, sizeof(bytes));
+            }
+            __atomic_sub_fetch(&running, 1, __ATOMIC_SEQ_CST);
+        });
+    }
+    while (1)
+    {
+        bool last = !__atomic_load_n(&running, __ATOMIC_SEQ_CST);
+        data = capture->copyBtsnoop(false);
+        const UInt8 * bytes = (const UInt8 *) data->getBytesNoCopy();
+        for (UInt32 offset = 0; offset + 24 + 33 <= data->getLength(); offset += 24 + 33)
+        {
+            // Every byte of a record's payload was written by the same call
+            torn += memcmp(bytes + offset + 25, bytes + offset + 26, 31) != 0;
+            ++drainedRecords;
+        }
+        OSSafeReleaseNULL(data);
+        if (last)
+        {
+            break;
+        }
+        benchYield();
+    }
+    for (std::thread & thread : threads)
+    {
+        thread.join();
+    }
+    report("record, 4 writers, draining", writers * perWriter, elapsedNS(startTime));
+
+    capture->getStatistics(&statistics);
+    BenchCheck(!torn, "%u torn records", torn);
+    BenchCheck(statistics.recorded == writers * perWriter && drainedRecords + statistics.overwritten == statistics.recorded, "%u drained and %llu overwritten of %llu recorded", drainedRecords, (unsigned long long) statistics.overwritten, (unsigned long long) statistics.recorded);
+    OSSafeReleaseNULL(capture);
+}
+
+/* ---- Snapshot / resume ---- */
+
+/* The interface of that number the device has now, retained */
+static VoodooUSBInterface * copyBenchInterface(VoodooUSBDevice * device, UInt8 number)
+{
+    OSIterator * iterator = device->getChildIterator(gIOServicePlane);
+    VoodooUSBInterface * match = NULL;
+    OSObject * child;
+    
+    while (iterator && !match && (child = iterator->getNextObject()))
+    {
+        VoodooUSBInterface * interface = OSDynamicCast(VoodooUSBInterface, child);
+        if (interface && !interface->isInactive() && interface->getInterfaceNumber() == number)
+        {
+            match = interface;
+            match->retain();
+        }
+    }
+    OSSafeReleaseNULL(iterator);
+    return match;
+}
+
+/* A wake or soft reset followed by setting the device up again from scratch, or from a snapshot */
+static void benchResume()
+{
+    BenchDevice bench(benchConfig());
+    if (!bench.valid() || !bench.interfaces[1])
+    {
+        BenchCheck(false, "device did not start");
+        return;
+    }
+    
+    VoodooUSBPipe * interruptPipe = NULL;
+    VoodooUSBPipe * bulkPipe = NULL;
+    bench.interfaces[0]->findPipe(interruptPipe, kUSBInterrupt, kUSBIn);
+    bench.interfaces[0]->findPipe(bulkPipe, kUSBBulk, kUSBOut);
+    
+    VoodooHCIEventReassembler * reassembler = VoodooHCIEventReassembler::withPipe(interruptPipe);
+    VoodooHCICommandEngine * engine = VoodooHCICommandEngine::withDevice(bench.device, bench.client);
+    if (!reassembler || !engine)
+    {
+        BenchCheck(false, "unable to create the reassembler or engine");
+        OSSafeReleaseNULL(reassembler);
+        OSSafeReleaseNULL(engine);
+        OSSafeReleaseNULL(bulkPipe);
+        OSSafeReleaseNULL(interruptPipe);
+        return;
+    }
+    reassembler->subscribe(HCI_EV_CMD_COMPLETE, VoodooHCICommandEngine::handleEventAction, engine);
+    reassembler->subscribe(HCI_EV_CMD_STATUS, VoodooHCICommandEngine::handleEventAction, engine);
+    reassembler->start();
+    
+    // A voice link was up when the lid closed
+    bench.interfaces[1]->selectAlternateSetting(bench.client, 1);
+    
+    VoodooUSBDeviceSnapshot snapshot;
+    IOReturn result = bench.device->saveState(bench.client, &snapshot, engine);
+    UInt8 allContents = kVoodooUSBSnapshotVendorVersion | kVoodooUSBSnapshotLocalVersion | kVoodooUSBSnapshotBufferSize;
+    BenchCheck(result == kIOReturnSuccess && snapshot.configuration == 1 && snapshot.interfaceCount == 2 && snapshot.contents == allContents,
+               "snapshot: 0x%08x, configuration %u, %u interfaces, contents 0x%02x", result, snapshot.configuration, snapshot.interfaceCount, snapshot.contents);
+    BenchCheck(snapshot.vendorVersion.qca.romVersion == 0x302 && snapshot.localVersion[0] == 0x08, "snapshot has ROM version 0x%x, HCI version %u", snapshot.vendorVersion.qca.romVersion, snapshot.localVersion[0]);
+    
+    UInt32 count = iterations(100);
+    VoodooUSBDeviceSnapshot scratch;
+    UInt64 coldNS = 0;
+    UInt64 fastNS = 0;
+    UInt32 failures = 0;
+    VoodooUSBResumeResult resume = { };
+    
+    // From scratch: every request and capability read again, and the voice setting chosen again
+    for (UInt32 i = 0; i < count; ++i)
+    {
+        UInt64 startTime = mach_absolute_time();
+        failures += bench.device->sendHCIRequestOut(bench.client, HCI_OP_RESET, 0, NULL) != kIOReturnSuccess;
+        failures += bench.device->saveState(bench.client, &scratch, engine) != kIOReturnSuccess;
+        failures += bench.interfaces[1]->selectAlternateSetting(bench.client, 1) != kIOReturnSuccess;
+        coldNS += elapsedNS(startTime);
+    }
+    report("soft reset, set up from scratch", count, coldNS);
+    
+    for (UInt32 i = 0; i < count; ++i)
+    {
+        UInt64 startTime = mach_absolute_time();
+        failures += bench.device->resetDevice(bench.client, &snapshot, &resume) != kIOReturnSuccess;
+        failures += bench.device->restoreCapabilities(&snapshot, engine, &resume) != kIOReturnSuccess;
+        fastNS += elapsedNS(startTime);
+    }
+    report("soft reset, restored from snapshot", count, fastNS);
+    printf("    %-44s %u requests sent, %u skipped per resume\n", "", resume.reissued, resume.skipped);
+    BenchCheck(failures == 0, "%u resets failed", failures);
+    BenchCheck(resume.reissued == 0 && resume.skipped == snapshot.interfaceCount + 4U, "%u requests sent, %u skipped with nothing changed", resume.reissued, resume.skipped);
+    BenchCheck(fastNS < coldNS, "restoring took %llu us, setting up %llu us", (unsigned long long) fastNS / 1000, (unsigned long long) coldNS / 1000);
+    
+    // The voice setting fell back to 0 over sleep; only that request goes out again
+    bench.interfaces[1]->selectAlternateSetting(bench.client, 0);
+    result = bench.device->restoreState(bench.client, &snapshot, mach_absolute_time(), &resume);
+    BenchCheck(result == kIOReturnSuccess && resume.reissued == 1 && !resume.reconfigured && bench.interfaces[1]->getAlternateSetting() == 1,
+               "changed alternate setting: 0x%08x, %u requests sent, setting %u", result, resume.reissued, bench.interfaces[1]->getAlternateSetting());
+    
+    VoodooUSBPipe * pipe = NULL;
+    BenchCheck(bench.interfaces[0]->findPipe(pipe, kUSBBulk, kUSBOut) && pipe == bulkPipe, "bulk pipe not kept across the resume");
+    OSSafeReleaseNULL(pipe);
+    
+    // Not the device the snapshot was taken of
+    scratch = snapshot;
+    scratch.interfaces[0].endpoints[kUSBBulk][kUSBOut] = 0x05;
+    result = bench.device->restoreState(bench.client, &scratch);
+    BenchCheck(result == kIOReturnNotFound, "restore onto a different endpoint layout: 0x%08x", result);
+    
+    OSDictionary * statistics = bench.device->copyStatistics();
+    reportHistogram("Wake to ready histogram", OSDynamicCast(OSDictionary, statistics ? statistics->getObject("Resume") : NULL));
+    BenchCheck(histogramValue(statistics, "Resume", "Count") == count + 2 && histogramValue(statistics, "Resume", "Errors") == 1, "resume histogram has %llu entries, %llu errors",
+               (unsigned long long) histogramValue(statistics, "Resume", "Count"), (unsigned long long) histogramValue(statistics, "Resume", "Errors"));
+    OSSafeReleaseNULL(statistics);
+    
+    reassembler->stop();
+    OSSafeReleaseNULL(engine);
+    OSSafeReleaseNULL(reassembler);
+    OSSafeReleaseNULL(bulkPipe);
+    OSSafeReleaseNULL(interruptPipe);
+    
+    // The device lost power; its interfaces are published again as new objects before they are checked
+    bench.device->setConfiguration(bench.client, 0);
+    result = bench.device->restoreState(bench.client, &snapshot, mach_absolute_time(), &resume);
+    BenchCheck(result == kIOReturnSuccess && resume.reconfigured && resume.reissued == 3, "lost configuration: 0x%08x, %u requests sent", result, resume.reissued);
+    
+    // The old engine went with the old pipes; the capabilities are read through one built on the new interface
+    VoodooUSBInterface * controllerInterface = copyBenchInterface(bench.device, 0);
+    interruptPipe = NULL;
+    if (controllerInterface)
+    {
+        controllerInterface->findPipe(interruptPipe, kUSBInterrupt, kUSBIn);
+    }
+    reassembler = VoodooHCIEventReassembler::withPipe(interruptPipe);
+    engine = VoodooHCICommandEngine::withDevice(bench.device, bench.client);
+    if (reassembler && engine)
+    {
+        reassembler->subscribe(HCI_EV_CMD_COMPLETE, VoodooHCICommandEngine::handleEventAction, engine);
+        reassembler->subscribe(HCI_EV_CMD_STATUS, VoodooHCICommandEngine::handleEventAction, engine);
+        reassembler->start();
+        
+        result = bench.device->restoreCapabilities(&snapshot, engine, &resume);
+        BenchCheck(result == kIOReturnSuccess && resume.reissued == 5, "capabilities after a reconfigure: 0x%08x, %u requests sent", result, resume.reissued);
+        
+        // Another controller came up behind the same USB side
+        scratch = snapshot;
+        scratch.bufferSize[0] ^= 0xff;
+        result = bench.device->restoreCapabilities(&scratch, engine, &resume);
+        BenchCheck(result == kIOReturnNoDevice, "restore onto different buffer sizes: 0x%08x", result);
+        
+        reassembler->stop();
+    }
+    else
+    {
+        BenchCheck(false, "unable to rebuild the reassembler or engine");
+    }
+    OSSafeReleaseNULL(engine);
+    OSSafeReleaseNULL(reassembler);
+    OSSafeReleaseNULL(interruptPipe);
+    if (controllerInterface)
+    {
+        controllerInterface->close(bench.client);
+    }
+    OSSafeReleaseNULL(controllerInterface);
+}
+
+/* Ath3k parts report a shorter version than QCA ones; the rest of the union must not count */
+static void benchResumeAth3k()
+{
+    IOUSBHostSimConfig config = benchConfig();
+    config.productID = 0x3004;
+    BenchDevice bench(config);
+    if (!bench.valid())
+    {
+        BenchCheck(false, "device did not start");
+        return;
+    }
+    
+    VoodooUSBDeviceSnapshot snapshot;
+    VoodooUSBResumeResult resume = { };
+    IOReturn result = bench.device->saveState(bench.client, &snapshot);
+    BenchCheck(result == kIOReturnSuccess && snapshot.contents == kVoodooUSBSnapshotVendorVersion, "Ath3k snapshot: 0x%08x, contents 0x%02x", result, snapshot.contents);
+    
+    UInt32 count = iterations(20);
+    UInt32 failures = 0;
+    for (UInt32 i = 0; i < count; ++i)
+    {
+        bench.device->setConfiguration(bench.client, 0);
+        failures += bench.device->restoreState(bench.client, &snapshot, 0, &resume) != kIOReturnSuccess || !resume.reconfigured;
+    }
+    BenchCheck(failures == 0, "%u of %u Ath3k resumes after a lost configuration failed", failures, count);
+}
+
+/* ---- Chip registry ---- */
+
+static void benchRegistry()
+{
+    BenchDevice bench(benchConfig());
+    if (!bench.valid())
+    {
+        BenchCheck(false, "device did not start");
+        return;
+    }
+
+    // What a probe does: identify by VID / PID, then pick the firmware layout from the ROM version
+    QCAVersion version;
+    QCADeviceInfo info;
+    bzero(&info, sizeof(info));
+    const VoodooChipEntry * chip = bench.device->getChipEntry();
+    IOReturn result = bench.device->getQcaUsbVendorVersion(bench.client, &version);
+    BenchCheck(chip && chip->family == kVoodooChipQcaRome, "0cf3:e300 not identified as ROME");
+    BenchCheck(result == kIOReturnSuccess && bench.device->getQcaUsbDeviceInfo(&version, &info), "ROM version not resolved");
+    BenchCheck(info.romVersion == 0x302 && info.ramPatchHdr == 28 && info.nvmHdr == 4 && info.versionOffset == 16, "wrong layout for ROME 3.2");
+
+    // Known and unknown IDs alternate, so both the hit and the miss path are measured
+    const UInt16 ids[][2] = { { 0x0cf3, 0x3004 }, { 0x1234, 0x5678 }, { 0x8087, 0x0032 }, { 0x05ac, 0x8290 }, { 0x0a5c, 0x21e8 }, { 0x0489, 0xe0d0 } };
+    UInt32 count = iterations(10000000) / ARRAY_SIZE(ids) * ARRAY_SIZE(ids);
+    UInt32 found = 0;
+
+    UInt64 startTime = mach_absolute_time();
+    for (UInt32 i = 0; i < count; ++i)
+    {
+        const UInt16 * id = ids[i % ARRAY_SIZE(ids)];
+        found += VoodooChipRegistry::lookupDevice(id[0], id[1]) != NULL;
+    }
+    report("VoodooChipRegistry::lookupDevice", count, elapsedNS(startTime));
+    BenchCheck(found == count / ARRAY_SIZE(ids) * 4, "%u of %u lookups hit", found, count);
+}
+
+/* ---- Error injection and instrumentation ---- */
+
+static void benchErrorInjection()
+{
+    IOUSBHostSimConfig config = benchConfig();
+    config.failEvery = 5;
+
+    BenchDevice bench(config);
+    if (!bench.valid())
+    {
+        BenchCheck(false, "device did not start");
+        return;
+    }
+
+    // Enumeration and the string prefetch already used up part of the cycle
+    bench.device->invalidateStringCache();
+    bench.controller->resetStatistics();
+
+    UInt32 count = iterations(500);
+    UInt32 failed = 0;
+    UInt8 state;
+
+    UInt64 startTime = mach_absolute_time();
+    for (UInt32 i = 0; i < count; ++i)
+    {
+        if (bench.device->sendVendorRequestIn(bench.client, VENDOR_GETSTATE, &state, sizeof(state)) != kIOReturnSuccess)
+        {
+            ++failed;
+        }
+    }
+    report("sendVendorRequestIn, every 5th failing", count, elapsedNS(startTime));
+
+    IOUSBHostSimStatistics statistics = bench.simStatistics();
+    OSDictionary * histograms = bench.device->copyStatistics();
+    BenchCheck(failed == statistics.injectedErrors && failed >= count / 5 - 1, "%u failures for %llu injected errors", failed, (unsigned long long) statistics.injectedErrors);
+    BenchCheck(histogramValue(histograms, "Control", "Errors") >= failed, "control histogram counted %llu errors", (unsigned long long) histogramValue(histograms, "Control", "Errors"));
+    OSSafeReleaseNULL(histograms);
+}
+
+static void benchHistogram()
+{
+    VoodooUSBLatencyHistogram histogram;
+    histogram.reset();
+
+    UInt32 count = iterations(5000000);
+    UInt64 startTime = mach_absolute_time();
+    for (UInt32 i = 0; i < count; ++i)
+    {
+        histogram.record(startTime, 64);
+    }
+    report("VoodooUSBLatencyHistogram::record", count, elapsedNS(startTime));
+    BenchCheck(histogram.count == count && histogram.bytes == (UInt64) count * 64, "histogram lost samples");
+}
+
+/* ---- Several adapters on one host ---- */
+
+#define BENCH_ADAPTERS      4
+
+/* What a client driver does at attach before the controller is usable */
+static IOReturn bringUpAction(VoodooUSBDevice * device, void * refCon)
+{
+    IOService * client = (IOService *) device;
+    VendorState state;
+    QCAVersion version;
+
+    IOReturn result = device->sendHCIRequestOut(client, HCI_OP_RESET, 0, NULL);
+    if (result == kIOReturnSuccess)
+    {
+        result = device->sendVendorRequestIn(client, VENDOR_GETSTATE, &state, sizeof(state));
+    }
+    if (result == kIOReturnSuccess)
+    {
+        result = device->getQcaUsbVendorVersion(client, &version);
+    }
+    if (result == kIOReturnSuccess)
+    {
+        device->invalidateStringCache();
+        result = device->prefetchStringDescriptors();
+    }
+    return result;
+}
+
+struct WorkOrder
+{
+    UInt32  next;
+    UInt32  outOfOrder;
+    UInt32  outsideGate;
+};
+
+struct WorkTicket
+{
+    WorkOrder * order;
+    UInt32      index;
+};
+
+static IOReturn orderedAction(VoodooUSBDevice * device, void * refCon)
+{
+    WorkTicket * ticket = (WorkTicket *) refCon;
+    ticket->order->outOfOrder += ticket->index != ticket->order->next++;
+    ticket->order->outsideGate += !device->getDeviceWorkLoop()->inGate();
+    return kIOReturnSuccess;
+}
+
+static void benchMultiDevice()
+{
+    BenchDevice * benches[BENCH_ADAPTERS];
+    VoodooUSBDevice * devices[BENCH_ADAPTERS];
+    bool valid = true;
+
+    for (int i = 0; i < BENCH_ADAPTERS; ++i)
+    {
+        benches[i] = new BenchDevice(benchConfig());
+        devices[i] = benches[i]->device;
+        valid = valid && benches[i]->valid();
+    }
+    BenchCheck(valid, "devices did not start");
+
+    UInt32 rounds = iterations(50);
+    UInt32 failed = 0;
+    IOReturn results[BENCH_ADAPTERS];
+    char name[64];
+
+    UInt64 startTime = mach_absolute_time();
+    for (UInt32 round = 0; valid && round < rounds; ++round)
+    {
+        for (int i = 0; i < BENCH_ADAPTERS; ++i)
+        {
+            failed += devices[i]->runGated(bringUpAction, NULL) != kIOReturnSuccess;
+        }
+    }
+    UInt64 sequentialNS = elapsedNS(startTime);
+    snprintf(name, sizeof(name), "bring-up, %u adapters one after another", BENCH_ADAPTERS);
+    report(name, rounds * BENCH_ADAPTERS, sequentialNS);
+
+    startTime = mach_absolute_time();
+    for (UInt32 round = 0; valid && round < rounds; ++round)
+    {
+        failed += VoodooUSBDevice::initializeInParallel(devices, BENCH_ADAPTERS, bringUpAction, NULL, results) != kIOReturnSuccess;
+    }
+    UInt64 parallelNS = elapsedNS(startTime);
+    snprintf(name, sizeof(name), "bring-up, %u adapters initializeInParallel", BENCH_ADAPTERS);
+    report(name, rounds * BENCH_ADAPTERS, parallelNS);
+    printf("    %-44s %.2fx\n", "bring-up speedup", parallelNS ? (double) sequentialNS / parallelNS : 0);
+
+    BenchCheck(!failed, "%u bring-ups failed", failed);
+    BenchCheck(parallelNS * 2 < sequentialNS, "parallel bring-up took %llu us against %llu us one by one", (unsigned long long) parallelNS / 1000, (unsigned long long) sequentialNS / 1000);
+
+    // Steady state: one client thread per adapter against one thread driving a single adapter
+    UInt32 count = iterations(1000);
+    volatile UInt32 transferFailures = 0;
+    auto transfers = [&] (VoodooUSBDevice * device)
+    {
+        VendorState state;
+        for (UInt32 i = 0; i < count; ++i)
+        {
+            if (device->sendVendorRequestIn((IOService *) device, VENDOR_GETSTATE, &state, sizeof(state)) != kIOReturnSuccess)
+            {
+                __atomic_add_fetch(&transferFailures, 1, __ATOMIC_SEQ_CST);
+            }
+        }
+    };
+
+    startTime = mach_absolute_time();
+    transfers(devices[0]);
+    UInt64 singleNS = elapsedNS(startTime);
+    report("sendVendorRequestIn, 1 adapter", count, singleNS);
+
+    std::vector<std::thread> threads;
+    startTime = mach_absolute_time();
+    for (int i = 0; valid && i < BENCH_ADAPTERS; ++i)
+    {
+        threads.emplace_back(transfers, devices[i]);
+    }
+    for (std::thread & thread : threads)
+    {
+        thread.join();
+    }
+    UInt64 multiNS = elapsedNS(startTime);
+    snprintf(name, sizeof(name), "sendVendorRequestIn, %u adapters at once", BENCH_ADAPTERS);
+    report(name, count * BENCH_ADAPTERS, multiNS);
+    BenchCheck(multiNS < singleNS * 2, "%u adapters took %.2fx as long as one", BENCH_ADAPTERS, (double) multiNS / singleNS);
+
+    // Several clients sharing one adapter need no locks of their own
+    threads.clear();
+    startTime = mach_absolute_time();
+    for (int i = 0; valid && i < BENCH_ADAPTERS; ++i)
+    {
+        threads.emplace_back(transfers, devices[0]);
+    }
+    for (std::thread & thread : threads)
+    {
+        thread.join();
+    }
+    snprintf(name, sizeof(name), "sendVendorRequestIn, %u clients on 1 adapter", BENCH_ADAPTERS);
+    report(name, count * BENCH_ADAPTERS, elapsedNS(startTime));
+    BenchCheck(!transferFailures, "%u transfers failed", transferFailures);
+
+    // Queued work runs in order and inside the gate
+    WorkOrder order = { 0, 0, 0 };
+    WorkTicket tickets[VOODOO_USB_WORK_QUEUE_DEPTH];
+    for (UInt32 i = 0; valid && i < VOODOO_USB_WORK_QUEUE_DEPTH; ++i)
+    {
+        tickets[i] = { &order, i };
+        devices[0]->enqueueWork(orderedAction, &tickets[i]);
+    }
+    devices[0]->drainWork();
+    BenchCheck(!valid || (order.next == VOODOO_USB_WORK_QUEUE_DEPTH && !order.outOfOrder && !order.outsideGate),
+               "%u of %u work items ran, %u out of order, %u outside the gate", order.next, VOODOO_USB_WORK_QUEUE_DEPTH, order.outOfOrder, order.outsideGate);
+
+    for (int i = 0; i < BENCH_ADAPTERS; ++i)
+    {
+        delete benches[i];
+    }
+}
+
+/* ---- Isochronous SCO streaming ---- */
+
+struct ScoCounter
+{
+    volatile UInt32 packets;
+    UInt32          corrupt;
+    volatile UInt32 transfers;
+    UInt64          lastFrameTime;
+    UInt64          frames;
+    UInt64          missedFrames;
+    UInt64          frameNS;
+};
+
+static void countScoFrames(ScoCounter * counter, const USBIsocFrame * frames, UInt32 frameCount)
+{
+    // Consecutive frames are frameNS apart; anything more is frames the endpoint sat idle
+    for (UInt32 i = 0; i < frameCount; ++i)
+    {
+        UInt64 timeStamp = frames[i].timeStamp;
+        if (counter->lastFrameTime && timeStamp > counter->lastFrameTime + counter->frameNS)
+        {
+            counter->missedFrames += (timeStamp - counter->lastFrameTime) / counter->frameNS - 1;
+        }
+        counter->lastFrameTime = timeStamp;
+    }
+    counter->frames += frameCount;
+    __atomic_add_fetch(&counter->transfers, 1, __ATOMIC_SEQ_CST);
+}
+
+static void countScoPacket(void * owner, void * refCon, const UInt8 * packet, UInt16 length)
+{
+    ScoCounter * counter = (ScoCounter *) refCon;
+    const HciScoHdr * header = (const HciScoHdr *) packet;
+    UInt32 sequence;
+
+    // Every payload starts with its sequence number and is padded with its low byte
+    memcpy(&sequence, packet + HCI_SCO_HDR_SIZE, sizeof(sequence));
+    bool intact = header->handle == 0x0001 && length == HCI_SCO_HDR_SIZE + header->dLength && sequence == counter->packets;
+    for (UInt32 i = HCI_SCO_HDR_SIZE + sizeof(sequence); intact && i < length; ++i)
+    {
+        intact = packet[i] == (UInt8) sequence;
+    }
+    counter->corrupt += !intact;
+    __atomic_add_fetch(&counter->packets, 1, __ATOMIC_SEQ_CST);
+}
+
+static void countScoTransfer(void * owner, void * refCon, IOReturn status, const USBIsocFrame * frames, UInt32 frameCount)
+{
+    countScoFrames((ScoCounter *) refCon, frames, frameCount);
+}
+
+static void countScoSingle(void * owner, void * parameter, IOReturn status, USBIsocFrame * frames)
+{
+    countScoFrames((ScoCounter *) parameter, frames, *(UInt32 *) owner);
+}
+
+static void benchSco()
+{
+    IOUSBHostSimConfig config = benchConfig();
+    BenchDevice bench(config);
+    if (!bench.valid() || !bench.interfaces[1])
+    {
+        BenchCheck(false, "device did not start");
+        return;
+    }
+    VoodooUSBInterface * sco = bench.interfaces[1];
+
+    // One to three voice links of 8 or 16 bit samples against the 9 / 17 / 25 / 33 / 49 byte settings
+    const UInt8 expected[3][2] = { { 1, 2 }, { 2, 4 }, { 3, 5 } };
+    for (UInt8 links = 1; links <= 3; ++links)
+    {
+        for (int sixteenBit = 0; sixteenBit < 2; ++sixteenBit)
+        {
+            UInt8 setting = 0xFF;
+            IOReturn result = sco->selectAlternateSettingForBandwidth(bench.client, voodooScoBytesPerFrame(links, sixteenBit), &setting);
+            VoodooUSBEndpointEntry entry = { };
+            bool found = sco->copyEndpointEntry(kUSBIsoc, kUSBIn, &entry);
+            BenchCheck(result == kIOReturnSuccess && setting == expected[links - 1][sixteenBit] && found && entry.maxPacketSize >= voodooScoBytesPerFrame(links, sixteenBit),
+                       "%u link(s), %d bit: alternate setting %u, result 0x%08x", links, sixteenBit ? 16 : 8, setting, result);
+            OSSafeReleaseNULL(entry.pipe);
+        }
+    }
+    BenchCheck(sco->selectAlternateSettingForBandwidth(bench.client, 64) == kIOReturnNoBandwidth, "64 bytes per frame fit an alternate setting");
+    BenchCheck(sco->selectAlternateSettingForBandwidth(bench.client, voodooScoBytesPerFrame(1, true)) == kIOReturnSuccess, "unable to select the one link setting");
+
+    VoodooUSBPipe * inPipe  = NULL;
+    VoodooUSBPipe * outPipe = NULL;
+    sco->findPipe(inPipe, kUSBIsoc, kUSBIn);
+    sco->findPipe(outPipe, kUSBIsoc, kUSBOut);
+    if (!inPipe || !outPipe)
+    {
+        BenchCheck(false, "isochronous pipes not found");
+        OSSafeReleaseNULL(inPipe);
+        OSSafeReleaseNULL(outPipe);
+        return;
+    }
+
+    const UInt32 framesPerTransfer = 8;
+    ScoCounter counter = { 0, 0, 0, 0, 0, 0, config.isochronousFrameNS };
+    char name[64];
+
+    // One transfer at a time, resubmitted by the client once it is back
+    UInt32 singleTransfers = iterations(50);
+    USBIsocFrame frames[framesPerTransfer];
+    IOBufferMemoryDescriptor * buffer = IOBufferMemoryDescriptor::withCapacity(framesPerTransfer * 17, kIODirectionIn);
+    USBIsocCompletion completion = { (void *) &framesPerTransfer, countScoSingle, &counter };
+    UInt64 startTime = mach_absolute_time();
+    for (UInt32 i = 0; i < singleTransfers; ++i)
+    {
+        for (UInt32 j = 0; j < framesPerTransfer; ++j)
+        {
+            frames[j] = { kIOReturnSuccess, 17, 0, 0, 0 };
+        }
+        IOReturn result = inPipe->isochronousIO(buffer, frames, framesPerTransfer, &completion);
+        if (result != kIOReturnSuccess || !waitFor(&counter.transfers, i + 1))
+        {
+            BenchCheck(false, "single isochronous transfer %u failed: 0x%08x", i, result);
+            break;
+        }
+    }
+    report("isochronous IN, one transfer at a time", (UInt32) counter.frames, elapsedNS(startTime));
+    printf("    %-44s %llu of %llu frames missed\n", "", (unsigned long long) counter.missedFrames, (unsigned long long) (counter.frames + counter.missedFrames));
+    BenchCheck(counter.missedFrames, "resubmitting from the client missed no frames");
+    OSSafeReleaseNULL(buffer);
+
+    // The ring, looping SCO packets from the OUT stream back to the IN stream
+    const UInt32 depth = 3;
+    const UInt32 count = iterations(300);
+    UInt8 packet[HCI_SCO_HDR_SIZE + 48];
+    HciScoHdr * header = (HciScoHdr *) packet;
+    counter = { 0, 0, 0, 0, 0, 0, config.isochronousFrameNS };
+    bench.model.scoLoopback = true;
+
+    startTime = mach_absolute_time();
+    IOReturn inResult  = inPipe->startIsochronousStream(depth, framesPerTransfer, countScoPacket, countScoTransfer, NULL, &counter);
+    IOReturn outResult = outPipe->startIsochronousStream(depth, framesPerTransfer, NULL, NULL, NULL);
+    BenchCheck(inResult == kIOReturnSuccess && outResult == kIOReturnSuccess, "unable to start the streams: 0x%08x, 0x%08x", inResult, outResult);
+
+    for (UInt32 sequence = 0; outResult == kIOReturnSuccess && sequence < count; ++sequence)
+    {
+        header->handle  = 0x0001;
+        header->dLength = sizeof(packet) - HCI_SCO_HDR_SIZE;
+        memset(packet + HCI_SCO_HDR_SIZE, (UInt8) sequence, header->dLength);
+        memcpy(packet + HCI_SCO_HDR_SIZE, &sequence, sizeof(sequence));
+
+        IOReturn result;
+        while ((result = outPipe->queueScoPacket(packet, sizeof(packet))) == kIOReturnNoSpace)
+        {
+            benchYield();
+        }
+        if (result != kIOReturnSuccess)
+        {
+            BenchCheck(false, "queueScoPacket() failed: 0x%08x", result);
+            break;
+        }
+    }
+    bool drained = waitFor(&counter.packets, count);
+    UInt64 duration = elapsedNS(startTime);
+
+    snprintf(name, sizeof(name), "isochronous SCO ring, depth %u", depth);
+    report(name, count, duration, (UInt64) count * sizeof(packet));
+
+    VoodooUSBIsocStatistics inStatistics, outStatistics;
+    inPipe->stopIsochronousStream();
+    outPipe->stopIsochronousStream();
+    inPipe->getIsochronousStatistics(&inStatistics);
+    outPipe->getIsochronousStatistics(&outStatistics);
+    printf("    %-44s %llu of %llu frames missed, %u underruns\n", "", (unsigned long long) counter.missedFrames, (unsigned long long) (counter.frames + counter.missedFrames), inStatistics.underruns + outStatistics.underruns);
+
+    BenchCheck(drained && !counter.corrupt, "%u of %u SCO packets looped back, %u corrupt or out of order", counter.packets, count, counter.corrupt);
+    BenchCheck(!counter.missedFrames && !inStatistics.underruns && !outStatistics.underruns, "the ring left the endpoint idle: %llu frames missed, %u + %u underruns",
+               (unsigned long long) counter.missedFrames, inStatistics.underruns, outStatistics.underruns);
+    BenchCheck(outStatistics.scoPackets == count && inStatistics.scoPackets == count && !inStatistics.frameErrors, "statistics: %u queued, %u received, %u frame errors",
+               outStatistics.scoPackets, inStatistics.scoPackets, inStatistics.frameErrors);
+
+    OSSafeReleaseNULL(inPipe);
+    OSSafeReleaseNULL(outPipe);
+}
+
+/* ---- Driver ---- */
+
+struct Benchmark
+{
+    const char            * name;
+    std::function<void()>   run;
+};
+
+int main(int argc, char ** argv)
+{
+    const char * filter = NULL;
+    bool verbose = false;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (!strcmp(argv[i], "--quick"))
+        {
+            gQuick = true;
+        }
+        else if (!strcmp(argv[i], "--verbose"))
+        {
+            verbose = true;
+        }
+        else if (!strcmp(argv[i], "--filter") && i + 1 < argc)
+        {
+            filter = argv[++i];
+        }
+        else
+        {
+            fprintf(stderr, "usage: %s [--quick] [--verbose] [--filter substring]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    IOSimSetLogEnabled(verbose);
+    IOUSBHostSimSetFactories([] () -> IOUSBHostInterface * { return new VoodooUSBInterface; },
+                             [] () -> IOUSBHostPipe * { return new VoodooUSBPipe; });
+
+    const Benchmark benchmarks[] =
+    {
+        { "control",        benchControl },
+        { "batch",          [] () { benchControlBatch(); benchControlBatchErrors(); } },
+        { "strings",        benchStrings },
+        { "findpipe",       benchFindPipe },
+        { "interfaces",     benchInterfaceLookup },
+        { "engine",         [] () { benchCommandEngine(1); benchCommandEngine(4); } },
+        { "reassembler",    benchReassembler },
+        { "poll",           benchPollMode },
+        { "timers",         benchTimerWheel },
+        { "pump",           [] () { benchReadPump(1); benchReadPump(8); } },
+        { "coalesce",       [] () { benchCoalescedPump(1); benchCoalescedPump(8); benchCoalescedPump(16); } },
+        { "firmware",       [] () { benchFirmwareDownload(1); benchFirmwareDownload(4); } },
+        { "patchram",       [] () { benchPatchram(1); benchPatchram(4); } },
+        { "intel",          [] () { benchIntelSfi(1, 1); benchIntelSfi(1, VOODOO_INTEL_SFI_DEPTH_DEFAULT); benchIntelSfi(4, VOODOO_INTEL_SFI_DEPTH_DEFAULT); } },
+        { "fwcache",        benchFirmwareCache },
+        { "gather",         [] () { benchGatherWrite(1013); benchGatherWrite(1016); } },
+        { "acl",            benchAclScheduler },
+        { "capture",        benchCapture },
+        { "registry",       benchRegistry },
+        { "resume",         benchResume },
+        { "resume-ath3k",   benchResumeAth3k },
+        { "errors",         benchErrorInjection },
+        { "histogram",      benchHistogram },
+        { "multidevice",    benchMultiDevice },
+        { "sco",            benchSco },
+    };
+
+    for (const Benchmark & benchmark : benchmarks)
+    {
+        if (filter && !strstr(benchmark.name, filter))
+        {
+            continue;
+        }
+
+        printf("%s\n", benchmark.name);
+        fflush(stdout);
+        benchmark.run();
+        fflush(stdout);
+    }
+
+    if (gFailures)
+    {
+        printf("%u check(s) failed\n", gFailures);
+        return 1;
+    }
+    printf("all checks passed\n");
+    return 0;
+}
@@ -0,0 +1,38 @@
+//
+//  IOBufferMemoryDescriptor.h
+//  VoodooUSBProvider Simulator
+//
+
+#ifndef SIM_IOKIT_IOBUFFERMEMORYDESCRIPTOR_H
+#define SIM_IOKIT_IOBUFFERMEMORYDESCRIPTOR_H
+
+#include <IOKit/IOMemoryDescriptor.h>
+
+enum
+{
+    kIOMemoryPhysicallyContiguous   = 0x00000010,
+    kIOMemoryPageable               = 0x00000400,
+    kIOMemoryKernelUserShared       = 0x00001000,
+};
+
+class IOBufferMemoryDescriptor : public IOMemoryDescriptor
+{
+public:
+    static IOBufferMemoryDescriptor * withCapacity(IOByteCount capacity, IODirection withDirection, bool withContiguousMemory = false);
+    static IOBufferMemoryDescriptor * withBytes(const void * bytes, IOByteCount withLength, IODirection withDirection, bool withContiguousMemory = false);
+    static IOBufferMemoryDescriptor * inTaskWithOptions(task_t inTask, IOOptionBits options, IOByteCount capacity, IOByteCount alignment = 1);
+    
+    void        setLength(IOByteCount length);
+    IOByteCount getCapacity() const { return capacity; }
+    void      * getBytesNoCopy() { return bytes; }
+    void      * getBytesNoCopy(IOByteCount start, IOByteCount withLength);
+    bool        appendBytes(const void * bytes, IOByteCount withLength);
+    
+protected:
+    virtual void free() override;
+    
+private:
+    IOByteCount capacity;
+};
+
+#endif /* SIM_IOKIT_IOBUFFERMEMORYDESCRIPTOR_H */
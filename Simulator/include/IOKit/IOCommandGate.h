@@ -0,0 +1,29 @@
+//
+//  IOCommandGate.h
+//  VoodooUSBProvider Simulator
+//
+//  Stand-in for <IOKit/IOCommandGate.h>: actions run on the calling thread with the work
+//  loop gate closed, exactly like the kernel's runAction().
+//
+
+#ifndef SIM_IOKIT_IOCOMMANDGATE_H
+#define SIM_IOKIT_IOCOMMANDGATE_H
+
+#include <IOKit/IOEventSource.h>
+
+class IOCommandGate : public IOEventSource
+{
+public:
+    typedef IOReturn (*Action)(OSObject * owner, void * arg0, void * arg1, void * arg2, void * arg3);
+    
+    static IOCommandGate * commandGate(OSObject * owner, Action action = 0);
+    
+    virtual IOReturn runAction(Action action, void * arg0 = 0, void * arg1 = 0, void * arg2 = 0, void * arg3 = 0);
+    virtual IOReturn runCommand(void * arg0 = 0, void * arg1 = 0, void * arg2 = 0, void * arg3 = 0);
+    
+    virtual IOReturn commandSleep(void * event, UInt32 interruptible = THREAD_ABORTSAFE);
+    virtual IOReturn commandSleep(void * event, AbsoluteTime deadline, UInt32 interruptible);
+    virtual void     commandWakeup(void * event, bool oneThread = false);
+};
+
+#endif /* SIM_IOKIT_IOCOMMANDGATE_H */
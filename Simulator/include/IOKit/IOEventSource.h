@@ -0,0 +1,33 @@
+//
+//  IOEventSource.h
+//  VoodooUSBProvider Simulator
+//
+//  Stand-in for <IOKit/IOEventSource.h>.
+//
+
+#ifndef SIM_IOKIT_IOEVENTSOURCE_H
+#define SIM_IOKIT_IOEVENTSOURCE_H
+
+#include <IOKit/IOWorkLoop.h>
+
+class IOEventSource : public OSObject
+{
+    friend class IOWorkLoop;
+    
+public:
+    typedef void (*Action)(OSObject * owner, ...);
+    
+    virtual bool init(OSObject * owner, Action action = 0);
+    
+    IOWorkLoop * getWorkLoop() const { return workLoop; }
+    OSObject   * getOwner() const { return owner; }
+    
+protected:
+    virtual void setWorkLoop(IOWorkLoop * workLoop);
+    
+    OSObject   * owner;
+    Action       action;
+    IOWorkLoop * workLoop;
+};
+
+#endif /* SIM_IOKIT_IOEVENTSOURCE_H */
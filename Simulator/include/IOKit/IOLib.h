@@ -0,0 +1,80 @@
+//
+//  IOLib.h
+//  VoodooUSBProvider Simulator
+//
+//  Stand-in for <IOKit/IOLib.h> plus the few <kern/clock.h> and <libkern/libkern.h>
+//  helpers the provider uses. mach_absolute_time() runs in nanoseconds.
+//
+
+#ifndef SIM_IOKIT_IOLIB_H
+#define SIM_IOKIT_IOLIB_H
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <IOKit/IOTypes.h>
+#include <IOKit/IOLocks.h>
+#include <libkern/OSAtomic.h>
+#include <libkern/OSByteOrder.h>
+
+/* Logging goes to stderr; IOSimSetLogEnabled(false) keeps benchmark output readable */
+void   IOLog(const char * format, ...) __attribute__((format(printf, 1, 2)));
+void   IOSimSetLogEnabled(bool enabled);
+
+void   IOSleep(unsigned milliseconds);
+void   IODelay(unsigned microseconds);
+
+void * IOMalloc(size_t size);
+void   IOFree(void * address, size_t size);
+void * IOMallocAligned(size_t size, size_t alignment);
+void   IOFreeAligned(void * address, size_t size);
+
+#define IONew(type, number)                 ((type *) IOMalloc(sizeof(type) * (number)))
+#define IODelete(ptr, type, number)         IOFree((ptr), sizeof(type) * (number))
+
+enum
+{
+    kNanosecondScale    = 1,
+    kMicrosecondScale   = 1000,
+    kMillisecondScale   = 1000 * 1000,
+    kSecondScale        = 1000 * 1000 * 1000,
+};
+
+UInt64 mach_absolute_time();
+void   clock_get_uptime(UInt64 * result);
+void   absolutetime_to_nanoseconds(UInt64 abstime, UInt64 * result);
+void   nanoseconds_to_absolutetime(UInt64 nanoseconds, UInt64 * result);
+void   clock_interval_to_absolutetime_interval(UInt32 interval, UInt32 scaleFactor, UInt64 * result);
+void   clock_interval_to_deadline(UInt32 interval, UInt32 scaleFactor, UInt64 * result);
+
+typedef unsigned long       clock_sec_t;
+typedef unsigned int        clock_usec_t;
+
+void   clock_get_calendar_microtime(clock_sec_t * seconds, clock_usec_t * microseconds);
+
+static inline unsigned int min(unsigned int a, unsigned int b)
+{
+    return a < b ? a : b;
+}
+
+static inline unsigned int max(unsigned int a, unsigned int b)
+{
+    return a > b ? a : b;
+}
+
+#if !defined(__GLIBC__) || (__GLIBC__ == 2 && __GLIBC_MINOR__ < 38)
+static inline size_t strlcpy(char * dst, const char * src, size_t size)
+{
+    size_t length = strlen(src);
+    if (size)
+    {
+        size_t copy = length < size - 1 ? length : size - 1;
+        memcpy(dst, src, copy);
+        dst[copy] = '\0';
+    }
+    return length;
+}
+#endif
+
+#endif /* SIM_IOKIT_IOLIB_H */
@@ -0,0 +1,43 @@
+//
+//  IOLocks.h
+//  VoodooUSBProvider Simulator
+//
+//  Stand-in for <IOKit/IOLocks.h> on pthreads. IOLockSleep() and IOLockWakeup() share one
+//  condition per lock; the event only narrows who is woken. Callers re-check their
+//  condition in a loop, as kernel code must anyway.
+//
+
+#ifndef SIM_IOKIT_IOLOCKS_H
+#define SIM_IOKIT_IOLOCKS_H
+
+#include <IOKit/IOTypes.h>
+
+struct IOLock;
+struct IORecursiveLock;
+struct IOSimpleLock;
+
+IOLock *      IOLockAlloc();
+void          IOLockFree(IOLock * lock);
+void          IOLockLock(IOLock * lock);
+bool          IOLockTryLock(IOLock * lock);
+void          IOLockUnlock(IOLock * lock);
+int           IOLockSleep(IOLock * lock, void * event, UInt32 interType);
+int           IOLockSleepDeadline(IOLock * lock, void * event, AbsoluteTime deadline, UInt32 interType);
+void          IOLockWakeup(IOLock * lock, void * event, bool oneThread);
+
+IORecursiveLock * IORecursiveLockAlloc();
+void          IORecursiveLockFree(IORecursiveLock * lock);
+void          IORecursiveLockLock(IORecursiveLock * lock);
+void          IORecursiveLockUnlock(IORecursiveLock * lock);
+bool          IORecursiveLockHaveLock(const IORecursiveLock * lock);
+
+typedef int   IOInterruptState;
+
+IOSimpleLock * IOSimpleLockAlloc();
+void          IOSimpleLockFree(IOSimpleLock * lock);
+void          IOSimpleLockLock(IOSimpleLock * lock);
+void          IOSimpleLockUnlock(IOSimpleLock * lock);
+IOInterruptState IOSimpleLockLockDisableInterrupt(IOSimpleLock * lock);
+void          IOSimpleLockUnlockEnableInterrupt(IOSimpleLock * lock, IOInterruptState state);
+
+#endif /* SIM_IOKIT_IOLOCKS_H */
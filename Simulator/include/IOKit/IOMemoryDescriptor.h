@@ -0,0 +1,40 @@
+//
+//  IOMemoryDescriptor.h
+//  VoodooUSBProvider Simulator
+//
+//  Stand-in for <IOKit/IOMemoryDescriptor.h>. Descriptors describe plain process memory;
+//  prepare() / complete() only keep a wiring count so unbalanced use can be detected.
+//  Transfers move data with readBytes() / writeBytes(), like a DMA engine would walk the ranges.
+//
+
+#ifndef SIM_IOKIT_IOMEMORYDESCRIPTOR_H
+#define SIM_IOKIT_IOMEMORYDESCRIPTOR_H
+
+#include <IOKit/IOLib.h>
+#include <libkern/c++/OSObject.h>
+
+class IOMemoryDescriptor : public OSObject
+{
+public:
+    static IOMemoryDescriptor * withAddress(void * address, IOByteCount withLength, IODirection withDirection);
+    static IOMemoryDescriptor * withAddressRange(mach_vm_address_t address, mach_vm_size_t length, IOOptionBits options, task_t task);
+    
+    virtual IOByteCount getLength() const { return length; }
+    virtual IODirection getDirection() const { return direction; }
+    
+    virtual IOReturn    prepare(IODirection forDirection = kIODirectionNone);
+    virtual IOReturn    complete(IODirection forDirection = kIODirectionNone);
+    
+    virtual IOByteCount readBytes(IOByteCount offset, void * bytes, IOByteCount withLength);
+    virtual IOByteCount writeBytes(IOByteCount offset, const void * bytes, IOByteCount withLength);
+    
+    SInt32 getWireCount() const { return wireCount; }
+    
+protected:
+    UInt8             * bytes;
+    IOByteCount         length;
+    IODirection         direction;
+    volatile SInt32     wireCount;
+};
+
+#endif /* SIM_IOKIT_IOMEMORYDESCRIPTOR_H */
@@ -0,0 +1,31 @@
+//
+//  IOMultiMemoryDescriptor.h
+//  VoodooUSBProvider Simulator
+//
+
+#ifndef SIM_IOKIT_IOMULTIMEMORYDESCRIPTOR_H
+#define SIM_IOKIT_IOMULTIMEMORYDESCRIPTOR_H
+
+#include <IOKit/IOMemoryDescriptor.h>
+
+class IOMultiMemoryDescriptor : public IOMemoryDescriptor
+{
+public:
+    static IOMultiMemoryDescriptor * withDescriptors(IOMemoryDescriptor ** descriptors, UInt32 withCount, IODirection withDirection, bool asReference = false);
+    
+    virtual bool initWithDescriptors(IOMemoryDescriptor ** descriptors, UInt32 withCount, IODirection withDirection, bool asReference = false);
+    
+    virtual IOReturn    prepare(IODirection forDirection = kIODirectionNone) override;
+    virtual IOReturn    complete(IODirection forDirection = kIODirectionNone) override;
+    virtual IOByteCount readBytes(IOByteCount offset, void * bytes, IOByteCount withLength) override;
+    virtual IOByteCount writeBytes(IOByteCount offset, const void * bytes, IOByteCount withLength) override;
+    
+protected:
+    virtual void free() override;
+    
+private:
+    IOMemoryDescriptor ** descriptors;
+    UInt32                count;
+};
+
+#endif /* SIM_IOKIT_IOMULTIMEMORYDESCRIPTOR_H */
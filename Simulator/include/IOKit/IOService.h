@@ -0,0 +1,81 @@
+//
+//  IOService.h
+//  VoodooUSBProvider Simulator
+//
+//  Stand-in for <IOKit/IOService.h>: a provider/client tree with exclusive open, and a
+//  property table. The simulator attaches objects explicitly; matching is limited to looking
+//  up registered services by registry entry ID, properties and parent.
+//
+
+#ifndef SIM_IOKIT_IOSERVICE_H
+#define SIM_IOKIT_IOSERVICE_H
+
+#include <IOKit/IOLib.h>
+#include <libkern/c++/OSArray.h>
+#include <libkern/c++/OSData.h>
+#include <libkern/c++/OSDictionary.h>
+#include <libkern/c++/OSNumber.h>
+
+struct IORegistryPlane
+{
+    const char * name;
+};
+
+extern const IORegistryPlane * gIOServicePlane;
+
+#define kIORegistryEntryIDKey   "IORegistryEntryID"
+#define kIOPropertyMatchKey     "IOPropertyMatch"
+#define kIOParentMatchKey       "IOParentMatch"
+
+class IOService : public OSObject
+{
+public:
+    virtual bool init(OSDictionary * dictionary = NULL);
+    
+    virtual bool start(IOService * provider);
+    virtual void stop(IOService * provider);
+    virtual bool attach(IOService * provider);
+    virtual void detach(IOService * provider);
+    virtual bool terminate(IOOptionBits options = 0);
+    bool         isInactive() const { return inactive; }
+    
+    virtual bool open(IOService * forClient, IOOptionBits options = 0, void * arg = 0);
+    virtual void close(IOService * forClient, IOOptionBits options = 0);
+    virtual bool isOpen(const IOService * forClient = 0) const;
+    
+    IOService  * getProvider() const { return provider; }
+    uint64_t     getRegistryEntryID() const { return registryEntryID; }
+    
+    virtual void registerService(IOOptionBits options = 0);
+    static OSDictionary * registryEntryIDMatching(uint64_t entryID, OSDictionary * table = NULL);
+    static IOService    * waitForMatchingService(OSDictionary * matching, uint64_t timeout = UINT64_MAX);
+    
+    OSIterator * getChildIterator(const IORegistryPlane * plane) const;
+    OSIterator * getClientIterator() const { return getChildIterator(gIOServicePlane); }
+    
+    bool         setProperty(const char * aKey, OSObject * anObject);
+    bool         setProperty(const char * aKey, unsigned long long aValue, unsigned int aNumberOfBits);
+    bool         setProperty(const char * aKey, bool aBoolean);
+    bool         setProperty(const char * aKey, const char * aString);
+    void         removeProperty(const char * aKey);
+    OSObject   * getProperty(const char * aKey) const;
+    OSObject   * copyProperty(const char * aKey) const;
+    
+protected:
+    virtual void free() override;
+    
+private:
+    bool                simMatches(OSDictionary * matching) const;
+    
+    IOService         * provider;
+    IOService         * simNextRegistered;
+    uint64_t            registryEntryID;
+    bool                registered;
+    OSArray           * children;
+    OSDictionary      * properties;
+    IOLock            * serviceLock;
+    const IOService   * openClient;
+    bool                inactive;
+};
+
+#endif /* SIM_IOKIT_IOSERVICE_H */
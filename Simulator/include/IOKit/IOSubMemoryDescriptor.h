@@ -0,0 +1,31 @@
+//
+//  IOSubMemoryDescriptor.h
+//  VoodooUSBProvider Simulator
+//
+
+#ifndef SIM_IOKIT_IOSUBMEMORYDESCRIPTOR_H
+#define SIM_IOKIT_IOSUBMEMORYDESCRIPTOR_H
+
+#include <IOKit/IOMemoryDescriptor.h>
+
+class IOSubMemoryDescriptor : public IOMemoryDescriptor
+{
+public:
+    static IOSubMemoryDescriptor * withSubRange(IOMemoryDescriptor * of, IOByteCount offset, IOByteCount length, IOOptionBits options);
+    
+    virtual bool initSubRange(IOMemoryDescriptor * parent, IOByteCount offset, IOByteCount length, IODirection withDirection);
+    
+    virtual IOReturn    prepare(IODirection forDirection = kIODirectionNone) override;
+    virtual IOReturn    complete(IODirection forDirection = kIODirectionNone) override;
+    virtual IOByteCount readBytes(IOByteCount offset, void * bytes, IOByteCount withLength) override;
+    virtual IOByteCount writeBytes(IOByteCount offset, const void * bytes, IOByteCount withLength) override;
+    
+protected:
+    virtual void free() override;
+    
+private:
+    IOMemoryDescriptor * parent;
+    IOByteCount          start;
+};
+
+#endif /* SIM_IOKIT_IOSUBMEMORYDESCRIPTOR_H */
@@ -0,0 +1,58 @@
+//
+//  IOTypes.h
+//  VoodooUSBProvider Simulator
+//
+//  Stand-in for <IOKit/IOTypes.h> on a 64-bit userspace host.
+//
+
+#ifndef SIM_IOKIT_IOTYPES_H
+#define SIM_IOKIT_IOTYPES_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <IOKit/IOReturn.h>
+
+typedef uint8_t             UInt8;
+typedef uint16_t            UInt16;
+typedef uint32_t            UInt32;
+typedef uint64_t            UInt64;
+typedef int8_t              SInt8;
+typedef int16_t             SInt16;
+typedef int32_t             SInt32;
+typedef int64_t             SInt64;
+typedef bool                Boolean;
+
+typedef UInt32              IOOptionBits;
+typedef UInt64              IOByteCount;
+typedef UInt64              IOVirtualAddress;
+typedef UInt64              IOPhysicalAddress;
+typedef UInt64              IOItemCount;
+typedef UInt64              AbsoluteTime;
+typedef UInt64              mach_vm_address_t;
+typedef UInt64              mach_vm_size_t;
+typedef int                 wait_result_t;
+typedef void *              task_t;
+
+extern task_t               kernel_task;
+
+enum
+{
+    kIODirectionNone        = 0x0,
+    kIODirectionIn          = 0x1,      /* device to memory */
+    kIODirectionOut         = 0x2,      /* memory to device */
+    kIODirectionOutIn       = kIODirectionOut | kIODirectionIn,
+    kIODirectionInOut       = kIODirectionIn  | kIODirectionOut,
+};
+typedef IOOptionBits        IODirection;
+
+#define THREAD_UNINT            0
+#define THREAD_INTERRUPTIBLE    1
+#define THREAD_ABORTSAFE        2
+
+#define THREAD_AWAKENED         0
+#define THREAD_TIMED_OUT        1
+#define THREAD_INTERRUPTED      2
+#define THREAD_RESTART          3
+
+#endif /* SIM_IOKIT_IOTYPES_H */
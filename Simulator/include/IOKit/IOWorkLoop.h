@@ -0,0 +1,48 @@
+//
+//  IOWorkLoop.h
+//  VoodooUSBProvider Simulator
+//
+//  Stand-in for <IOKit/IOWorkLoop.h>. Only the gate is modelled: a recursive lock that
+//  event sources close around their actions, and that commandSleep() drops while asleep.
+//  There is no work loop thread; nothing in the provider signals one.
+//
+
+#ifndef SIM_IOKIT_IOWORKLOOP_H
+#define SIM_IOKIT_IOWORKLOOP_H
+
+#include <IOKit/IOLib.h>
+#include <libkern/c++/OSObject.h>
+#include <pthread.h>
+
+class IOEventSource;
+
+class IOWorkLoop : public OSObject
+{
+public:
+    static IOWorkLoop * workLoop();
+    
+    virtual IOReturn addEventSource(IOEventSource * newEvent);
+    virtual IOReturn removeEventSource(IOEventSource * toRemove);
+    
+    virtual void closeGate();
+    virtual void openGate();
+    virtual bool tryCloseGate();
+    virtual bool inGate() const;
+    
+    /* Called with the gate closed; the gate is reopened for the duration of the sleep */
+    virtual int  sleepGate(void * event, AbsoluteTime deadline, UInt32 interuptibleType);
+    virtual void wakeupGate(void * event, bool oneThread);
+    
+protected:
+    virtual bool init() override;
+    virtual void free() override;
+    
+private:
+    pthread_mutex_t     gateMutex;
+    pthread_cond_t      gateCondition;
+    volatile pthread_t  gateOwner;
+    volatile UInt32     gateCount;
+    bool                gateInitialized;
+};
+
+#endif /* SIM_IOKIT_IOWORKLOOP_H */
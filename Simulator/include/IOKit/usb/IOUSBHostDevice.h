@@ -0,0 +1,52 @@
+//
+//  IOUSBHostDevice.h
+//  VoodooUSBProvider Simulator
+//
+//  Stand-in for <IOKit/usb/IOUSBHostDevice.h>. simStart() builds the descriptors from an
+//  IOUSBHostSimConfig, starts the simulated controller and attaches one interface per
+//  interface number, allocated through the factory set with IOUSBHostSimSetFactories().
+//
+
+#ifndef SIM_IOKIT_USB_IOUSBHOSTDEVICE_H
+#define SIM_IOKIT_USB_IOUSBHOSTDEVICE_H
+
+#include <IOKit/usb/IOUSBHostPipe.h>
+
+struct IOUSBHostSimConfig;
+class  IOUSBHostSimModel;
+
+class IOUSBHostDevice : public IOService
+{
+public:
+    virtual IOReturn deviceRequest(IOService * forClient, StandardUSB::DeviceRequest & request, void * dataBuffer, uint32_t & bytesTransferred, uint32_t completionTimeoutMs = kUSBHostStandardRequestCompletionTimeout);
+    virtual IOReturn deviceRequest(IOService * forClient, StandardUSB::DeviceRequest & request, IOMemoryDescriptor * dataBuffer, uint32_t & bytesTransferred, uint32_t completionTimeoutMs = kUSBHostStandardRequestCompletionTimeout);
+    virtual IOReturn deviceRequest(IOService * forClient, StandardUSB::DeviceRequest & request, void * dataBuffer, IOUSBHostCompletion * completion, uint32_t completionTimeoutMs = kUSBHostStandardRequestCompletionTimeout);
+    virtual IOReturn deviceRequest(IOService * forClient, StandardUSB::DeviceRequest & request, IOMemoryDescriptor * dataBuffer, IOUSBHostCompletion * completion, uint32_t completionTimeoutMs = kUSBHostStandardRequestCompletionTimeout);
+    
+    const StandardUSB::DeviceDescriptor        * getDeviceDescriptor();
+    const StandardUSB::ConfigurationDescriptor * getConfigurationDescriptor(uint8_t index);
+    const StandardUSB::ConfigurationDescriptor * getConfigurationDescriptor();
+    const StandardUSB::StringDescriptor        * getStringDescriptor(uint8_t index, uint16_t languageID = StandardUSB::kLanguageIDEnglishUS);
+    
+    virtual IOReturn setConfiguration(uint8_t bConfigurationValue, bool matchInterfaces = true);
+    virtual IOReturn reset();
+    
+    /* Simulator only */
+    bool simStart(const IOUSBHostSimConfig & config, IOUSBHostSimModel * model);
+    void simStop();
+    IOUSBHostSimController * simGetController() const { return simController; }
+    
+protected:
+    virtual void free() override;
+    
+private:
+    void simAttachInterfaces();
+    void simDetachInterfaces();
+    
+    IOUSBHostSimController          * simController;
+    StandardUSB::DeviceDescriptor     deviceDescriptor;
+    UInt8                           * configuration;
+    UInt8                             currentConfiguration;
+};
+
+#endif /* SIM_IOKIT_USB_IOUSBHOSTDEVICE_H */
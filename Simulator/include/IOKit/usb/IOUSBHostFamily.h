@@ -0,0 +1,55 @@
+//
+//  IOUSBHostFamily.h
+//  VoodooUSBProvider Simulator
+//
+//  Stand-in for <IOKit/usb/IOUSBHostFamily.h>.
+//
+
+#ifndef SIM_IOKIT_USB_IOUSBHOSTFAMILY_H
+#define SIM_IOKIT_USB_IOUSBHOSTFAMILY_H
+
+#include <IOKit/IOService.h>
+#include <IOKit/IOBufferMemoryDescriptor.h>
+#include <IOKit/usb/USB.h>
+
+using namespace StandardUSB;
+
+#define kUSBHostStandardRequestCompletionTimeout    5000
+#define kUSBHostClassRequestCompletionTimeout       5000
+#define kUSBHostVendorRequestCompletionTimeout      5000
+
+/* Completions run on the simulated controller thread, which stands in for the family work loop */
+typedef void (*IOUSBHostCompletionAction)(void * owner, void * parameter, IOReturn status, uint32_t bytesTransferred);
+
+struct IOUSBHostCompletion
+{
+    void                        * owner;
+    IOUSBHostCompletionAction     action;
+    void                        * parameter;
+};
+
+struct IOUSBHostIsochronousFrame
+{
+    IOReturn                      status;
+    uint32_t                      requestCount;
+    uint32_t                      completeCount;
+    uint32_t                      reserved;
+    uint64_t                      timeStamp;
+} __attribute__((packed));
+
+typedef void (*IOUSBHostIsochronousCompletionAction)(void * owner, void * parameter, IOReturn status, IOUSBHostIsochronousFrame * pFrames);
+
+struct IOUSBHostIsochronousCompletion
+{
+    void                                  * owner;
+    IOUSBHostIsochronousCompletionAction    action;
+    void                                  * parameter;
+};
+
+enum
+{
+    kAbortAsynchronous          = 0,
+    kAbortSynchronous           = 1,
+};
+
+#endif /* SIM_IOKIT_USB_IOUSBHOSTFAMILY_H */
@@ -0,0 +1,44 @@
+//
+//  IOUSBHostInterface.h
+//  VoodooUSBProvider Simulator
+//
+//  Stand-in for <IOKit/usb/IOUSBHostInterface.h>. Pipes of the current alternate setting
+//  are allocated on first copyPipe() and dropped when the alternate setting changes.
+//
+
+#ifndef SIM_IOKIT_USB_IOUSBHOSTINTERFACE_H
+#define SIM_IOKIT_USB_IOUSBHOSTINTERFACE_H
+
+#include <IOKit/usb/IOUSBHostDevice.h>
+
+#define kIOUSBHostInterfaceMaxPipes     32
+
+class IOUSBHostInterface : public IOService
+{
+public:
+    const StandardUSB::InterfaceDescriptor     * getInterfaceDescriptor();
+    const StandardUSB::ConfigurationDescriptor * getConfigurationDescriptor();
+    
+    virtual IOReturn        selectAlternateSetting(uint8_t bAlternateSetting);
+    virtual IOUSBHostPipe * copyPipe(uint8_t address);
+    
+    IOUSBHostDevice * getDevice() const { return simDevice; }
+    
+    virtual void close(IOService * forClient, IOOptionBits options = 0) override;
+    
+    /* Simulator only */
+    void simInit(IOUSBHostDevice * device, UInt8 interfaceNumber);
+    void simReleasePipes();
+    
+protected:
+    virtual void free() override;
+    
+private:
+    IOUSBHostDevice                         * simDevice;
+    const StandardUSB::InterfaceDescriptor  * interfaceDescriptor;
+    UInt8                                     interfaceNumber;
+    IOUSBHostPipe                           * pipes[kIOUSBHostInterfaceMaxPipes];
+    IOLock                                  * pipeLock;
+};
+
+#endif /* SIM_IOKIT_USB_IOUSBHOSTINTERFACE_H */
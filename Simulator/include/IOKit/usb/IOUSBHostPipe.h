@@ -0,0 +1,38 @@
+//
+//  IOUSBHostPipe.h
+//  VoodooUSBProvider Simulator
+//
+//  Stand-in for <IOKit/usb/IOUSBHostPipe.h>. Transfers are handed to the simulated
+//  controller of the owning device, which completes them on its own thread.
+//
+
+#ifndef SIM_IOKIT_USB_IOUSBHOSTPIPE_H
+#define SIM_IOKIT_USB_IOUSBHOSTPIPE_H
+
+#include <IOKit/usb/IOUSBHostFamily.h>
+
+class IOUSBHostSimController;
+class IOUSBHostInterface;
+
+class IOUSBHostPipe : public OSObject
+{
+public:
+    virtual IOReturn io(IOMemoryDescriptor * dataBuffer, uint32_t dataBufferLength, IOUSBHostCompletion * completion, uint32_t completionTimeoutMs = 0);
+    virtual IOReturn io(IOMemoryDescriptor * dataBuffer, uint32_t dataBufferLength, uint32_t & bytesTransferred, uint32_t completionTimeoutMs = 0);
+    virtual IOReturn io(IOMemoryDescriptor * dataBuffer, IOUSBHostIsochronousFrame * frameList, uint32_t frameListCount, uint64_t firstFrameNumber = 0, IOUSBHostIsochronousCompletion * completion = NULL);
+    
+    virtual IOReturn abort(IOOptionBits options = kAbortAsynchronous, IOReturn withError = kIOReturnAborted, IOService * forClient = NULL);
+    virtual IOReturn clearStall(bool withRequest);
+    
+    const StandardUSB::EndpointDescriptor * getEndpointDescriptor() { return &endpointDescriptor; }
+    
+    /* Simulator only: bind a freshly allocated pipe to its endpoint */
+    void simInit(IOUSBHostSimController * controller, const StandardUSB::EndpointDescriptor * descriptor);
+    IOUSBHostSimController * simGetController() const { return simController; }
+    
+private:
+    IOUSBHostSimController          * simController;
+    StandardUSB::EndpointDescriptor   endpointDescriptor;
+};
+
+#endif /* SIM_IOKIT_USB_IOUSBHOSTPIPE_H */
@@ -0,0 +1,204 @@
+//
+//  StandardUSB.h
+//  VoodooUSBProvider Simulator
+//
+//  Stand-in for <IOKit/usb/StandardUSB.h>: chapter 9 descriptors and the helpers
+//  IOUSBHostFamily offers to walk them.
+//
+
+#ifndef SIM_IOKIT_USB_STANDARDUSB_H
+#define SIM_IOKIT_USB_STANDARDUSB_H
+
+#include <IOKit/IOTypes.h>
+
+#define USBToHost16(x)      ((UInt16) (x))
+#define HostToUSB16(x)      ((UInt16) (x))
+#define USBToHost32(x)      ((UInt32) (x))
+#define HostToUSB32(x)      ((UInt32) (x))
+#define USBToHostWord(x)    USBToHost16(x)
+#define HostToUSBWord(x)    HostToUSB16(x)
+#define USBToHostLong(x)    USBToHost32(x)
+#define HostToUSBLong(x)    HostToUSB32(x)
+
+namespace StandardUSB
+{
+    enum
+    {
+        kDescriptorSize                     = 2,
+    };
+    
+    enum tDescriptorType
+    {
+        kDescriptorTypeDevice               = 1,
+        kDescriptorTypeConfiguration        = 2,
+        kDescriptorTypeString               = 3,
+        kDescriptorTypeInterface            = 4,
+        kDescriptorTypeEndpoint             = 5,
+    };
+    
+    enum tDeviceRequestDirection
+    {
+        kRequestDirectionOut                = 0,
+        kRequestDirectionIn                 = 1,
+    };
+    
+    enum tDeviceRequestType
+    {
+        kRequestTypeStandard                = 0,
+        kRequestTypeClass                   = 1,
+        kRequestTypeVendor                  = 2,
+    };
+    
+    enum tDeviceRequestRecipient
+    {
+        kRequestRecipientDevice             = 0,
+        kRequestRecipientInterface          = 1,
+        kRequestRecipientEndpoint           = 2,
+        kRequestRecipientOther              = 3,
+    };
+    
+    enum tDeviceRequest
+    {
+        kDeviceRequestGetStatus             = 0,
+        kDeviceRequestClearFeature          = 1,
+        kDeviceRequestSetFeature            = 3,
+        kDeviceRequestSetAddress            = 5,
+        kDeviceRequestGetDescriptor         = 6,
+        kDeviceRequestSetDescriptor         = 7,
+        kDeviceRequestGetConfiguration      = 8,
+        kDeviceRequestSetConfiguration      = 9,
+        kDeviceRequestGetInterface          = 10,
+        kDeviceRequestSetInterface          = 11,
+    };
+    
+    enum tEndpointType
+    {
+        kEndpointTypeControl                = 0,
+        kEndpointTypeIsochronous            = 1,
+        kEndpointTypeBulk                   = 2,
+        kEndpointTypeInterrupt              = 3,
+    };
+    
+    enum tEndpointDirection
+    {
+        kEndpointDirectionOut               = 0,
+        kEndpointDirectionIn                = 1,
+        kEndpointDirectionUnknown           = 2,
+    };
+    
+    enum
+    {
+        kLanguageIDEnglishUS                = 0x0409,
+    };
+    
+    struct Descriptor
+    {
+        UInt8     bLength;
+        UInt8     bDescriptorType;
+    } __attribute__((packed));
+    
+    struct DeviceDescriptor : public Descriptor
+    {
+        UInt16    bcdUSB;
+        UInt8     bDeviceClass;
+        UInt8     bDeviceSubClass;
+        UInt8     bDeviceProtocol;
+        UInt8     bMaxPacketSize0;
+        UInt16    idVendor;
+        UInt16    idProduct;
+        UInt16    bcdDevice;
+        UInt8     iManufacturer;
+        UInt8     iProduct;
+        UInt8     iSerialNumber;
+        UInt8     bNumConfigurations;
+    } __attribute__((packed));
+    
+    struct ConfigurationDescriptor : public Descriptor
+    {
+        UInt16    wTotalLength;
+        UInt8     bNumInterfaces;
+        UInt8     bConfigurationValue;
+        UInt8     iConfiguration;
+        UInt8     bmAttributes;
+        UInt8     MaxPower;
+    } __attribute__((packed));
+    
+    struct InterfaceDescriptor : public Descriptor
+    {
+        UInt8     bInterfaceNumber;
+        UInt8     bAlternateSetting;
+        UInt8     bNumEndpoints;
+        UInt8     bInterfaceClass;
+        UInt8     bInterfaceSubClass;
+        UInt8     bInterfaceProtocol;
+        UInt8     iInterface;
+    } __attribute__((packed));
+    
+    struct EndpointDescriptor : public Descriptor
+    {
+        UInt8     bEndpointAddress;
+        UInt8     bmAttributes;
+        UInt16    wMaxPacketSize;
+        UInt8     bInterval;
+    } __attribute__((packed));
+    
+    struct StringDescriptor : public Descriptor
+    {
+        UInt8     bString[1];
+    } __attribute__((packed));
+    
+    struct DeviceRequest
+    {
+        UInt8     bmRequestType;
+        UInt8     bRequest;
+        UInt16    wValue;
+        UInt16    wIndex;
+        UInt16    wLength;
+    } __attribute__((packed));
+    
+    static inline UInt8 makeDeviceRequestbmRequestType(tDeviceRequestDirection direction, tDeviceRequestType type, tDeviceRequestRecipient recipient)
+    {
+        return (UInt8) (((direction & 0x1) << 7) | ((type & 0x3) << 5) | (recipient & 0x1f));
+    }
+    
+    const Descriptor * getNextDescriptor(const ConfigurationDescriptor * configurationDescriptor, const Descriptor * currentDescriptor);
+    const Descriptor * getNextDescriptorWithType(const ConfigurationDescriptor * configurationDescriptor, const Descriptor * currentDescriptor, const UInt8 type);
+    const InterfaceDescriptor * getNextInterfaceDescriptor(const ConfigurationDescriptor * configurationDescriptor, const Descriptor * currentDescriptor);
+    const EndpointDescriptor * getNextEndpointDescriptor(const ConfigurationDescriptor * configurationDescriptor, const InterfaceDescriptor * interfaceDescriptor, const Descriptor * currentDescriptor);
+    
+    static inline UInt8 getEndpointAddress(const EndpointDescriptor * descriptor)
+    {
+        return descriptor->bEndpointAddress;
+    }
+    
+    static inline UInt8 getEndpointNumber(const EndpointDescriptor * descriptor)
+    {
+        return descriptor->bEndpointAddress & 0x0f;
+    }
+    
+    static inline UInt8 getEndpointType(const EndpointDescriptor * descriptor)
+    {
+        return descriptor->bmAttributes & 0x03;
+    }
+    
+    static inline UInt8 getEndpointDirection(const EndpointDescriptor * descriptor)
+    {
+        if (getEndpointType(descriptor) == kEndpointTypeControl)
+        {
+            return kEndpointDirectionUnknown;
+        }
+        return (descriptor->bEndpointAddress & 0x80) ? kEndpointDirectionIn : kEndpointDirectionOut;
+    }
+    
+    static inline UInt16 getEndpointMaxPacketSize(const EndpointDescriptor * descriptor)
+    {
+        return USBToHost16(descriptor->wMaxPacketSize) & 0x7ff;
+    }
+    
+    static inline UInt8 getEndpointBurstSize(const EndpointDescriptor * descriptor)
+    {
+        return (UInt8) (((USBToHost16(descriptor->wMaxPacketSize) >> 11) & 0x3) + 1);
+    }
+}
+
+#endif /* SIM_IOKIT_USB_STANDARDUSB_H */
@@ -0,0 +1,61 @@
+//
+//  USB.h
+//  VoodooUSBProvider Simulator
+//
+//  Stand-in for <IOKit/usb/USB.h>: the family-independent constants and macros.
+//
+
+#ifndef SIM_IOKIT_USB_USB_H
+#define SIM_IOKIT_USB_USB_H
+
+#include <IOKit/usb/StandardUSB.h>
+
+enum
+{
+    kUSBControl                 = 0,
+    kUSBIsoc                    = 1,
+    kUSBBulk                    = 2,
+    kUSBInterrupt               = 3,
+    kUSBAnyType                 = 0xFF,
+};
+
+enum
+{
+    kUSBOut                     = 0,
+    kUSBIn                      = 1,
+    kUSBNone                    = 2,
+    kUSBAnyDirn                 = 3,
+};
+
+enum
+{
+    kUSBStandard                = 0,
+    kUSBClass                   = 1,
+    kUSBVendor                  = 2,
+};
+
+enum
+{
+    kUSBDevice                  = 0,
+    kUSBInterface               = 1,
+    kUSBEndpoint                = 2,
+    kUSBOther                   = 3,
+};
+
+enum
+{
+    kUSBRqDirnShift             = 7,
+    kUSBRqDirnMask              = 1,
+    kUSBRqTypeShift             = 5,
+    kUSBRqTypeMask              = 3,
+    kUSBRqRecipientMask         = 0x1F,
+};
+
+#define USBmakebmRequestType(direction, type, recipient)                                    \
+    ((((direction) & kUSBRqDirnMask) << kUSBRqDirnShift) |                                  \
+     (((type) & kUSBRqTypeMask) << kUSBRqTypeShift) |                                       \
+     ((recipient) & kUSBRqRecipientMask))
+
+#define kUSBDefaultControlCompletionTimeoutMS       5000
+
+#endif /* SIM_IOKIT_USB_USB_H */
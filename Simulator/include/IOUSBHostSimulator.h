@@ -0,0 +1,223 @@
+//
+//  IOUSBHostSimulator.h
+//  VoodooUSBProvider Simulator
+//
+//  The simulated USB controller behind the IOUSBHost* stand-ins.
+//
+//  Every device owns one controller thread. Transfers are queued per endpoint and
+//  finish back to back on the "bus" (each endpoint is busy until its previous transfer
+//  is done), then their completion is delivered completionLatencyNS later on the
+//  controller thread, the way host controller interrupts and the family work loop
+//  would deliver it. IN endpoints only complete once the device model has data for them.
+//
+
+#ifndef IOUSBHostSimulator_h
+#define IOUSBHostSimulator_h
+
+#include <IOKit/usb/IOUSBHostInterface.h>
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+#define kIOUSBHostSimMaxAlternateSettings   8
+
+struct IOUSBHostSimConfig
+{
+    UInt16      vendorID;
+    UInt16      productID;
+    UInt16      bcdDevice;
+    const char * manufacturer;
+    const char * product;
+    const char * serialNumber;
+
+    UInt64      controlLatencyNS;           /* setup to status stage of a control transfer */
+    UInt64      transferLatencyNS;          /* fixed cost of a bulk / interrupt / isochronous transfer */
+    UInt64      packetLatencyNS;            /* added for every max-size packet moved */
+    UInt64      completionLatencyNS;        /* transfer done on the bus to its completion being called */
+    UInt64      hciResponseLatencyNS;       /* HCI command accepted to its event queued on the interrupt endpoint */
+    UInt64      isochronousFrameNS;         /* one isochronous frame, 1 ms at full speed */
+
+    UInt16      interruptMaxPacketSize;     /* 16 on most Bluetooth controllers */
+    UInt16      bulkMaxPacketSize;          /* 64 full speed, 512 high speed */
+    UInt8       isochronousSettings;        /* alternate settings on interface 1, up to kIOUSBHostSimMaxAlternateSettings */
+    UInt16      isochronousMaxPacketSize[kIOUSBHostSimMaxAlternateSettings];
+
+    UInt32      failEvery;                  /* every Nth transfer on any pipe fails, 0 never */
+    IOReturn    injectedError;
+
+    UInt8       hciCommandCredits;          /* Num_HCI_Command_Packets returned in command events */
+    UInt32      qcaRomVersion;              /* returned by the QCA GETVERSION vendor request */
+};
+
+/* Bluetooth controller on interface 0 (0x81 interrupt, 0x82 bulk in, 0x02 bulk out) and SCO on interface 1 */
+IOUSBHostSimConfig IOUSBHostSimDefaultConfig();
+
+struct IOUSBHostSimStatistics
+{
+    UInt64      controlTransfers;
+    UInt64      dataTransfers;
+    UInt64      bytesIn;
+    UInt64      bytesOut;
+    UInt64      zeroLengthPackets;          /* bulk / interrupt OUT transfers that carried no data */
+    UInt64      injectedErrors;
+    UInt64      aborted;
+    UInt64      timeouts;
+    UInt64      stringFetches;
+    UInt64      hciCommands;
+    UInt32      peakOutstanding;            /* transfers queued on one endpoint at the same time */
+};
+
+class IOUSBHostSimController;
+
+/*
+ * Device side of the simulation. Called on the controller thread with no simulator lock held,
+ * so a model may queue IN data or events from inside these calls.
+ */
+class IOUSBHostSimModel
+{
+public:
+    virtual ~IOUSBHostSimModel() {}
+
+    /* Class and vendor control requests; IN requests fill data and set length to what was returned */
+    virtual IOReturn controlRequest(IOUSBHostSimController * controller, const StandardUSB::DeviceRequest & request, UInt8 * data, UInt32 & length);
+
+    /* Bulk, interrupt and isochronous OUT payloads */
+    virtual IOReturn dataOut(IOUSBHostSimController * controller, UInt8 address, const UInt8 * data, UInt32 length);
+};
+
+/*
+ * Answers every HCI command sent on the control endpoint with a Command Complete event carrying
+ * status 0, after hciResponseLatencyNS. Up to hciCommandCredits commands are worked on at once;
+ * each event returns the credits left. A handful of informational commands get plausible
+ * return parameters. ACL data written to 0x02 can be looped back to 0x82, and SCO data written
+ * to isochronous 0x03 back to 0x83.
+ * With aclCompletedPackets the model also behaves like the controller's ACL buffers: every packet
+ * is sent over the air in aclPacketNS, one after the other, and then returned with a Number Of
+ * Completed Packets event. Packets that arrive while all aclBufferPackets buffers are taken are
+ * counted in aclOverflows; a real controller would drop them.
+ * Vendor OUT requests are accepted and logged in order in vendorRequestsOut.
+ */
+class IOUSBHostSimBluetoothModel : public IOUSBHostSimModel
+{
+public:
+    IOUSBHostSimBluetoothModel() : aclLoopback(false), scoLoopback(false), aclCompletedPackets(false), aclPacketNS(100 * kMicrosecondScale),
+                                   aclBufferPackets(8), aclOverflows(0), commandsOutstanding(0), aclAirFree(0) {}
+
+    virtual IOReturn controlRequest(IOUSBHostSimController * controller, const StandardUSB::DeviceRequest & request, UInt8 * data, UInt32 & length) override;
+    virtual IOReturn dataOut(IOUSBHostSimController * controller, UInt8 address, const UInt8 * data, UInt32 length) override;
+
+    /* Return parameters after the status byte; override to model vendor commands */
+    virtual UInt32 commandReturnParameters(UInt16 opCode, const UInt8 * parameters, UInt8 parameterLength, UInt8 * returnParameters);
+
+    bool aclLoopback;
+    bool scoLoopback;
+
+    bool            aclCompletedPackets;
+    UInt64          aclPacketNS;
+    UInt16          aclBufferPackets;           /* reported by Read Buffer Size */
+    volatile UInt32 aclOverflows;
+
+    std::vector<UInt32> vendorRequestsOut;      /* wValue << 16 | wIndex of each vendor OUT request; read once the requests completed */
+
+private:
+    UInt32 commandsOutstanding;                 /* accepted, Command Complete not queued yet; controller thread only */
+    std::deque<UInt64> aclHeld;                 /* when each buffered packet is returned; controller thread only */
+    UInt64 aclAirFree;
+};
+
+typedef IOUSBHostInterface * (*IOUSBHostSimInterfaceFactory)();
+typedef IOUSBHostPipe      * (*IOUSBHostSimPipeFactory)();
+
+/* The provider classes derive from the stand-ins, so the simulator has to allocate them */
+void IOUSBHostSimSetFactories(IOUSBHostSimInterfaceFactory interfaceFactory, IOUSBHostSimPipeFactory pipeFactory);
+IOUSBHostInterface * IOUSBHostSimNewInterface();
+IOUSBHostPipe      * IOUSBHostSimNewPipe();
+
+class IOUSBHostSimController
+{
+public:
+    IOUSBHostSimController(IOUSBHostDevice * device, const IOUSBHostSimConfig & config, IOUSBHostSimModel * model);
+    ~IOUSBHostSimController();
+
+    void     stop();
+
+    /* Called by the stand-ins */
+    IOReturn submitControl(const StandardUSB::DeviceRequest & request, IOMemoryDescriptor * buffer, void * bytes, IOUSBHostCompletion * completion, uint32_t timeoutMS);
+    IOReturn submitControlSync(const StandardUSB::DeviceRequest & request, IOMemoryDescriptor * buffer, void * bytes, uint32_t & bytesTransferred, uint32_t timeoutMS);
+    IOReturn submitData(IOUSBHostPipe * pipe, IOMemoryDescriptor * buffer, uint32_t length, IOUSBHostCompletion * completion, uint32_t timeoutMS);
+    IOReturn submitDataSync(IOUSBHostPipe * pipe, IOMemoryDescriptor * buffer, uint32_t length, uint32_t & bytesTransferred, uint32_t timeoutMS);
+    IOReturn submitIsochronous(IOUSBHostPipe * pipe, IOMemoryDescriptor * buffer, IOUSBHostIsochronousFrame * frames, uint32_t frameCount, IOUSBHostIsochronousCompletion * completion);
+    IOReturn abort(IOUSBHostPipe * pipe, IOReturn withError);
+
+    /* Device model side: data the device will return on an IN endpoint */
+    void     queueInData(UInt8 address, const void * data, UInt32 length, UInt64 delayNS = 0);
+    void     queueEvent(const void * event, UInt32 length, UInt64 delayNS = 0);
+
+    /* Run fn on the controller thread delayNS from now */
+    void     schedule(UInt64 delayNS, std::function<void()> fn);
+    bool     isControllerThread() const;
+
+    const IOUSBHostSimConfig & getConfig() const { return config; }
+    void     getStatistics(IOUSBHostSimStatistics * statistics);
+    void     resetStatistics();
+    UInt64   getFrameNumber() const;
+
+private:
+    struct Transfer;
+    struct Endpoint;
+    struct Event
+    {
+        UInt64                  due;
+        UInt64                  sequence;
+        std::function<void()>   fn;
+
+        bool operator<(const Event & other) const
+        {
+            return due != other.due ? due > other.due : sequence > other.sequence;
+        }
+    };
+
+    typedef std::shared_ptr<Transfer> TransferRef;
+    
+    void     run();
+    void     scheduleLocked(UInt64 due, std::function<void()> fn);
+    Endpoint * endpointForLocked(UInt8 address, UInt8 type, UInt16 maxPacketSize);
+    UInt64   transferTime(const Endpoint * endpoint, UInt32 length) const;
+    bool     injectFailureLocked();
+    IOReturn submitLocked(const TransferRef & transfer, uint32_t timeoutMS);
+    void     pushInLocked(Endpoint * endpoint, std::vector<UInt8> && data);
+    void     matchInLocked(Endpoint * endpoint);
+    void     abortLocked(Endpoint * endpoint, IOReturn withError);
+    void     finishLocked(const TransferRef & transfer, IOReturn status, UInt32 bytes, UInt64 due);
+    void     deliver(const TransferRef & transfer);
+    void     handleControl(const TransferRef & transfer);
+    void     handleOut(const TransferRef & transfer);
+    IOReturn standardRequest(const StandardUSB::DeviceRequest & request, UInt8 * data, UInt32 & length);
+    IOReturn waitLocked(std::unique_lock<std::mutex> & guard, const TransferRef & transfer, uint32_t & bytesTransferred);
+
+    IOUSBHostDevice           * device;
+    IOUSBHostSimConfig          config;
+    IOUSBHostSimModel         * model;
+
+    mutable std::mutex          lock;
+    std::condition_variable     wake;           /* controller thread: new event */
+    std::condition_variable     syncWake;       /* synchronous callers: a transfer finished */
+    std::priority_queue<Event>  events;
+    UInt64                      sequence;
+    bool                        running;
+    std::thread                 thread;
+    UInt8                       configurationValue;
+
+    std::map<UInt8, Endpoint *> endpoints;
+    UInt64                      transferCount;
+    IOUSBHostSimStatistics      statistics;
+};
+
+#endif /* IOUSBHostSimulator_h */
@@ -0,0 +1,13 @@
+//
+//  cpu_number.h
+//  VoodooUSBProvider Simulator
+//
+//  Stand-in for <kern/cpu_number.h>; the CPU the calling thread runs on right now.
+//
+
+#ifndef SIM_KERN_CPU_NUMBER_H
+#define SIM_KERN_CPU_NUMBER_H
+
+int cpu_number(void);
+
+#endif /* SIM_KERN_CPU_NUMBER_H */
@@ -0,0 +1,32 @@
+//
+//  thread_call.h
+//  VoodooUSBProvider Simulator
+//
+//  Stand-in for <kern/thread_call.h>. Calls run on a shared pool of threads that grows
+//  while every thread is busy, so blocking calls do not hold up each other.
+//
+
+#ifndef SIM_KERN_THREAD_CALL_H
+#define SIM_KERN_THREAD_CALL_H
+
+#include <IOKit/IOTypes.h>
+
+typedef struct thread_call    * thread_call_t;
+typedef void                  * thread_call_param_t;
+typedef void (*thread_call_func_t)(thread_call_param_t param0, thread_call_param_t param1);
+
+thread_call_t thread_call_allocate(thread_call_func_t func, thread_call_param_t param0);
+bool          thread_call_free(thread_call_t call);
+
+/* True if the call was already pending, in which case it still runs only once */
+bool          thread_call_enter(thread_call_t call);
+bool          thread_call_enter1(thread_call_t call, thread_call_param_t param1);
+
+/* deadline is in mach_absolute_time() units; entering a pending call moves its deadline */
+bool          thread_call_enter_delayed(thread_call_t call, uint64_t deadline);
+
+bool          thread_call_cancel(thread_call_t call);
+bool          thread_call_cancel_wait(thread_call_t call);
+bool          thread_call_isactive(thread_call_t call);
+
+#endif /* SIM_KERN_THREAD_CALL_H */
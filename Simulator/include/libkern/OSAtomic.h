@@ -0,0 +1,74 @@
+//
+//  OSAtomic.h
+//  VoodooUSBProvider Simulator
+//
+//  Stand-in for <libkern/OSAtomic.h>. Like the kernel versions, the arithmetic
+//  operations return the value held before the operation and are fully ordered.
+//
+
+#ifndef SIM_LIBKERN_OSATOMIC_H
+#define SIM_LIBKERN_OSATOMIC_H
+
+#include <IOKit/IOTypes.h>
+
+static inline SInt32 OSAddAtomic(SInt32 amount, volatile SInt32 * address)
+{
+    return __atomic_fetch_add(address, amount, __ATOMIC_SEQ_CST);
+}
+
+static inline SInt32 OSIncrementAtomic(volatile SInt32 * address)
+{
+    return OSAddAtomic(1, address);
+}
+
+static inline SInt32 OSDecrementAtomic(volatile SInt32 * address)
+{
+    return OSAddAtomic(-1, address);
+}
+
+static inline SInt64 OSAddAtomic64(SInt64 amount, volatile SInt64 * address)
+{
+    return __atomic_fetch_add(address, amount, __ATOMIC_SEQ_CST);
+}
+
+static inline SInt64 OSIncrementAtomic64(volatile SInt64 * address)
+{
+    return OSAddAtomic64(1, address);
+}
+
+static inline SInt64 OSDecrementAtomic64(volatile SInt64 * address)
+{
+    return OSAddAtomic64(-1, address);
+}
+
+static inline UInt32 OSBitOrAtomic(UInt32 mask, volatile UInt32 * address)
+{
+    return __atomic_fetch_or(address, mask, __ATOMIC_SEQ_CST);
+}
+
+static inline UInt32 OSBitAndAtomic(UInt32 mask, volatile UInt32 * address)
+{
+    return __atomic_fetch_and(address, mask, __ATOMIC_SEQ_CST);
+}
+
+static inline bool OSCompareAndSwap(UInt32 oldValue, UInt32 newValue, volatile UInt32 * address)
+{
+    return __atomic_compare_exchange_n(address, &oldValue, newValue, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+static inline bool OSCompareAndSwap64(UInt64 oldValue, UInt64 newValue, volatile UInt64 * address)
+{
+    return __atomic_compare_exchange_n(address, &oldValue, newValue, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+static inline bool OSCompareAndSwapPtr(void * oldValue, void * newValue, void * volatile * address)
+{
+    return __atomic_compare_exchange_n(address, &oldValue, newValue, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+static inline void OSMemoryBarrier()
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+#endif /* SIM_LIBKERN_OSATOMIC_H */
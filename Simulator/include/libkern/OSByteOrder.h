@@ -0,0 +1,49 @@
+//
+//  OSByteOrder.h
+//  VoodooUSBProvider Simulator
+//
+//  Stand-in for <libkern/OSByteOrder.h> on a little-endian host.
+//
+
+#ifndef SIM_LIBKERN_OSBYTEORDER_H
+#define SIM_LIBKERN_OSBYTEORDER_H
+
+#include <string.h>
+#include <IOKit/IOTypes.h>
+
+static inline UInt16 OSReadLittleInt16(const volatile void * base, uintptr_t offset)
+{
+    UInt16 value;
+    memcpy(&value, (const UInt8 *) base + offset, sizeof(value));
+    return value;
+}
+
+static inline UInt32 OSReadLittleInt32(const volatile void * base, uintptr_t offset)
+{
+    UInt32 value;
+    memcpy(&value, (const UInt8 *) base + offset, sizeof(value));
+    return value;
+}
+
+static inline void OSWriteLittleInt16(volatile void * base, uintptr_t offset, UInt16 value)
+{
+    memcpy((UInt8 *) base + offset, &value, sizeof(value));
+}
+
+static inline void OSWriteLittleInt32(volatile void * base, uintptr_t offset, UInt32 value)
+{
+    memcpy((UInt8 *) base + offset, &value, sizeof(value));
+}
+
+#define OSSwapLittleToHostInt16(x)  ((UInt16) (x))
+#define OSSwapHostToLittleInt16(x)  ((UInt16) (x))
+#define OSSwapLittleToHostInt32(x)  ((UInt32) (x))
+#define OSSwapHostToLittleInt32(x)  ((UInt32) (x))
+#define OSSwapHostToBigInt16(x)     __builtin_bswap16(x)
+#define OSSwapHostToBigInt32(x)     __builtin_bswap32(x)
+#define OSSwapHostToBigInt64(x)     __builtin_bswap64(x)
+#define OSSwapBigToHostInt16(x)     __builtin_bswap16(x)
+#define OSSwapBigToHostInt32(x)     __builtin_bswap32(x)
+#define OSSwapBigToHostInt64(x)     __builtin_bswap64(x)
+
+#endif /* SIM_LIBKERN_OSBYTEORDER_H */
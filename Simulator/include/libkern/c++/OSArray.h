@@ -0,0 +1,47 @@
+//
+//  OSArray.h
+//  VoodooUSBProvider Simulator
+//
+
+#ifndef SIM_LIBKERN_OSARRAY_H
+#define SIM_LIBKERN_OSARRAY_H
+
+#include <libkern/c++/OSIterator.h>
+
+class OSArray : public OSObject
+{
+public:
+    static OSArray * withCapacity(unsigned int capacity);
+    
+    bool         setObject(const OSMetaClassBase * anObject);
+    OSObject   * getObject(unsigned int index) const;
+    void         removeObject(unsigned int index);
+    unsigned int getCount() const { return count; }
+    
+protected:
+    virtual void free() override;
+    
+private:
+    OSObject  ** objects;
+    unsigned int count;
+    unsigned int capacity;
+};
+
+/* Iterates over a snapshot of the array taken at creation */
+class OSCollectionIterator : public OSIterator
+{
+public:
+    static OSCollectionIterator * withCollection(const OSArray * collection);
+    
+    virtual void       reset() override;
+    virtual OSObject * getNextObject() override;
+    
+protected:
+    virtual void free() override;
+    
+private:
+    OSArray    * collection;
+    unsigned int index;
+};
+
+#endif /* SIM_LIBKERN_OSARRAY_H */
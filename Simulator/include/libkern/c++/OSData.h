@@ -0,0 +1,32 @@
+//
+//  OSData.h
+//  VoodooUSBProvider Simulator
+//
+
+#ifndef SIM_LIBKERN_OSDATA_H
+#define SIM_LIBKERN_OSDATA_H
+
+#include <libkern/c++/OSObject.h>
+
+class OSData : public OSObject
+{
+public:
+    static OSData * withCapacity(unsigned int capacity);
+    static OSData * withBytes(const void * bytes, unsigned int numBytes);
+    
+    bool appendBytes(const void * bytes, unsigned int numBytes);
+    
+    unsigned int getLength() const { return length; }
+    const void * getBytesNoCopy() const { return length ? data : NULL; }
+    const void * getBytesNoCopy(unsigned int start, unsigned int numBytes) const;
+    
+protected:
+    virtual void free() override;
+    
+private:
+    UInt8      * data;
+    unsigned int length;
+    unsigned int capacity;
+};
+
+#endif /* SIM_LIBKERN_OSDATA_H */
@@ -0,0 +1,39 @@
+//
+//  OSDictionary.h
+//  VoodooUSBProvider Simulator
+//
+
+#ifndef SIM_LIBKERN_OSDICTIONARY_H
+#define SIM_LIBKERN_OSDICTIONARY_H
+
+#include <libkern/c++/OSString.h>
+
+class OSDictionary : public OSObject
+{
+public:
+    static OSDictionary * withCapacity(unsigned int capacity);
+    
+    bool         setObject(const char * aKey, const OSMetaClassBase * anObject);
+    OSObject   * getObject(const char * aKey) const;
+    void         removeObject(const char * aKey);
+    unsigned int getCount() const { return count; }
+    
+    const char * getKey(unsigned int index) const;
+    OSObject   * getObject(unsigned int index) const;
+    
+protected:
+    virtual void free() override;
+    
+private:
+    struct Entry
+    {
+        OSString * key;
+        OSObject * value;
+    };
+    
+    Entry      * entries;
+    unsigned int count;
+    unsigned int capacity;
+};
+
+#endif /* SIM_LIBKERN_OSDICTIONARY_H */
@@ -0,0 +1,19 @@
+//
+//  OSIterator.h
+//  VoodooUSBProvider Simulator
+//
+
+#ifndef SIM_LIBKERN_OSITERATOR_H
+#define SIM_LIBKERN_OSITERATOR_H
+
+#include <libkern/c++/OSObject.h>
+
+class OSIterator : public OSObject
+{
+public:
+    virtual void       reset() = 0;
+    virtual bool       isValid() { return true; }
+    virtual OSObject * getNextObject() = 0;
+};
+
+#endif /* SIM_LIBKERN_OSITERATOR_H */
@@ -0,0 +1,25 @@
+//
+//  OSNumber.h
+//  VoodooUSBProvider Simulator
+//
+
+#ifndef SIM_LIBKERN_OSNUMBER_H
+#define SIM_LIBKERN_OSNUMBER_H
+
+#include <libkern/c++/OSObject.h>
+
+class OSNumber : public OSObject
+{
+public:
+    static OSNumber * withNumber(unsigned long long value, unsigned int numberOfBits);
+    
+    unsigned long long unsigned64BitValue() const { return value; }
+    unsigned int       unsigned32BitValue() const { return (unsigned int) value; }
+    unsigned int       numberOfBits() const { return bits; }
+    
+private:
+    unsigned long long value;
+    unsigned int       bits;
+};
+
+#endif /* SIM_LIBKERN_OSNUMBER_H */
@@ -0,0 +1,107 @@
+//
+//  OSObject.h
+//  VoodooUSBProvider Simulator
+//
+//  Stand-in for <libkern/c++/OSObject.h>. Reference counting follows the kernel:
+//  the last release() calls free(), and free() destroys the object.
+//  Run-time type checks use C++ RTTI instead of OSMetaClass.
+//
+
+#ifndef SIM_LIBKERN_OSOBJECT_H
+#define SIM_LIBKERN_OSOBJECT_H
+
+#include <stdlib.h>
+#include <IOKit/IOTypes.h>
+#include <libkern/OSAtomic.h>
+
+class OSObject
+{
+public:
+    /* Kernel operator new hands out zero-filled memory, and drivers rely on it */
+    static void * operator new(size_t size)
+    {
+        void * memory = calloc(1, size);
+        if (!memory)
+        {
+            abort();
+        }
+        return memory;
+    }
+    
+    static void operator delete(void * memory)
+    {
+        ::free(memory);
+    }
+    
+    static void operator delete(void * memory, size_t)
+    {
+        ::free(memory);
+    }
+    
+    OSObject() : retainCount(1) {}
+    
+    virtual bool init()
+    {
+        return true;
+    }
+    
+    virtual void retain() const
+    {
+        __atomic_add_fetch(&retainCount, 1, __ATOMIC_SEQ_CST);
+    }
+    
+    virtual void release() const
+    {
+        if (__atomic_sub_fetch(&retainCount, 1, __ATOMIC_SEQ_CST) == 0)
+        {
+            const_cast<OSObject *> (this)->free();
+        }
+    }
+    
+    virtual int getRetainCount() const
+    {
+        return __atomic_load_n(&retainCount, __ATOMIC_SEQ_CST);
+    }
+    
+protected:
+    virtual ~OSObject() {}
+    
+    virtual void free()
+    {
+        delete this;
+    }
+    
+private:
+    mutable SInt32 retainCount;
+};
+
+typedef OSObject OSMetaClassBase;
+
+#define OSDeclareCommonStructors(className)
+
+#define OSDeclareDefaultStructors(className)                                \
+    public:                                                                 \
+        className();                                                        \
+    protected:                                                              \
+        virtual ~className();
+
+#define OSDeclareAbstractStructors(className)                               \
+    OSDeclareDefaultStructors(className)
+
+#define OSDefineMetaClassAndStructors(className, superclassName)           \
+    className::className() : superclassName() {}                            \
+    className::~className() {}
+
+#define OSDefineMetaClassAndAbstractStructors(className, superclassName)   \
+    OSDefineMetaClassAndStructors(className, superclassName)
+
+#define OSDynamicCast(type, inst)                                           \
+    (dynamic_cast<type *> (const_cast<OSObject *> (static_cast<const OSObject *> (inst))))
+
+#define OSSafeRelease(inst)                                                 \
+    do { if (inst) (inst)->release(); } while (0)
+
+#define OSSafeReleaseNULL(inst)                                             \
+    do { if (inst) (inst)->release(); (inst) = NULL; } while (0)
+
+#endif /* SIM_LIBKERN_OSOBJECT_H */
@@ -0,0 +1,27 @@
+//
+//  OSString.h
+//  VoodooUSBProvider Simulator
+//
+
+#ifndef SIM_LIBKERN_OSSTRING_H
+#define SIM_LIBKERN_OSSTRING_H
+
+#include <libkern/c++/OSObject.h>
+
+class OSString : public OSObject
+{
+public:
+    static OSString * withCString(const char * cString);
+    
+    const char * getCStringNoCopy() const { return string; }
+    unsigned int getLength() const;
+    bool isEqualTo(const char * cString) const;
+    
+protected:
+    virtual void free() override;
+    
+private:
+    char * string;
+};
+
+#endif /* SIM_LIBKERN_OSSTRING_H */
@@ -0,0 +1,13 @@
+//
+//  machine_routines.h
+//  VoodooUSBProvider Simulator
+//
+//  Stand-in for the one <machine/machine_routines.h> call the provider makes.
+//
+
+#ifndef SIM_MACHINE_MACHINE_ROUTINES_H
+#define SIM_MACHINE_MACHINE_ROUTINES_H
+
+unsigned int ml_get_max_cpus(void);
+
+#endif /* SIM_MACHINE_MACHINE_ROUTINES_H */
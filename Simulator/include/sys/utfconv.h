@@ -0,0 +1,24 @@
+//
+//  utfconv.h
+//  VoodooUSBProvider Simulator
+//
+//  Stand-in for <sys/utfconv.h>; only the UTF-16 to UTF-8 direction is provided.
+//
+
+#ifndef SIM_SYS_UTFCONV_H
+#define SIM_SYS_UTFCONV_H
+
+#include <IOKit/IOTypes.h>
+
+#define UTF_REVERSE_ENDIAN      0x0001
+#define UTF_NO_NULL_TERM        0x0002
+#define UTF_DECOMPOSED          0x0004
+#define UTF_PRECOMPOSED         0x0008
+#define UTF_ESCAPE_ILLEGAL      0x0010
+#define UTF_SFM_CONVERSIONS     0x0020
+#define UTF_BIG_ENDIAN          0x0040
+#define UTF_LITTLE_ENDIAN       0x0080
+
+int utf8_encodestr(const u_int16_t * ucsp, size_t ucslen, u_int8_t * utf8p, size_t * utf8len, size_t buflen, u_int16_t altslash, int flags);
+
+#endif /* SIM_SYS_UTFCONV_H */
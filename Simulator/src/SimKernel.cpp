@@ -0,0 +1,1270 @@
+//
+//  SimKernel.cpp
+//  VoodooUSBProvider Simulator
+//
+//  Userspace implementation of the libkern / IOKit subset the provider links against.
+//
+
+#include <IOKit/IOService.h>
+#include <IOKit/IOBufferMemoryDescriptor.h>
+#include <IOKit/IOSubMemoryDescriptor.h>
+#include <IOKit/IOMultiMemoryDescriptor.h>
+#include <sys/utfconv.h>
+
+#include <kern/cpu_number.h>
+#include <machine/machine_routines.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+
+task_t kernel_task = (task_t) &kernel_task;
+
+static const IORegistryPlane gIOServicePlaneStorage = { "IOService" };
+const IORegistryPlane * gIOServicePlane = &gIOServicePlaneStorage;
+
+/* ---- IOLib ---- */
+
+static volatile bool gLogEnabled = true;
+
+void IOLog(const char * format, ...)
+{
+    if (!gLogEnabled)
+    {
+        return;
+    }
+
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+}
+
+void IOSimSetLogEnabled(bool enabled)
+{
+    gLogEnabled = enabled;
+}
+
+static void sleepNanoseconds(UInt64 nanoseconds)
+{
+    struct timespec request = { (time_t) (nanoseconds / kSecondScale), (long) (nanoseconds % kSecondScale) };
+    while (nanosleep(&request, &request) == -1 && errno == EINTR)
+    {
+    }
+}
+
+void IOSleep(unsigned milliseconds)
+{
+    sleepNanoseconds((UInt64) milliseconds * kMillisecondScale);
+}
+
+void IODelay(unsigned microseconds)
+{
+    // Busy wait like the kernel does; a sleep would overshoot short delays by far
+    UInt64 deadline = mach_absolute_time() + (UInt64) microseconds * kMicrosecondScale;
+    while (mach_absolute_time() < deadline)
+    {
+    }
+}
+
+void * IOMalloc(size_t size)
+{
+    return malloc(size);
+}
+
+void IOFree(void * address, size_t size)
+{
+    free(address);
+}
+
+void * IOMallocAligned(size_t size, size_t alignment)
+{
+    void * address = NULL;
+    if (posix_memalign(&address, alignment < sizeof(void *) ? sizeof(void *) : alignment, size))
+    {
+        return NULL;
+    }
+    return address;
+}
+
+void IOFreeAligned(void * address, size_t size)
+{
+    free(address);
+}
+
+UInt64 mach_absolute_time()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (UInt64) now.tv_sec * kSecondScale + (UInt64) now.tv_nsec;
+}
+
+void clock_get_uptime(UInt64 * result)
+{
+    *result = mach_absolute_time();
+}
+
+void absolutetime_to_nanoseconds(UInt64 abstime, UInt64 * result)
+{
+    *result = abstime;
+}
+
+void nanoseconds_to_absolutetime(UInt64 nanoseconds, UInt64 * result)
+{
+    *result = nanoseconds;
+}
+
+void clock_interval_to_absolutetime_interval(UInt32 interval, UInt32 scaleFactor, UInt64 * result)
+{
+    *result = (UInt64) interval * scaleFactor;
+}
+
+void clock_interval_to_deadline(UInt32 interval, UInt32 scaleFactor, UInt64 * result)
+{
+    *result = mach_absolute_time() + (UInt64) interval * scaleFactor;
+}
+
+void clock_get_calendar_microtime(clock_sec_t * seconds, clock_usec_t * microseconds)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    *seconds      = (clock_sec_t) now.tv_sec;
+    *microseconds = (clock_usec_t) (now.tv_nsec / 1000);
+}
+
+/* ---- CPUs ---- */
+
+int cpu_number(void)
+{
+    int cpu = sched_getcpu();
+    return cpu < 0 ? 0 : cpu;
+}
+
+unsigned int ml_get_max_cpus(void)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_CONF);
+    return cpus > 0 ? (unsigned int) cpus : 1;
+}
+
+/* ---- IOLocks ---- */
+
+struct IOLock
+{
+    pthread_mutex_t     mutex;
+    pthread_cond_t      condition;
+};
+
+struct IORecursiveLock
+{
+    pthread_mutex_t     mutex;
+    volatile pthread_t  owner;
+    volatile UInt32     count;
+};
+
+struct IOSimpleLock
+{
+    pthread_mutex_t     mutex;
+};
+
+IOLock * IOLockAlloc()
+{
+    IOLock * lock = IONew(IOLock, 1);
+    if (!lock)
+    {
+        return NULL;
+    }
+
+    // Deadlines are mach_absolute_time() values, which run on the monotonic clock
+    pthread_condattr_t attributes;
+    pthread_condattr_init(&attributes);
+    pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+    pthread_mutex_init(&lock->mutex, NULL);
+    pthread_cond_init(&lock->condition, &attributes);
+    pthread_condattr_destroy(&attributes);
+    return lock;
+}
+
+void IOLockFree(IOLock * lock)
+{
+    pthread_cond_destroy(&lock->condition);
+    pthread_mutex_destroy(&lock->mutex);
+    IODelete(lock, IOLock, 1);
+}
+
+void IOLockLock(IOLock * lock)
+{
+    pthread_mutex_lock(&lock->mutex);
+}
+
+bool IOLockTryLock(IOLock * lock)
+{
+    return pthread_mutex_trylock(&lock->mutex) == 0;
+}
+
+void IOLockUnlock(IOLock * lock)
+{
+    pthread_mutex_unlock(&lock->mutex);
+}
+
+int IOLockSleep(IOLock * lock, void * event, UInt32 interType)
+{
+    pthread_cond_wait(&lock->condition, &lock->mutex);
+    return THREAD_AWAKENED;
+}
+
+int IOLockSleepDeadline(IOLock * lock, void * event, AbsoluteTime deadline, UInt32 interType)
+{
+    if (deadline == UINT64_MAX)
+    {
+        return IOLockSleep(lock, event, interType);
+    }
+
+    struct timespec when = { (time_t) (deadline / kSecondScale), (long) (deadline % kSecondScale) };
+    return pthread_cond_timedwait(&lock->condition, &lock->mutex, &when) == ETIMEDOUT ? THREAD_TIMED_OUT : THREAD_AWAKENED;
+}
+
+void IOLockWakeup(IOLock * lock, void * event, bool oneThread)
+{
+    // Sleepers on other events re-check their condition and go back to sleep
+    pthread_cond_broadcast(&lock->condition);
+}
+
+IORecursiveLock * IORecursiveLockAlloc()
+{
+    IORecursiveLock * lock = IONew(IORecursiveLock, 1);
+    if (!lock)
+    {
+        return NULL;
+    }
+
+    pthread_mutexattr_t attributes;
+    pthread_mutexattr_init(&attributes);
+    pthread_mutexattr_settype(&attributes, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&lock->mutex, &attributes);
+    pthread_mutexattr_destroy(&attributes);
+    lock->owner = 0;
+    lock->count = 0;
+    return lock;
+}
+
+void IORecursiveLockFree(IORecursiveLock * lock)
+{
+    pthread_mutex_destroy(&lock->mutex);
+    IODelete(lock, IORecursiveLock, 1);
+}
+
+void IORecursiveLockLock(IORecursiveLock * lock)
+{
+    pthread_mutex_lock(&lock->mutex);
+    lock->owner = pthread_self();
+    ++lock->count;
+}
+
+void IORecursiveLockUnlock(IORecursiveLock * lock)
+{
+    if (!--lock->count)
+    {
+        lock->owner = 0;
+    }
+    pthread_mutex_unlock(&lock->mutex);
+}
+
+bool IORecursiveLockHaveLock(const IORecursiveLock * lock)
+{
+    return lock->count && pthread_equal(lock->owner, pthread_self());
+}
+
+IOSimpleLock * IOSimpleLockAlloc()
+{
+    IOSimpleLock * lock = IONew(IOSimpleLock, 1);
+    if (lock)
+    {
+        pthread_mutex_init(&lock->mutex, NULL);
+    }
+    return lock;
+}
+
+void IOSimpleLockFree(IOSimpleLock * lock)
+{
+    pthread_mutex_destroy(&lock->mutex);
+    IODelete(lock, IOSimpleLock, 1);
+}
+
+void IOSimpleLockLock(IOSimpleLock * lock)
+{
+    pthread_mutex_lock(&lock->mutex);
+}
+
+void IOSimpleLockUnlock(IOSimpleLock * lock)
+{
+    pthread_mutex_unlock(&lock->mutex);
+}
+
+IOInterruptState IOSimpleLockLockDisableInterrupt(IOSimpleLock * lock)
+{
+    pthread_mutex_lock(&lock->mutex);
+    return 0;
+}
+
+void IOSimpleLockUnlockEnableInterrupt(IOSimpleLock * lock, IOInterruptState state)
+{
+    pthread_mutex_unlock(&lock->mutex);
+}
+
+/* ---- Collections ---- */
+
+OSData * OSData::withCapacity(unsigned int capacity)
+{
+    OSData * data = new OSData;
+    if (capacity)
+    {
+        data->data = (UInt8 *) malloc(capacity);
+        data->capacity = capacity;
+    }
+    return data;
+}
+
+OSData * OSData::withBytes(const void * bytes, unsigned int numBytes)
+{
+    OSData * data = withCapacity(numBytes);
+    if (!data->appendBytes(bytes, numBytes))
+    {
+        OSSafeReleaseNULL(data);
+    }
+    return data;
+}
+
+bool OSData::appendBytes(const void * bytes, unsigned int numBytes)
+{
+    if (length + numBytes > capacity)
+    {
+        unsigned int grown = max(length + numBytes, capacity * 2);
+        UInt8 * larger = (UInt8 *) realloc(data, grown);
+        if (!larger)
+        {
+            return false;
+        }
+        data = larger;
+        capacity = grown;
+    }
+
+    if (bytes)
+    {
+        memcpy(data + length, bytes, numBytes);
+    }
+    else
+    {
+        bzero(data + length, numBytes);
+    }
+    length += numBytes;
+    return true;
+}
+
+const void * OSData::getBytesNoCopy(unsigned int start, unsigned int numBytes) const
+{
+    if (!length || start >= length || numBytes > length - start)
+    {
+        return NULL;
+    }
+    return data + start;
+}
+
+void OSData::free()
+{
+    ::free(data);
+    OSObject::free();
+}
+
+OSString * OSString::withCString(const char * cString)
+{
+    OSString * string = new OSString;
+    string->string = strdup(cString ? cString : "");
+    return string;
+}
+
+unsigned int OSString::getLength() const
+{
+    return (unsigned int) strlen(string);
+}
+
+bool OSString::isEqualTo(const char * cString) const
+{
+    return cString && !strcmp(string, cString);
+}
+
+void OSString::free()
+{
+    ::free(string);
+    OSObject::free();
+}
+
+OSNumber * OSNumber::withNumber(unsigned long long value, unsigned int numberOfBits)
+{
+    OSNumber * number = new OSNumber;
+    number->bits  = numberOfBits;
+    number->value = (numberOfBits < 64) ? (value & ((1ULL << numberOfBits) - 1)) : value;
+    return number;
+}
+
+OSArray * OSArray::withCapacity(unsigned int capacity)
+{
+    OSArray * array = new OSArray;
+    array->capacity = capacity ? capacity : 4;
+    array->objects  = (OSObject **) calloc(array->capacity, sizeof(OSObject *));
+    return array;
+}
+
+bool OSArray::setObject(const OSMetaClassBase * anObject)
+{
+    if (!anObject)
+    {
+        return false;
+    }
+
+    if (count == capacity)
+    {
+        OSObject ** larger = (OSObject **) realloc(objects, sizeof(OSObject *) * capacity * 2);
+        if (!larger)
+        {
+            return false;
+        }
+        objects = larger;
+        capacity *= 2;
+    }
+
+    anObject->retain();
+    objects[count++] = const_cast<OSObject *> (anObject);
+    return true;
+}
+
+OSObject * OSArray::getObject(unsigned int index) const
+{
+    return index < count ? objects[index] : NULL;
+}
+
+void OSArray::removeObject(unsigned int index)
+{
+    if (index >= count)
+    {
+        return;
+    }
+
+    OSObject * object = objects[index];
+    memmove(&objects[index], &objects[index + 1], sizeof(OSObject *) * (count - index - 1));
+    --count;
+    object->release();
+}
+
+void OSArray::free()
+{
+    for (unsigned int i = 0; i < count; ++i)
+    {
+        objects[i]->release();
+    }
+    ::free(objects);
+    OSObject::free();
+}
+
+OSCollectionIterator * OSCollectionIterator::withCollection(const OSArray * collection)
+{
+    if (!collection)
+    {
+        return NULL;
+    }
+
+    OSCollectionIterator * iterator = new OSCollectionIterator;
+    iterator->collection = OSArray::withCapacity(collection->getCount());
+    for (unsigned int i = 0; i < collection->getCount(); ++i)
+    {
+        iterator->collection->setObject(collection->getObject(i));
+    }
+    return iterator;
+}
+
+void OSCollectionIterator::reset()
+{
+    index = 0;
+}
+
+OSObject * OSCollectionIterator::getNextObject()
+{
+    return collection->getObject(index++);
+}
+
+void OSCollectionIterator::free()
+{
+    OSSafeReleaseNULL(collection);
+    OSIterator::free();
+}
+
+OSDictionary * OSDictionary::withCapacity(unsigned int capacity)
+{
+    OSDictionary * dictionary = new OSDictionary;
+    dictionary->capacity = capacity ? capacity : 4;
+    dictionary->entries  = (Entry *) calloc(dictionary->capacity, sizeof(Entry));
+    return dictionary;
+}
+
+bool OSDictionary::setObject(const char * aKey, const OSMetaClassBase * anObject)
+{
+    if (!aKey || !anObject)
+    {
+        return false;
+    }
+
+    anObject->retain();
+    for (unsigned int i = 0; i < count; ++i)
+    {
+        if (entries[i].key->isEqualTo(aKey))
+        {
+            entries[i].value->release();
+            entries[i].value = const_cast<OSObject *> (anObject);
+            return true;
+        }
+    }
+
+    if (count == capacity)
+    {
+        Entry * larger = (Entry *) realloc(entries, sizeof(Entry) * capacity * 2);
+        if (!larger)
+        {
+            anObject->release();
+            return false;
+        }
+        entries = larger;
+        capacity *= 2;
+    }
+
+    entries[count].key   = OSString::withCString(aKey);
+    entries[count].value = const_cast<OSObject *> (anObject);
+    ++count;
+    return true;
+}
+
+OSObject * OSDictionary::getObject(const char * aKey) const
+{
+    for (unsigned int i = 0; aKey && i < count; ++i)
+    {
+        if (entries[i].key->isEqualTo(aKey))
+        {
+            return entries[i].value;
+        }
+    }
+    return NULL;
+}
+
+void OSDictionary::removeObject(const char * aKey)
+{
+    for (unsigned int i = 0; aKey && i < count; ++i)
+    {
+        if (entries[i].key->isEqualTo(aKey))
+        {
+            entries[i].key->release();
+            entries[i].value->release();
+            memmove(&entries[i], &entries[i + 1], sizeof(Entry) * (count - i - 1));
+            --count;
+            return;
+        }
+    }
+}
+
+const char * OSDictionary::getKey(unsigned int index) const
+{
+    return index < count ? entries[index].key->getCStringNoCopy() : NULL;
+}
+
+OSObject * OSDictionary::getObject(unsigned int index) const
+{
+    return index < count ? entries[index].value : NULL;
+}
+
+void OSDictionary::free()
+{
+    for (unsigned int i = 0; i < count; ++i)
+    {
+        entries[i].key->release();
+        entries[i].value->release();
+    }
+    ::free(entries);
+    OSObject::free();
+}
+
+/* ---- IOService ---- */
+
+/* Registered services, not retained; a service leaves the list when it is freed */
+static pthread_mutex_t gRegistryMutex = PTHREAD_MUTEX_INITIALIZER;
+static IOService     * gRegisteredServices;
+static volatile SInt64 gNextRegistryEntryID = 0x100000000ULL;
+
+bool IOService::init(OSDictionary * dictionary)
+{
+    if (!OSObject::init())
+    {
+        return false;
+    }
+
+    registryEntryID = (uint64_t) OSIncrementAtomic64(&gNextRegistryEntryID);
+
+    serviceLock = IOLockAlloc();
+    children    = OSArray::withCapacity(4);
+    properties  = OSDictionary::withCapacity(8);
+
+    for (unsigned int i = 0; dictionary && i < dictionary->getCount(); ++i)
+    {
+        properties->setObject(dictionary->getKey(i), dictionary->getObject(i));
+    }
+    return serviceLock != NULL;
+}
+
+bool IOService::start(IOService * provider)
+{
+    return true;
+}
+
+void IOService::stop(IOService * provider)
+{
+}
+
+bool IOService::attach(IOService * provider)
+{
+    if (!provider || this->provider)
+    {
+        return false;
+    }
+
+    provider->retain();
+    this->provider = provider;
+
+    IOLockLock(provider->serviceLock);
+    provider->children->setObject(this);
+    IOLockUnlock(provider->serviceLock);
+    return true;
+}
+
+void IOService::detach(IOService * provider)
+{
+    if (!provider || this->provider != provider)
+    {
+        return;
+    }
+
+    // The provider's reference may be the last one on this object; drop it after clearing the link
+    this->provider = NULL;
+
+    IOLockLock(provider->serviceLock);
+    for (unsigned int i = 0; i < provider->children->getCount(); ++i)
+    {
+        if (provider->children->getObject(i) == this)
+        {
+            retain();
+            provider->children->removeObject(i);
+            break;
+        }
+    }
+    IOLockUnlock(provider->serviceLock);
+
+    provider->release();
+    release();
+}
+
+bool IOService::terminate(IOOptionBits options)
+{
+    inactive = true;
+    return true;
+}
+
+bool IOService::open(IOService * forClient, IOOptionBits options, void * arg)
+{
+    if (!forClient || inactive)
+    {
+        return false;
+    }
+
+    IOLockLock(serviceLock);
+    bool opened = !openClient || openClient == forClient;
+    if (opened)
+    {
+        openClient = forClient;
+    }
+    IOLockUnlock(serviceLock);
+    return opened;
+}
+
+void IOService::close(IOService * forClient, IOOptionBits options)
+{
+    IOLockLock(serviceLock);
+    if (openClient == forClient)
+    {
+        openClient = NULL;
+    }
+    IOLockUnlock(serviceLock);
+}
+
+bool IOService::isOpen(const IOService * forClient) const
+{
+    return forClient ? openClient == forClient : openClient != NULL;
+}
+
+OSIterator * IOService::getChildIterator(const IORegistryPlane * plane) const
+{
+    IOLockLock(serviceLock);
+    OSIterator * iterator = OSCollectionIterator::withCollection(children);
+    IOLockUnlock(serviceLock);
+    return iterator;
+}
+
+bool IOService::setProperty(const char * aKey, OSObject * anObject)
+{
+    IOLockLock(serviceLock);
+    bool result = properties->setObject(aKey, anObject);
+    IOLockUnlock(serviceLock);
+    return result;
+}
+
+bool IOService::setProperty(const char * aKey, unsigned long long aValue, unsigned int aNumberOfBits)
+{
+    OSNumber * number = OSNumber::withNumber(aValue, aNumberOfBits);
+    bool result = setProperty(aKey, number);
+    number->release();
+    return result;
+}
+
+bool IOService::setProperty(const char * aKey, bool aBoolean)
+{
+    return setProperty(aKey, (unsigned long long) aBoolean, 1);
+}
+
+bool IOService::setProperty(const char * aKey, const char * aString)
+{
+    OSString * string = OSString::withCString(aString);
+    bool result = setProperty(aKey, string);
+    string->release();
+    return result;
+}
+
+void IOService::removeProperty(const char * aKey)
+{
+    IOLockLock(serviceLock);
+    properties->removeObject(aKey);
+    IOLockUnlock(serviceLock);
+}
+
+OSObject * IOService::getProperty(const char * aKey) const
+{
+    IOLockLock(serviceLock);
+    OSObject * object = properties->getObject(aKey);
+    IOLockUnlock(serviceLock);
+    return object;
+}
+
+OSObject * IOService::copyProperty(const char * aKey) const
+{
+    IOLockLock(serviceLock);
+    OSObject * object = properties->getObject(aKey);
+    if (object)
+    {
+        object->retain();
+    }
+    IOLockUnlock(serviceLock);
+    return object;
+}
+
+void IOService::registerService(IOOptionBits options)
+{
+    pthread_mutex_lock(&gRegistryMutex);
+    if (!registered)
+    {
+        registered        = true;
+        simNextRegistered = gRegisteredServices;
+        gRegisteredServices = this;
+    }
+    pthread_mutex_unlock(&gRegistryMutex);
+}
+
+OSDictionary * IOService::registryEntryIDMatching(uint64_t entryID, OSDictionary * table)
+{
+    OSDictionary * matching = table ? table : OSDictionary::withCapacity(2);
+    OSNumber * number = OSNumber::withNumber(entryID, 64);
+
+    matching->setObject(kIORegistryEntryIDKey, number);
+    number->release();
+    return matching;
+}
+
+static bool simValuesEqual(OSObject * a, OSObject * b)
+{
+    OSNumber * numberA = OSDynamicCast(OSNumber, a);
+    OSNumber * numberB = OSDynamicCast(OSNumber, b);
+    if (numberA || numberB)
+    {
+        return numberA && numberB && numberA->unsigned64BitValue() == numberB->unsigned64BitValue();
+    }
+
+    OSString * stringA = OSDynamicCast(OSString, a);
+    OSString * stringB = OSDynamicCast(OSString, b);
+    return stringA && stringB && stringA->isEqualTo(stringB->getCStringNoCopy());
+}
+
+bool IOService::simMatches(OSDictionary * matching) const
+{
+    OSNumber * entryID = OSDynamicCast(OSNumber, matching->getObject(kIORegistryEntryIDKey));
+    if (entryID && entryID->unsigned64BitValue() != registryEntryID)
+    {
+        return false;
+    }
+
+    OSDictionary * propertyMatch = OSDynamicCast(OSDictionary, matching->getObject(kIOPropertyMatchKey));
+    for (unsigned int i = 0; propertyMatch && i < propertyMatch->getCount(); ++i)
+    {
+        OSObject * value = copyProperty(propertyMatch->getKey(i));
+        bool equal = value && simValuesEqual(value, propertyMatch->getObject(i));
+        OSSafeReleaseNULL(value);
+        if (!equal)
+        {
+            return false;
+        }
+    }
+
+    OSDictionary * parentMatch = OSDynamicCast(OSDictionary, matching->getObject(kIOParentMatchKey));
+    return !parentMatch || (provider && provider->simMatches(parentMatch));
+}
+
+IOService * IOService::waitForMatchingService(OSDictionary * matching, uint64_t timeout)
+{
+    UInt64 deadline = timeout == UINT64_MAX ? UINT64_MAX : mach_absolute_time() + timeout;
+
+    while (matching)
+    {
+        IOService * match = NULL;
+
+        pthread_mutex_lock(&gRegistryMutex);
+        for (IOService * service = gRegisteredServices; service && !match; service = service->simNextRegistered)
+        {
+            // Only attached services: the provider's reference keeps them alive while they are retained here
+            if (service->provider && !service->inactive && service->simMatches(matching))
+            {
+                match = service;
+                match->retain();
+            }
+        }
+        pthread_mutex_unlock(&gRegistryMutex);
+
+        if (match || mach_absolute_time() >= deadline)
+        {
+            return match;
+        }
+        IOSleep(1);
+    }
+    return NULL;
+}
+
+void IOService::free()
+{
+    pthread_mutex_lock(&gRegistryMutex);
+    for (IOService ** link = &gRegisteredServices; registered && *link; link = &(*link)->simNextRegistered)
+    {
+        if (*link == this)
+        {
+            *link = simNextRegistered;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&gRegistryMutex);
+
+    OSSafeReleaseNULL(children);
+    OSSafeReleaseNULL(properties);
+    OSSafeReleaseNULL(provider);
+
+    if (serviceLock)
+    {
+        IOLockFree(serviceLock);
+        serviceLock = NULL;
+    }
+    OSObject::free();
+}
+
+/* ---- Memory descriptors ---- */
+
+IOMemoryDescriptor * IOMemoryDescriptor::withAddress(void * address, IOByteCount withLength, IODirection withDirection)
+{
+    IOMemoryDescriptor * descriptor = new IOMemoryDescriptor;
+    descriptor->bytes     = (UInt8 *) address;
+    descriptor->length    = withLength;
+    descriptor->direction = withDirection;
+    return descriptor;
+}
+
+IOMemoryDescriptor * IOMemoryDescriptor::withAddressRange(mach_vm_address_t address, mach_vm_size_t length, IOOptionBits options, task_t task)
+{
+    return withAddress((void *) address, length, options & kIODirectionOutIn);
+}
+
+IOReturn IOMemoryDescriptor::prepare(IODirection forDirection)
+{
+    OSIncrementAtomic(&wireCount);
+    return kIOReturnSuccess;
+}
+
+IOReturn IOMemoryDescriptor::complete(IODirection forDirection)
+{
+    if (OSDecrementAtomic(&wireCount) <= 0)
+    {
+        OSIncrementAtomic(&wireCount);
+        IOLog("IOMemoryDescriptor::complete() - Unbalanced complete() on %p\n", this);
+        return kIOReturnNotReady;
+    }
+    return kIOReturnSuccess;
+}
+
+IOByteCount IOMemoryDescriptor::readBytes(IOByteCount offset, void * bytes, IOByteCount withLength)
+{
+    if (offset >= length)
+    {
+        return 0;
+    }
+
+    IOByteCount count = withLength < length - offset ? withLength : length - offset;
+    memcpy(bytes, this->bytes + offset, count);
+    return count;
+}
+
+IOByteCount IOMemoryDescriptor::writeBytes(IOByteCount offset, const void * bytes, IOByteCount withLength)
+{
+    if (offset >= length)
+    {
+        return 0;
+    }
+
+    IOByteCount count = withLength < length - offset ? withLength : length - offset;
+    memcpy(this->bytes + offset, bytes, count);
+    return count;
+}
+
+IOBufferMemoryDescriptor * IOBufferMemoryDescriptor::withCapacity(IOByteCount capacity, IODirection withDirection, bool withContiguousMemory)
+{
+    IOBufferMemoryDescriptor * descriptor = new IOBufferMemoryDescriptor;
+    descriptor->bytes = (UInt8 *) calloc(1, capacity ? capacity : 1);
+    if (!descriptor->bytes)
+    {
+        OSSafeReleaseNULL(descriptor);
+        return NULL;
+    }
+    descriptor->capacity  = capacity;
+    descriptor->length    = capacity;
+    descriptor->direction = withDirection;
+    return descriptor;
+}
+
+IOBufferMemoryDescriptor * IOBufferMemoryDescriptor::withBytes(const void * bytes, IOByteCount withLength, IODirection withDirection, bool withContiguousMemory)
+{
+    IOBufferMemoryDescriptor * descriptor = withCapacity(withLength, withDirection, withContiguousMemory);
+    if (descriptor)
+    {
+        memcpy(descriptor->bytes, bytes, withLength);
+    }
+    return descriptor;
+}
+
+IOBufferMemoryDescriptor * IOBufferMemoryDescriptor::inTaskWithOptions(task_t inTask, IOOptionBits options, IOByteCount capacity, IOByteCount alignment)
+{
+    return withCapacity(capacity, options & kIODirectionOutIn, options & kIOMemoryPhysicallyContiguous);
+}
+
+void IOBufferMemoryDescriptor::setLength(IOByteCount length)
+{
+    this->length = length < capacity ? length : capacity;
+}
+
+void * IOBufferMemoryDescriptor::getBytesNoCopy(IOByteCount start, IOByteCount withLength)
+{
+    if (start >= capacity || withLength > capacity - start)
+    {
+        return NULL;
+    }
+    return bytes + start;
+}
+
+bool IOBufferMemoryDescriptor::appendBytes(const void * bytes, IOByteCount withLength)
+{
+    IOByteCount count = withLength < capacity - length ? withLength : capacity - length;
+    memcpy(this->bytes + length, bytes, count);
+    length += count;
+    return count == withLength;
+}
+
+void IOBufferMemoryDescriptor::free()
+{
+    ::free(bytes);
+    IOMemoryDescriptor::free();
+}
+
+IOSubMemoryDescriptor * IOSubMemoryDescriptor::withSubRange(IOMemoryDescriptor * of, IOByteCount offset, IOByteCount length, IOOptionBits options)
+{
+    IOSubMemoryDescriptor * descriptor = new IOSubMemoryDescriptor;
+    if (!descriptor->initSubRange(of, offset, length, options & kIODirectionOutIn))
+    {
+        OSSafeReleaseNULL(descriptor);
+    }
+    return descriptor;
+}
+
+bool IOSubMemoryDescriptor::initSubRange(IOMemoryDescriptor * parent, IOByteCount offset, IOByteCount length, IODirection withDirection)
+{
+    if (!parent || offset > parent->getLength() || length > parent->getLength() - offset)
+    {
+        return false;
+    }
+
+    if (parent != this->parent)
+    {
+        parent->retain();
+        OSSafeRelease(this->parent);
+        this->parent = parent;
+    }
+
+    start           = offset;
+    this->length    = length;
+    this->direction = withDirection;
+    return true;
+}
+
+IOReturn IOSubMemoryDescriptor::prepare(IODirection forDirection)
+{
+    IOReturn result = parent->prepare(forDirection);
+    if (result == kIOReturnSuccess)
+    {
+        IOMemoryDescriptor::prepare(forDirection);
+    }
+    return result;
+}
+
+IOReturn IOSubMemoryDescriptor::complete(IODirection forDirection)
+{
+    IOReturn result = IOMemoryDescriptor::complete(forDirection);
+    if (result == kIOReturnSuccess)
+    {
+        parent->complete(forDirection);
+    }
+    return result;
+}
+
+IOByteCount IOSubMemoryDescriptor::readBytes(IOByteCount offset, void * bytes, IOByteCount withLength)
+{
+    if (offset >= length)
+    {
+        return 0;
+    }
+    return parent->readBytes(start + offset, bytes, withLength < length - offset ? withLength : length - offset);
+}
+
+IOByteCount IOSubMemoryDescriptor::writeBytes(IOByteCount offset, const void * bytes, IOByteCount withLength)
+{
+    if (offset >= length)
+    {
+        return 0;
+    }
+    return parent->writeBytes(start + offset, bytes, withLength < length - offset ? withLength : length - offset);
+}
+
+void IOSubMemoryDescriptor::free()
+{
+    OSSafeReleaseNULL(parent);
+    IOMemoryDescriptor::free();
+}
+
+IOMultiMemoryDescriptor * IOMultiMemoryDescriptor::withDescriptors(IOMemoryDescriptor ** descriptors, UInt32 withCount, IODirection withDirection, bool asReference)
+{
+    IOMultiMemoryDescriptor * descriptor = new IOMultiMemoryDescriptor;
+    if (!descriptor->initWithDescriptors(descriptors, withCount, withDirection, asReference))
+    {
+        OSSafeReleaseNULL(descriptor);
+    }
+    return descriptor;
+}
+
+bool IOMultiMemoryDescriptor::initWithDescriptors(IOMemoryDescriptor ** descriptors, UInt32 withCount, IODirection withDirection, bool asReference)
+{
+    if (!descriptors || !withCount || this->descriptors)
+    {
+        return false;
+    }
+
+    // The members are retained, never copied; asReference only decides who owns the array in the kernel
+    this->descriptors = new IOMemoryDescriptor * [withCount];
+    count  = withCount;
+    length = 0;
+    for (UInt32 i = 0; i < withCount; ++i)
+    {
+        if (!descriptors[i])
+        {
+            count = i;
+            return false;
+        }
+        descriptors[i]->retain();
+        this->descriptors[i] = descriptors[i];
+        length += descriptors[i]->getLength();
+    }
+    direction = withDirection;
+    return true;
+}
+
+IOReturn IOMultiMemoryDescriptor::prepare(IODirection forDirection)
+{
+    for (UInt32 i = 0; i < count; ++i)
+    {
+        IOReturn result = descriptors[i]->prepare(forDirection);
+        if (result != kIOReturnSuccess)
+        {
+            while (i--)
+            {
+                descriptors[i]->complete(forDirection);
+            }
+            return result;
+        }
+    }
+    return IOMemoryDescriptor::prepare(forDirection);
+}
+
+IOReturn IOMultiMemoryDescriptor::complete(IODirection forDirection)
+{
+    IOReturn result = IOMemoryDescriptor::complete(forDirection);
+    if (result == kIOReturnSuccess)
+    {
+        for (UInt32 i = 0; i < count; ++i)
+        {
+            descriptors[i]->complete(forDirection);
+        }
+    }
+    return result;
+}
+
+IOByteCount IOMultiMemoryDescriptor::readBytes(IOByteCount offset, void * bytes, IOByteCount withLength)
+{
+    IOByteCount done = 0;
+
+    for (UInt32 i = 0; i < count && done < withLength; ++i)
+    {
+        IOByteCount segment = descriptors[i]->getLength();
+        if (offset >= segment)
+        {
+            offset -= segment;
+            continue;
+        }
+        done  += descriptors[i]->readBytes(offset, (UInt8 *) bytes + done, withLength - done);
+        offset = 0;
+    }
+    return done;
+}
+
+IOByteCount IOMultiMemoryDescriptor::writeBytes(IOByteCount offset, const void * bytes, IOByteCount withLength)
+{
+    IOByteCount done = 0;
+
+    for (UInt32 i = 0; i < count && done < withLength; ++i)
+    {
+        IOByteCount segment = descriptors[i]->getLength();
+        if (offset >= segment)
+        {
+            offset -= segment;
+            continue;
+        }
+        done  += descriptors[i]->writeBytes(offset, (const UInt8 *) bytes + done, withLength - done);
+        offset = 0;
+    }
+    return done;
+}
+
+void IOMultiMemoryDescriptor::free()
+{
+    for (UInt32 i = 0; i < count; ++i)
+    {
+        descriptors[i]->release();
+    }
+    delete [] descriptors;
+    IOMemoryDescriptor::free();
+}
+
+/* ---- utfconv ---- */
+
+int utf8_encodestr(const u_int16_t * ucsp, size_t ucslen, u_int8_t * utf8p, size_t * utf8len, size_t buflen, u_int16_t altslash, int flags)
+{
+    size_t count = ucslen / sizeof(u_int16_t);
+    size_t limit = (flags & UTF_NO_NULL_TERM) ? buflen : buflen - 1;
+    size_t written = 0;
+    int result = 0;
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        u_int16_t unit;
+        memcpy(&unit, &ucsp[i], sizeof(unit));
+        if (flags & UTF_BIG_ENDIAN)
+        {
+            unit = (u_int16_t) ((unit << 8) | (unit >> 8));
+        }
+
+        UInt32 codePoint = unit;
+        if (unit >= 0xD800 && unit < 0xDC00 && i + 1 < count)
+        {
+            u_int16_t low;
+            memcpy(&low, &ucsp[i + 1], sizeof(low));
+            if (flags & UTF_BIG_ENDIAN)
+            {
+                low = (u_int16_t) ((low << 8) | (low >> 8));
+            }
+            if (low >= 0xDC00 && low < 0xE000)
+            {
+                codePoint = 0x10000 + ((unit - 0xD800) << 10) + (low - 0xDC00);
+                ++i;
+            }
+        }
+        else if (codePoint == '/')
+        {
+            codePoint = altslash ? altslash : '/';
+        }
+
+        u_int8_t encoded[4];
+        size_t size;
+        if (codePoint < 0x80)
+        {
+            encoded[0] = (u_int8_t) codePoint;
+            size = 1;
+        }
+        else if (codePoint < 0x800)
+        {
+            encoded[0] = (u_int8_t) (0xC0 | (codePoint >> 6));
+            encoded[1] = (u_int8_t) (0x80 | (codePoint & 0x3F));
+            size = 2;
+        }
+        else if (codePoint < 0x10000)
+        {
+            encoded[0] = (u_int8_t) (0xE0 | (codePoint >> 12));
+            encoded[1] = (u_int8_t) (0x80 | ((codePoint >> 6) & 0x3F));
+            encoded[2] = (u_int8_t) (0x80 | (codePoint & 0x3F));
+            size = 3;
+        }
+        else
+        {
+            encoded[0] = (u_int8_t) (0xF0 | (codePoint >> 18));
+            encoded[1] = (u_int8_t) (0x80 | ((codePoint >> 12) & 0x3F));
+            encoded[2] = (u_int8_t) (0x80 | ((codePoint >> 6) & 0x3F));
+            encoded[3] = (u_int8_t) (0x80 | (codePoint & 0x3F));
+            size = 4;
+        }
+
+        if (written + size > limit)
+        {
+            result = ENAMETOOLONG;
+            break;
+        }
+        memcpy(utf8p + written, encoded, size);
+        written += size;
+    }
+
+    if (!(flags & UTF_NO_NULL_TERM) && buflen)
+    {
+        utf8p[written] = '\0';
+    }
+    *utf8len = written;
+    return result;
+}
@@ -0,0 +1,1649 @@
+//
+//  SimUSBHost.cpp
+//  VoodooUSBProvider Simulator
+//
+//  IOUSBHostDevice / IOUSBHostInterface / IOUSBHostPipe stand-ins and the simulated
+//  controller that moves their transfers.
+//
+
+#include <IOUSBHostSimulator.h>
+
+#include <chrono>
+
+/* ---- StandardUSB ---- */
+
+namespace StandardUSB
+{
+    const Descriptor * getNextDescriptor(const ConfigurationDescriptor * configurationDescriptor, const Descriptor * currentDescriptor)
+    {
+        if (!configurationDescriptor)
+        {
+            return NULL;
+        }
+
+        const UInt8 * end = (const UInt8 *) configurationDescriptor + USBToHost16(configurationDescriptor->wTotalLength);
+        const Descriptor * current = currentDescriptor ? currentDescriptor : configurationDescriptor;
+        if (!current->bLength)
+        {
+            return NULL;
+        }
+
+        const Descriptor * next = (const Descriptor *) ((const UInt8 *) current + current->bLength);
+        if ((const UInt8 *) next + sizeof(Descriptor) > end || !next->bLength || (const UInt8 *) next + next->bLength > end)
+        {
+            return NULL;
+        }
+        return next;
+    }
+
+    const Descriptor * getNextDescriptorWithType(const ConfigurationDescriptor * configurationDescriptor, const Descriptor * currentDescriptor, const UInt8 type)
+    {
+        const Descriptor * descriptor = currentDescriptor;
+        while ((descriptor = getNextDescriptor(configurationDescriptor, descriptor)))
+        {
+            if (descriptor->bDescriptorType == type)
+            {
+                return descriptor;
+            }
+        }
+        return NULL;
+    }
+
+    const InterfaceDescriptor * getNextInterfaceDescriptor(const ConfigurationDescriptor * configurationDescriptor, const Descriptor * currentDescriptor)
+    {
+        return (const InterfaceDescriptor *) getNextDescriptorWithType(configurationDescriptor, currentDescriptor, kDescriptorTypeInterface);
+    }
+
+    const EndpointDescriptor * getNextEndpointDescriptor(const ConfigurationDescriptor * configurationDescriptor, const InterfaceDescriptor * interfaceDescriptor, const Descriptor * currentDescriptor)
+    {
+        const Descriptor * descriptor = currentDescriptor ? currentDescriptor : interfaceDescriptor;
+        while ((descriptor = getNextDescriptor(configurationDescriptor, descriptor)))
+        {
+            if (descriptor->bDescriptorType == kDescriptorTypeInterface)
+            {
+                return NULL;
+            }
+            if (descriptor->bDescriptorType == kDescriptorTypeEndpoint)
+            {
+                return (const EndpointDescriptor *) descriptor;
+            }
+        }
+        return NULL;
+    }
+}
+
+/* ---- Factories ---- */
+
+static IOUSBHostInterface * defaultInterfaceFactory()
+{
+    return new IOUSBHostInterface;
+}
+
+static IOUSBHostPipe * defaultPipeFactory()
+{
+    return new IOUSBHostPipe;
+}
+
+static IOUSBHostSimInterfaceFactory gInterfaceFactory = defaultInterfaceFactory;
+static IOUSBHostSimPipeFactory      gPipeFactory      = defaultPipeFactory;
+
+void IOUSBHostSimSetFactories(IOUSBHostSimInterfaceFactory interfaceFactory, IOUSBHostSimPipeFactory pipeFactory)
+{
+    gInterfaceFactory = interfaceFactory ? interfaceFactory : defaultInterfaceFactory;
+    gPipeFactory      = pipeFactory ? pipeFactory : defaultPipeFactory;
+}
+
+IOUSBHostInterface * IOUSBHostSimNewInterface()
+{
+    return gInterfaceFactory();
+}
+
+IOUSBHostPipe * IOUSBHostSimNewPipe()
+{
+    return gPipeFactory();
+}
+
+IOUSBHostSimConfig IOUSBHostSimDefaultConfig()
+{
+    IOUSBHostSimConfig config;
+    bzero(&config, sizeof(config));
+
+    config.vendorID               = 0x0cf3;
+    config.productID              = 0xe300;
+    config.bcdDevice              = 0x0001;
+    config.manufacturer           = "Qualcomm Atheros";
+    config.product                = "Simulated Bluetooth Controller";
+    config.serialNumber           = "0123456789AB";
+
+    // Full speed Bluetooth controller behind an xHCI: frames are 1 ms, but control and bulk
+    // transfers finish within a few hundred microseconds when the bus is otherwise idle
+    config.controlLatencyNS       = 250 * kMicrosecondScale;
+    config.transferLatencyNS      = 125 * kMicrosecondScale;
+    config.packetLatencyNS        = 5 * kMicrosecondScale;
+    config.completionLatencyNS    = 20 * kMicrosecondScale;
+    config.hciResponseLatencyNS   = 200 * kMicrosecondScale;
+    config.isochronousFrameNS     = kMillisecondScale;
+
+    config.interruptMaxPacketSize = 16;
+    config.bulkMaxPacketSize      = 64;
+
+    // The Bluetooth core specification's SCO alternate settings for 0 to 3 voice channels and mSBC / 16 bit
+    const UInt16 isochronous[] = { 0, 9, 17, 25, 33, 49 };
+    config.isochronousSettings    = sizeof(isochronous) / sizeof(isochronous[0]);
+    memcpy(config.isochronousMaxPacketSize, isochronous, sizeof(isochronous));
+
+    config.failEvery              = 0;
+    config.injectedError          = kIOReturnNotResponding;
+    config.hciCommandCredits      = 1;
+    config.qcaRomVersion          = 0x00000302;           /* ROME 3.2 */
+    return config;
+}
+
+/* ---- IOUSBHostPipe ---- */
+
+void IOUSBHostPipe::simInit(IOUSBHostSimController * controller, const StandardUSB::EndpointDescriptor * descriptor)
+{
+    simController = controller;
+    if (descriptor)
+    {
+        endpointDescriptor = *descriptor;
+    }
+}
+
+IOReturn IOUSBHostPipe::io(IOMemoryDescriptor * dataBuffer, uint32_t dataBufferLength, IOUSBHostCompletion * completion, uint32_t completionTimeoutMs)
+{
+    if (!simController)
+    {
+        return kIOReturnNoDevice;
+    }
+    if (!completion || !completion->action)
+    {
+        return kIOReturnBadArgument;
+    }
+    return simController->submitData(this, dataBuffer, dataBufferLength, completion, completionTimeoutMs);
+}
+
+IOReturn IOUSBHostPipe::io(IOMemoryDescriptor * dataBuffer, uint32_t dataBufferLength, uint32_t & bytesTransferred, uint32_t completionTimeoutMs)
+{
+    bytesTransferred = 0;
+    if (!simController)
+    {
+        return kIOReturnNoDevice;
+    }
+    return simController->submitDataSync(this, dataBuffer, dataBufferLength, bytesTransferred, completionTimeoutMs);
+}
+
+IOReturn IOUSBHostPipe::io(IOMemoryDescriptor * dataBuffer, IOUSBHostIsochronousFrame * frameList, uint32_t frameListCount, uint64_t firstFrameNumber, IOUSBHostIsochronousCompletion * completion)
+{
+    if (!simController)
+    {
+        return kIOReturnNoDevice;
+    }
+    if (!frameList || !frameListCount || !completion || !completion->action)
+    {
+        return kIOReturnBadArgument;
+    }
+    return simController->submitIsochronous(this, dataBuffer, frameList, frameListCount, completion);
+}
+
+IOReturn IOUSBHostPipe::abort(IOOptionBits options, IOReturn withError, IOService * forClient)
+{
+    if (!simController)
+    {
+        return kIOReturnNoDevice;
+    }
+    return simController->abort(this, withError);
+}
+
+IOReturn IOUSBHostPipe::clearStall(bool withRequest)
+{
+    return abort(kAbortAsynchronous, kIOReturnAborted);
+}
+
+/* ---- IOUSBHostDevice ---- */
+
+IOReturn IOUSBHostDevice::deviceRequest(IOService * forClient, StandardUSB::DeviceRequest & request, void * dataBuffer, uint32_t & bytesTransferred, uint32_t completionTimeoutMs)
+{
+    bytesTransferred = 0;
+    return simController ? simController->submitControlSync(request, NULL, dataBuffer, bytesTransferred, completionTimeoutMs) : kIOReturnNoDevice;
+}
+
+IOReturn IOUSBHostDevice::deviceRequest(IOService * forClient, StandardUSB::DeviceRequest & request, IOMemoryDescriptor * dataBuffer, uint32_t & bytesTransferred, uint32_t completionTimeoutMs)
+{
+    bytesTransferred = 0;
+    return simController ? simController->submitControlSync(request, dataBuffer, NULL, bytesTransferred, completionTimeoutMs) : kIOReturnNoDevice;
+}
+
+IOReturn IOUSBHostDevice::deviceRequest(IOService * forClient, StandardUSB::DeviceRequest & request, void * dataBuffer, IOUSBHostCompletion * completion, uint32_t completionTimeoutMs)
+{
+    if (!completion || !completion->action)
+    {
+        return kIOReturnBadArgument;
+    }
+    return simController ? simController->submitControl(request, NULL, dataBuffer, completion, completionTimeoutMs) : kIOReturnNoDevice;
+}
+
+IOReturn IOUSBHostDevice::deviceRequest(IOService * forClient, StandardUSB::DeviceRequest & request, IOMemoryDescriptor * dataBuffer, IOUSBHostCompletion * completion, uint32_t completionTimeoutMs)
+{
+    if (!completion || !completion->action)
+    {
+        return kIOReturnBadArgument;
+    }
+    return simController ? simController->submitControl(request, dataBuffer, NULL, completion, completionTimeoutMs) : kIOReturnNoDevice;
+}
+
+const StandardUSB::DeviceDescriptor * IOUSBHostDevice::getDeviceDescriptor()
+{
+    return &deviceDescriptor;
+}
+
+const StandardUSB::ConfigurationDescriptor * IOUSBHostDevice::getConfigurationDescriptor(uint8_t index)
+{
+    return index == 0 ? (const StandardUSB::ConfigurationDescriptor *) configuration : NULL;
+}
+
+const StandardUSB::ConfigurationDescriptor * IOUSBHostDevice::getConfigurationDescriptor()
+{
+    return currentConfiguration ? (const StandardUSB::ConfigurationDescriptor *) configuration : NULL;
+}
+
+const StandardUSB::StringDescriptor * IOUSBHostDevice::getStringDescriptor(uint8_t index, uint16_t languageID)
+{
+    // Read from the device every time; the caller owns and deletes the copy
+    UInt8 buffer[255];
+    uint32_t length = 0;
+    StandardUSB::DeviceRequest request =
+    {
+        .bmRequestType = makeDeviceRequestbmRequestType(kRequestDirectionIn, kRequestTypeStandard, kRequestRecipientDevice),
+        .bRequest      = kDeviceRequestGetDescriptor,
+        .wValue        = (UInt16) ((kDescriptorTypeString << 8) | index),
+        .wIndex        = languageID,
+        .wLength       = sizeof(buffer)
+    };
+
+    if (deviceRequest(this, request, (void *) buffer, length) != kIOReturnSuccess || length < kDescriptorSize || buffer[0] > length)
+    {
+        return NULL;
+    }
+
+    UInt8 * descriptor = (UInt8 *) ::operator new(buffer[0] > sizeof(StandardUSB::StringDescriptor) ? buffer[0] : sizeof(StandardUSB::StringDescriptor));
+    memcpy(descriptor, buffer, buffer[0]);
+    return (const StandardUSB::StringDescriptor *) descriptor;
+}
+
+IOReturn IOUSBHostDevice::setConfiguration(uint8_t bConfigurationValue, bool matchInterfaces)
+{
+    if (!simController)
+    {
+        return kIOReturnNoDevice;
+    }
+
+    uint32_t length = 0;
+    StandardUSB::DeviceRequest request =
+    {
+        .bmRequestType = makeDeviceRequestbmRequestType(kRequestDirectionOut, kRequestTypeStandard, kRequestRecipientDevice),
+        .bRequest      = kDeviceRequestSetConfiguration,
+        .wValue        = bConfigurationValue,
+        .wIndex        = 0,
+        .wLength       = 0
+    };
+
+    // Interfaces of the old configuration go away first, as they do when the family terminates them
+    simDetachInterfaces();
+
+    IOReturn result = simController->submitControlSync(request, NULL, NULL, length, kUSBHostStandardRequestCompletionTimeout);
+    if (result != kIOReturnSuccess)
+    {
+        return result;
+    }
+
+    currentConfiguration = bConfigurationValue;
+    if (currentConfiguration && matchInterfaces)
+    {
+        simAttachInterfaces();
+    }
+    return kIOReturnSuccess;
+}
+
+IOReturn IOUSBHostDevice::reset()
+{
+    return simController ? kIOReturnSuccess : kIOReturnNoDevice;
+}
+
+bool IOUSBHostDevice::simStart(const IOUSBHostSimConfig & config, IOUSBHostSimModel * model)
+{
+    if (simController)
+    {
+        return false;
+    }
+
+    deviceDescriptor.bLength            = sizeof(StandardUSB::DeviceDescriptor);
+    deviceDescriptor.bDescriptorType    = kDescriptorTypeDevice;
+    deviceDescriptor.bcdUSB             = HostToUSB16(0x0200);
+    deviceDescriptor.bDeviceClass       = 0xE0;     /* wireless controller */
+    deviceDescriptor.bDeviceSubClass    = 0x01;     /* RF controller */
+    deviceDescriptor.bDeviceProtocol    = 0x01;     /* Bluetooth programming interface */
+    deviceDescriptor.bMaxPacketSize0    = 64;
+    deviceDescriptor.idVendor           = HostToUSB16(config.vendorID);
+    deviceDescriptor.idProduct          = HostToUSB16(config.productID);
+    deviceDescriptor.bcdDevice          = HostToUSB16(config.bcdDevice);
+    deviceDescriptor.iManufacturer      = config.manufacturer ? 1 : 0;
+    deviceDescriptor.iProduct           = config.product ? 2 : 0;
+    deviceDescriptor.iSerialNumber      = config.serialNumber ? 3 : 0;
+    deviceDescriptor.bNumConfigurations = 1;
+
+    UInt8 settings = config.isochronousSettings < kIOUSBHostSimMaxAlternateSettings ? config.isochronousSettings : kIOUSBHostSimMaxAlternateSettings;
+    UInt16 total = sizeof(StandardUSB::ConfigurationDescriptor) + sizeof(StandardUSB::InterfaceDescriptor) + 3 * sizeof(StandardUSB::EndpointDescriptor) + settings * (sizeof(StandardUSB::InterfaceDescriptor) + 2 * sizeof(StandardUSB::EndpointDescriptor));
+
+    configuration = (UInt8 *) calloc(1, total);
+    UInt8 * cursor = configuration;
+
+    StandardUSB::ConfigurationDescriptor * configurationDescriptor = (StandardUSB::ConfigurationDescriptor *) cursor;
+    configurationDescriptor->bLength             = sizeof(StandardUSB::ConfigurationDescriptor);
+    configurationDescriptor->bDescriptorType     = kDescriptorTypeConfiguration;
+    configurationDescriptor->wTotalLength        = HostToUSB16(total);
+    configurationDescriptor->bNumInterfaces      = settings ? 2 : 1;
+    configurationDescriptor->bConfigurationValue = 1;
+    configurationDescriptor->bmAttributes        = 0xE0;
+    configurationDescriptor->MaxPower            = 50;
+    cursor += sizeof(StandardUSB::ConfigurationDescriptor);
+
+    auto addInterface = [&cursor] (UInt8 number, UInt8 alternateSetting, UInt8 endpoints)
+    {
+        StandardUSB::InterfaceDescriptor * interface = (StandardUSB::InterfaceDescriptor *) cursor;
+        interface->bLength            = sizeof(StandardUSB::InterfaceDescriptor);
+        interface->bDescriptorType    = kDescriptorTypeInterface;
+        interface->bInterfaceNumber   = number;
+        interface->bAlternateSetting  = alternateSetting;
+        interface->bNumEndpoints      = endpoints;
+        interface->bInterfaceClass    = 0xE0;
+        interface->bInterfaceSubClass = 0x01;
+        interface->bInterfaceProtocol = 0x01;
+        cursor += sizeof(StandardUSB::InterfaceDescriptor);
+    };
+
+    auto addEndpoint = [&cursor] (UInt8 address, UInt8 type, UInt16 maxPacketSize, UInt8 interval)
+    {
+        StandardUSB::EndpointDescriptor * endpoint = (StandardUSB::EndpointDescriptor *) cursor;
+        endpoint->bLength          = sizeof(StandardUSB::EndpointDescriptor);
+        endpoint->bDescriptorType  = kDescriptorTypeEndpoint;
+        endpoint->bEndpointAddress = address;
+        endpoint->bmAttributes     = type;
+        endpoint->wMaxPacketSize   = HostToUSB16(maxPacketSize);
+        endpoint->bInterval        = interval;
+        cursor += sizeof(StandardUSB::EndpointDescriptor);
+    };
+
+    addInterface(0, 0, 3);
+    addEndpoint(0x81, kEndpointTypeInterrupt, config.interruptMaxPacketSize, 1);
+    addEndpoint(0x82, kEndpointTypeBulk, config.bulkMaxPacketSize, 0);
+    addEndpoint(0x02, kEndpointTypeBulk, config.bulkMaxPacketSize, 0);
+
+    for (UInt8 i = 0; i < settings; ++i)
+    {
+        addInterface(1, i, 2);
+        addEndpoint(0x83, kEndpointTypeIsochronous, config.isochronousMaxPacketSize[i], 1);
+        addEndpoint(0x03, kEndpointTypeIsochronous, config.isochronousMaxPacketSize[i], 1);
+    }
+
+    simController = new IOUSBHostSimController(this, config, model);
+
+    // Enumeration leaves the device configured with its interfaces published
+    if (setConfiguration(1) != kIOReturnSuccess)
+    {
+        simStop();
+        return false;
+    }
+    return true;
+}
+
+void IOUSBHostDevice::simStop()
+{
+    simDetachInterfaces();
+    currentConfiguration = 0;
+
+    if (simController)
+    {
+        simController->stop();
+        delete simController;
+        simController = NULL;
+    }
+
+    if (configuration)
+    {
+        ::free(configuration);
+        configuration = NULL;
+    }
+}
+
+void IOUSBHostDevice::simAttachInterfaces()
+{
+    const StandardUSB::ConfigurationDescriptor * configurationDescriptor = (const StandardUSB::ConfigurationDescriptor *) configuration;
+
+    for (UInt8 number = 0; number < configurationDescriptor->bNumInterfaces; ++number)
+    {
+        IOUSBHostInterface * interface = IOUSBHostSimNewInterface();
+        if (!interface->init())
+        {
+            interface->release();
+            continue;
+        }
+
+        interface->simInit(this, number);
+        interface->setProperty("bInterfaceNumber", number, 8);
+        interface->attach(this);
+        interface->registerService();
+        interface->release();
+    }
+}
+
+void IOUSBHostDevice::simDetachInterfaces()
+{
+    OSIterator * iterator = getChildIterator(gIOServicePlane);
+    if (!iterator)
+    {
+        return;
+    }
+
+    OSObject * child;
+    while ((child = iterator->getNextObject()))
+    {
+        IOUSBHostInterface * interface = OSDynamicCast(IOUSBHostInterface, child);
+        if (interface)
+        {
+            interface->terminate();
+            interface->simReleasePipes();
+            interface->detach(this);
+        }
+    }
+    iterator->release();
+}
+
+void IOUSBHostDevice::free()
+{
+    simStop();
+    IOService::free();
+}
+
+/* ---- IOUSBHostInterface ---- */
+
+void IOUSBHostInterface::simInit(IOUSBHostDevice * device, UInt8 interfaceNumber)
+{
+    simDevice             = device;
+    this->interfaceNumber = interfaceNumber;
+    pipeLock              = IOLockAlloc();
+
+    const StandardUSB::InterfaceDescriptor * descriptor = NULL;
+    while ((descriptor = StandardUSB::getNextInterfaceDescriptor(device->getConfigurationDescriptor(0), descriptor)))
+    {
+        if (descriptor->bInterfaceNumber == interfaceNumber)
+        {
+            interfaceDescriptor = descriptor;
+            break;
+        }
+    }
+}
+
+const StandardUSB::InterfaceDescriptor * IOUSBHostInterface::getInterfaceDescriptor()
+{
+    return interfaceDescriptor;
+}
+
+const StandardUSB::ConfigurationDescriptor * IOUSBHostInterface::getConfigurationDescriptor()
+{
+    return simDevice ? simDevice->getConfigurationDescriptor() : NULL;
+}
+
+IOReturn IOUSBHostInterface::selectAlternateSetting(uint8_t bAlternateSetting)
+{
+    if (!simDevice || isInactive())
+    {
+        return kIOReturnNoDevice;
+    }
+
+    const StandardUSB::InterfaceDescriptor * descriptor = NULL;
+    while ((descriptor = StandardUSB::getNextInterfaceDescriptor(getConfigurationDescriptor(), descriptor)))
+    {
+        if (descriptor->bInterfaceNumber == interfaceNumber && descriptor->bAlternateSetting == bAlternateSetting)
+        {
+            break;
+        }
+    }
+    if (!descriptor)
+    {
+        return kIOReturnBadArgument;
+    }
+
+    uint32_t length = 0;
+    StandardUSB::DeviceRequest request =
+    {
+        .bmRequestType = makeDeviceRequestbmRequestType(kRequestDirectionOut, kRequestTypeStandard, kRequestRecipientInterface),
+        .bRequest      = kDeviceRequestSetInterface,
+        .wValue        = bAlternateSetting,
+        .wIndex        = interfaceNumber,
+        .wLength       = 0
+    };
+
+    IOReturn result = simDevice->deviceRequest(this, request, (void *) NULL, length);
+    if (result != kIOReturnSuccess)
+    {
+        return result;
+    }
+
+    // Pipes of the old setting are gone; clients have to copy them again
+    simReleasePipes();
+
+    IOLockLock(pipeLock);
+    interfaceDescriptor = descriptor;
+    IOLockUnlock(pipeLock);
+    return kIOReturnSuccess;
+}
+
+IOUSBHostPipe * IOUSBHostInterface::copyPipe(uint8_t address)
+{
+    if (!simDevice || isInactive())
+    {
+        return NULL;
+    }
+
+    UInt32 slot = (address & 0x0F) | ((address & 0x80) ? 0x10 : 0);
+
+    IOLockLock(pipeLock);
+    IOUSBHostPipe * pipe = pipes[slot];
+    if (!pipe)
+    {
+        const StandardUSB::EndpointDescriptor * endpoint = NULL;
+        while ((endpoint = StandardUSB::getNextEndpointDescriptor(getConfigurationDescriptor(), interfaceDescriptor, endpoint)))
+        {
+            if (endpoint->bEndpointAddress == address)
+            {
+                break;
+            }
+        }
+
+        if (endpoint)
+        {
+            pipe = IOUSBHostSimNewPipe();
+            if (pipe->init())
+            {
+                pipe->simInit(simDevice->simGetController(), endpoint);
+                pipes[slot] = pipe;
+            }
+            else
+            {
+                OSSafeReleaseNULL(pipe);
+            }
+        }
+    }
+
+    if (pipe)
+    {
+        pipe->retain();
+    }
+    IOLockUnlock(pipeLock);
+    return pipe;
+}
+
+void IOUSBHostInterface::close(IOService * forClient, IOOptionBits options)
+{
+    IOService::close(forClient, options);
+}
+
+void IOUSBHostInterface::simReleasePipes()
+{
+    IOUSBHostPipe * released[kIOUSBHostInterfaceMaxPipes];
+
+    if (!pipeLock)
+    {
+        return;
+    }
+
+    IOLockLock(pipeLock);
+    memcpy(released, pipes, sizeof(released));
+    bzero(pipes, sizeof(pipes));
+    IOLockUnlock(pipeLock);
+
+    // Outstanding transfers complete with kIOReturnAborted; references clients still hold become dead pipes
+    for (UInt32 i = 0; i < kIOUSBHostInterfaceMaxPipes; ++i)
+    {
+        if (released[i])
+        {
+            released[i]->abort();
+            released[i]->simInit(NULL, NULL);
+            released[i]->release();
+        }
+    }
+}
+
+void IOUSBHostInterface::free()
+{
+    simReleasePipes();
+
+    if (pipeLock)
+    {
+        IOLockFree(pipeLock);
+        pipeLock = NULL;
+    }
+    IOService::free();
+}
+
+/* ---- Controller ---- */
+
+struct IOUSBHostSimController::Endpoint
+{
+    UInt8                               address;
+    UInt8                               type;
+    UInt16                              maxPacketSize;
+    UInt64                              busyUntil;
+    std::deque<TransferRef>             pendingIn;      /* IN transfers waiting for device data */
+    std::deque<std::vector<UInt8>>      inData;         /* device data waiting for an IN transfer */
+    std::vector<TransferRef>            active;         /* everything not finished yet, for abort */
+};
+
+struct IOUSBHostSimController::Transfer
+{
+    Endpoint                          * endpoint;
+    StandardUSB::DeviceRequest          request;
+    IOMemoryDescriptor                * buffer;         /* retained */
+    void                              * bytes;
+    uint32_t                            length;
+    IOUSBHostCompletion                 completion;
+    IOUSBHostIsochronousCompletion      isochronousCompletion;
+    IOUSBHostIsochronousFrame         * frames;
+    uint32_t                            frameCount;
+    bool                                sync;
+    bool                                finished;       /* outcome decided, delivery scheduled */
+    bool                                delivered;
+    IOReturn                            status;
+    uint32_t                            bytesTransferred;
+
+    ~Transfer()
+    {
+        OSSafeReleaseNULL(buffer);
+    }
+
+    IOByteCount read(IOByteCount offset, void * to, IOByteCount count)
+    {
+        if (buffer)
+        {
+            return buffer->readBytes(offset, to, count);
+        }
+        if (bytes)
+        {
+            memcpy(to, (UInt8 *) bytes + offset, count);
+            return count;
+        }
+        return 0;
+    }
+
+    IOByteCount write(IOByteCount offset, const void * from, IOByteCount count)
+    {
+        if (buffer)
+        {
+            return buffer->writeBytes(offset, from, count);
+        }
+        if (bytes)
+        {
+            memcpy((UInt8 *) bytes + offset, from, count);
+            return count;
+        }
+        return 0;
+    }
+};
+
+static thread_local IOUSBHostSimController * gCurrentController = NULL;
+
+IOUSBHostSimController::IOUSBHostSimController(IOUSBHostDevice * device, const IOUSBHostSimConfig & config, IOUSBHostSimModel * model) :
+    device(device), config(config), model(model), sequence(0), running(true), configurationValue(0), transferCount(0)
+{
+    bzero(&statistics, sizeof(statistics));
+    if (!this->config.isochronousFrameNS)
+    {
+        this->config.isochronousFrameNS = kMillisecondScale;
+    }
+    thread = std::thread(&IOUSBHostSimController::run, this);
+}
+
+IOUSBHostSimController::~IOUSBHostSimController()
+{
+    stop();
+    for (auto & entry : endpoints)
+    {
+        delete entry.second;
+    }
+}
+
+void IOUSBHostSimController::stop()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (!running)
+        {
+            return;
+        }
+
+        // Everything outstanding completes before the thread goes away, so clients can unwind
+        for (auto & entry : endpoints)
+        {
+            abortLocked(entry.second, kIOReturnAborted);
+        }
+        scheduleLocked(mach_absolute_time(), [this] ()
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            running = false;
+        });
+    }
+
+    if (thread.joinable())
+    {
+        thread.join();
+    }
+
+    // Synchronous callers still waiting would never be woken
+    std::lock_guard<std::mutex> guard(lock);
+    while (!events.empty())
+    {
+        events.pop();
+    }
+    syncWake.notify_all();
+}
+
+bool IOUSBHostSimController::isControllerThread() const
+{
+    return gCurrentController == this;
+}
+
+void IOUSBHostSimController::run()
+{
+    gCurrentController = this;
+
+    std::unique_lock<std::mutex> guard(lock);
+    while (running)
+    {
+        if (events.empty())
+        {
+            wake.wait(guard);
+            continue;
+        }
+
+        UInt64 now = mach_absolute_time();
+        UInt64 due = events.top().due;
+        if (due > now)
+        {
+            // A condition variable wakes up tens of microseconds late; spin through the last stretch
+            if (due - now > 100 * kMicrosecondScale)
+            {
+                wake.wait_for(guard, std::chrono::nanoseconds(due - now - 60 * kMicrosecondScale));
+            }
+            else
+            {
+                guard.unlock();
+                std::this_thread::yield();
+                guard.lock();
+            }
+            continue;
+        }
+
+        std::function<void()> fn = std::move(const_cast<Event &> (events.top()).fn);
+        events.pop();
+
+        guard.unlock();
+        fn();
+        guard.lock();
+    }
+}
+
+void IOUSBHostSimController::scheduleLocked(UInt64 due, std::function<void()> fn)
+{
+    bool earliest = events.empty() || due < events.top().due;
+    events.push({ due, sequence++, std::move(fn) });
+    if (earliest)
+    {
+        wake.notify_one();
+    }
+}
+
+void IOUSBHostSimController::schedule(UInt64 delayNS, std::function<void()> fn)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if (running)
+    {
+        scheduleLocked(mach_absolute_time() + delayNS, std::move(fn));
+    }
+}
+
+IOUSBHostSimController::Endpoint * IOUSBHostSimController::endpointForLocked(UInt8 address, UInt8 type, UInt16 maxPacketSize)
+{
+    Endpoint *& endpoint = endpoints[address];
+    if (!endpoint)
+    {
+        endpoint = new Endpoint;
+        endpoint->address   = address;
+        endpoint->busyUntil = 0;
+    }
+
+    // Alternate settings may change the packet size of the same address
+    endpoint->type          = type;
+    endpoint->maxPacketSize = maxPacketSize ? maxPacketSize : 64;
+    return endpoint;
+}
+
+UInt64 IOUSBHostSimController::transferTime(const Endpoint * endpoint, UInt32 length) const
+{
+    UInt64 packets = length ? (length + endpoint->maxPacketSize - 1) / endpoint->maxPacketSize : 1;
+    UInt64 base = (endpoint->type == kEndpointTypeControl) ? config.controlLatencyNS : config.transferLatencyNS;
+    return base + packets * config.packetLatencyNS;
+}
+
+bool IOUSBHostSimController::injectFailureLocked()
+{
+    ++transferCount;
+    if (config.failEvery && !(transferCount % config.failEvery))
+    {
+        ++statistics.injectedErrors;
+        return true;
+    }
+    return false;
+}
+
+IOReturn IOUSBHostSimController::submitLocked(const TransferRef & transfer, uint32_t timeoutMS)
+{
+    if (!running)
+    {
+        return kIOReturnNoDevice;
+    }
+
+    Endpoint * endpoint = transfer->endpoint;
+    UInt64 now = mach_absolute_time();
+
+    endpoint->active.push_back(transfer);
+    if (endpoint->active.size() > statistics.peakOutstanding)
+    {
+        statistics.peakOutstanding = (UInt32) endpoint->active.size();
+    }
+
+    if (timeoutMS)
+    {
+        scheduleLocked(now + (UInt64) timeoutMS * kMillisecondScale, [this, transfer] ()
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if (!transfer->finished)
+            {
+                ++statistics.timeouts;
+                finishLocked(transfer, kIOReturnTimeout, 0, mach_absolute_time());
+            }
+        });
+    }
+
+    // The error is found when the transfer hits the bus
+    if (injectFailureLocked())
+    {
+        finishLocked(transfer, config.injectedError, 0, now + transferTime(endpoint, 0) + config.completionLatencyNS);
+        return kIOReturnSuccess;
+    }
+
+    if (endpoint->type == kEndpointTypeControl)
+    {
+        UInt64 start = endpoint->busyUntil > now ? endpoint->busyUntil : now;
+        endpoint->busyUntil = start + transferTime(endpoint, transfer->length);
+        ++statistics.controlTransfers;
+        scheduleLocked(endpoint->busyUntil, [this, transfer] ()
+        {
+            handleControl(transfer);
+        });
+    }
+    else if (endpoint->address & 0x80)
+    {
+        endpoint->pendingIn.push_back(transfer);
+        matchInLocked(endpoint);
+    }
+    else
+    {
+        UInt64 start = endpoint->busyUntil > now ? endpoint->busyUntil : now;
+        endpoint->busyUntil = start + transferTime(endpoint, transfer->length);
+        ++statistics.dataTransfers;
+        scheduleLocked(endpoint->busyUntil, [this, transfer] ()
+        {
+            handleOut(transfer);
+        });
+    }
+    return kIOReturnSuccess;
+}
+
+void IOUSBHostSimController::finishLocked(const TransferRef & transfer, IOReturn status, UInt32 bytes, UInt64 due)
+{
+    if (transfer->finished)
+    {
+        return;
+    }
+
+    transfer->finished         = true;
+    transfer->status           = status;
+    transfer->bytesTransferred = bytes;
+
+    std::vector<TransferRef> & active = transfer->endpoint->active;
+    for (auto it = active.begin(); it != active.end(); ++it)
+    {
+        if (*it == transfer)
+        {
+            active.erase(it);
+            break;
+        }
+    }
+
+    if (status == kIOReturnAborted)
+    {
+        ++statistics.aborted;
+    }
+
+    if (transfer->sync)
+    {
+        // The waiter returns once the completion would have been delivered
+        scheduleLocked(due, [this, transfer] ()
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            transfer->delivered = true;
+            syncWake.notify_all();
+        });
+    }
+    else
+    {
+        scheduleLocked(due, [this, transfer] ()
+        {
+            deliver(transfer);
+        });
+    }
+}
+
+void IOUSBHostSimController::deliver(const TransferRef & transfer)
+{
+    transfer->delivered = true;
+
+    if (transfer->frames)
+    {
+        IOUSBHostIsochronousCompletion completion = transfer->isochronousCompletion;
+        completion.action(completion.owner, completion.parameter, transfer->status, transfer->frames);
+    }
+    else
+    {
+        IOUSBHostCompletion completion = transfer->completion;
+        completion.action(completion.owner, completion.parameter, transfer->status, transfer->bytesTransferred);
+    }
+}
+
+IOReturn IOUSBHostSimController::waitLocked(std::unique_lock<std::mutex> & guard, const TransferRef & transfer, uint32_t & bytesTransferred)
+{
+    while (!transfer->delivered && running)
+    {
+        syncWake.wait(guard);
+    }
+
+    if (!transfer->delivered)
+    {
+        return kIOReturnNoDevice;
+    }
+    bytesTransferred = transfer->bytesTransferred;
+    return transfer->status;
+}
+
+void IOUSBHostSimController::pushInLocked(Endpoint * endpoint, std::vector<UInt8> && data)
+{
+    endpoint->inData.push_back(std::move(data));
+    matchInLocked(endpoint);
+}
+
+void IOUSBHostSimController::matchInLocked(Endpoint * endpoint)
+{
+    UInt64 now = mach_absolute_time();
+
+    while (!endpoint->pendingIn.empty() && !endpoint->inData.empty())
+    {
+        TransferRef transfer = endpoint->pendingIn.front();
+        endpoint->pendingIn.pop_front();
+        if (transfer->finished)
+        {
+            continue;
+        }
+
+        // One queued chunk per transfer; a short chunk ends the transfer like a short packet does
+        std::vector<UInt8> & chunk = endpoint->inData.front();
+        UInt32 count = (UInt32) (chunk.size() < transfer->length ? chunk.size() : transfer->length);
+        transfer->write(0, chunk.data(), count);
+        if (count < chunk.size())
+        {
+            chunk.erase(chunk.begin(), chunk.begin() + count);
+        }
+        else
+        {
+            endpoint->inData.pop_front();
+        }
+
+        UInt64 start = endpoint->busyUntil > now ? endpoint->busyUntil : now;
+        endpoint->busyUntil = start + transferTime(endpoint, count);
+        ++statistics.dataTransfers;
+        statistics.bytesIn += count;
+        finishLocked(transfer, kIOReturnSuccess, count, endpoint->busyUntil + config.completionLatencyNS);
+    }
+
+    while (!endpoint->pendingIn.empty() && endpoint->pendingIn.front()->finished)
+    {
+        endpoint->pendingIn.pop_front();
+    }
+}
+
+void IOUSBHostSimController::abortLocked(Endpoint * endpoint, IOReturn withError)
+{
+    std::vector<TransferRef> active = endpoint->active;
+    UInt64 now = mach_absolute_time();
+
+    for (const TransferRef & transfer : active)
+    {
+        finishLocked(transfer, withError, 0, now);
+    }
+    endpoint->pendingIn.clear();
+    endpoint->busyUntil = now;
+}
+
+void IOUSBHostSimController::handleOut(const TransferRef & transfer)
+{
+    std::vector<UInt8> data(transfer->length);
+    transfer->read(0, data.data(), data.size());
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (transfer->finished)
+        {
+            return;
+        }
+    }
+
+    IOReturn status = model ? model->dataOut(this, transfer->endpoint->address, data.data(), (UInt32) data.size()) : kIOReturnSuccess;
+
+    std::lock_guard<std::mutex> guard(lock);
+    if (status == kIOReturnSuccess)
+    {
+        statistics.bytesOut += data.size();
+        statistics.zeroLengthPackets += data.empty();
+    }
+    finishLocked(transfer, status, status == kIOReturnSuccess ? (UInt32) data.size() : 0, mach_absolute_time() + config.completionLatencyNS);
+}
+
+IOReturn IOUSBHostSimController::standardRequest(const StandardUSB::DeviceRequest & request, UInt8 * data, UInt32 & length)
+{
+    UInt32 requested = length;
+    length = 0;
+
+    switch (request.bRequest)
+    {
+        case kDeviceRequestGetDescriptor:
+        {
+            UInt8 type  = request.wValue >> 8;
+            UInt8 index = request.wValue & 0xFF;
+            UInt8 string[255];
+            const void * source = NULL;
+            UInt32 size = 0;
+
+            if (type == kDescriptorTypeDevice)
+            {
+                source = device->getDeviceDescriptor();
+                size   = sizeof(StandardUSB::DeviceDescriptor);
+            }
+            else if (type == kDescriptorTypeConfiguration && index == 0)
+            {
+                source = device->getConfigurationDescriptor(0);
+                size   = USBToHost16(device->getConfigurationDescriptor(0)->wTotalLength);
+            }
+            else if (type == kDescriptorTypeString)
+            {
+                const char * strings[] = { config.manufacturer, config.product, config.serialNumber };
+                std::lock_guard<std::mutex> guard(lock);
+                ++statistics.stringFetches;
+
+                string[1] = kDescriptorTypeString;
+                if (index == 0)
+                {
+                    string[0] = 4;
+                    string[2] = kLanguageIDEnglishUS & 0xFF;
+                    string[3] = kLanguageIDEnglishUS >> 8;
+                }
+                else if (index <= 3 && strings[index - 1] && request.wIndex == kLanguageIDEnglishUS)
+                {
+                    UInt32 characters = (UInt32) strlen(strings[index - 1]);
+                    if (characters > 126)
+                    {
+                        characters = 126;
+                    }
+                    for (UInt32 i = 0; i < characters; ++i)
+                    {
+                        string[2 + 2 * i] = (UInt8) strings[index - 1][i];
+                        string[3 + 2 * i] = 0;
+                    }
+                    string[0] = (UInt8) (2 + 2 * characters);
+                }
+                else
+                {
+                    return kIOReturnBadArgument;
+                }
+                source = string;
+                size   = string[0];
+            }
+            else
+            {
+                return kIOReturnUnsupported;
+            }
+
+            length = size < requested ? size : requested;
+            memcpy(data, source, length);
+            return kIOReturnSuccess;
+        }
+
+        case kDeviceRequestGetStatus:
+            if (requested < 2)
+            {
+                return kIOReturnBadArgument;
+            }
+            data[0] = 0x01;         /* self powered */
+            data[1] = 0x00;
+            length  = 2;
+            return kIOReturnSuccess;
+
+        case kDeviceRequestGetConfiguration:
+            if (requested < 1)
+            {
+                return kIOReturnBadArgument;
+            }
+            data[0] = configurationValue;
+            length  = 1;
+            return kIOReturnSuccess;
+
+        case kDeviceRequestSetConfiguration:
+            configurationValue = (UInt8) request.wValue;
+            return kIOReturnSuccess;
+
+        case kDeviceRequestSetInterface:
+        case kDeviceRequestClearFeature:
+        case kDeviceRequestSetFeature:
+            return kIOReturnSuccess;
+
+        default:
+            return kIOReturnUnsupported;
+    }
+}
+
+void IOUSBHostSimController::handleControl(const TransferRef & transfer)
+{
+    const StandardUSB::DeviceRequest & request = transfer->request;
+    bool in = request.bmRequestType & 0x80;
+    UInt8 type = (request.bmRequestType >> 5) & 0x3;
+    UInt32 length = transfer->length;
+    std::vector<UInt8> data(length > 0 ? length : 1);
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (transfer->finished)
+        {
+            return;
+        }
+    }
+
+    if (!in && length)
+    {
+        transfer->read(0, data.data(), length);
+    }
+
+    IOReturn status;
+    if (type == kRequestTypeStandard)
+    {
+        status = standardRequest(request, data.data(), length);
+    }
+    else
+    {
+        if (type == kRequestTypeClass && !in)
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            ++statistics.hciCommands;
+        }
+        status = model ? model->controlRequest(this, request, data.data(), length) : kIOReturnUnsupported;
+    }
+
+    if (status == kIOReturnSuccess && in && length)
+    {
+        transfer->write(0, data.data(), length);
+    }
+
+    std::lock_guard<std::mutex> guard(lock);
+    if (status == kIOReturnSuccess)
+    {
+        (in ? statistics.bytesIn : statistics.bytesOut) += length;
+    }
+    finishLocked(transfer, status, status == kIOReturnSuccess ? length : 0, mach_absolute_time() + config.completionLatencyNS);
+}
+
+IOReturn IOUSBHostSimController::submitControl(const StandardUSB::DeviceRequest & request, IOMemoryDescriptor * buffer, void * bytes, IOUSBHostCompletion * completion, uint32_t timeoutMS)
+{
+    TransferRef transfer = std::make_shared<Transfer>();
+    transfer->request    = request;
+    transfer->buffer     = buffer;
+    transfer->bytes      = bytes;
+    transfer->length     = USBToHost16(request.wLength);
+    transfer->completion = *completion;
+    if (buffer)
+    {
+        buffer->retain();
+    }
+
+    std::lock_guard<std::mutex> guard(lock);
+    transfer->endpoint = endpointForLocked(0, kEndpointTypeControl, 64);
+    return submitLocked(transfer, timeoutMS);
+}
+
+IOReturn IOUSBHostSimController::submitControlSync(const StandardUSB::DeviceRequest & request, IOMemoryDescriptor * buffer, void * bytes, uint32_t & bytesTransferred, uint32_t timeoutMS)
+{
+    if (isControllerThread())
+    {
+        return kIOReturnNotPermitted;
+    }
+
+    TransferRef transfer = std::make_shared<Transfer>();
+    transfer->request = request;
+    transfer->buffer  = buffer;
+    transfer->bytes   = bytes;
+    transfer->length  = USBToHost16(request.wLength);
+    transfer->sync    = true;
+    if (buffer)
+    {
+        buffer->retain();
+    }
+
+    std::unique_lock<std::mutex> guard(lock);
+    transfer->endpoint = endpointForLocked(0, kEndpointTypeControl, 64);
+    IOReturn result = submitLocked(transfer, timeoutMS);
+    if (result != kIOReturnSuccess)
+    {
+        return result;
+    }
+    return waitLocked(guard, transfer, bytesTransferred);
+}
+
+IOReturn IOUSBHostSimController::submitData(IOUSBHostPipe * pipe, IOMemoryDescriptor * buffer, uint32_t length, IOUSBHostCompletion * completion, uint32_t timeoutMS)
+{
+    const StandardUSB::EndpointDescriptor * descriptor = pipe->getEndpointDescriptor();
+    if (!buffer || length > buffer->getLength())
+    {
+        return kIOReturnBadArgument;
+    }
+
+    TransferRef transfer = std::make_shared<Transfer>();
+    transfer->buffer     = buffer;
+    transfer->length     = length;
+    transfer->completion = *completion;
+    buffer->retain();
+
+    std::lock_guard<std::mutex> guard(lock);
+    transfer->endpoint = endpointForLocked(descriptor->bEndpointAddress, getEndpointType(descriptor), getEndpointMaxPacketSize(descriptor));
+    return submitLocked(transfer, timeoutMS);
+}
+
+IOReturn IOUSBHostSimController::submitDataSync(IOUSBHostPipe * pipe, IOMemoryDescriptor * buffer, uint32_t length, uint32_t & bytesTransferred, uint32_t timeoutMS)
+{
+    const StandardUSB::EndpointDescriptor * descriptor = pipe->getEndpointDescriptor();
+    if (!buffer || length > buffer->getLength())
+    {
+        return kIOReturnBadArgument;
+    }
+    if (isControllerThread())
+    {
+        return kIOReturnNotPermitted;
+    }
+
+    TransferRef transfer = std::make_shared<Transfer>();
+    transfer->buffer = buffer;
+    transfer->length = length;
+    transfer->sync   = true;
+    buffer->retain();
+
+    std::unique_lock<std::mutex> guard(lock);
+    transfer->endpoint = endpointForLocked(descriptor->bEndpointAddress, getEndpointType(descriptor), getEndpointMaxPacketSize(descriptor));
+    IOReturn result = submitLocked(transfer, timeoutMS);
+    if (result != kIOReturnSuccess)
+    {
+        return result;
+    }
+    return waitLocked(guard, transfer, bytesTransferred);
+}
+
+IOReturn IOUSBHostSimController::submitIsochronous(IOUSBHostPipe * pipe, IOMemoryDescriptor * buffer, IOUSBHostIsochronousFrame * frames, uint32_t frameCount, IOUSBHostIsochronousCompletion * completion)
+{
+    const StandardUSB::EndpointDescriptor * descriptor = pipe->getEndpointDescriptor();
+    UInt32 total = 0;
+
+    for (uint32_t i = 0; i < frameCount; ++i)
+    {
+        total += frames[i].requestCount;
+    }
+    if (!buffer || total > buffer->getLength())
+    {
+        return kIOReturnBadArgument;
+    }
+
+    TransferRef transfer = std::make_shared<Transfer>();
+    transfer->buffer                = buffer;
+    transfer->length                = total;
+    transfer->frames                = frames;
+    transfer->frameCount            = frameCount;
+    transfer->isochronousCompletion = *completion;
+    buffer->retain();
+
+    std::lock_guard<std::mutex> guard(lock);
+    if (!running)
+    {
+        return kIOReturnNoDevice;
+    }
+
+    Endpoint * endpoint = endpointForLocked(descriptor->bEndpointAddress, kEndpointTypeIsochronous, getEndpointMaxPacketSize(descriptor));
+    transfer->endpoint = endpoint;
+    endpoint->active.push_back(transfer);
+
+    // Frames are consecutive and start with the next bus frame after whatever is already scheduled
+    UInt64 now = mach_absolute_time();
+    UInt64 start = endpoint->busyUntil;
+    if (start <= now)
+    {
+        // Idle endpoint: wait for the next frame boundary. A queued transfer continues without a gap.
+        start = (now / config.isochronousFrameNS + 1) * config.isochronousFrameNS;
+    }
+    endpoint->busyUntil = start + (UInt64) frameCount * config.isochronousFrameNS;
+    ++statistics.dataTransfers;
+
+    bool failed = injectFailureLocked();
+    scheduleLocked(endpoint->busyUntil, [this, transfer, start, failed] ()
+    {
+        Endpoint * endpoint = transfer->endpoint;
+        bool in = endpoint->address & 0x80;
+        IOByteCount offset = 0;
+        std::vector<UInt8> out;
+
+        std::unique_lock<std::mutex> guard(lock);
+        if (transfer->finished)
+        {
+            return;
+        }
+
+        for (uint32_t i = 0; i < transfer->frameCount; ++i)
+        {
+            IOUSBHostIsochronousFrame & frame = transfer->frames[i];
+            UInt32 count = frame.requestCount < endpoint->maxPacketSize ? frame.requestCount : endpoint->maxPacketSize;
+
+            frame.timeStamp = start + i * config.isochronousFrameNS;
+            frame.status = failed ? config.injectedError : kIOReturnSuccess;
+            frame.completeCount = 0;
+            if (failed)
+            {
+                offset += frame.requestCount;
+                continue;
+            }
+
+            if (in)
+            {
+                // A frame carries at most one packet of what the device has queued, or nothing
+                if (!endpoint->inData.empty())
+                {
+                    std::vector<UInt8> & chunk = endpoint->inData.front();
+                    count = (UInt32) (chunk.size() < count ? chunk.size() : count);
+                    transfer->write(offset, chunk.data(), count);
+                    chunk.erase(chunk.begin(), chunk.begin() + count);
+                    if (chunk.empty())
+                    {
+                        endpoint->inData.pop_front();
+                    }
+                    frame.completeCount = count;
+                    statistics.bytesIn += count;
+                }
+            }
+            else
+            {
+                size_t at = out.size();
+                out.resize(at + count);
+                transfer->read(offset, out.data() + at, count);
+                frame.completeCount = count;
+                statistics.bytesOut += count;
+            }
+            offset += frame.requestCount;
+        }
+        guard.unlock();
+
+        if (!out.empty() && model)
+        {
+            model->dataOut(this, endpoint->address, out.data(), (UInt32) out.size());
+        }
+
+        guard.lock();
+        finishLocked(transfer, failed ? config.injectedError : kIOReturnSuccess, 0, mach_absolute_time() + config.completionLatencyNS);
+    });
+    return kIOReturnSuccess;
+}
+
+IOReturn IOUSBHostSimController::abort(IOUSBHostPipe * pipe, IOReturn withError)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = endpoints.find(pipe->getEndpointDescriptor()->bEndpointAddress);
+    if (it != endpoints.end())
+    {
+        abortLocked(it->second, withError);
+    }
+    return kIOReturnSuccess;
+}
+
+void IOUSBHostSimController::queueInData(UInt8 address, const void * data, UInt32 length, UInt64 delayNS)
+{
+    std::vector<UInt8> chunk((const UInt8 *) data, (const UInt8 *) data + length);
+
+    std::lock_guard<std::mutex> guard(lock);
+    if (!running)
+    {
+        return;
+    }
+
+    Endpoint * endpoint = endpoints[address];
+    if (!endpoint)
+    {
+        endpoint = endpointForLocked(address, (address == 0x81) ? kEndpointTypeInterrupt : kEndpointTypeBulk, 0);
+    }
+
+    if (!delayNS)
+    {
+        pushInLocked(endpoint, std::move(chunk));
+        return;
+    }
+
+    auto shared = std::make_shared<std::vector<UInt8>>(std::move(chunk));
+    scheduleLocked(mach_absolute_time() + delayNS, [this, endpoint, shared] ()
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        pushInLocked(endpoint, std::move(*shared));
+    });
+}
+
+void IOUSBHostSimController::queueEvent(const void * event, UInt32 length, UInt64 delayNS)
+{
+    // The controller sends an event as consecutive interrupt packets; all of them become available together
+    UInt32 packet = config.interruptMaxPacketSize ? config.interruptMaxPacketSize : 16;
+    auto chunks = std::make_shared<std::vector<std::vector<UInt8>>>();
+    for (UInt32 offset = 0; offset < length; offset += packet)
+    {
+        UInt32 count = (length - offset) < packet ? (length - offset) : packet;
+        chunks->emplace_back((const UInt8 *) event + offset, (const UInt8 *) event + offset + count);
+    }
+
+    std::lock_guard<std::mutex> guard(lock);
+    if (!running)
+    {
+        return;
+    }
+
+    Endpoint * endpoint = endpoints[0x81];
+    if (!endpoint)
+    {
+        endpoint = endpointForLocked(0x81, kEndpointTypeInterrupt, packet);
+    }
+
+    scheduleLocked(mach_absolute_time() + delayNS, [this, endpoint, chunks] ()
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        for (std::vector<UInt8> & chunk : *chunks)
+        {
+            endpoint->inData.push_back(std::move(chunk));
+        }
+        matchInLocked(endpoint);
+    });
+}
+
+void IOUSBHostSimController::getStatistics(IOUSBHostSimStatistics * statistics)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    *statistics = this->statistics;
+}
+
+void IOUSBHostSimController::resetStatistics()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    bzero(&statistics, sizeof(statistics));
+}
+
+UInt64 IOUSBHostSimController::getFrameNumber() const
+{
+    return mach_absolute_time() / config.isochronousFrameNS;
+}
+
+/* ---- Device models ---- */
+
+IOReturn IOUSBHostSimModel::controlRequest(IOUSBHostSimController * controller, const StandardUSB::DeviceRequest & request, UInt8 * data, UInt32 & length)
+{
+    // Vendor requests read back zeros, writes are accepted
+    if (request.bmRequestType & 0x80)
+    {
+        bzero(data, length);
+    }
+    return kIOReturnSuccess;
+}
+
+IOReturn IOUSBHostSimModel::dataOut(IOUSBHostSimController * controller, UInt8 address, const UInt8 * data, UInt32 length)
+{
+    return kIOReturnSuccess;
+}
+
+IOReturn IOUSBHostSimBluetoothModel::controlRequest(IOUSBHostSimController * controller, const StandardUSB::DeviceRequest & request, UInt8 * data, UInt32 & length)
+{
+    UInt8 type = (request.bmRequestType >> 5) & 0x3;
+
+    // VENDOR_QCA_GETVERSION: ram, rom and patch version, board id, flag
+    if (type == kRequestTypeVendor && (request.bmRequestType & 0x80) && request.bRequest == 0x09)
+    {
+        UInt8 version[16] = { };
+        OSWriteLittleInt32(version, 4, controller->getConfig().qcaRomVersion);
+        length = length < sizeof(version) ? length : sizeof(version);
+        memcpy(data, version, length);
+        return kIOReturnSuccess;
+    }
+
+    if (type == kRequestTypeVendor && !(request.bmRequestType & 0x80))
+    {
+        vendorRequestsOut.push_back(((UInt32) USBToHost16(request.wValue) << 16) | USBToHost16(request.wIndex));
+    }
+
+    if (type != kRequestTypeClass || (request.bmRequestType & 0x80))
+    {
+        return IOUSBHostSimModel::controlRequest(controller, request, data, length);
+    }
+
+    // HCI command: opcode, parameter length, parameters
+    if (length < 3 || length < 3U + data[2])
+    {
+        return kIOReturnBadArgument;
+    }
+
+    UInt16 opCode = OSReadLittleInt16(data, 0);
+    auto event = std::make_shared<std::vector<UInt8>>(2 + 255);
+    UInt8 * bytes = event->data();
+    UInt8 returnLength = (UInt8) commandReturnParameters(opCode, data + 3, data[2], bytes + 6);
+
+    bytes[0] = 0x0E;                                        /* Command Complete */
+    bytes[1] = 4 + returnLength;
+    OSWriteLittleInt16(bytes, 3, opCode);
+    bytes[5] = 0x00;                                        /* success */
+    event->resize(2 + bytes[1]);
+
+    // Num_HCI_Command_Packets is what is free once this command is answered, like a real controller
+    ++commandsOutstanding;
+    controller->schedule(controller->getConfig().hciResponseLatencyNS, [this, controller, event] ()
+    {
+        UInt8 credits = controller->getConfig().hciCommandCredits;
+        --commandsOutstanding;
+        (*event)[2] = commandsOutstanding < credits ? credits - commandsOutstanding : 0;
+        controller->queueEvent(event->data(), (UInt32) event->size());
+    });
+    return kIOReturnSuccess;
+}
+
+IOReturn IOUSBHostSimBluetoothModel::dataOut(IOUSBHostSimController * controller, UInt8 address, const UInt8 * data, UInt32 length)
+{
+    // A zero length packet only ends the transfer before it; there is nothing to loop back
+    if (aclLoopback && address == 0x02 && length)
+    {
+        controller->queueInData(0x82, data, length);
+    }
+    if (scoLoopback && address == 0x03)
+    {
+        controller->queueInData(0x83, data, length);
+    }
+    if (aclCompletedPackets && address == 0x02 && length >= 4)
+    {
+        UInt64 now = mach_absolute_time();
+        while (!aclHeld.empty() && aclHeld.front() <= now)
+        {
+            aclHeld.pop_front();
+        }
+        if (aclHeld.size() >= aclBufferPackets)
+        {
+            __atomic_add_fetch(&aclOverflows, 1, __ATOMIC_SEQ_CST);
+        }
+
+        // The air is shared: a packet goes out once the ones before it are gone
+        aclAirFree = (aclAirFree > now ? aclAirFree : now) + aclPacketNS;
+        aclHeld.push_back(aclAirFree);
+
+        const UInt8 event[] = { 0x13, 5, 1, data[0], (UInt8) (data[1] & 0x0F), 0x01, 0x00 };           /* Number Of Completed Packets */
+        controller->queueEvent(event, sizeof(event), aclAirFree - now);
+    }
+    return kIOReturnSuccess;
+}
+
+UInt32 IOUSBHostSimBluetoothModel::commandReturnParameters(UInt16 opCode, const UInt8 * parameters, UInt8 parameterLength, UInt8 * returnParameters)
+{
+    switch (opCode)
+    {
+        case 0x1001:            /* Read Local Version Information */
+        {
+            const UInt8 version[] = { 0x08, 0x00, 0x00, 0x08, 0x1d, 0x00, 0x02, 0x01 };
+            memcpy(returnParameters, version, sizeof(version));
+            return sizeof(version);
+        }
+
+        case 0x1005:            /* Read Buffer Size */
+        {
+            const UInt8 sizes[] = { 0xfd, 0x03, 0x40, (UInt8) aclBufferPackets, (UInt8) (aclBufferPackets >> 8), 0x08, 0x00 };
+            memcpy(returnParameters, sizes, sizeof(sizes));
+            return sizeof(sizes);
+        }
+
+        case 0x1009:            /* Read BD_ADDR */
+        {
+            const UInt8 address[] = { 0x66, 0x55, 0x44, 0x33, 0x22, 0x11 };
+            memcpy(returnParameters, address, sizeof(address));
+            return sizeof(address);
+        }
+
+        default:
+            return 0;
+    }
+}
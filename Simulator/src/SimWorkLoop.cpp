@@ -0,0 +1,513 @@
+//
+//  SimWorkLoop.cpp
+//  VoodooUSBProvider Simulator
+//
+//  IOWorkLoop gate, IOCommandGate and thread calls.
+//
+
+#include <IOKit/IOCommandGate.h>
+#include <kern/thread_call.h>
+
+#include <errno.h>
+
+#include <deque>
+#include <thread>
+
+/* ---- IOWorkLoop ---- */
+
+IOWorkLoop * IOWorkLoop::workLoop()
+{
+    IOWorkLoop * loop = new IOWorkLoop;
+    if (loop && !loop->init())
+    {
+        loop->release();
+        return NULL;
+    }
+    return loop;
+}
+
+bool IOWorkLoop::init()
+{
+    if (!OSObject::init())
+    {
+        return false;
+    }
+
+    pthread_condattr_t attributes;
+    pthread_condattr_init(&attributes);
+    pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+    pthread_mutex_init(&gateMutex, NULL);
+    pthread_cond_init(&gateCondition, &attributes);
+    pthread_condattr_destroy(&attributes);
+
+    gateOwner       = 0;
+    gateCount       = 0;
+    gateInitialized = true;
+    return true;
+}
+
+void IOWorkLoop::free()
+{
+    if (gateInitialized)
+    {
+        pthread_cond_destroy(&gateCondition);
+        pthread_mutex_destroy(&gateMutex);
+    }
+    OSObject::free();
+}
+
+IOReturn IOWorkLoop::addEventSource(IOEventSource * newEvent)
+{
+    if (!newEvent)
+    {
+        return kIOReturnBadArgument;
+    }
+
+    newEvent->retain();
+    newEvent->setWorkLoop(this);
+    return kIOReturnSuccess;
+}
+
+IOReturn IOWorkLoop::removeEventSource(IOEventSource * toRemove)
+{
+    if (!toRemove || toRemove->getWorkLoop() != this)
+    {
+        return kIOReturnBadArgument;
+    }
+
+    toRemove->setWorkLoop(NULL);
+    toRemove->release();
+    return kIOReturnSuccess;
+}
+
+void IOWorkLoop::closeGate()
+{
+    if (inGate())
+    {
+        ++gateCount;
+        return;
+    }
+
+    pthread_mutex_lock(&gateMutex);
+    gateOwner = pthread_self();
+    gateCount = 1;
+}
+
+bool IOWorkLoop::tryCloseGate()
+{
+    if (inGate())
+    {
+        ++gateCount;
+        return true;
+    }
+
+    if (pthread_mutex_trylock(&gateMutex))
+    {
+        return false;
+    }
+    gateOwner = pthread_self();
+    gateCount = 1;
+    return true;
+}
+
+void IOWorkLoop::openGate()
+{
+    if (--gateCount)
+    {
+        return;
+    }
+
+    gateOwner = 0;
+    pthread_mutex_unlock(&gateMutex);
+}
+
+bool IOWorkLoop::inGate() const
+{
+    return gateCount && pthread_equal(gateOwner, pthread_self());
+}
+
+int IOWorkLoop::sleepGate(void * event, AbsoluteTime deadline, UInt32 interuptibleType)
+{
+    // Like IORecursiveLockSleep(): the whole recursion is given up and restored on wakeup
+    UInt32 count = gateCount;
+    int result = THREAD_AWAKENED;
+
+    gateOwner = 0;
+    gateCount = 0;
+
+    if (deadline == UINT64_MAX || !deadline)
+    {
+        pthread_cond_wait(&gateCondition, &gateMutex);
+    }
+    else
+    {
+        struct timespec when = { (time_t) (deadline / kSecondScale), (long) (deadline % kSecondScale) };
+        if (pthread_cond_timedwait(&gateCondition, &gateMutex, &when) == ETIMEDOUT)
+        {
+            result = THREAD_TIMED_OUT;
+        }
+    }
+
+    gateOwner = pthread_self();
+    gateCount = count;
+    return result;
+}
+
+void IOWorkLoop::wakeupGate(void * event, bool oneThread)
+{
+    // Sleepers on other events re-check their condition and go back to sleep
+    pthread_cond_broadcast(&gateCondition);
+}
+
+/* ---- IOEventSource ---- */
+
+bool IOEventSource::init(OSObject * owner, Action action)
+{
+    if (!OSObject::init() || !owner)
+    {
+        return false;
+    }
+
+    this->owner  = owner;
+    this->action = action;
+    return true;
+}
+
+void IOEventSource::setWorkLoop(IOWorkLoop * workLoop)
+{
+    this->workLoop = workLoop;
+}
+
+/* ---- IOCommandGate ---- */
+
+IOCommandGate * IOCommandGate::commandGate(OSObject * owner, Action action)
+{
+    IOCommandGate * gate = new IOCommandGate;
+    if (gate && !gate->init(owner, (IOEventSource::Action) action))
+    {
+        gate->release();
+        return NULL;
+    }
+    return gate;
+}
+
+IOReturn IOCommandGate::runAction(Action action, void * arg0, void * arg1, void * arg2, void * arg3)
+{
+    if (!action)
+    {
+        return kIOReturnBadArgument;
+    }
+
+    if (!workLoop)
+    {
+        return kIOReturnNotReady;
+    }
+
+    workLoop->closeGate();
+    IOReturn result = action(owner, arg0, arg1, arg2, arg3);
+    workLoop->openGate();
+    return result;
+}
+
+IOReturn IOCommandGate::runCommand(void * arg0, void * arg1, void * arg2, void * arg3)
+{
+    return runAction((Action) action, arg0, arg1, arg2, arg3);
+}
+
+IOReturn IOCommandGate::commandSleep(void * event, UInt32 interruptible)
+{
+    return commandSleep(event, UINT64_MAX, interruptible);
+}
+
+IOReturn IOCommandGate::commandSleep(void * event, AbsoluteTime deadline, UInt32 interruptible)
+{
+    if (!workLoop || !workLoop->inGate())
+    {
+        return kIOReturnNotPermitted;
+    }
+
+    switch (workLoop->sleepGate(event, deadline, interruptible))
+    {
+        case THREAD_AWAKENED:
+            return kIOReturnSuccess;
+        case THREAD_TIMED_OUT:
+            return kIOReturnTimeout;
+        default:
+            return kIOReturnAborted;
+    }
+}
+
+void IOCommandGate::commandWakeup(void * event, bool oneThread)
+{
+    if (workLoop)
+    {
+        workLoop->wakeupGate(event, oneThread);
+    }
+}
+
+/* ---- Thread calls ---- */
+
+struct thread_call
+{
+    thread_call_func_t      func;
+    thread_call_param_t     param0;
+    thread_call_param_t     param1;
+    bool                    pending;
+    bool                    delayed;            /* pending on gCallDelayed rather than gCallQueue */
+    UInt64                  deadline;
+    bool                    freed;              /* freed while running, deleted once it returns */
+    UInt32                  running;
+};
+
+/*
+ * The pool outlives main(): workers are detached and wait on these forever, so they must not have
+ * destructors (destroying a condition variable that has waiters blocks).
+ */
+static pthread_mutex_t              gCallLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t               gCallWake = PTHREAD_COND_INITIALIZER;      /* workers: a call was queued */
+static pthread_cond_t               gCallDone = PTHREAD_COND_INITIALIZER;      /* cancel_wait: a call finished */
+static pthread_cond_t               gCallTimer = PTHREAD_COND_INITIALIZER;     /* timer: the earliest deadline moved */
+static std::deque<thread_call_t>  & gCallQueue = * new std::deque<thread_call_t>;
+static std::deque<thread_call_t>  & gCallDelayed = * new std::deque<thread_call_t>;
+static UInt32                       gCallIdle;
+static bool                         gCallTimerStarted;
+
+static void callWorker()
+{
+    pthread_mutex_lock(&gCallLock);
+    while (true)
+    {
+        while (gCallQueue.empty())
+        {
+            ++gCallIdle;
+            pthread_cond_wait(&gCallWake, &gCallLock);
+            --gCallIdle;
+        }
+
+        thread_call_t call = gCallQueue.front();
+        gCallQueue.pop_front();
+        call->pending = false;
+        ++call->running;
+
+        thread_call_func_t func = call->func;
+        thread_call_param_t param0 = call->param0;
+        thread_call_param_t param1 = call->param1;
+
+        pthread_mutex_unlock(&gCallLock);
+        func(param0, param1);
+        pthread_mutex_lock(&gCallLock);
+
+        if (!--call->running && call->freed)
+        {
+            IODelete(call, struct thread_call, 1);
+            continue;
+        }
+        pthread_cond_broadcast(&gCallDone);
+    }
+}
+
+static void queueCallLocked(thread_call_t call)
+{
+    call->pending = true;
+    call->delayed = false;
+    gCallQueue.push_back(call);
+
+    // The kernel adds threads to a thread call group while its threads block; so does this pool
+    if (gCallIdle < gCallQueue.size())
+    {
+        std::thread(callWorker).detach();
+    }
+    pthread_cond_signal(&gCallWake);
+}
+
+/* Moves delayed calls to the queue as their deadlines pass */
+static void callTimer()
+{
+    pthread_mutex_lock(&gCallLock);
+    while (true)
+    {
+        if (gCallDelayed.empty())
+        {
+            pthread_cond_wait(&gCallTimer, &gCallLock);
+            continue;
+        }
+
+        auto earliest = gCallDelayed.begin();
+        for (auto it = gCallDelayed.begin(); it != gCallDelayed.end(); ++it)
+        {
+            if ((*it)->deadline < (*earliest)->deadline)
+            {
+                earliest = it;
+            }
+        }
+
+        UInt64 now = mach_absolute_time();
+        if ((*earliest)->deadline <= now)
+        {
+            thread_call_t call = *earliest;
+            gCallDelayed.erase(earliest);
+            queueCallLocked(call);
+            continue;
+        }
+
+        UInt64 waitNS;
+        struct timespec until;
+        absolutetime_to_nanoseconds((*earliest)->deadline - now, &waitNS);
+        clock_gettime(CLOCK_REALTIME, &until);
+        waitNS += until.tv_nsec;
+        until.tv_sec  += waitNS / 1000000000ULL;
+        until.tv_nsec  = waitNS % 1000000000ULL;
+        pthread_cond_timedwait(&gCallTimer, &gCallLock, &until);
+    }
+}
+
+static void removeDelayedLocked(thread_call_t call)
+{
+    for (auto it = gCallDelayed.begin(); it != gCallDelayed.end(); ++it)
+    {
+        if (*it == call)
+        {
+            gCallDelayed.erase(it);
+            break;
+        }
+    }
+}
+
+thread_call_t thread_call_allocate(thread_call_func_t func, thread_call_param_t param0)
+{
+    thread_call_t call = IONew(struct thread_call, 1);
+    if (call)
+    {
+        call->func    = func;
+        call->param0  = param0;
+        call->param1  = NULL;
+        call->pending = false;
+        call->delayed = false;
+        call->freed   = false;
+        call->running = 0;
+    }
+    return call;
+}
+
+bool thread_call_free(thread_call_t call)
+{
+    pthread_mutex_lock(&gCallLock);
+    if (call->pending)
+    {
+        pthread_mutex_unlock(&gCallLock);
+        return false;
+    }
+
+    // Like the kernel, a call may free itself from its own function
+    bool running = call->running;
+    call->freed = true;
+    pthread_mutex_unlock(&gCallLock);
+
+    if (!running)
+    {
+        IODelete(call, struct thread_call, 1);
+    }
+    return true;
+}
+
+bool thread_call_enter1(thread_call_t call, thread_call_param_t param1)
+{
+    pthread_mutex_lock(&gCallLock);
+    call->param1 = param1;
+    bool pending = call->pending;
+    if (pending && !call->delayed)
+    {
+        pthread_mutex_unlock(&gCallLock);
+        return true;
+    }
+
+    // A delayed call entered again runs now
+    if (pending)
+    {
+        removeDelayedLocked(call);
+    }
+    queueCallLocked(call);
+    pthread_mutex_unlock(&gCallLock);
+    return pending;
+}
+
+bool thread_call_enter_delayed(thread_call_t call, uint64_t deadline)
+{
+    pthread_mutex_lock(&gCallLock);
+    bool pending = call->pending;
+    if (pending && !call->delayed)
+    {
+        pthread_mutex_unlock(&gCallLock);
+        return true;
+    }
+
+    if (!pending)
+    {
+        call->pending = true;
+        call->delayed = true;
+        gCallDelayed.push_back(call);
+    }
+    call->deadline = deadline;
+
+    if (!gCallTimerStarted)
+    {
+        gCallTimerStarted = true;
+        std::thread(callTimer).detach();
+    }
+    pthread_cond_signal(&gCallTimer);
+    pthread_mutex_unlock(&gCallLock);
+    return pending;
+}
+
+bool thread_call_enter(thread_call_t call)
+{
+    return thread_call_enter1(call, NULL);
+}
+
+bool thread_call_cancel(thread_call_t call)
+{
+    pthread_mutex_lock(&gCallLock);
+    if (!call->pending)
+    {
+        pthread_mutex_unlock(&gCallLock);
+        return false;
+    }
+
+    if (call->delayed)
+    {
+        removeDelayedLocked(call);
+    }
+    for (auto it = gCallQueue.begin(); it != gCallQueue.end(); ++it)
+    {
+        if (*it == call)
+        {
+            gCallQueue.erase(it);
+            break;
+        }
+    }
+    call->pending = false;
+    call->delayed = false;
+    pthread_mutex_unlock(&gCallLock);
+    return true;
+}
+
+bool thread_call_cancel_wait(thread_call_t call)
+{
+    bool cancelled = thread_call_cancel(call);
+
+    pthread_mutex_lock(&gCallLock);
+    while (call->running)
+    {
+        pthread_cond_wait(&gCallDone, &gCallLock);
+    }
+    pthread_mutex_unlock(&gCallLock);
+    return cancelled;
+}
+
+bool thread_call_isactive(thread_call_t call)
+{
+    pthread_mutex_lock(&gCallLock);
+    bool active = call->pending || call->running;
+    pthread_mutex_unlock(&gCallLock);
+    return active;
+}
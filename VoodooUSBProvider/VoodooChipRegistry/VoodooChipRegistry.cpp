@@ -0,0 +1,170 @@
+//
+//  VoodooChipRegistry.cpp
+//  VoodooUSBProvider
+//
+//  Copyright © 2021 Charlie Jiang. All rights reserved.
+//
+
+#include "VoodooChipRegistry.h"
+
+#define CHIP(vid, pid, family, name)                { voodooChipKey(vid, pid), family, { 0, 0, 0 }, name }
+#define QCA_ROM(rom, family, patch, nvm, ver, name) { rom, family, { patch, nvm, ver }, name }
+
+static constexpr VoodooChipEntry VoodooChipDevicesTable[] =
+{
+    /* Atheros AR3011 */
+    CHIP(0x0cf3, 0x3000, kVoodooChipAth3k,          "AR3011"),
+    CHIP(0x0489, 0xe027, kVoodooChipAth3k,          "AR3011"),
+    CHIP(0x0489, 0xe03d, kVoodooChipAth3k,          "AR3011"),
+    CHIP(0x04f2, 0xaff1, kVoodooChipAth3k,          "AR3011"),
+    CHIP(0x0930, 0x0215, kVoodooChipAth3k,          "AR3011"),
+    CHIP(0x0cf3, 0x3002, kVoodooChipAth3k,          "AR3011"),
+    CHIP(0x0cf3, 0xe019, kVoodooChipAth3k,          "AR3011"),
+    CHIP(0x13d3, 0x3304, kVoodooChipAth3k,          "AR3011"),
+    
+    /* Atheros AR3012 */
+    CHIP(0x0cf3, 0x3004, kVoodooChipAth3012,        "AR3012"),
+    CHIP(0x0cf3, 0x3008, kVoodooChipAth3012,        "AR3012"),
+    CHIP(0x0cf3, 0x311d, kVoodooChipAth3012,        "AR3012"),
+    CHIP(0x0cf3, 0x311e, kVoodooChipAth3012,        "AR3012"),
+    CHIP(0x0cf3, 0x311f, kVoodooChipAth3012,        "AR3012"),
+    CHIP(0x0cf3, 0x817a, kVoodooChipAth3012,        "AR3012"),
+    CHIP(0x0cf3, 0x817b, kVoodooChipAth3012,        "AR3012"),
+    CHIP(0x0489, 0xe04d, kVoodooChipAth3012,        "AR3012"),
+    CHIP(0x0489, 0xe04e, kVoodooChipAth3012,        "AR3012"),
+    CHIP(0x0489, 0xe056, kVoodooChipAth3012,        "AR3012"),
+    CHIP(0x0489, 0xe057, kVoodooChipAth3012,        "AR3012"),
+    CHIP(0x0489, 0xe05f, kVoodooChipAth3012,        "AR3012"),
+    CHIP(0x04ca, 0x3004, kVoodooChipAth3012,        "AR3012"),
+    CHIP(0x04ca, 0x3005, kVoodooChipAth3012,        "AR3012"),
+    CHIP(0x04ca, 0x3006, kVoodooChipAth3012,        "AR3012"),
+    CHIP(0x04ca, 0x3008, kVoodooChipAth3012,        "AR3012"),
+    CHIP(0x0930, 0x0219, kVoodooChipAth3012,        "AR3012"),
+    CHIP(0x0930, 0x021c, kVoodooChipAth3012,        "AR3012"),
+    CHIP(0x0930, 0x0220, kVoodooChipAth3012,        "AR3012"),
+    CHIP(0x0930, 0x0227, kVoodooChipAth3012,        "AR3012"),
+    CHIP(0x13d3, 0x3362, kVoodooChipAth3012,        "AR3012"),
+    CHIP(0x13d3, 0x3375, kVoodooChipAth3012,        "AR3012"),
+    CHIP(0x13d3, 0x3393, kVoodooChipAth3012,        "AR3012"),
+    CHIP(0x13d3, 0x3402, kVoodooChipAth3012,        "AR3012"),
+    CHIP(0x13d3, 0x3408, kVoodooChipAth3012,        "AR3012"),
+    CHIP(0x13d3, 0x3432, kVoodooChipAth3012,        "AR3012"),
+    
+    /* QCA ROME */
+    CHIP(0x0cf3, 0x535b, kVoodooChipQcaRome,        "QCA ROME"),
+    CHIP(0x0cf3, 0xe007, kVoodooChipQcaRome,        "QCA ROME"),
+    CHIP(0x0cf3, 0xe009, kVoodooChipQcaRome,        "QCA ROME"),
+    CHIP(0x0cf3, 0xe010, kVoodooChipQcaRome,        "QCA ROME"),
+    CHIP(0x0cf3, 0xe300, kVoodooChipQcaRome,        "QCA ROME"),
+    CHIP(0x0cf3, 0xe301, kVoodooChipQcaRome,        "QCA ROME"),
+    CHIP(0x0cf3, 0xe360, kVoodooChipQcaRome,        "QCA ROME"),
+    CHIP(0x0cf3, 0xe500, kVoodooChipQcaRome,        "QCA ROME"),
+    CHIP(0x0489, 0xe092, kVoodooChipQcaRome,        "QCA ROME"),
+    CHIP(0x0489, 0xe09f, kVoodooChipQcaRome,        "QCA ROME"),
+    CHIP(0x0489, 0xe0a2, kVoodooChipQcaRome,        "QCA ROME"),
+    CHIP(0x04ca, 0x3011, kVoodooChipQcaRome,        "QCA ROME"),
+    CHIP(0x04ca, 0x3015, kVoodooChipQcaRome,        "QCA ROME"),
+    CHIP(0x04ca, 0x3016, kVoodooChipQcaRome,        "QCA ROME"),
+    CHIP(0x04ca, 0x301a, kVoodooChipQcaRome,        "QCA ROME"),
+    CHIP(0x13d3, 0x3491, kVoodooChipQcaRome,        "QCA ROME"),
+    CHIP(0x13d3, 0x3496, kVoodooChipQcaRome,        "QCA ROME"),
+    CHIP(0x13d3, 0x3501, kVoodooChipQcaRome,        "QCA ROME"),
+    
+    /* QCA WCN6855 */
+    CHIP(0x0489, 0xe0cc, kVoodooChipQcaWcn6855,     "QCA WCN6855"),
+    CHIP(0x0489, 0xe0d6, kVoodooChipQcaWcn6855,     "QCA WCN6855"),
+    CHIP(0x0489, 0xe0e3, kVoodooChipQcaWcn6855,     "QCA WCN6855"),
+    CHIP(0x10ab, 0x9309, kVoodooChipQcaWcn6855,     "QCA WCN6855"),
+    CHIP(0x10ab, 0x9409, kVoodooChipQcaWcn6855,     "QCA WCN6855"),
+    CHIP(0x0489, 0xe0d0, kVoodooChipQcaWcn6855,     "QCA WCN6855"),
+    
+    /* Intel */
+    CHIP(0x8087, 0x07dc, kVoodooChipIntelLegacy,    "Intel 7260"),
+    CHIP(0x8087, 0x0a2a, kVoodooChipIntelLegacy,    "Intel 7265"),
+    CHIP(0x8087, 0x0aa7, kVoodooChipIntelLegacy,    "Intel 3168"),
+    CHIP(0x8087, 0x0a2b, kVoodooChipIntelBootloader, "Intel 8260"),
+    CHIP(0x8087, 0x0aaa, kVoodooChipIntelBootloader, "Intel 9460 / 9560"),
+    CHIP(0x8087, 0x0025, kVoodooChipIntelBootloader, "Intel 9260"),
+    CHIP(0x8087, 0x0026, kVoodooChipIntelBootloader, "Intel AX201"),
+    CHIP(0x8087, 0x0029, kVoodooChipIntelBootloader, "Intel AX200"),
+    CHIP(0x8087, 0x0032, kVoodooChipIntelBootloader, "Intel AX210"),
+    CHIP(0x8087, 0x0033, kVoodooChipIntelBootloader, "Intel AX211"),
+    
+    /* Broadcom */
+    CHIP(0x0a5c, 0x216f, kVoodooChipBroadcom,       "BCM20702A1"),
+    CHIP(0x0a5c, 0x21de, kVoodooChipBroadcom,       "BCM20702A1"),
+    CHIP(0x0a5c, 0x21e6, kVoodooChipBroadcom,       "BCM20702A1"),
+    CHIP(0x0a5c, 0x21e8, kVoodooChipBroadcom,       "BCM20702A1"),
+    CHIP(0x0a5c, 0x21ec, kVoodooChipBroadcom,       "BCM20702A1"),
+    CHIP(0x0a5c, 0x22be, kVoodooChipBroadcom,       "BCM20702B0"),
+    CHIP(0x0a5c, 0x640b, kVoodooChipBroadcom,       "BCM20703A1"),
+    CHIP(0x0a5c, 0x6410, kVoodooChipBroadcom,       "BCM20703A1"),
+    CHIP(0x0a5c, 0x6412, kVoodooChipBroadcom,       "BCM4350C5"),
+    CHIP(0x0930, 0x0221, kVoodooChipBroadcom,       "BCM20702A1"),
+    CHIP(0x0930, 0x0223, kVoodooChipBroadcom,       "BCM20702A1"),
+    CHIP(0x0489, 0xe07a, kVoodooChipBroadcom,       "BCM20702A1"),
+    CHIP(0x04ca, 0x2003, kVoodooChipBroadcom,       "BCM20702A1"),
+    CHIP(0x0b05, 0x17cf, kVoodooChipBroadcom,       "BCM20702A1"),
+    CHIP(0x13d3, 0x3404, kVoodooChipBroadcom,       "BCM20702A1"),
+    CHIP(0x413c, 0x8143, kVoodooChipBroadcom,       "BCM20702A1"),
+};
+
+static constexpr VoodooChipEntry VoodooChipQcaRomTable[] =
+{
+    QCA_ROM(0x00000100, kVoodooChipQcaRome,     20, 4,  8, "ROME 1.0"),
+    QCA_ROM(0x00000101, kVoodooChipQcaRome,     20, 4,  8, "ROME 1.1"),
+    QCA_ROM(0x00000200, kVoodooChipQcaRome,     28, 4, 16, "ROME 2.0"),
+    QCA_ROM(0x00000201, kVoodooChipQcaRome,     28, 4, 16, "ROME 2.1"),
+    QCA_ROM(0x00000300, kVoodooChipQcaRome,     28, 4, 16, "ROME 3.0"),
+    QCA_ROM(0x00000302, kVoodooChipQcaRome,     28, 4, 16, "ROME 3.2"),
+    QCA_ROM(0x00130100, kVoodooChipQcaWcn6855,  40, 4, 16, "WCN6855 1.0"),
+    QCA_ROM(0x00130200, kVoodooChipQcaWcn6855,  40, 4, 16, "WCN6855 2.0"),
+};
+
+#undef CHIP
+#undef QCA_ROM
+
+static_assert(voodooChipKeysUnique(VoodooChipDevicesTable), "Duplicate VID / PID in the chip registry");
+static_assert(voodooChipKeysUnique(VoodooChipQcaRomTable), "Duplicate ROM version in the chip registry");
+
+static constexpr auto VoodooChipDevicesHash = makeVoodooChipHashTable(VoodooChipDevicesTable);
+static constexpr auto VoodooChipQcaRomHash  = makeVoodooChipHashTable(VoodooChipQcaRomTable);
+
+/* Indexed by VoodooChipFamily, in declaration order */
+static constexpr VoodooChipFamilyInfo VoodooChipFamiliesTable[] =
+{
+    { "Unknown",            { kVoodooChipStepEnd } },
+    { "Atheros AR3011",     { kVoodooChipStepAth3kDownload } },
+    { "Atheros AR3012",     { kVoodooChipStepAth3kReadVersion, kVoodooChipStepAth3kRamPatch, kVoodooChipStepAth3kSysConfig, kVoodooChipStepAth3kSwitchPID, kVoodooChipStepAth3kNormalMode } },
+    { "Qualcomm ROME",      { kVoodooChipStepQcaReadVersion, kVoodooChipStepQcaRamPatch, kVoodooChipStepQcaNvm } },
+    { "Qualcomm WCN6855",   { kVoodooChipStepQcaReadVersion, kVoodooChipStepQcaRamPatch, kVoodooChipStepQcaNvm } },
+    { "Intel",              { kVoodooChipStepIntelReadVersion, kVoodooChipStepIntelEnterMfg, kVoodooChipStepIntelPatch, kVoodooChipStepIntelExitMfg } },
+    { "Intel Bootloader",   { kVoodooChipStepIntelReadVersion, kVoodooChipStepIntelSecureSend, kVoodooChipStepIntelBoot, kVoodooChipStepIntelDdc } },
+    { "Broadcom",           { kVoodooChipStepHciReset, kVoodooChipStepBcmMinidriver, kVoodooChipStepBcmHcd, kVoodooChipStepBcmLaunchRam, kVoodooChipStepHciReset } },
+};
+
+static_assert(ARRAY_SIZE(VoodooChipFamiliesTable) == kVoodooChipFamilyCount, "Every chip family needs an entry");
+
+const VoodooChipEntry * VoodooChipRegistry::lookupDevice(UInt16 vendorID, UInt16 productID)
+{
+    return VoodooChipDevicesHash.find(VoodooChipDevicesTable, voodooChipKey(vendorID, productID));
+}
+
+const VoodooChipEntry * VoodooChipRegistry::lookupQcaRomVersion(UInt32 romVersion)
+{
+    return VoodooChipQcaRomHash.find(VoodooChipQcaRomTable, romVersion);
+}
+
+const VoodooChipFamilyInfo * VoodooChipRegistry::getFamilyInfo(VoodooChipFamily family)
+{
+    if (family >= kVoodooChipFamilyCount)
+    {
+        return &VoodooChipFamiliesTable[kVoodooChipUnknown];
+    }
+    return &VoodooChipFamiliesTable[family];
+}
+
+const char * VoodooChipRegistry::getFamilyName(VoodooChipFamily family)
+{
+    return getFamilyInfo(family)->name;
+}
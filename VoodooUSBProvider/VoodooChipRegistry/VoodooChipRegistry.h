@@ -0,0 +1,249 @@
+//
+//  VoodooChipRegistry.h
+//  VoodooUSBProvider
+//
+//  Copyright © 2021 Charlie Jiang. All rights reserved.
+//
+
+#ifndef VoodooChipRegistry_h
+#define VoodooChipRegistry_h
+
+#include "VoodooUSBCommon.h"
+
+#define VOODOO_CHIP_INIT_STEPS_MAX          6
+
+enum VoodooChipFamily : UInt8
+{
+    kVoodooChipUnknown = 0,
+    kVoodooChipAth3k,                   /* AR3011: the whole firmware is loaded over bulk before the controller enumerates as HCI */
+    kVoodooChipAth3012,                 /* AR3012: ROM based, RAM patch and system config over bulk */
+    kVoodooChipQcaRome,                 /* QCA6174 / QCA9377 family */
+    kVoodooChipQcaWcn6855,
+    kVoodooChipIntelLegacy,             /* 7260 / 7265 / 3168: patch in manufacturer mode */
+    kVoodooChipIntelBootloader,         /* 8260 and later: operational firmware through secure send */
+    kVoodooChipBroadcom,                /* BCM20702 and later: HCD file through the mini driver */
+    kVoodooChipFamilyCount
+};
+
+enum VoodooChipInitStep : UInt8
+{
+    kVoodooChipStepEnd = 0,
+    kVoodooChipStepHciReset,
+    kVoodooChipStepAth3kDownload,       /* stream the firmware to bulk endpoint 0x02 */
+    kVoodooChipStepAth3kReadVersion,
+    kVoodooChipStepAth3kRamPatch,
+    kVoodooChipStepAth3kSysConfig,
+    kVoodooChipStepAth3kSwitchPID,
+    kVoodooChipStepAth3kNormalMode,
+    kVoodooChipStepQcaReadVersion,
+    kVoodooChipStepQcaRamPatch,
+    kVoodooChipStepQcaNvm,
+    kVoodooChipStepIntelReadVersion,
+    kVoodooChipStepIntelEnterMfg,
+    kVoodooChipStepIntelPatch,
+    kVoodooChipStepIntelExitMfg,
+    kVoodooChipStepIntelSecureSend,
+    kVoodooChipStepIntelBoot,
+    kVoodooChipStepIntelDdc,
+    kVoodooChipStepBcmMinidriver,
+    kVoodooChipStepBcmHcd,
+    kVoodooChipStepBcmLaunchRam
+};
+
+/* Firmware layout; zero where the family has no such header */
+struct VoodooChipLayout
+{
+    UInt8        ramPatchHdr;      /* length of header in rampatch */
+    UInt8        nvmHdr;           /* length of header in NVM */
+    UInt8        versionOffset;    /* offset of version structure in rampatch */
+};
+
+struct VoodooChipEntry
+{
+    UInt32               key;           /* (idVendor << 16) | idProduct, or the QCA ROM version */
+    VoodooChipFamily     family;
+    VoodooChipLayout     layout;
+    const char         * name;
+};
+
+struct VoodooChipFamilyInfo
+{
+    const char         * name;
+    VoodooChipInitStep   initSequence[VOODOO_CHIP_INIT_STEPS_MAX];     /* terminated by kVoodooChipStepEnd unless full */
+};
+
+/* ---- Compile-time perfect hash ---- */
+
+constexpr UInt32 voodooChipHash(UInt32 key, UInt32 seed)
+{
+    // murmur3 finalizer, seeded; cheap and good enough to find a collision free seed quickly
+    UInt32 hash = key ^ seed;
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6b;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+#define VOODOO_CHIP_HASH_BUCKET_SEED        0x9e3779b9
+
+/* Power of two, at least twice the number of keys, so every bucket finds free slots quickly */
+constexpr UInt32 voodooChipHashSlots(UInt32 count)
+{
+    UInt32 slots = 1;
+    while (slots < 2 * count)
+    {
+        slots <<= 1;
+    }
+    return slots;
+}
+
+/* About two keys per bucket */
+constexpr UInt32 voodooChipHashBuckets(UInt32 count)
+{
+    UInt32 buckets = 1;
+    while (2 * buckets < count)
+    {
+        buckets <<= 1;
+    }
+    return buckets;
+}
+
+/*
+ * Two level perfect hash (hash and displace): a key picks its bucket with a fixed seed, then its
+ * slot with the seed stored for that bucket. The seeds are chosen so that no two keys share a slot.
+ */
+template <UInt32 Count>
+struct VoodooChipHashTable
+{
+    static constexpr UInt32 Buckets = voodooChipHashBuckets(Count);
+    static constexpr UInt32 Slots   = voodooChipHashSlots(Count);
+    
+    UInt16  seeds[Buckets];
+    UInt16  slots[Slots];           /* index into the entry table + 1, 0 is an empty slot */
+    
+    const VoodooChipEntry * find(const VoodooChipEntry (&entries)[Count], UInt32 key) const
+    {
+        UInt16 seed = seeds[voodooChipHash(key, VOODOO_CHIP_HASH_BUCKET_SEED) & (Buckets - 1)];
+        UInt16 slot = slots[voodooChipHash(key, seed) & (Slots - 1)];
+        
+        // A key that is not in the table lands on an empty slot or on a different key
+        if (slot && entries[slot - 1].key == key)
+        {
+            return &entries[slot - 1];
+        }
+        return NULL;
+    }
+};
+
+template <UInt32 Count>
+constexpr bool voodooChipKeysUnique(const VoodooChipEntry (&entries)[Count])
+{
+    for (UInt32 i = 0; i < Count; ++i)
+    {
+        for (UInt32 j = i + 1; j < Count; ++j)
+        {
+            if (entries[i].key == entries[j].key)
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/*
+ * Builds the table in the compiler, largest buckets first while the slots are still mostly free.
+ * Check voodooChipKeysUnique() first: duplicate keys never hash apart and exhaust the evaluation.
+ */
+template <UInt32 Count>
+constexpr VoodooChipHashTable<Count> makeVoodooChipHashTable(const VoodooChipEntry (&entries)[Count])
+{
+    typedef VoodooChipHashTable<Count> Table;
+    
+    Table table {};
+    UInt32 bucketOf[Count] {};
+    UInt32 bucketSize[Table::Buckets] {};
+    UInt32 largest = 0;
+    
+    for (UInt32 i = 0; i < Count; ++i)
+    {
+        bucketOf[i] = voodooChipHash(entries[i].key, VOODOO_CHIP_HASH_BUCKET_SEED) & (Table::Buckets - 1);
+        if (++bucketSize[bucketOf[i]] > largest)
+        {
+            largest = bucketSize[bucketOf[i]];
+        }
+    }
+    
+    for (UInt32 size = largest; size; --size)
+    {
+        for (UInt32 bucket = 0; bucket < Table::Buckets; ++bucket)
+        {
+            if (bucketSize[bucket] != size)
+            {
+                continue;
+            }
+            
+            for (UInt16 seed = 1; ; ++seed)
+            {
+                UInt32 taken[Count] {};
+                UInt32 placed = 0;
+                bool collision = false;
+                
+                for (UInt32 i = 0; i < Count && !collision; ++i)
+                {
+                    if (bucketOf[i] != bucket)
+                    {
+                        continue;
+                    }
+                    
+                    UInt32 slot = voodooChipHash(entries[i].key, seed) & (Table::Slots - 1);
+                    collision = table.slots[slot] != 0;
+                    for (UInt32 j = 0; j < placed && !collision; ++j)
+                    {
+                        collision = taken[j] == slot;
+                    }
+                    taken[placed++] = slot;
+                }
+                
+                if (collision)
+                {
+                    continue;
+                }
+                
+                table.seeds[bucket] = seed;
+                for (UInt32 i = 0; i < Count; ++i)
+                {
+                    if (bucketOf[i] == bucket)
+                    {
+                        table.slots[voodooChipHash(entries[i].key, seed) & (Table::Slots - 1)] = (UInt16) (i + 1);
+                    }
+                }
+                break;
+            }
+        }
+    }
+    return table;
+}
+
+constexpr UInt32 voodooChipKey(UInt16 vendorID, UInt16 productID)
+{
+    return ((UInt32) vendorID << 16) | productID;
+}
+
+/*
+ * One registry for every chip the provider knows how to bring up, shared by probe, matching and
+ * firmware selection in the client drivers. Both lookups are a single hash and compare.
+ */
+class VoodooChipRegistry
+{
+public:
+    static const VoodooChipEntry * lookupDevice(UInt16 vendorID, UInt16 productID);
+    static const VoodooChipEntry * lookupQcaRomVersion(UInt32 romVersion);
+    
+    static const VoodooChipFamilyInfo * getFamilyInfo(VoodooChipFamily family);
+    static const char * getFamilyName(VoodooChipFamily family);
+};
+
+#endif /* VoodooChipRegistry_h */
@@ -0,0 +1,258 @@
+//
+//  VoodooBcmPatchLoader.cpp
+//  VoodooUSBProvider
+//
+//  Copyright © 2021 Charlie Jiang. All rights reserved.
+//
+
+#include "VoodooBcmPatchLoader.h"
+
+OSDefineMetaClassAndStructors(VoodooBcmPatchLoader, OSObject)
+
+VoodooBcmPatchLoader * VoodooBcmPatchLoader::withEngine(VoodooHCICommandEngine * engine, UInt32 depth)
+{
+    VoodooBcmPatchLoader * loader = new VoodooBcmPatchLoader;
+    
+    if (loader && !loader->initWithEngine(engine, depth))
+    {
+        OSSafeReleaseNULL(loader);
+    }
+    return loader;
+}
+
+bool VoodooBcmPatchLoader::initWithEngine(VoodooHCICommandEngine * engine, UInt32 depth)
+{
+    if (!super::init() || !engine)
+    {
+        return false;
+    }
+    
+    if (!depth || depth > VOODOO_BCM_PATCH_DEPTH_MAX)
+    {
+        VoodooUSBErrorLog("VoodooBcmPatchLoader::initWithEngine() - Invalid depth %u!!!\n", depth);
+        return false;
+    }
+    
+    lock = IOLockAlloc();
+    if (!lock)
+    {
+        return false;
+    }
+    
+    bzero(&statistics, sizeof(statistics));
+    
+    this->depth       = depth;
+    minidriverDelayMS = VOODOO_BCM_MINIDRIVER_DELAY_MS;
+    launchDelayMS     = VOODOO_BCM_LAUNCH_DELAY_MS;
+    image             = NULL;
+    
+    this->engine = engine;
+    this->engine->retain();
+    return true;
+}
+
+void VoodooBcmPatchLoader::free()
+{
+    OSSafeReleaseNULL(engine);
+    
+    if (lock)
+    {
+        IOLockFree(lock);
+        lock = NULL;
+    }
+    super::free();
+}
+
+IOReturn VoodooBcmPatchLoader::scan(const UInt8 * bytes, UInt32 length, UInt32 * records, UInt32 * streamLength)
+{
+    UInt32 count = 0;
+    UInt32 end = length;
+    UInt32 offset = 0;
+    
+    while (offset < length)
+    {
+        const FwCommandHdr * header = (const FwCommandHdr *) (bytes + offset);
+        if (length - offset < HCI_COMMAND_HDR_SIZE || length - offset - HCI_COMMAND_HDR_SIZE < header->pLength)
+        {
+            VoodooUSBErrorLog("VoodooBcmPatchLoader::scan() - Truncated record at offset %u of %u!!!\n", offset, length);
+            return kIOReturnUnderrun;
+        }
+        
+        // Whatever follows Launch RAM is never sent, but a file cut short there is still rejected
+        if (end == length)
+        {
+            if (header->opCode == HCI_OP_BCM_LAUNCH_RAM)
+            {
+                end = offset;
+            }
+            else
+            {
+                ++count;
+            }
+        }
+        offset += HCI_COMMAND_HDR_SIZE + header->pLength;
+    }
+    
+    if (!count && end == length)
+    {
+        return kIOReturnBadArgument;
+    }
+    
+    if (records)
+    {
+        *records = count;
+    }
+    if (streamLength)
+    {
+        *streamLength = end;
+    }
+    return kIOReturnSuccess;
+}
+
+IOReturn VoodooBcmPatchLoader::validate(OSData * patchram, UInt32 * records)
+{
+    if (!patchram || !patchram->getLength())
+    {
+        return kIOReturnBadArgument;
+    }
+    return scan((const UInt8 *) patchram->getBytesNoCopy(), patchram->getLength(), records, NULL);
+}
+
+void VoodooBcmPatchLoader::setDelays(UInt32 minidriverMS, UInt32 launchMS)
+{
+    minidriverDelayMS = minidriverMS;
+    launchDelayMS     = launchMS;
+}
+
+IOReturn VoodooBcmPatchLoader::load(OSData * patchram)
+{
+    UInt32 recordCount;
+    
+    IOReturn result = validate(patchram, &recordCount);
+    if (result != kIOReturnSuccess)
+    {
+        VoodooUSBErrorLog("VoodooBcmPatchLoader::load() - Malformed patchram: 0x%08x!!!\n", result);
+        return result;
+    }
+    
+    IOLockLock(lock);
+    if (image)
+    {
+        IOLockUnlock(lock);
+        VoodooUSBErrorLog("VoodooBcmPatchLoader::load() - Load already in progress!!!\n");
+        return kIOReturnBusy;
+    }
+    image = (const UInt8 *) patchram->getBytesNoCopy();
+    scan(image, patchram->getLength(), NULL, &streamLength);
+    nextOffset = 0;
+    IOLockUnlock(lock);
+    
+    UInt64 startTime = mach_absolute_time();
+    result = sendPatchram(patchram);
+    
+    UInt64 durationNS;
+    absolutetime_to_nanoseconds(mach_absolute_time() - startTime, &durationNS);
+    
+    IOLockLock(lock);
+    image = NULL;
+    IOLockUnlock(lock);
+    
+    if (result == kIOReturnSuccess)
+    {
+        statistics.records    += recordCount;
+        statistics.bytes      += streamLength;
+        statistics.durationNS += durationNS;
+        VoodooUSBDebugLog("VoodooBcmPatchLoader::load() - %u records, %u bytes in %llu us\n", recordCount, streamLength, durationNS / 1000);
+    }
+    return result;
+}
+
+IOReturn VoodooBcmPatchLoader::sendPatchram(OSData * patchram)
+{
+    IOReturn result = engine->sendCommandSync(HCI_VSC_DOWNLOAD_MINIDRIVER.opCode(), HCI_VSC_DOWNLOAD_MINIDRIVER.paramLength(), HCI_VSC_DOWNLOAD_MINIDRIVER.param());
+    if (result != kIOReturnSuccess)
+    {
+        VoodooUSBErrorLog("VoodooBcmPatchLoader::sendPatchram() - Download Minidriver failed: 0x%08x!!!\n", result);
+        return result;
+    }
+    
+    if (minidriverDelayMS)
+    {
+        IOSleep(minidriverDelayMS);
+    }
+    
+    VoodooHCICommandSource source = { this, nextRecordAction, rewindRecordAction, NULL };
+    UInt32 peakInFlight = 0;
+    
+    result = engine->sendCommandStream(&source, depth, &peakInFlight);
+    statistics.peakInFlight = max(statistics.peakInFlight, peakInFlight);
+    
+    if (result != kIOReturnSuccess)
+    {
+        VoodooUSBErrorLog("VoodooBcmPatchLoader::sendPatchram() - Write RAM failed at offset %u of %u: 0x%08x!!!\n", nextOffset, streamLength, result);
+        return result;
+    }
+    
+    // The file's own Launch RAM if it has one, the end of record address otherwise
+    if (streamLength < patchram->getLength())
+    {
+        const FwCommandHdr * header = (const FwCommandHdr *) (image + streamLength);
+        result = engine->sendCommandSync(header->opCode, header->pLength, image + streamLength + HCI_COMMAND_HDR_SIZE);
+        statistics.bytes += HCI_COMMAND_HDR_SIZE + header->pLength;
+    }
+    else
+    {
+        result = engine->sendCommandSync(HCI_VSC_END_OF_RECORD.opCode(), HCI_VSC_END_OF_RECORD.paramLength(), HCI_VSC_END_OF_RECORD.param());
+        statistics.bytes += HCI_VSC_END_OF_RECORD.size();
+    }
+    if (result != kIOReturnSuccess)
+    {
+        VoodooUSBErrorLog("VoodooBcmPatchLoader::sendPatchram() - Launch RAM failed: 0x%08x!!!\n", result);
+        return result;
+    }
+    
+    if (launchDelayMS)
+    {
+        IOSleep(launchDelayMS);
+    }
+    
+    result = engine->sendCommandSync(HCI_VSC_WAKEUP.opCode(), HCI_VSC_WAKEUP.paramLength(), HCI_VSC_WAKEUP.param());
+    if (result != kIOReturnSuccess)
+    {
+        VoodooUSBErrorLog("VoodooBcmPatchLoader::sendPatchram() - Wake up failed: 0x%08x!!!\n", result);
+    }
+    return result;
+}
+
+// Called with the engine locked; the record is sent straight from the file
+bool VoodooBcmPatchLoader::nextRecordAction(void * owner, VoodooHCIStreamCommand * command)
+{
+    VoodooBcmPatchLoader * that = (VoodooBcmPatchLoader *) owner;
+    
+    if (that->nextOffset >= that->streamLength)
+    {
+        return false;
+    }
+    
+    const UInt8 * record = that->image + that->nextOffset;
+    bzero(command, sizeof(*command));
+    command->frame       = record;
+    command->frameLength = HCI_COMMAND_HDR_SIZE + ((const FwCommandHdr *) record)->pLength;
+    that->nextOffset += command->frameLength;
+    return true;
+}
+
+void VoodooBcmPatchLoader::rewindRecordAction(void * owner, const VoodooHCIStreamCommand * command)
+{
+    VoodooBcmPatchLoader * that = (VoodooBcmPatchLoader *) owner;
+    
+    that->nextOffset -= command->frameLength;
+}
+
+void VoodooBcmPatchLoader::getStatistics(VoodooBcmPatchStatistics * statistics)
+{
+    if (statistics)
+    {
+        *statistics = this->statistics;
+    }
+}
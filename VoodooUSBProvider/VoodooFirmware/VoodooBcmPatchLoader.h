@@ -0,0 +1,75 @@
+//
+//  VoodooBcmPatchLoader.h
+//  VoodooUSBProvider
+//
+//  Copyright © 2021 Charlie Jiang. All rights reserved.
+//
+
+#ifndef VoodooBcmPatchLoader_h
+#define VoodooBcmPatchLoader_h
+
+#include "VoodooHCICommandEngine.h"
+
+#define VOODOO_BCM_PATCH_DEPTH_DEFAULT      8
+#define VOODOO_BCM_PATCH_DEPTH_MAX          (VOODOO_HCI_COMMAND_ENGINE_SLOTS / 2)  /* leaves the engine slots for everyone else */
+#define VOODOO_BCM_MINIDRIVER_DELAY_MS      50      /* Download Minidriver to the first Write RAM */
+#define VOODOO_BCM_LAUNCH_DELAY_MS          250     /* Launch RAM to the controller running the patch */
+
+struct VoodooBcmPatchStatistics
+{
+    UInt64    bytes;            /* of the records sent, headers included */
+    UInt64    durationNS;       /* minidriver to wake up, delays included */
+    UInt32    records;
+    UInt32    peakInFlight;
+};
+
+/*
+ * Loads a Broadcom .hcd patchram file through the command engine.
+ * An .hcd file is a stream of HCI commands (opcode, length, parameters), mostly Write RAM, closed
+ * by a Launch RAM. Every record is already a command frame, so the loader walks the OSData in place
+ * and hands each record to the engine's sendCommandStream() as it is; nothing is copied. Up to depth
+ * records are queued at once, so the engine always has the following record at hand when the
+ * controller answers and the thread only wakes up for the end of the stream.
+ * Launch RAM waits for every write before it to complete; Download Minidriver, Launch RAM and the
+ * wake up are sent synchronously.
+ */
+class VoodooBcmPatchLoader : public OSObject
+{
+    typedef OSObject super;
+    
+    OSDeclareDefaultStructors(VoodooBcmPatchLoader)
+    
+public:
+    static VoodooBcmPatchLoader * withEngine(VoodooHCICommandEngine * engine, UInt32 depth = VOODOO_BCM_PATCH_DEPTH_DEFAULT);
+    
+    virtual bool initWithEngine(VoodooHCICommandEngine * engine, UInt32 depth);
+    virtual void free() override;
+    
+    /* Checks the record framing of the whole file; records counts those before Launch RAM */
+    static IOReturn validate(OSData * patchram, UInt32 * records = NULL);
+    
+    void     setDelays(UInt32 minidriverMS, UInt32 launchMS);
+    IOReturn load(OSData * patchram);
+    
+    void     getStatistics(VoodooBcmPatchStatistics * statistics);
+    
+private:
+    static IOReturn scan(const UInt8 * bytes, UInt32 length, UInt32 * records, UInt32 * streamLength);
+    IOReturn sendPatchram(OSData * patchram);
+    static bool nextRecordAction(void * owner, VoodooHCIStreamCommand * command);
+    static void rewindRecordAction(void * owner, const VoodooHCIStreamCommand * command);
+    
+    VoodooHCICommandEngine     * engine;
+    IOLock                     * lock;
+    UInt32                       depth;
+    UInt32                       minidriverDelayMS;
+    UInt32                       launchDelayMS;
+    
+    const UInt8                * image;
+    UInt32                       streamLength;      /* up to the Launch RAM record, or the whole file */
+    UInt32                       nextOffset;
+    
+    VoodooBcmPatchStatistics     statistics;
+};
+
+#endif /* VoodooBcmPatchLoader_h */
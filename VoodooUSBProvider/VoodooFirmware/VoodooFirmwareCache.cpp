@@ -0,0 +1,345 @@
+//
+//  VoodooFirmwareCache.cpp
+//  VoodooUSBProvider
+//
+//  Copyright © 2021 Charlie Jiang. All rights reserved.
+//
+
+#include "VoodooFirmwareCache.h"
+
+/* Shared by every device holding a reference; the last one to let go frees it so the kext can unload */
+static VoodooFirmwareCache * gSharedFirmwareCache = NULL;
+static UInt32                gSharedFirmwareCacheUsers = 0;
+static IOLock      * volatile gSharedFirmwareCacheLock = NULL;
+
+OSDefineMetaClassAndStructors(VoodooFirmwareCache, OSObject)
+
+static IOLock * sharedCacheLock()
+{
+    // Allocated once and kept; a lock is not an OSObject, so it does not hold the kext loaded
+    if (!gSharedFirmwareCacheLock)
+    {
+        IOLock * lock = IOLockAlloc();
+        if (lock && !OSCompareAndSwapPtr(NULL, lock, (void * volatile *) &gSharedFirmwareCacheLock))
+        {
+            IOLockFree(lock);
+        }
+    }
+    return gSharedFirmwareCacheLock;
+}
+
+VoodooFirmwareCache * VoodooFirmwareCache::copySharedCache()
+{
+    IOLock * lock = sharedCacheLock();
+    if (!lock)
+    {
+        return NULL;
+    }
+    
+    IOLockLock(lock);
+    if (!gSharedFirmwareCache)
+    {
+        gSharedFirmwareCache = withBudget(VOODOO_FIRMWARE_CACHE_BUDGET_DEFAULT);
+    }
+    VoodooFirmwareCache * cache = gSharedFirmwareCache;
+    if (cache)
+    {
+        ++gSharedFirmwareCacheUsers;
+        cache->retain();
+    }
+    IOLockUnlock(lock);
+    return cache;
+}
+
+void VoodooFirmwareCache::releaseSharedCache(VoodooFirmwareCache *& cache)
+{
+    VoodooFirmwareCache * last = NULL;
+    
+    if (!cache)
+    {
+        return;
+    }
+    
+    IOLockLock(gSharedFirmwareCacheLock);
+    if (cache == gSharedFirmwareCache && !--gSharedFirmwareCacheUsers)
+    {
+        last = gSharedFirmwareCache;
+        gSharedFirmwareCache = NULL;
+    }
+    IOLockUnlock(gSharedFirmwareCacheLock);
+    
+    // Freeing the cache flushes its images, which is left out of the lock
+    OSSafeReleaseNULL(last);
+    OSSafeReleaseNULL(cache);
+}
+
+VoodooFirmwareCache * VoodooFirmwareCache::withBudget(UInt64 budgetBytes)
+{
+    VoodooFirmwareCache * cache = new VoodooFirmwareCache;
+    
+    if (cache && !cache->initWithBudget(budgetBytes))
+    {
+        OSSafeReleaseNULL(cache);
+    }
+    return cache;
+}
+
+bool VoodooFirmwareCache::initWithBudget(UInt64 budgetBytes)
+{
+    if (!super::init())
+    {
+        return false;
+    }
+    
+    lock = IOLockAlloc();
+    if (!lock)
+    {
+        return false;
+    }
+    
+    bzero(entries, sizeof(entries));
+    bzero(&statistics, sizeof(statistics));
+    budget = budgetBytes;
+    clock  = 0;
+    return true;
+}
+
+void VoodooFirmwareCache::free()
+{
+    if (lock)
+    {
+        flush();
+        IOLockFree(lock);
+        lock = NULL;
+    }
+    super::free();
+}
+
+void VoodooFirmwareCache::releaseImages(VoodooFirmwareImage ** images, UInt32 count)
+{
+    for (UInt32 i = 0; i < count; ++i)
+    {
+        OSSafeReleaseNULL(images[i]);
+    }
+}
+
+// Called with lock held
+VoodooFirmwareCacheEntry * VoodooFirmwareCache::findLocked(const VoodooFirmwareKey & key)
+{
+    for (UInt32 i = 0; i < VOODOO_FIRMWARE_CACHE_ENTRIES; ++i)
+    {
+        VoodooFirmwareCacheEntry * entry = &entries[i];
+        if (entry->used && entry->key.romVersion == key.romVersion && entry->key.boardId == key.boardId && entry->key.kind == key.kind)
+        {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// Called with lock held; an entry whose fetch is under way is never dropped
+VoodooFirmwareImage * VoodooFirmwareCache::dropLocked(VoodooFirmwareCacheEntry * entry)
+{
+    VoodooFirmwareImage * image = entry->image;
+    
+    statistics.bytes -= image->getLength();
+    --statistics.entries;
+    bzero(entry, sizeof(*entry));
+    return image;
+}
+
+// Called with lock held; a free entry, or the least recently used one once all are taken
+VoodooFirmwareCacheEntry * VoodooFirmwareCache::allocateLocked(VoodooFirmwareImage ** evicted)
+{
+    VoodooFirmwareCacheEntry * oldest = NULL;
+    
+    *evicted = NULL;
+    for (UInt32 i = 0; i < VOODOO_FIRMWARE_CACHE_ENTRIES; ++i)
+    {
+        VoodooFirmwareCacheEntry * entry = &entries[i];
+        if (!entry->used)
+        {
+            return entry;
+        }
+        if (entry->image && (!oldest || entry->lastUsed < oldest->lastUsed))
+        {
+            oldest = entry;
+        }
+    }
+    
+    if (oldest)
+    {
+        ++statistics.evictions;
+        *evicted = dropLocked(oldest);
+    }
+    return oldest;
+}
+
+// Called with lock held; drops the least recently used images until the rest fit the budget
+UInt32 VoodooFirmwareCache::trimLocked(VoodooFirmwareCacheEntry * keep, VoodooFirmwareImage ** evicted)
+{
+    UInt32 count = 0;
+    
+    while (statistics.bytes > budget)
+    {
+        VoodooFirmwareCacheEntry * oldest = NULL;
+        for (UInt32 i = 0; i < VOODOO_FIRMWARE_CACHE_ENTRIES; ++i)
+        {
+            VoodooFirmwareCacheEntry * entry = &entries[i];
+            if (entry != keep && entry->used && entry->image && (!oldest || entry->lastUsed < oldest->lastUsed))
+            {
+                oldest = entry;
+            }
+        }
+        if (!oldest)
+        {
+            break;
+        }
+        
+        ++statistics.evictions;
+        evicted[count++] = dropLocked(oldest);
+    }
+    return count;
+}
+
+VoodooFirmwareImage * VoodooFirmwareCache::copyImage(const VoodooFirmwareKey & key, VoodooFirmwareFetchAction fetch, void * owner, void * refCon)
+{
+    VoodooFirmwareImage * evicted[VOODOO_FIRMWARE_CACHE_ENTRIES];
+    UInt32 evictedCount = 0;
+    VoodooFirmwareCacheEntry * entry;
+    VoodooFirmwareImage * image;
+    bool waited = false;
+    
+    IOLockLock(lock);
+    while ((entry = findLocked(key)) && !entry->image)
+    {
+        // Someone else is fetching this very image; share it rather than read the file twice
+        if (!waited)
+        {
+            ++statistics.shared;
+            waited = true;
+        }
+        IOLockSleep(lock, (void *) entry, THREAD_UNINT);
+    }
+    
+    if (entry)
+    {
+        if (!waited)
+        {
+            ++statistics.hits;
+        }
+        entry->lastUsed = ++clock;
+        image = entry->image;
+        image->retain();
+        IOLockUnlock(lock);
+        return image;
+    }
+    
+    ++statistics.misses;
+    if (!fetch)
+    {
+        IOLockUnlock(lock);
+        return NULL;
+    }
+    
+    // Claimed before the fetch, so others asking for the same image wait for this one
+    entry = allocateLocked(&evicted[0]);
+    if (evicted[0])
+    {
+        evictedCount = 1;
+    }
+    if (entry)
+    {
+        entry->used     = true;
+        entry->key      = key;
+        entry->image    = NULL;
+        entry->lastUsed = ++clock;
+    }
+    IOLockUnlock(lock);
+    
+    releaseImages(evicted, evictedCount);
+    
+    image = fetch(owner, refCon, &key);
+    
+    // Every entry is being fetched: the image is still good, it is only not kept
+    if (!entry)
+    {
+        return image;
+    }
+    
+    evictedCount = 0;
+    IOLockLock(lock);
+    if (image && image->getLength() <= budget)
+    {
+        image->retain();
+        entry->image = image;
+        statistics.bytes += image->getLength();
+        ++statistics.entries;
+        evictedCount = trimLocked(entry, evicted);
+    }
+    else
+    {
+        // Waiters find no entry and fetch themselves
+        bzero(entry, sizeof(*entry));
+    }
+    IOLockWakeup(lock, (void *) entry, false);
+    IOLockUnlock(lock);
+    
+    releaseImages(evicted, evictedCount);
+    return image;
+}
+
+void VoodooFirmwareCache::setBudget(UInt64 budgetBytes)
+{
+    VoodooFirmwareImage * evicted[VOODOO_FIRMWARE_CACHE_ENTRIES];
+    
+    IOLockLock(lock);
+    budget = budgetBytes;
+    UInt32 evictedCount = trimLocked(NULL, evicted);
+    IOLockUnlock(lock);
+    
+    releaseImages(evicted, evictedCount);
+}
+
+void VoodooFirmwareCache::remove(const VoodooFirmwareKey & key)
+{
+    VoodooFirmwareImage * image = NULL;
+    
+    IOLockLock(lock);
+    VoodooFirmwareCacheEntry * entry = findLocked(key);
+    if (entry && entry->image)
+    {
+        image = dropLocked(entry);
+    }
+    IOLockUnlock(lock);
+    
+    OSSafeReleaseNULL(image);
+}
+
+void VoodooFirmwareCache::flush()
+{
+    VoodooFirmwareImage * evicted[VOODOO_FIRMWARE_CACHE_ENTRIES];
+    UInt32 evictedCount = 0;
+    
+    IOLockLock(lock);
+    for (UInt32 i = 0; i < VOODOO_FIRMWARE_CACHE_ENTRIES; ++i)
+    {
+        if (entries[i].used && entries[i].image)
+        {
+            evicted[evictedCount++] = dropLocked(&entries[i]);
+        }
+    }
+    IOLockUnlock(lock);
+    
+    releaseImages(evicted, evictedCount);
+}
+
+void VoodooFirmwareCache::getStatistics(VoodooFirmwareCacheStatistics * statistics)
+{
+    if (statistics)
+    {
+        IOLockLock(lock);
+        *statistics = this->statistics;
+        IOLockUnlock(lock);
+    }
+}
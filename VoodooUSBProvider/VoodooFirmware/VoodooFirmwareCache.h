@@ -0,0 +1,107 @@
+//
+//  VoodooFirmwareCache.h
+//  VoodooUSBProvider
+//
+//  Copyright © 2021 Charlie Jiang. All rights reserved.
+//
+
+#ifndef VoodooFirmwareCache_h
+#define VoodooFirmwareCache_h
+
+#include "VoodooFirmwareImage.h"
+
+#define VOODOO_FIRMWARE_CACHE_ENTRIES           16
+#define VOODOO_FIRMWARE_CACHE_BUDGET_DEFAULT    (4 * 1024 * 1024)
+
+struct VoodooFirmwareKey
+{
+    UInt32                romVersion;
+    UInt16                boardId;      /* QCAVersion::boardId, the reference clock for Ath3k */
+    VoodooFirmwareKind    kind;
+};
+
+static inline VoodooFirmwareKey VoodooFirmwareQcaKey(const QCAVersion & version, VoodooFirmwareKind kind)
+{
+    return { (UInt32) version.romVersion, (UInt16) version.boardId, kind };
+}
+
+static inline VoodooFirmwareKey VoodooFirmwareAth3kKey(const Ath3KVersion & version, VoodooFirmwareKind kind)
+{
+    return { (UInt32) version.romVersion, version.refClock, kind };
+}
+
+/* Reads and parses the image on a miss; returns it retained, or NULL */
+typedef VoodooFirmwareImage * (*VoodooFirmwareFetchAction)(void * owner, void * refCon, const VoodooFirmwareKey * key);
+
+struct VoodooFirmwareCacheEntry
+{
+    VoodooFirmwareKey       key;
+    VoodooFirmwareImage   * image;          /* NULL while its fetch is under way */
+    UInt64                  lastUsed;
+    bool                    used;
+};
+
+struct VoodooFirmwareCacheStatistics
+{
+    UInt64    hits;
+    UInt64    misses;
+    UInt64    shared;           /* waited for a fetch of the same image by someone else instead of fetching */
+    UInt64    evictions;
+    UInt64    bytes;
+    UInt32    entries;
+};
+
+/*
+ * Parsed firmware images by chip ROM version, board ID and kind, so a reset, a wake from sleep or a
+ * second adapter of the same kind gets the image without reading or parsing the file again.
+ * Images are kept within a memory budget and the least recently used ones are dropped first;
+ * a dropped image stays valid for whoever still holds it.
+ * Only one fetch runs for a key at a time: identical adapters attaching together wait for the
+ * first one's fetch and share its image.
+ */
+class VoodooFirmwareCache : public OSObject
+{
+    typedef OSObject super;
+    
+    OSDeclareDefaultStructors(VoodooFirmwareCache)
+    
+public:
+    /*
+     * Provider wide, created on first use and retained for the caller. Hand it back with
+     * releaseSharedCache(), which sets cache to NULL; the cache and its images are freed once
+     * the last holder does, so a loaded cache does not keep the kext from unloading.
+     */
+    static VoodooFirmwareCache * copySharedCache();
+    static void releaseSharedCache(VoodooFirmwareCache *& cache);
+    
+    static VoodooFirmwareCache * withBudget(UInt64 budgetBytes = VOODOO_FIRMWARE_CACHE_BUDGET_DEFAULT);
+    
+    virtual bool initWithBudget(UInt64 budgetBytes);
+    virtual void free() override;
+    
+    /* Retained image, fetched on a miss when fetch is given */
+    VoodooFirmwareImage * copyImage(const VoodooFirmwareKey & key, VoodooFirmwareFetchAction fetch = NULL, void * owner = NULL, void * refCon = NULL);
+    
+    void     setBudget(UInt64 budgetBytes);
+    void     remove(const VoodooFirmwareKey & key);
+    void     flush();
+    
+    void     getStatistics(VoodooFirmwareCacheStatistics * statistics);
+    
+private:
+    /* Dropped images are handed back, to be released once the lock is given up */
+    VoodooFirmwareCacheEntry * findLocked(const VoodooFirmwareKey & key);
+    VoodooFirmwareCacheEntry * allocateLocked(VoodooFirmwareImage ** evicted);
+    VoodooFirmwareImage      * dropLocked(VoodooFirmwareCacheEntry * entry);
+    UInt32                     trimLocked(VoodooFirmwareCacheEntry * keep, VoodooFirmwareImage ** evicted);
+    static void                releaseImages(VoodooFirmwareImage ** images, UInt32 count);
+    
+    IOLock                       * lock;
+    UInt64                         budget;
+    UInt64                         clock;           /* bumped on every use, orders the entries for eviction */
+    
+    VoodooFirmwareCacheEntry       entries[VOODOO_FIRMWARE_CACHE_ENTRIES];
+    VoodooFirmwareCacheStatistics  statistics;
+};
+
+#endif /* VoodooFirmwareCache_h */
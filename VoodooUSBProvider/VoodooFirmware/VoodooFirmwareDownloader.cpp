@@ -0,0 +1,376 @@
+//
+//  VoodooFirmwareDownloader.cpp
+//  VoodooUSBProvider
+//
+//  Copyright © 2021 Charlie Jiang. All rights reserved.
+//
+
+#include "VoodooFirmwareDownloader.h"
+
+OSDefineMetaClassAndStructors(VoodooFirmwareDownloader, OSObject)
+
+VoodooFirmwareDownloader * VoodooFirmwareDownloader::withPipe(VoodooUSBPipe * bulkPipe, UInt32 segmentSize, UInt32 depth)
+{
+    VoodooFirmwareDownloader * downloader = new VoodooFirmwareDownloader;
+    
+    if (downloader && !downloader->initWithPipe(bulkPipe, segmentSize, depth))
+    {
+        OSSafeReleaseNULL(downloader);
+    }
+    return downloader;
+}
+
+bool VoodooFirmwareDownloader::initWithPipe(VoodooUSBPipe * bulkPipe, UInt32 segmentSize, UInt32 depth)
+{
+    if (!super::init() || !bulkPipe)
+    {
+        return false;
+    }
+    
+    if (!segmentSize || !depth || depth > VOODOO_FIRMWARE_DEPTH_MAX)
+    {
+        VoodooUSBErrorLog("VoodooFirmwareDownloader::initWithPipe() - Invalid segment size %u or depth %u!!!\n", segmentSize, depth);
+        return false;
+    }
+    
+    lock = IOLockAlloc();
+    if (!lock)
+    {
+        return false;
+    }
+    
+    bzero(segments, sizeof(segments));
+    bzero(&statistics, sizeof(statistics));
+    
+    this->segmentSize = segmentSize;
+    this->depth       = depth;
+    image             = NULL;
+    progressAction    = NULL;
+    
+    for (UInt32 i = 0; i < depth; ++i)
+    {
+        segments[i].downloader = this;
+        segments[i].completion = { this, writeCompletionAction, &segments[i] };
+    }
+    
+    pipe = bulkPipe;
+    pipe->retain();
+    return true;
+}
+
+void VoodooFirmwareDownloader::free()
+{
+    for (UInt32 i = 0; i < VOODOO_FIRMWARE_DEPTH_MAX; ++i)
+    {
+        OSSafeReleaseNULL(segments[i].window);
+    }
+    OSSafeReleaseNULL(pipe);
+    
+    if (lock)
+    {
+        IOLockFree(lock);
+        lock = NULL;
+    }
+    super::free();
+}
+
+void VoodooFirmwareDownloader::setProgressAction(VoodooFirmwareProgressAction action, void * owner, void * refCon)
+{
+    progressAction = action;
+    progressOwner  = owner;
+    progressRefCon = refCon;
+}
+
+IOReturn VoodooFirmwareDownloader::download(OSData * firmware, UInt32 offset, UInt32 timeoutMS)
+{
+    if (!firmware || offset > firmware->getLength())
+    {
+        return kIOReturnBadArgument;
+    }
+    
+    if (image)
+    {
+        VoodooUSBErrorLog("VoodooFirmwareDownloader::download() - Download already in progress!!!\n");
+        return kIOReturnBusy;
+    }
+    
+    imageLength = firmware->getLength();
+    if (offset == imageLength)
+    {
+        return kIOReturnSuccess;
+    }
+    
+    // Describe the OSData in place and wire it once; every segment is a sub-range of this descriptor
+    image = IOMemoryDescriptor::withAddressRange((mach_vm_address_t) firmware->getBytesNoCopy(), imageLength, kIODirectionOut, kernel_task);
+    if (!image)
+    {
+        return kIOReturnNoMemory;
+    }
+    
+    IOReturn result = image->prepare();
+    if (result != kIOReturnSuccess)
+    {
+        VoodooUSBErrorLog("VoodooFirmwareDownloader::download() - Unable to wire firmware image: 0x%08x!!!\n", result);
+        OSSafeReleaseNULL(image);
+        return result;
+    }
+    
+    result = transfer(offset, timeoutMS);
+    
+    image->complete();
+    OSSafeReleaseNULL(image);
+    return result;
+}
+
+IOReturn VoodooFirmwareDownloader::download(VoodooFirmwareImage * firmware, UInt32 offset, UInt32 timeoutMS)
+{
+    if (!firmware || offset > firmware->getLength())
+    {
+        return kIOReturnBadArgument;
+    }
+    
+    if (image)
+    {
+        VoodooUSBErrorLog("VoodooFirmwareDownloader::download() - Download already in progress!!!\n");
+        return kIOReturnBusy;
+    }
+    
+    imageLength = firmware->getLength();
+    if (offset == imageLength)
+    {
+        return kIOReturnSuccess;
+    }
+    
+    // Wired when the image was parsed, and it stays wired after the download
+    image = firmware->getDescriptor();
+    image->retain();
+    
+    IOReturn result = transfer(offset, timeoutMS);
+    
+    OSSafeReleaseNULL(image);
+    return result;
+}
+
+// Streams image from offset; image is prepared
+IOReturn VoodooFirmwareDownloader::transfer(UInt32 offset, UInt32 timeoutMS)
+{
+    this->timeoutMS = timeoutMS;
+    nextOffset      = offset;
+    sentBytes       = offset;
+    inFlight        = 0;
+    queueing        = false;
+    status          = kIOReturnSuccess;
+    
+    UInt64 startTime = mach_absolute_time();
+    UInt32 segmentCount = 0;
+    
+    for (UInt32 i = 0; i < depth; ++i)
+    {
+        segments[i].busy = false;
+    }
+    
+    // Completions hand their segment back and refill it, so the queue stays full until the image runs out
+    queueSegments(NULL);
+    
+    IOLockLock(lock);
+    while (inFlight || queueing)
+    {
+        IOLockSleep(lock, (void *) &inFlight, THREAD_UNINT);
+    }
+    IOReturn result = status;
+    segmentCount = (imageLength - offset + segmentSize - 1) / segmentSize;
+    IOLockUnlock(lock);
+    
+    UInt64 durationNS;
+    absolutetime_to_nanoseconds(mach_absolute_time() - startTime, &durationNS);
+    
+    if (result != kIOReturnSuccess)
+    {
+        VoodooUSBErrorLog("VoodooFirmwareDownloader::transfer() - Download failed at %u of %u bytes: 0x%08x!!!\n", sentBytes, imageLength, result);
+        return result;
+    }
+    
+    statistics.bytes      += imageLength - offset;
+    statistics.durationNS += durationNS;
+    statistics.segments   += segmentCount;
+    if (statistics.durationNS)
+    {
+        statistics.bytesPerSecond = (UInt32) (statistics.bytes * 1000000000ULL / statistics.durationNS);
+    }
+    
+    VoodooUSBDebugLog("VoodooFirmwareDownloader::transfer() - %u bytes in %llu us (%u bytes/s)\n", imageLength - offset, durationNS / 1000, statistics.bytesPerSecond);
+    return kIOReturnSuccess;
+}
+
+IOReturn VoodooFirmwareDownloader::downloadQcaImage(VoodooUSBDevice * device, IOService * forClient, OSData * firmware, UInt8 headerLength)
+{
+    if (!device || !firmware)
+    {
+        return kIOReturnBadArgument;
+    }
+    
+    // The header goes over the control endpoint, the body is streamed to bulk endpoint 0x02
+    UInt32 size = min(firmware->getLength(), (UInt32) headerLength);
+    IOReturn result = device->sendVendorRequestOut(forClient, QCA_DFU_DOWNLOAD, (void *) firmware->getBytesNoCopy(), size);
+    if (result != kIOReturnSuccess)
+    {
+        VoodooUSBErrorLog("VoodooFirmwareDownloader::downloadQcaImage() - Unable to send firmware header: 0x%08x!!!\n", result);
+        return result;
+    }
+    
+    return download(firmware, size, QCA_DFU_TIMEOUT);
+}
+
+IOReturn VoodooFirmwareDownloader::downloadQcaImage(VoodooUSBDevice * device, IOService * forClient, VoodooFirmwareImage * firmware)
+{
+    if (!device || !firmware)
+    {
+        return kIOReturnBadArgument;
+    }
+    
+    // Same as above, with the header length and the wiring already worked out by the image
+    UInt32 size = firmware->getHeaderLength();
+    IOReturn result = device->sendVendorRequestOut(forClient, QCA_DFU_DOWNLOAD, (void *) firmware->getData()->getBytesNoCopy(), size);
+    if (result != kIOReturnSuccess)
+    {
+        VoodooUSBErrorLog("VoodooFirmwareDownloader::downloadQcaImage() - Unable to send firmware header: 0x%08x!!!\n", result);
+        return result;
+    }
+    
+    return download(firmware, size, QCA_DFU_TIMEOUT);
+}
+
+void VoodooFirmwareDownloader::queueSegments(VoodooFirmwareSegment * done)
+{
+    IOLockLock(lock);
+    if (done)
+    {
+        done->busy = false;
+        --inFlight;
+    }
+    
+    // Segments have to reach the endpoint in image order, so only one thread posts at a time; the
+    // others leave their free segment to it, and it picks the segment up before it gives up the lock
+    if (queueing)
+    {
+        IOLockUnlock(lock);
+        return;
+    }
+    queueing = true;
+    
+    while (status == kIOReturnSuccess && nextOffset < imageLength)
+    {
+        VoodooFirmwareSegment * segment = NULL;
+        for (UInt32 i = 0; i < depth && !segment; ++i)
+        {
+            segment = segments[i].busy ? NULL : &segments[i];
+        }
+        if (!segment)
+        {
+            break;
+        }
+        
+        segment->busy   = true;
+        segment->offset = nextOffset;
+        segment->length = min(segmentSize, imageLength - nextOffset);
+        nextOffset += segment->length;
+        if (++inFlight > statistics.peakInFlight)
+        {
+            statistics.peakInFlight = inFlight;
+        }
+        IOLockUnlock(lock);
+        
+        // The completion may run before this returns
+        IOReturn result = postSegment(segment);
+        
+        IOLockLock(lock);
+        if (result != kIOReturnSuccess)
+        {
+            segment->busy = false;
+            --inFlight;
+            if (status == kIOReturnSuccess)
+            {
+                status = result;
+            }
+        }
+    }
+    
+    // transfer() may release the downloader as soon as it sees this, so nothing touches it afterwards
+    queueing = false;
+    if (!inFlight)
+    {
+        IOLockWakeup(lock, (void *) &inFlight, false);
+    }
+    IOLockUnlock(lock);
+}
+
+IOReturn VoodooFirmwareDownloader::postSegment(VoodooFirmwareSegment * segment)
+{
+    if (!segment->window)
+    {
+        segment->window = IOSubMemoryDescriptor::withSubRange(image, segment->offset, segment->length, kIODirectionOut);
+        if (!segment->window)
+        {
+            return kIOReturnNoMemory;
+        }
+    }
+    else if (!segment->window->initSubRange(image, segment->offset, segment->length, kIODirectionOut))
+    {
+        return kIOReturnNoMemory;
+    }
+    
+    segment->postTime = mach_absolute_time();
+    return pipe->write(segment->window, 0, timeoutMS, segment->length, &segment->completion);
+}
+
+void VoodooFirmwareDownloader::reportProgress()
+{
+    if (progressAction)
+    {
+        progressAction(progressOwner, progressRefCon, sentBytes, imageLength);
+    }
+}
+
+void VoodooFirmwareDownloader::writeCompletionAction(void * owner, void * parameter, IOReturn status, UInt32 arg)
+{
+    VoodooFirmwareDownloader * that = (VoodooFirmwareDownloader *) owner;
+    VoodooFirmwareSegment * segment = (VoodooFirmwareSegment *) parameter;
+    UInt32 length = (UInt32) USBCompletionBytes(segment->length, arg);
+    
+    that->pipe->recordTransfer(kIODirectionOut, segment->postTime, length, status);
+    
+    IOLockLock(that->lock);
+    if (status != kIOReturnSuccess || length != segment->length)
+    {
+        if (that->status == kIOReturnSuccess)
+        {
+            that->status = (status != kIOReturnSuccess) ? status : kIOReturnUnderrun;
+        }
+    }
+    else
+    {
+        that->sentBytes += length;
+    }
+    IOLockUnlock(that->lock);
+    
+    if (status == kIOReturnSuccess)
+    {
+        that->reportProgress();
+    }
+    else if (status != kIOReturnAborted)
+    {
+        // Stop the segments still queued behind the failed one instead of waiting for each to time out
+        that->pipe->abort();
+    }
+    
+    // The segment counts as in flight until here; transfer() waits for it, and for the refill
+    that->queueSegments(segment);
+}
+
+void VoodooFirmwareDownloader::getStatistics(VoodooFirmwareStatistics * statistics)
+{
+    if (statistics)
+    {
+        *statistics = this->statistics;
+    }
+}
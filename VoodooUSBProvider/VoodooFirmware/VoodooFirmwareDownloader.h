@@ -0,0 +1,99 @@
+//
+//  VoodooFirmwareDownloader.h
+//  VoodooUSBProvider
+//
+//  Copyright © 2021 Charlie Jiang. All rights reserved.
+//
+
+#ifndef VoodooFirmwareDownloader_h
+#define VoodooFirmwareDownloader_h
+
+#include "VoodooUSBDevice.h"
+#include "VoodooFirmwareImage.h"
+#include <IOKit/IOSubMemoryDescriptor.h>
+
+#define VOODOO_FIRMWARE_SEGMENT_DEFAULT     QCA_DFU_PACKET_LEN
+#define VOODOO_FIRMWARE_DEPTH_DEFAULT       4
+#define VOODOO_FIRMWARE_DEPTH_MAX           8
+
+/* sent and total are byte counts of the whole image, header included */
+typedef void (*VoodooFirmwareProgressAction)(void * owner, void * refCon, UInt32 sent, UInt32 total);
+
+class VoodooFirmwareDownloader;
+
+struct VoodooFirmwareSegment
+{
+    VoodooFirmwareDownloader * downloader;
+    IOSubMemoryDescriptor    * window;         /* view into the image, re-initialised for every segment */
+    USBCompletion              completion;
+    UInt32                     offset;
+    UInt32                     length;
+    UInt64                     postTime;
+    bool                       busy;           /* posted, or its completion has not handed it back yet */
+};
+
+struct VoodooFirmwareStatistics
+{
+    UInt64    bytes;
+    UInt64    durationNS;
+    UInt32    segments;
+    UInt32    peakInFlight;
+    UInt32    bytesPerSecond;
+};
+
+/*
+ * Streams a firmware image to the bulk-out endpoint straight from its OSData, several segments in flight.
+ * The image is wired once for the whole download; segments are sub-ranges of it, so nothing is copied.
+ */
+class VoodooFirmwareDownloader : public OSObject
+{
+    typedef OSObject super;
+    
+    OSDeclareDefaultStructors(VoodooFirmwareDownloader)
+    
+public:
+    static VoodooFirmwareDownloader * withPipe(VoodooUSBPipe * bulkPipe, UInt32 segmentSize = VOODOO_FIRMWARE_SEGMENT_DEFAULT, UInt32 depth = VOODOO_FIRMWARE_DEPTH_DEFAULT);
+    
+    virtual bool initWithPipe(VoodooUSBPipe * bulkPipe, UInt32 segmentSize, UInt32 depth);
+    virtual void free() override;
+    
+    void     setProgressAction(VoodooFirmwareProgressAction action, void * owner, void * refCon = NULL);
+    
+    IOReturn download(OSData * firmware, UInt32 offset = 0, UInt32 timeoutMS = QCA_DFU_TIMEOUT);
+    IOReturn download(VoodooFirmwareImage * firmware, UInt32 offset = 0, UInt32 timeoutMS = QCA_DFU_TIMEOUT);
+    IOReturn downloadQcaImage(VoodooUSBDevice * device, IOService * forClient, OSData * firmware, UInt8 headerLength);
+    IOReturn downloadQcaImage(VoodooUSBDevice * device, IOService * forClient, VoodooFirmwareImage * firmware);
+    
+    void     getStatistics(VoodooFirmwareStatistics * statistics);
+    
+private:
+    IOReturn transfer(UInt32 offset, UInt32 timeoutMS);
+    void     queueSegments(VoodooFirmwareSegment * done);
+    IOReturn postSegment(VoodooFirmwareSegment * segment);
+    void     reportProgress();
+    static void writeCompletionAction(void * owner, void * parameter, IOReturn status, UInt32 arg);
+    
+    VoodooUSBPipe                * pipe;
+    IOLock                       * lock;
+    
+    VoodooFirmwareSegment          segments[VOODOO_FIRMWARE_DEPTH_MAX];
+    UInt32                         segmentSize;
+    UInt32                         depth;
+    
+    IOMemoryDescriptor           * image;
+    UInt32                         imageLength;
+    UInt32                         nextOffset;
+    UInt32                         timeoutMS;
+    volatile UInt32                sentBytes;
+    volatile UInt32                inFlight;
+    bool                           queueing;        /* one thread at a time posts segments */
+    IOReturn                       status;
+    
+    VoodooFirmwareProgressAction   progressAction;
+    void                         * progressOwner;
+    void                         * progressRefCon;
+    
+    VoodooFirmwareStatistics       statistics;
+};
+
+#endif /* VoodooFirmwareDownloader_h */
@@ -0,0 +1,118 @@
+//
+//  VoodooFirmwareImage.cpp
+//  VoodooUSBProvider
+//
+//  Copyright © 2021 Charlie Jiang. All rights reserved.
+//
+
+#include "VoodooFirmwareImage.h"
+#include "VoodooUSBDevice.h"
+
+OSDefineMetaClassAndStructors(VoodooFirmwareImage, OSObject)
+
+VoodooFirmwareImage * VoodooFirmwareImage::withData(OSData * data, UInt32 headerLength)
+{
+    VoodooFirmwareImage * image = new VoodooFirmwareImage;
+    
+    if (image && !image->initWithData(data, headerLength))
+    {
+        OSSafeReleaseNULL(image);
+    }
+    return image;
+}
+
+VoodooFirmwareImage * VoodooFirmwareImage::withQcaData(OSData * data, VoodooFirmwareKind kind, const QCADeviceInfo * info)
+{
+    if (!data || !info || kind >= kVoodooFirmwareKindCount)
+    {
+        return NULL;
+    }
+    
+    VoodooFirmwareImage * image = withData(data, kind == kVoodooFirmwareRamPatch ? info->ramPatchHdr : info->nvmHdr);
+    if (image && kind == kVoodooFirmwareRamPatch)
+    {
+        // The version lives inside the image itself; read it in place rather than offsetting the OSData object
+        const QCARamPatchVersion * patchVersion = (const QCARamPatchVersion *) data->getBytesNoCopy(info->versionOffset, sizeof(QCARamPatchVersion));
+        if (!patchVersion)
+        {
+            VoodooUSBErrorLog("VoodooFirmwareImage::withQcaData() - Firmware is too short for the version at offset %d!!!\n", info->versionOffset);
+            OSSafeReleaseNULL(image);
+            return NULL;
+        }
+        image->version    = *patchVersion;
+        image->hasVersion = true;
+    }
+    return image;
+}
+
+bool VoodooFirmwareImage::initWithData(OSData * data, UInt32 headerLength)
+{
+    if (!super::init() || !data || headerLength >= data->getLength())
+    {
+        return false;
+    }
+    
+    // Described in place and wired once; every download cuts its segments out of this descriptor
+    descriptor = IOMemoryDescriptor::withAddressRange((mach_vm_address_t) data->getBytesNoCopy(), data->getLength(), kIODirectionOut, kernel_task);
+    if (!descriptor)
+    {
+        return false;
+    }
+    
+    IOReturn result = descriptor->prepare();
+    if (result != kIOReturnSuccess)
+    {
+        VoodooUSBErrorLog("VoodooFirmwareImage::initWithData() - Unable to wire firmware image: 0x%08x!!!\n", result);
+        return false;
+    }
+    prepared = true;
+    
+    this->headerLength = headerLength;
+    hasVersion         = false;
+    bzero(&version, sizeof(version));
+    
+    this->data = data;
+    this->data->retain();
+    return true;
+}
+
+void VoodooFirmwareImage::free()
+{
+    if (descriptor && prepared)
+    {
+        descriptor->complete();
+    }
+    OSSafeReleaseNULL(descriptor);
+    OSSafeReleaseNULL(data);
+    super::free();
+}
+
+OSData * VoodooFirmwareImage::getData()
+{
+    return data;
+}
+
+IOMemoryDescriptor * VoodooFirmwareImage::getDescriptor()
+{
+    return descriptor;
+}
+
+UInt32 VoodooFirmwareImage::getLength()
+{
+    return data->getLength();
+}
+
+UInt32 VoodooFirmwareImage::getHeaderLength()
+{
+    return headerLength;
+}
+
+bool VoodooFirmwareImage::getRamPatchVersion(QCARamPatchVersion * version)
+{
+    if (!version || !hasVersion)
+    {
+        return false;
+    }
+    *version = this->version;
+    return true;
+}
@@ -0,0 +1,53 @@
+//
+//  VoodooFirmwareImage.h
+//  VoodooUSBProvider
+//
+//  Copyright © 2021 Charlie Jiang. All rights reserved.
+//
+
+#ifndef VoodooFirmwareImage_h
+#define VoodooFirmwareImage_h
+
+#include "VoodooUSBCommon.h"
+#include <libkern/c++/OSData.h>
+
+enum VoodooFirmwareKind : UInt8
+{
+    kVoodooFirmwareRamPatch = 0,
+    kVoodooFirmwareNvm,                 /* QCA NVM, Ath3k system config */
+    kVoodooFirmwareKindCount
+};
+
+/*
+ * A firmware file parsed once: its header split off, its version read and the whole image wired
+ * for the bulk pipe. Immutable once created, so any number of devices and downloads share it.
+ */
+class VoodooFirmwareImage : public OSObject
+{
+    typedef OSObject super;
+    
+    OSDeclareDefaultStructors(VoodooFirmwareImage)
+    
+public:
+    static VoodooFirmwareImage * withData(OSData * data, UInt32 headerLength);
+    static VoodooFirmwareImage * withQcaData(OSData * data, VoodooFirmwareKind kind, const QCADeviceInfo * info);
+    
+    virtual bool initWithData(OSData * data, UInt32 headerLength);
+    virtual void free() override;
+    
+    OSData             * getData();
+    IOMemoryDescriptor * getDescriptor();       /* prepared for the lifetime of the image */
+    UInt32               getLength();
+    UInt32               getHeaderLength();     /* sent over the control endpoint, the rest goes over bulk */
+    bool                 getRamPatchVersion(QCARamPatchVersion * version);
+    
+private:
+    OSData             * data;
+    IOMemoryDescriptor * descriptor;
+    bool                 prepared;
+    UInt32               headerLength;
+    bool                 hasVersion;
+    QCARamPatchVersion   version;
+};
+
+#endif /* VoodooFirmwareImage_h */
@@ -0,0 +1,406 @@
+//
+//  VoodooIntelSfiLoader.cpp
+//  VoodooUSBProvider
+//
+//  Copyright © 2021 Charlie Jiang. All rights reserved.
+//
+
+#include "VoodooIntelSfiLoader.h"
+
+static const UInt8 kSecureSendType[kVoodooIntelSfiPhaseCount] =
+{
+    INTEL_SECURE_SEND_CSS_HEADER, INTEL_SECURE_SEND_PUBLIC_KEY, INTEL_SECURE_SEND_SIGNATURE, INTEL_SECURE_SEND_DATA
+};
+
+/* The payload runs to the end of the image */
+static const UInt32 kPhaseOffset[kVoodooIntelSfiPhaseCount] =
+{
+    0, VOODOO_INTEL_SFI_PUBLIC_KEY_OFFSET, VOODOO_INTEL_SFI_SIGNATURE_OFFSET, VOODOO_INTEL_SFI_PAYLOAD_OFFSET
+};
+
+static const UInt32 kPhaseLength[kVoodooIntelSfiPhaseCount - 1] =
+{
+    VOODOO_INTEL_SFI_CSS_HEADER_LENGTH, VOODOO_INTEL_SFI_PUBLIC_KEY_LENGTH, VOODOO_INTEL_SFI_SIGNATURE_LENGTH
+};
+
+OSDefineMetaClassAndStructors(VoodooIntelSfiLoader, OSObject)
+
+VoodooIntelSfiLoader * VoodooIntelSfiLoader::withEngine(VoodooHCICommandEngine * engine, VoodooHCIEventReassembler * reassembler, UInt32 depth)
+{
+    VoodooIntelSfiLoader * loader = new VoodooIntelSfiLoader;
+    
+    if (loader && !loader->initWithEngine(engine, reassembler, depth))
+    {
+        OSSafeReleaseNULL(loader);
+    }
+    return loader;
+}
+
+bool VoodooIntelSfiLoader::initWithEngine(VoodooHCICommandEngine * engine, VoodooHCIEventReassembler * reassembler, UInt32 depth)
+{
+    if (!super::init() || !engine)
+    {
+        return false;
+    }
+    
+    if (!depth || depth > VOODOO_INTEL_SFI_DEPTH_MAX)
+    {
+        VoodooUSBErrorLog("VoodooIntelSfiLoader::initWithEngine() - Invalid depth %u!!!\n", depth);
+        return false;
+    }
+    
+    lock = IOLockAlloc();
+    if (!lock)
+    {
+        return false;
+    }
+    
+    bzero(&statistics, sizeof(statistics));
+    
+    this->depth = depth;
+    image       = NULL;
+    
+    this->engine = engine;
+    this->engine->retain();
+    this->reassembler = reassembler;
+    if (reassembler)
+    {
+        reassembler->retain();
+    }
+    return true;
+}
+
+void VoodooIntelSfiLoader::free()
+{
+    OSSafeReleaseNULL(reassembler);
+    OSSafeReleaseNULL(engine);
+    
+    if (lock)
+    {
+        IOLockFree(lock);
+        lock = NULL;
+    }
+    super::free();
+}
+
+// Called on a validated payload: whole commands from offset until the block is a multiple of 4 bytes
+UInt32 VoodooIntelSfiLoader::payloadBlockEnd(const UInt8 * bytes, UInt32 length, UInt32 offset)
+{
+    UInt32 end = offset;
+    
+    do
+    {
+        end += HCI_COMMAND_HDR_SIZE + ((const FwCommandHdr *) (bytes + end))->pLength;
+    }
+    while ((end - offset) % 4 && end < length);
+    return end;
+}
+
+IOReturn VoodooIntelSfiLoader::scan(const UInt8 * bytes, UInt32 length, UInt32 * fragments, UInt32 * bootAddress)
+{
+    if (length <= VOODOO_INTEL_SFI_PAYLOAD_OFFSET)
+    {
+        return kIOReturnUnderrun;
+    }
+    
+    // Only the RSA signed layout is known here; ECDSA images have a longer header
+    UInt32 cssVersion = OSReadLittleInt32(bytes, VOODOO_INTEL_SFI_CSS_VERSION_OFFSET);
+    if (cssVersion != VOODOO_INTEL_SFI_CSS_VERSION)
+    {
+        VoodooUSBErrorLog("VoodooIntelSfiLoader::scan() - Unsupported CSS header version 0x%08x!!!\n", cssVersion);
+        return kIOReturnUnsupported;
+    }
+    
+    UInt32 count = 0;
+    for (UInt32 i = 0; i < kVoodooIntelSfiPayload; ++i)
+    {
+        count += (kPhaseLength[i] + INTEL_SECURE_SEND_FRAGMENT_MAX - 1) / INTEL_SECURE_SEND_FRAGMENT_MAX;
+    }
+    
+    UInt32 address = 0;
+    UInt32 blockLength = 0;
+    for (UInt32 offset = VOODOO_INTEL_SFI_PAYLOAD_OFFSET; offset < length; )
+    {
+        const FwCommandHdr * header = (const FwCommandHdr *) (bytes + offset);
+        if (length - offset < HCI_COMMAND_HDR_SIZE || length - offset - HCI_COMMAND_HDR_SIZE < header->pLength)
+        {
+            VoodooUSBErrorLog("VoodooIntelSfiLoader::scan() - Truncated command at offset %u of %u!!!\n", offset, length);
+            return kIOReturnUnderrun;
+        }
+        
+        // The firmware is entered at the address the image writes into the boot parameters
+        if (header->opCode == HCI_OP_INTEL_WRITE_BOOT_PARAMS && header->pLength >= sizeof(UInt32))
+        {
+            address = OSReadLittleInt32(bytes, offset + HCI_COMMAND_HDR_SIZE);
+        }
+        
+        blockLength += HCI_COMMAND_HDR_SIZE + header->pLength;
+        offset      += HCI_COMMAND_HDR_SIZE + header->pLength;
+        if (!(blockLength % 4))
+        {
+            count += (blockLength + INTEL_SECURE_SEND_FRAGMENT_MAX - 1) / INTEL_SECURE_SEND_FRAGMENT_MAX;
+            blockLength = 0;
+        }
+    }
+    
+    // The bootloader only takes blocks of whole words
+    if (blockLength)
+    {
+        VoodooUSBErrorLog("VoodooIntelSfiLoader::scan() - Payload ends %u bytes into an unaligned block!!!\n", blockLength);
+        return kIOReturnUnderrun;
+    }
+    
+    if (fragments)
+    {
+        *fragments = count;
+    }
+    if (bootAddress)
+    {
+        *bootAddress = address;
+    }
+    return kIOReturnSuccess;
+}
+
+IOReturn VoodooIntelSfiLoader::validate(OSData * sfi, UInt32 * fragments, UInt32 * bootAddress)
+{
+    if (!sfi)
+    {
+        return kIOReturnBadArgument;
+    }
+    return scan((const UInt8 *) sfi->getBytesNoCopy(), sfi->getLength(), fragments, bootAddress);
+}
+
+IOReturn VoodooIntelSfiLoader::load(OSData * sfi)
+{
+    UInt32 bootAddress;
+    
+    IOReturn result = validate(sfi, NULL, &bootAddress);
+    if (result != kIOReturnSuccess)
+    {
+        VoodooUSBErrorLog("VoodooIntelSfiLoader::load() - Malformed SFI image: 0x%08x!!!\n", result);
+        return result;
+    }
+    
+    IOLockLock(lock);
+    if (image)
+    {
+        IOLockUnlock(lock);
+        VoodooUSBErrorLog("VoodooIntelSfiLoader::load() - Load already in progress!!!\n");
+        return kIOReturnBusy;
+    }
+    image            = (const UInt8 *) sfi->getBytesNoCopy();
+    imageLength      = sfi->getLength();
+    phase            = kVoodooIntelSfiCssHeader;
+    nextOffset       = 0;
+    blockEnd         = 0;
+    resultReceived   = false;
+    booted           = false;
+    secureSendResult = kIOReturnSuccess;
+    bzero(phaseStartTime, sizeof(phaseStartTime));
+    bzero(phaseEndTime, sizeof(phaseEndTime));
+    bzero(&statistics, sizeof(statistics));
+    statistics.bootAddress = bootAddress;
+    IOLockUnlock(lock);
+    
+    if (reassembler)
+    {
+        result = reassembler->subscribe(HCI_EV_VENDOR, vendorEventAction, this);
+    }
+    
+    if (result == kIOReturnSuccess)
+    {
+        result = sendImage(bootAddress);
+    }
+    
+    if (reassembler)
+    {
+        reassembler->unsubscribe(vendorEventAction, this);
+    }
+    
+    IOLockLock(lock);
+    image = NULL;
+    IOLockUnlock(lock);
+    
+    if (result == kIOReturnSuccess)
+    {
+        VoodooUSBDebugLog("VoodooIntelSfiLoader::load() - %u fragments in %llu us, booted in %llu us\n", statistics.fragments, statistics.downloadNS / 1000, statistics.bootNS / 1000);
+    }
+    return result;
+}
+
+IOReturn VoodooIntelSfiLoader::waitForEvent(volatile bool * done, UInt32 timeoutMS)
+{
+    UInt64 deadline;
+    clock_interval_to_deadline(timeoutMS, kMillisecondScale, &deadline);
+    
+    IOReturn result = kIOReturnSuccess;
+    IOLockLock(lock);
+    while (!*done)
+    {
+        if (IOLockSleepDeadline(lock, (void *) done, deadline, THREAD_UNINT) == THREAD_TIMED_OUT && !*done)
+        {
+            result = kIOReturnTimeout;
+            break;
+        }
+    }
+    IOLockUnlock(lock);
+    return result;
+}
+
+IOReturn VoodooIntelSfiLoader::sendImage(UInt32 bootAddress)
+{
+    UInt64 startTime = mach_absolute_time();
+    
+    VoodooHCICommandSource source = { this, nextFragmentAction, rewindFragmentAction, fragmentAnsweredAction };
+    IOReturn result = engine->sendCommandStream(&source, depth, &statistics.peakInFlight);
+    
+    for (UInt32 i = 0; i < kVoodooIntelSfiPhaseCount; ++i)
+    {
+        if (phaseEndTime[i] > phaseStartTime[i])
+        {
+            absolutetime_to_nanoseconds(phaseEndTime[i] - phaseStartTime[i], &statistics.phaseNS[i]);
+        }
+    }
+    
+    if (result != kIOReturnSuccess)
+    {
+        VoodooUSBErrorLog("VoodooIntelSfiLoader::sendImage() - Secure send failed in phase %u at offset %u of %u: 0x%08x!!!\n", phase, nextOffset, imageLength, result);
+        return result;
+    }
+    
+    // The bootloader checks the signature once it has the whole image, and says so in a vendor event
+    if (reassembler)
+    {
+        result = waitForEvent(&resultReceived, VOODOO_INTEL_SFI_DOWNLOAD_TIMEOUT);
+        if (result == kIOReturnSuccess)
+        {
+            result = secureSendResult;
+        }
+        if (result != kIOReturnSuccess)
+        {
+            VoodooUSBErrorLog("VoodooIntelSfiLoader::sendImage() - No good secure send result: 0x%08x!!!\n", result);
+            return result;
+        }
+    }
+    absolutetime_to_nanoseconds(mach_absolute_time() - startTime, &statistics.downloadNS);
+    
+    // INTEL_RESET with the image's boot address in place of the default boot parameter
+    UInt8 resetParam[INTEL_RESET.paramLength()];
+    memcpy(resetParam, INTEL_RESET.param(), sizeof(resetParam));
+    OSWriteLittleInt32(resetParam, 4, bootAddress);
+    
+    UInt64 resetTime = mach_absolute_time();
+    result = engine->sendCommandSync(HCI_OP_INTEL_RESET, sizeof(resetParam), resetParam);
+    if (result == kIOReturnSuccess && reassembler)
+    {
+        result = waitForEvent(&booted, VOODOO_INTEL_SFI_BOOT_TIMEOUT);
+    }
+    if (result != kIOReturnSuccess)
+    {
+        VoodooUSBErrorLog("VoodooIntelSfiLoader::sendImage() - Boot at 0x%08x failed: 0x%08x!!!\n", bootAddress, result);
+        return result;
+    }
+    absolutetime_to_nanoseconds(mach_absolute_time() - resetTime, &statistics.bootNS);
+    return kIOReturnSuccess;
+}
+
+// Called with the engine locked; the type byte and the fragment meet in the engine's command buffer
+bool VoodooIntelSfiLoader::nextFragmentAction(void * owner, VoodooHCIStreamCommand * command)
+{
+    VoodooIntelSfiLoader * that = (VoodooIntelSfiLoader *) owner;
+    
+    while (that->nextOffset == that->blockEnd)
+    {
+        UInt32 phaseEnd = (that->phase == kVoodooIntelSfiPayload) ? that->imageLength : kPhaseOffset[that->phase] + kPhaseLength[that->phase];
+        if (that->nextOffset == phaseEnd)
+        {
+            if (that->phase == kVoodooIntelSfiPayload)
+            {
+                return false;
+            }
+            that->nextOffset = kPhaseOffset[++that->phase];
+        }
+        
+        // Header, key and signature are a block each, the payload is cut at word aligned command boundaries
+        that->blockEnd = (that->phase == kVoodooIntelSfiPayload) ? payloadBlockEnd(that->image, that->imageLength, that->nextOffset) : kPhaseOffset[that->phase] + kPhaseLength[that->phase];
+    }
+    
+    UInt32 fragmentPhase = that->phase;
+    UInt8 length = (UInt8) min(that->blockEnd - that->nextOffset, (UInt32) INTEL_SECURE_SEND_FRAGMENT_MAX);
+    
+    bzero(command, sizeof(*command));
+    command->opCode  = HCI_OP_INTEL_SECURE_SEND;
+    command->headLen = 1;
+    command->head    = &kSecureSendType[fragmentPhase];
+    command->tailLen = length;
+    command->tail    = that->image + that->nextOffset;
+    command->refCon  = (void *) (uintptr_t) fragmentPhase;
+    that->nextOffset += length;
+    
+    if (!that->phaseStartTime[fragmentPhase])
+    {
+        that->phaseStartTime[fragmentPhase] = mach_absolute_time();
+    }
+    ++that->statistics.fragments;
+    ++that->statistics.phaseFragments[fragmentPhase];
+    that->statistics.bytes += length;
+    return true;
+}
+
+void VoodooIntelSfiLoader::rewindFragmentAction(void * owner, const VoodooHCIStreamCommand * command)
+{
+    VoodooIntelSfiLoader * that = (VoodooIntelSfiLoader *) owner;
+    UInt32 fragmentPhase = (UInt32) (uintptr_t) command->refCon;
+    
+    that->phase      = fragmentPhase;
+    that->nextOffset = (UInt32) ((const UInt8 *) command->tail - that->image);
+    
+    --that->statistics.fragments;
+    --that->statistics.phaseFragments[fragmentPhase];
+    that->statistics.bytes -= command->tailLen;
+}
+
+void VoodooIntelSfiLoader::fragmentAnsweredAction(void * owner, void * refCon, IOReturn status)
+{
+    VoodooIntelSfiLoader * that = (VoodooIntelSfiLoader *) owner;
+    
+    that->phaseEndTime[(UInt32) (uintptr_t) refCon] = mach_absolute_time();
+}
+
+void VoodooIntelSfiLoader::vendorEventAction(void * owner, void * refCon, const HciEventHdr * event, UInt16 length)
+{
+    VoodooIntelSfiLoader * that = (VoodooIntelSfiLoader *) owner;
+    const UInt8 * param = (const UInt8 *) event + HCI_EVENT_HDR_SIZE;
+    
+    if (event->pLength < 1)
+    {
+        return;
+    }
+    
+    IOLockLock(that->lock);
+    if (that->image && param[0] == INTEL_EV_SECURE_SEND_RESULT && event->pLength >= 5)
+    {
+        // result, opcode, status; a non-zero result is a rejected image
+        if (param[1])
+        {
+            VoodooUSBErrorLog("VoodooIntelSfiLoader::vendorEventAction() - Secure send result 0x%02x, status 0x%02x!!!\n", param[1], param[4]);
+            that->secureSendResult = kIOReturnError;
+        }
+        that->resultReceived = true;
+        IOLockWakeup(that->lock, (void *) &that->resultReceived, false);
+    }
+    else if (that->image && param[0] == INTEL_EV_BOOTUP)
+    {
+        that->booted = true;
+        IOLockWakeup(that->lock, (void *) &that->booted, false);
+    }
+    IOLockUnlock(that->lock);
+}
+
+void VoodooIntelSfiLoader::getStatistics(VoodooIntelSfiStatistics * statistics)
+{
+    if (statistics)
+    {
+        *statistics = this->statistics;
+    }
+}
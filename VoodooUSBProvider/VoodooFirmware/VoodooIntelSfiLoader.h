@@ -0,0 +1,115 @@
+//
+//  VoodooIntelSfiLoader.h
+//  VoodooUSBProvider
+//
+//  Copyright © 2021 Charlie Jiang. All rights reserved.
+//
+
+#ifndef VoodooIntelSfiLoader_h
+#define VoodooIntelSfiLoader_h
+
+#include "VoodooHCICommandEngine.h"
+#include "VoodooHCIEventReassembler.h"
+
+#define VOODOO_INTEL_SFI_DEPTH_DEFAULT          8
+#define VOODOO_INTEL_SFI_DEPTH_MAX              (VOODOO_HCI_COMMAND_ENGINE_SLOTS / 2)
+#define VOODOO_INTEL_SFI_DOWNLOAD_TIMEOUT       5000    /* last fragment to the secure send result */
+#define VOODOO_INTEL_SFI_BOOT_TIMEOUT           1000    /* reset to the bootup event */
+
+/* RSA signed SFI image: CSS header, public key, exponent, signature, then the HCI command payload */
+#define VOODOO_INTEL_SFI_CSS_HEADER_LENGTH      128
+#define VOODOO_INTEL_SFI_PUBLIC_KEY_OFFSET      128
+#define VOODOO_INTEL_SFI_PUBLIC_KEY_LENGTH      256
+#define VOODOO_INTEL_SFI_SIGNATURE_OFFSET       388     /* the 4 byte exponent is never sent */
+#define VOODOO_INTEL_SFI_SIGNATURE_LENGTH       256
+#define VOODOO_INTEL_SFI_PAYLOAD_OFFSET         644
+#define VOODOO_INTEL_SFI_CSS_VERSION_OFFSET     8
+#define VOODOO_INTEL_SFI_CSS_VERSION            0x00010000
+
+enum VoodooIntelSfiPhase
+{
+    kVoodooIntelSfiCssHeader    = 0,
+    kVoodooIntelSfiPublicKey,
+    kVoodooIntelSfiSignature,
+    kVoodooIntelSfiPayload,
+    kVoodooIntelSfiPhaseCount
+};
+
+/* Of the last load */
+struct VoodooIntelSfiStatistics
+{
+    UInt64    phaseNS[kVoodooIntelSfiPhaseCount];           /* first fragment queued to the last one answered */
+    UInt32    phaseFragments[kVoodooIntelSfiPhaseCount];
+    UInt64    downloadNS;                                   /* first fragment to the secure send result */
+    UInt64    bootNS;                                       /* reset to the bootup event */
+    UInt64    bytes;                                        /* of the image that went to the controller */
+    UInt32    fragments;
+    UInt32    peakInFlight;
+    UInt32    bootAddress;
+};
+
+/*
+ * Loads an Intel SFI image through the command engine while the controller is in its bootloader.
+ * The CSS header, public key and signature are sent as secure send blocks of their own type, and the
+ * payload in blocks of whole HCI commands that end on a 4 byte boundary; every block goes out in
+ * fragments of up to INTEL_SECURE_SEND_FRAGMENT_MAX bytes behind their type byte.
+ * Fragments are gathered from the OSData straight into the engine's wired command buffers, and the
+ * engine's sendCommandStream() keeps up to depth of them queued at once, so the next one goes out as
+ * soon as the controller grants a credit. Once the secure send result is in, the controller is reset into the firmware at
+ * the boot address of the image's Write Boot Params command.
+ * Without a reassembler the loader cannot see the bootloader's vendor events and goes on to the reset
+ * as soon as the last fragment is answered.
+ */
+class VoodooIntelSfiLoader : public OSObject
+{
+    typedef OSObject super;
+    
+    OSDeclareDefaultStructors(VoodooIntelSfiLoader)
+    
+public:
+    static VoodooIntelSfiLoader * withEngine(VoodooHCICommandEngine * engine, VoodooHCIEventReassembler * reassembler = NULL, UInt32 depth = VOODOO_INTEL_SFI_DEPTH_DEFAULT);
+    
+    virtual bool initWithEngine(VoodooHCICommandEngine * engine, VoodooHCIEventReassembler * reassembler, UInt32 depth);
+    virtual void free() override;
+    
+    /* Checks the header and the command framing of the payload; bootAddress is 0 without Write Boot Params */
+    static IOReturn validate(OSData * sfi, UInt32 * fragments = NULL, UInt32 * bootAddress = NULL);
+    
+    IOReturn load(OSData * sfi);
+    
+    void     getStatistics(VoodooIntelSfiStatistics * statistics);
+    
+private:
+    static IOReturn scan(const UInt8 * bytes, UInt32 length, UInt32 * fragments, UInt32 * bootAddress);
+    static UInt32   payloadBlockEnd(const UInt8 * bytes, UInt32 length, UInt32 offset);
+    
+    IOReturn sendImage(UInt32 bootAddress);
+    IOReturn waitForEvent(volatile bool * done, UInt32 timeoutMS);
+    
+    static bool nextFragmentAction(void * owner, VoodooHCIStreamCommand * command);
+    static void rewindFragmentAction(void * owner, const VoodooHCIStreamCommand * command);
+    static void fragmentAnsweredAction(void * owner, void * refCon, IOReturn status);
+    static void vendorEventAction(void * owner, void * refCon, const HciEventHdr * event, UInt16 length);
+    
+    VoodooHCICommandEngine     * engine;
+    VoodooHCIEventReassembler  * reassembler;
+    IOLock                     * lock;
+    UInt32                       depth;
+    
+    const UInt8                * image;
+    UInt32                       imageLength;
+    UInt32                       phase;             /* of the next fragment */
+    UInt32                       nextOffset;
+    UInt32                       blockEnd;          /* of the secure send block nextOffset is in */
+    
+    volatile bool                resultReceived;
+    volatile bool                booted;
+    IOReturn                     secureSendResult;
+    
+    UInt64                       phaseStartTime[kVoodooIntelSfiPhaseCount];
+    UInt64                       phaseEndTime[kVoodooIntelSfiPhaseCount];
+    
+    VoodooIntelSfiStatistics     statistics;
+};
+
+#endif /* VoodooIntelSfiLoader_h */
@@ -50,6 +50,18 @@ struct HciEventHdr
     UInt8     pLength;
 } __packed;
 
+struct HciAclHdr
+{
+    UInt16    handle;    /* connection handle & packet boundary / broadcast flags */
+    UInt16    dLength;
+} __packed;
+
+struct HciScoHdr
+{
+    UInt16    handle;    /* connection handle & packet status flags */
+    UInt8     dLength;
+} __packed;
+
 struct HciResponse: HciEventHdr
 {
     UInt8     numCommands;
@@ -202,6 +214,37 @@ enum HCI_STAT_FLAGS
 #define HCI_OP_SET_EVENT_MASK                       0x0c01
 #define HCI_OP_RESET                                0x0c03
 #define HCI_OP_SET_EVENT_FLT                        0x0c05
+#define HCI_OP_READ_LOCAL_VERSION                   0x1001
+#define HCI_OP_READ_LOCAL_COMMANDS                  0x1002
+#define HCI_OP_READ_LOCAL_FEATURES                  0x1003
+#define HCI_OP_READ_LOCAL_EXT_FEATURES              0x1004
+#define HCI_OP_READ_BUFFER_SIZE                     0x1005
+
+/* Broadcom vendor commands */
+#define HCI_OP_BCM_DOWNLOAD_MINIDRIVER              0xfc2e
+#define HCI_OP_BCM_WRITE_RAM                        0xfc4c
+#define HCI_OP_BCM_LAUNCH_RAM                       0xfc4e
+#define HCI_OP_BCM_WAKEUP                           0xfc53
+#define HCI_OP_BCM_READ_VERBOSE_CONFIG              0xfc79
+
+/* Intel vendor commands */
+#define HCI_OP_INTEL_RESET                          0xfc01
+#define HCI_OP_INTEL_READ_VERSION                   0xfc05
+#define HCI_OP_INTEL_SECURE_SEND                    0xfc09
+#define HCI_OP_INTEL_WRITE_BOOT_PARAMS              0xfc0e
+#define HCI_OP_INTEL_MFG_MODE                       0xfc11
+#define HCI_OP_INTEL_SET_EVENT_MASK                 0xfc52
+
+/* Intel secure send fragment types, the first parameter byte of HCI_OP_INTEL_SECURE_SEND */
+#define INTEL_SECURE_SEND_CSS_HEADER                0x00
+#define INTEL_SECURE_SEND_DATA                      0x01
+#define INTEL_SECURE_SEND_SIGNATURE                 0x02
+#define INTEL_SECURE_SEND_PUBLIC_KEY                0x03
+#define INTEL_SECURE_SEND_FRAGMENT_MAX              252
+
+/* Intel bootloader vendor events, the first parameter byte of HCI_EV_VENDOR */
+#define INTEL_EV_BOOTUP                             0x02
+#define INTEL_EV_SECURE_SEND_RESULT                 0x06    /* result, opcode, status once the whole image is in */
 
 #define QCA_HCI_CC_OPCODE                           0xFC00
 #define QCA_HCI_CC_SUCCESS                          0x00
@@ -218,33 +261,149 @@ enum HCI_STAT_FLAGS
 #define HCI_SCO_HDR_SIZE                            3
 
 
+/* ---- Compile-time HCI command frames ---- */
+
+/* Parameter length mandated for each opcode the provider builds frames for */
+template <UInt16 OpCode>
+struct HciCommandTraits;
+
+#define HCI_COMMAND_PARAM_LENGTH(op, len) \
+    template <> struct HciCommandTraits<op> { static constexpr UInt8 paramLength = len; }
+
+HCI_COMMAND_PARAM_LENGTH(HCI_OP_RESET,                      0);
+HCI_COMMAND_PARAM_LENGTH(HCI_OP_READ_LOCAL_VERSION,         0);
+HCI_COMMAND_PARAM_LENGTH(HCI_OP_READ_LOCAL_COMMANDS,        0);
+HCI_COMMAND_PARAM_LENGTH(HCI_OP_READ_LOCAL_FEATURES,        0);
+HCI_COMMAND_PARAM_LENGTH(HCI_OP_READ_LOCAL_EXT_FEATURES,    1);
+HCI_COMMAND_PARAM_LENGTH(HCI_OP_READ_BUFFER_SIZE,           0);
+HCI_COMMAND_PARAM_LENGTH(HCI_OP_BCM_DOWNLOAD_MINIDRIVER,    0);
+HCI_COMMAND_PARAM_LENGTH(HCI_OP_BCM_LAUNCH_RAM,             4);
+HCI_COMMAND_PARAM_LENGTH(HCI_OP_BCM_WAKEUP,                 1);
+HCI_COMMAND_PARAM_LENGTH(HCI_OP_BCM_READ_VERBOSE_CONFIG,    0);
+HCI_COMMAND_PARAM_LENGTH(HCI_OP_INTEL_RESET,                8);
+HCI_COMMAND_PARAM_LENGTH(HCI_OP_INTEL_MFG_MODE,             2);
+HCI_COMMAND_PARAM_LENGTH(HCI_OP_INTEL_SET_EVENT_MASK,       8);
+
+/* A typed parameter, already in HCI (little endian) byte order */
+template <UInt8 Size>
+struct HciParam
+{
+    UInt8 bytes[Size];
+};
+
+constexpr HciParam<1> hciU8(UInt8 value)
+{
+    return { { value } };
+}
+
+constexpr HciParam<2> hciU16(UInt16 value)
+{
+    return { { (UInt8) value, (UInt8) (value >> 8) } };
+}
+
+constexpr HciParam<4> hciU32(UInt32 value)
+{
+    return { { (UInt8) value, (UInt8) (value >> 8), (UInt8) (value >> 16), (UInt8) (value >> 24) } };
+}
+
+/* A complete command packet (header + parameters) laid out exactly as it goes on the wire */
+template <UInt8 ParamLength>
+struct HciCommandFrame
+{
+    UInt8 bytes[HCI_COMMAND_HDR_SIZE + ParamLength];
+    
+    constexpr UInt16 opCode() const { return (UInt16) (bytes[0] | (bytes[1] << 8)); }
+    constexpr UInt16 size() const { return HCI_COMMAND_HDR_SIZE + ParamLength; }
+    constexpr UInt8 paramLength() const { return ParamLength; }
+    const UInt8 * param() const { return bytes + HCI_COMMAND_HDR_SIZE; }
+};
+
+template <UInt8... Sizes>
+constexpr UInt32 hciParamLength()
+{
+    const UInt32 sizes[] = { 0, Sizes... };
+    UInt32 total = 0;
+    
+    for (UInt32 i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i)
+    {
+        total += sizes[i];
+    }
+    return total;
+}
+
+template <UInt32 N>
+constexpr void hciAppendParams(UInt8 (&)[N], UInt32)
+{
+}
+
+template <UInt32 N, UInt8 Size, UInt8... Rest>
+constexpr void hciAppendParams(UInt8 (&out)[N], UInt32 offset, const HciParam<Size> & param, const HciParam<Rest> &... rest)
+{
+    for (UInt32 i = 0; i < Size; ++i)
+    {
+        out[offset + i] = param.bytes[i];
+    }
+    hciAppendParams(out, offset + Size, rest...);
+}
+
+/*
+ * Builds the frame at compile time, e.g. makeHciCommand<HCI_OP_BCM_WAKEUP>(hciU8(0x13)).
+ * Parameters whose total size differs from HciCommandTraits<OpCode>::paramLength do not compile.
+ */
+template <UInt16 OpCode, UInt8... Sizes>
+constexpr HciCommandFrame<HciCommandTraits<OpCode>::paramLength> makeHciCommand(const HciParam<Sizes> &... params)
+{
+    static_assert(hciParamLength<Sizes...>() == HciCommandTraits<OpCode>::paramLength, "HCI command parameter length does not match its opcode");
+    
+    HciCommandFrame<HciCommandTraits<OpCode>::paramLength> frame {};
+    frame.bytes[0] = (UInt8) OpCode;
+    frame.bytes[1] = (UInt8) (OpCode >> 8);
+    frame.bytes[2] = HciCommandTraits<OpCode>::paramLength;
+    hciAppendParams(frame.bytes, HCI_COMMAND_HDR_SIZE, params...);
+    return frame;
+}
+
+/*
+ * All frames below are constexpr: they live in read-only storage, are only emitted into the
+ * translation units that use them and can be handed to the send paths without a copy.
+ */
+
 /* Standard HCI commands */
-UInt8 HCI_LOCAL_VERSION[]              = { 0x01, 0x10, 0x00 };
-UInt8 HCI_READ_LOCAL_COMMANDS[]        = { 0x02, 0x10, 0x00 };
-UInt8 HCI_READ_FEATURES[]              = { 0x03, 0x10, 0x00 };
-UInt8 HCI_READ_LOCAL_FEATURES[]        = { 0x04, 0x10, 0x00 };
-UInt8 HCI_RESET[]                      = { 0x03, 0x0c, 0x00 };
+static constexpr auto HCI_LOCAL_VERSION             = makeHciCommand<HCI_OP_READ_LOCAL_VERSION>();
+static constexpr auto HCI_READ_LOCAL_COMMANDS       = makeHciCommand<HCI_OP_READ_LOCAL_COMMANDS>();
+static constexpr auto HCI_READ_FEATURES             = makeHciCommand<HCI_OP_READ_LOCAL_FEATURES>();
+static constexpr auto HCI_READ_LOCAL_FEATURES       = makeHciCommand<HCI_OP_READ_LOCAL_EXT_FEATURES>(hciU8(0x01));
+static constexpr auto HCI_READ_BUFFER_SIZE          = makeHciCommand<HCI_OP_READ_BUFFER_SIZE>();
+static constexpr auto HCI_RESET                     = makeHciCommand<HCI_OP_RESET>();
 
 /* Broadcom specific commands */
 
 // Read chip-id and other configuration variables
-UInt8 HCI_VSC_READ_VERBOSE_CONFIG[]    = { 0x79, 0xfc, 0x00 };
+static constexpr auto HCI_VSC_READ_VERBOSE_CONFIG   = makeHciCommand<HCI_OP_BCM_READ_VERBOSE_CONFIG>();
 
 // Download mini driver
-UInt8 HCI_VSC_DOWNLOAD_MINIDRIVER[]    = { 0x2e, 0xfc, 0x00 };
+static constexpr auto HCI_VSC_DOWNLOAD_MINIDRIVER   = makeHciCommand<HCI_OP_BCM_DOWNLOAD_MINIDRIVER>();
 
 // End of Record
-UInt8 HCI_VSC_END_OF_RECORD[]          = { 0x4e, 0xfc, 0x04, 0xff, 0xff, 0xff, 0xff };
+static constexpr auto HCI_VSC_END_OF_RECORD         = makeHciCommand<HCI_OP_BCM_LAUNCH_RAM>(hciU32(0xffffffff));
 
 // Wake up
-UInt8 HCI_VSC_WAKEUP[]                 = { 0x53, 0xfc, 0x01, 0x13 };
+static constexpr auto HCI_VSC_WAKEUP                = makeHciCommand<HCI_OP_BCM_WAKEUP>(hciU8(0x13));
 
 /* Intel specific commands */
 
-UInt8 EXIT_MFG_PARAM[]                 = { 0x00, 0x02 };
-UInt8 ENTER_MFG_PARAM[]                = { 0x01, 0x00 };
-UInt8 EVENT_MASK[]                     = { 0x87, 0x0c, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
-UInt8 INTEL_RESET_PARAM[]              = { 0x00, 0x01, 0x00, 0x01, 0x00000000 };
-UInt8 INTEL_RESET_BL_PARAM[]           = { 0x01, 0x01, 0x01, 0x00, 0x00000000 };
+static constexpr UInt8 EXIT_MFG_PARAM[]             = { 0x00, 0x02 };
+static constexpr UInt8 ENTER_MFG_PARAM[]            = { 0x01, 0x00 };
+static constexpr UInt8 EVENT_MASK[]                 = { 0x87, 0x0c, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
+static constexpr UInt8 INTEL_RESET_PARAM[]          = { 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00 };
+static constexpr UInt8 INTEL_RESET_BL_PARAM[]       = { 0x01, 0x01, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00 };
+
+static constexpr auto INTEL_EXIT_MFG                = makeHciCommand<HCI_OP_INTEL_MFG_MODE>(hciU8(0x00), hciU8(0x02));
+static constexpr auto INTEL_ENTER_MFG               = makeHciCommand<HCI_OP_INTEL_MFG_MODE>(hciU8(0x01), hciU8(0x00));
+static constexpr auto INTEL_EVENT_MASK              = makeHciCommand<HCI_OP_INTEL_SET_EVENT_MASK>(hciU32(0x00000c87), hciU32(0x00000000));
+
+/* reset type, patch enable, DDC reload, boot option, boot parameter */
+static constexpr auto INTEL_RESET                   = makeHciCommand<HCI_OP_INTEL_RESET>(hciU8(0x00), hciU8(0x01), hciU8(0x00), hciU8(0x01), hciU32(0x00000000));
+static constexpr auto INTEL_RESET_BL                = makeHciCommand<HCI_OP_INTEL_RESET>(hciU8(0x01), hciU8(0x01), hciU8(0x01), hciU8(0x00), hciU32(0x00000000));
 
 #endif /* VoodooHCI_h */
@@ -0,0 +1,670 @@
+//
+//  VoodooHCIAclScheduler.cpp
+//  VoodooUSBProvider
+//
+//  Copyright © 2021 Charlie Jiang. All rights reserved.
+//
+
+#include "VoodooHCIAclScheduler.h"
+
+OSDefineMetaClassAndStructors(VoodooHCIAclScheduler, OSObject)
+
+VoodooHCIAclScheduler * VoodooHCIAclScheduler::withPipe(VoodooUSBPipe * bulkOutPipe, UInt16 aclMtu, UInt16 aclPackets, VoodooHCITimerWheel * wheel)
+{
+    VoodooHCIAclScheduler * scheduler = new VoodooHCIAclScheduler;
+    
+    if (scheduler && !scheduler->initWithPipe(bulkOutPipe, aclMtu, aclPackets, wheel))
+    {
+        OSSafeReleaseNULL(scheduler);
+    }
+    return scheduler;
+}
+
+bool VoodooHCIAclScheduler::initWithPipe(VoodooUSBPipe * bulkOutPipe, UInt16 aclMtu, UInt16 aclPackets, VoodooHCITimerWheel * wheel)
+{
+    if (!super::init() || !bulkOutPipe || !aclMtu || !aclPackets)
+    {
+        return false;
+    }
+    
+    lock = IOLockAlloc();
+    if (!lock)
+    {
+        return false;
+    }
+    
+    bzero(connections, sizeof(connections));
+    bzero(writes, sizeof(writes));
+    bzero(&statistics, sizeof(statistics));
+    for (int i = 0; i < VOODOO_HCI_ACL_MAX_CONNECTIONS; ++i)
+    {
+        VoodooHCITimerWheel::initTimer(&connections[i].timer, connectionTimerAction, this, &connections[i]);
+    }
+    for (int i = 0; i < VOODOO_HCI_ACL_MAX_WRITES; ++i)
+    {
+        writes[i].scheduler     = this;
+        writes[i].usbCompletion = { this, writeCompletionAction, &writes[i] };
+    }
+    
+    mtu          = aclMtu;
+    totalCredits = aclPackets;
+    credits      = aclPackets;
+    current      = 0;
+    inRound      = false;
+    txTimeoutMS  = HCI_ACL_TX_TIMEOUT;
+    
+    pipe = bulkOutPipe;
+    pipe->retain();
+    
+    this->wheel = wheel;
+    if (wheel)
+    {
+        wheel->retain();
+    }
+    return true;
+}
+
+void VoodooHCIAclScheduler::free()
+{
+    if (lock)
+    {
+        // Not removeConnection(): its schedule() would dispatch the other connections' packets,
+        // and a dispatched write retains us while we are already being freed
+        for (int i = 0; i < VOODOO_HCI_ACL_MAX_CONNECTIONS; ++i)
+        {
+            VoodooHCIAclPacket flushed[VOODOO_HCI_ACL_QUEUE_DEPTH];
+            UInt32 count = 0;
+            UInt16 handle = 0;
+            
+            IOLockLock(lock);
+            if (connections[i].used)
+            {
+                count  = flushConnection(&connections[i], flushed);
+                handle = connections[i].handle;
+                connections[i].used = false;
+            }
+            IOLockUnlock(lock);
+            
+            for (UInt32 j = 0; j < count; ++j)
+            {
+                completePacket(&flushed[j], kIOReturnAborted, handle);
+            }
+        }
+        
+        // The writes still on the bus and the armed timers hold a reference on us, so none are left here
+        IOLockFree(lock);
+        lock = NULL;
+    }
+    
+    OSSafeReleaseNULL(wheel);
+    OSSafeReleaseNULL(pipe);
+    super::free();
+}
+
+VoodooHCIAclConnection * VoodooHCIAclScheduler::findConnection(UInt16 handle)
+{
+    for (int i = 0; i < VOODOO_HCI_ACL_MAX_CONNECTIONS; ++i)
+    {
+        if (connections[i].used && connections[i].handle == handle)
+        {
+            return &connections[i];
+        }
+    }
+    return NULL;
+}
+
+IOReturn VoodooHCIAclScheduler::addConnection(UInt16 handle, UInt32 quantum)
+{
+    handle = hci_handle(handle);
+    
+    IOLockLock(lock);
+    if (findConnection(handle))
+    {
+        IOLockUnlock(lock);
+        return kIOReturnExclusiveAccess;
+    }
+    
+    for (int i = 0; i < VOODOO_HCI_ACL_MAX_CONNECTIONS; ++i)
+    {
+        VoodooHCIAclConnection * connection = &connections[i];
+        if (!connection->used)
+        {
+            // Field by field: the timer of the connection that had the slot may still be firing
+            connection->used          = true;
+            connection->handle        = handle;
+            connection->quantum       = quantum ? quantum : HCI_ACL_HDR_SIZE + mtu;
+            connection->deficit       = 0;
+            connection->outstanding   = 0;
+            connection->lastCompleted = 0;
+            connection->packets       = 0;
+            connection->bytes         = 0;
+            connection->head          = 0;
+            connection->count         = 0;
+            IOLockUnlock(lock);
+            return kIOReturnSuccess;
+        }
+    }
+    IOLockUnlock(lock);
+    
+    VoodooUSBErrorLog("VoodooHCIAclScheduler::addConnection() - No room for handle 0x%03x!!!\n", handle);
+    return kIOReturnNoResources;
+}
+
+UInt32 VoodooHCIAclScheduler::flushConnection(VoodooHCIAclConnection * connection, VoodooHCIAclPacket * flushed)
+{
+    UInt32 count = connection->count;
+    
+    for (UInt32 i = 0; i < count; ++i)
+    {
+        flushed[i] = connection->queue[(connection->head + i) % VOODOO_HCI_ACL_QUEUE_DEPTH];
+    }
+    connection->head    = 0;
+    connection->count   = 0;
+    connection->deficit = 0;
+    statistics.dropped += count;
+    return count;
+}
+
+void VoodooHCIAclScheduler::removeConnection(UInt16 handle, IOReturn status)
+{
+    VoodooHCIAclPacket flushed[VOODOO_HCI_ACL_QUEUE_DEPTH];
+    UInt32 count = 0;
+    bool disarmed = false;
+    
+    IOLockLock(lock);
+    VoodooHCIAclConnection * connection = findConnection(hci_handle(handle));
+    if (connection)
+    {
+        count = flushConnection(connection, flushed);
+        
+        // The controller flushes a link's buffers when it goes away and the host takes the credits back
+        credits += connection->outstanding;
+        connection->outstanding = 0;
+        connection->used = false;
+        disarmed = disarmLocked(connection);
+    }
+    IOLockUnlock(lock);
+    
+    for (UInt32 i = 0; i < count; ++i)
+    {
+        completePacket(&flushed[i], status, hci_handle(handle));
+    }
+    
+    if (connection)
+    {
+        schedule();
+    }
+    if (disarmed)
+    {
+        release();
+    }
+}
+
+IOReturn VoodooHCIAclScheduler::sendPacket(IOMemoryDescriptor * packet, VoodooHCIAclCompletion * completion)
+{
+    HciAclHdr header;
+    
+    if (!packet || packet->getLength() < HCI_ACL_HDR_SIZE || packet->readBytes(0, &header, sizeof(header)) != sizeof(header))
+    {
+        return kIOReturnBadArgument;
+    }
+    
+    UInt16 handle = hci_handle(OSSwapLittleToHostInt16(header.handle));
+    UInt32 length = (UInt32) packet->getLength();
+    if (length != HCI_ACL_HDR_SIZE + (UInt32) OSSwapLittleToHostInt16(header.dLength) || length > HCI_ACL_HDR_SIZE + (UInt32) mtu)
+    {
+        VoodooUSBErrorLog("VoodooHCIAclScheduler::sendPacket() - Packet of %u bytes does not fit the header or the controller!!!\n", length);
+        return kIOReturnBadArgument;
+    }
+    
+    IOLockLock(lock);
+    VoodooHCIAclConnection * connection = findConnection(handle);
+    if (!connection)
+    {
+        IOLockUnlock(lock);
+        return kIOReturnNotFound;
+    }
+    if (connection->count == VOODOO_HCI_ACL_QUEUE_DEPTH)
+    {
+        IOLockUnlock(lock);
+        return kIOReturnNoSpace;
+    }
+    
+    VoodooHCIAclPacket * entry = &connection->queue[(connection->head + connection->count) % VOODOO_HCI_ACL_QUEUE_DEPTH];
+    entry->packet = packet;
+    entry->length = length;
+    if (completion)
+    {
+        entry->completion = *completion;
+    }
+    else
+    {
+        bzero(&entry->completion, sizeof(entry->completion));
+    }
+    packet->retain();
+    ++connection->count;
+    IOLockUnlock(lock);
+    
+    schedule();
+    return kIOReturnSuccess;
+}
+
+void VoodooHCIAclScheduler::completePacket(VoodooHCIAclPacket * packet, IOReturn status, UInt16 handle)
+{
+    if (packet->completion.action)
+    {
+        packet->completion.action(packet->completion.owner, packet->completion.refCon, status, handle, packet->packet);
+    }
+    OSSafeReleaseNULL(packet->packet);
+}
+
+void VoodooHCIAclScheduler::schedule()
+{
+    VoodooHCIAclPacket failed[VOODOO_HCI_ACL_MAX_WRITES];
+    UInt16 failedHandle[VOODOO_HCI_ACL_MAX_WRITES];
+    UInt32 failedCount = 0;
+    
+    IOLockLock(lock);
+    for (int write = 0; write < VOODOO_HCI_ACL_MAX_WRITES; ++write)
+    {
+        if (writes[write].busy)
+        {
+            continue;
+        }
+        
+        // Deficit round robin: every round a connection may send up to its quantum, and what it
+        // could not use carries over as long as it has packets waiting
+        bool sent = false;
+        UInt32 idle = 0;
+        while (!sent && credits && idle < VOODOO_HCI_ACL_MAX_CONNECTIONS)
+        {
+            VoodooHCIAclConnection * connection = &connections[current];
+            if (!connection->used || !connection->count)
+            {
+                connection->deficit = 0;
+                current = (current + 1) % VOODOO_HCI_ACL_MAX_CONNECTIONS;
+                inRound = false;
+                ++idle;
+                continue;
+            }
+            idle = 0;
+            
+            if (!inRound)
+            {
+                connection->deficit += connection->quantum;
+                inRound = true;
+            }
+            
+            if (connection->queue[connection->head].length > connection->deficit)
+            {
+                current = (current + 1) % VOODOO_HCI_ACL_MAX_CONNECTIONS;
+                inRound = false;
+                continue;
+            }
+            
+            sent = true;
+            if (!dispatchLocked(connection, &writes[write]))
+            {
+                failed[failedCount] = writes[write].packet;
+                failedHandle[failedCount++] = connection->handle;
+            }
+            
+            if (!connection->count)
+            {
+                connection->deficit = 0;
+                current = (current + 1) % VOODOO_HCI_ACL_MAX_CONNECTIONS;
+                inRound = false;
+            }
+        }
+        
+        if (!sent)
+        {
+            break;
+        }
+    }
+    
+    if (!credits)
+    {
+        for (int i = 0; i < VOODOO_HCI_ACL_MAX_CONNECTIONS; ++i)
+        {
+            if (connections[i].used && connections[i].count)
+            {
+                ++statistics.creditStalls;
+                break;
+            }
+        }
+    }
+    IOLockUnlock(lock);
+    
+    for (UInt32 i = 0; i < failedCount; ++i)
+    {
+        completePacket(&failed[i], kIOReturnIOError, failedHandle[i]);
+    }
+}
+
+bool VoodooHCIAclScheduler::dispatchLocked(VoodooHCIAclConnection * connection, VoodooHCIAclWrite * write)
+{
+    VoodooHCIAclPacket * packet = &connection->queue[connection->head];
+    
+    write->packet = *packet;
+    write->handle = connection->handle;
+    connection->head = (connection->head + 1) % VOODOO_HCI_ACL_QUEUE_DEPTH;
+    --connection->count;
+    connection->deficit -= write->packet.length;
+    
+    if (!connection->outstanding)
+    {
+        connection->lastCompleted = mach_absolute_time();
+        armLocked(connection);
+    }
+    ++connection->outstanding;
+    --credits;
+    
+    // The scheduler has to outlive every write still on the bus
+    write->busy = true;
+    retain();
+    
+    IOReturn result = pipe->writeSegments(&write->packet.packet, 1, 0, &write->usbCompletion);
+    if (result == kIOReturnSuccess)
+    {
+        return true;
+    }
+    
+    VoodooUSBErrorLog("VoodooHCIAclScheduler::dispatchLocked() - Write for handle 0x%03x failed: 0x%08x!!!\n", connection->handle, result);
+    write->busy = false;
+    --connection->outstanding;
+    ++credits;
+    ++statistics.writeErrors;
+    if (!connection->outstanding && disarmLocked(connection))
+    {
+        release();
+    }
+    release();
+    return false;
+}
+
+// Called with lock held; the deadline is txTimeoutMS after lastCompleted, so every returned packet moves it
+void VoodooHCIAclScheduler::armLocked(VoodooHCIAclConnection * connection)
+{
+    if (wheel && !wheel->armTimer(&connection->timer, txTimeoutMS))
+    {
+        retain();
+    }
+}
+
+// Called with lock held; true when the timer's reference is the caller's to drop
+bool VoodooHCIAclScheduler::disarmLocked(VoodooHCIAclConnection * connection)
+{
+    return wheel && wheel->cancelTimer(&connection->timer);
+}
+
+void VoodooHCIAclScheduler::writeCompletionAction(void * owner, void * parameter, IOReturn status, UInt32 arg)
+{
+    VoodooHCIAclScheduler * that  = (VoodooHCIAclScheduler *) owner;
+    VoodooHCIAclWrite     * write = (VoodooHCIAclWrite *) parameter;
+    VoodooHCIAclPacket packet;
+    UInt16 handle;
+    bool disarmed = false;
+    
+    IOLockLock(that->lock);
+    packet = write->packet;
+    handle = write->handle;
+    write->busy = false;
+    
+    if (status == kIOReturnSuccess)
+    {
+        ++that->statistics.packets;
+        that->statistics.bytes += packet.length;
+    }
+    else
+    {
+        ++that->statistics.writeErrors;
+    }
+    
+    VoodooHCIAclConnection * connection = that->findConnection(handle);
+    if (connection)
+    {
+        if (status == kIOReturnSuccess)
+        {
+            ++connection->packets;
+            connection->bytes += packet.length;
+        }
+        else if (connection->outstanding)
+        {
+            // The controller never got it, so it will not be returned either
+            --connection->outstanding;
+            ++that->credits;
+            disarmed = !connection->outstanding && that->disarmLocked(connection);
+        }
+    }
+    IOLockUnlock(that->lock);
+    
+    that->completePacket(&packet, status, handle);
+    that->schedule();
+    if (disarmed)
+    {
+        that->release();
+    }
+    that->release();
+}
+
+bool VoodooHCIAclScheduler::handleEvent(const HciEventHdr * event, UInt16 length)
+{
+    if (!event || length < HCI_EVENT_HDR_SIZE || length < HCI_EVENT_HDR_SIZE + event->pLength)
+    {
+        return false;
+    }
+    
+    const UInt8 * param = (const UInt8 *) event + HCI_EVENT_HDR_SIZE;
+    
+    switch (event->event)
+    {
+        case HCI_EV_NUM_COMP_PKTS:
+        {
+            if (event->pLength < 1 || event->pLength < 1 + 4 * param[0])
+            {
+                return false;
+            }
+            
+            UInt64 now = mach_absolute_time();
+            UInt32 disarmed = 0;
+            IOLockLock(lock);
+            for (UInt8 i = 0; i < param[0]; ++i)
+            {
+                UInt16 handle = hci_handle(OSReadLittleInt16(param, 1 + 4 * i));
+                UInt16 count  = OSReadLittleInt16(param, 3 + 4 * i);
+                
+                // Packets of a connection already removed were taken back then
+                VoodooHCIAclConnection * connection = findConnection(handle);
+                if (!connection)
+                {
+                    continue;
+                }
+                
+                UInt32 returned = (count < connection->outstanding) ? count : connection->outstanding;
+                connection->outstanding -= returned;
+                connection->lastCompleted = now;
+                credits += returned;
+                if (!connection->outstanding)
+                {
+                    disarmed += disarmLocked(connection);
+                }
+                else
+                {
+                    armLocked(connection);
+                }
+            }
+            
+            if (credits > totalCredits)
+            {
+                VoodooUSBWarningLog("VoodooHCIAclScheduler::handleEvent() - Controller returned more buffers than it has!\n");
+                credits = totalCredits;
+            }
+            IOLockUnlock(lock);
+            
+            while (disarmed--)
+            {
+                release();
+            }
+            break;
+        }
+        
+        case HCI_EV_DISCONN_COMPLETE:
+            if (event->pLength < 3)
+            {
+                return false;
+            }
+            if (param[0] == 0)
+            {
+                removeConnection(OSReadLittleInt16(param, 1));
+            }
+            return true;
+        
+        default:
+            return false;
+    }
+    
+    schedule();
+    return true;
+}
+
+void VoodooHCIAclScheduler::handleEventAction(void * owner, void * refCon, const HciEventHdr * event, UInt16 length)
+{
+    ((VoodooHCIAclScheduler *) owner)->handleEvent(event, length);
+}
+
+UInt32 VoodooHCIAclScheduler::checkTimeouts(UInt32 timeoutMS)
+{
+    VoodooHCIAclPacket flushed[VOODOO_HCI_ACL_QUEUE_DEPTH];
+    UInt64 now = mach_absolute_time();
+    UInt64 interval;
+    UInt32 expired = 0;
+    
+    nanoseconds_to_absolutetime((UInt64) timeoutMS * 1000000ULL, &interval);
+    
+    for (int i = 0; i < VOODOO_HCI_ACL_MAX_CONNECTIONS; ++i)
+    {
+        UInt32 count = 0;
+        UInt16 handle;
+        bool disarmed;
+        
+        IOLockLock(lock);
+        VoodooHCIAclConnection * connection = &connections[i];
+        if (!connection->used || !connection->outstanding || now - connection->lastCompleted < interval)
+        {
+            IOLockUnlock(lock);
+            continue;
+        }
+        
+        handle = connection->handle;
+        count = expireLocked(connection, flushed);
+        disarmed = disarmLocked(connection);
+        ++expired;
+        IOLockUnlock(lock);
+        
+        VoodooUSBErrorLog("VoodooHCIAclScheduler::checkTimeouts() - Handle 0x%03x returned no packet for %u ms, %u packets dropped!!!\n", handle, timeoutMS, count);
+        for (UInt32 j = 0; j < count; ++j)
+        {
+            completePacket(&flushed[j], kIOReturnTimeout, handle);
+        }
+        if (disarmed)
+        {
+            release();
+        }
+    }
+    
+    if (expired)
+    {
+        schedule();
+    }
+    return expired;
+}
+
+// Called with lock held
+UInt32 VoodooHCIAclScheduler::expireLocked(VoodooHCIAclConnection * connection, VoodooHCIAclPacket * flushed)
+{
+    // Like a link TX timeout on Linux, the link is considered dead. Its buffers are taken back
+    // so the other connections keep going; the client is expected to disconnect it.
+    UInt32 count = flushConnection(connection, flushed);
+    credits += connection->outstanding;
+    connection->outstanding = 0;
+    ++statistics.timeouts;
+    return count;
+}
+
+void VoodooHCIAclScheduler::connectionTimerAction(void * owner, void * refCon)
+{
+    VoodooHCIAclScheduler  * that       = (VoodooHCIAclScheduler *) owner;
+    VoodooHCIAclConnection * connection = (VoodooHCIAclConnection *) refCon;
+    VoodooHCIAclPacket flushed[VOODOO_HCI_ACL_QUEUE_DEPTH];
+    UInt32 count = 0;
+    UInt16 handle = 0;
+    bool expired = false;
+    UInt64 interval;
+    
+    nanoseconds_to_absolutetime((UInt64) that->txTimeoutMS * 1000000ULL, &interval);
+    
+    // The slot may have drained, or gone to another connection, since the timer was picked
+    IOLockLock(that->lock);
+    if (connection->used && connection->outstanding)
+    {
+        UInt64 elapsed = mach_absolute_time() - connection->lastCompleted;
+        if (elapsed >= interval)
+        {
+            handle  = connection->handle;
+            count   = that->expireLocked(connection, flushed);
+            expired = true;
+        }
+        else
+        {
+            // Picked just as the controller returned a packet: wait out the rest of the moved deadline
+            UInt64 remainingNS;
+            absolutetime_to_nanoseconds(interval - elapsed, &remainingNS);
+            if (!that->wheel->armTimer(&connection->timer, (UInt32) (remainingNS / 1000000ULL) + 1))
+            {
+                that->retain();
+            }
+        }
+    }
+    IOLockUnlock(that->lock);
+    
+    if (expired)
+    {
+        VoodooUSBErrorLog("VoodooHCIAclScheduler::connectionTimerAction() - Handle 0x%03x returned no packet for %u ms, %u packets dropped!!!\n", handle, that->txTimeoutMS, count);
+        for (UInt32 i = 0; i < count; ++i)
+        {
+            that->completePacket(&flushed[i], kIOReturnTimeout, handle);
+        }
+        that->schedule();
+    }
+    that->release();
+}
+
+void VoodooHCIAclScheduler::setTxTimeout(UInt32 timeoutMS)
+{
+    txTimeoutMS = timeoutMS;
+}
+
+UInt32 VoodooHCIAclScheduler::getCredits()
+{
+    return credits;
+}
+
+UInt32 VoodooHCIAclScheduler::getPacketsQueued(UInt16 handle)
+{
+    IOLockLock(lock);
+    VoodooHCIAclConnection * connection = findConnection(hci_handle(handle));
+    UInt32 count = connection ? connection->count : 0;
+    IOLockUnlock(lock);
+    return count;
+}
+
+void VoodooHCIAclScheduler::getStatistics(VoodooHCIAclStatistics * statistics)
+{
+    if (statistics)
+    {
+        IOLockLock(lock);
+        *statistics = this->statistics;
+        IOLockUnlock(lock);
+    }
+}
@@ -0,0 +1,145 @@
+//
+//  VoodooHCIAclScheduler.h
+//  VoodooUSBProvider
+//
+//  Copyright © 2021 Charlie Jiang. All rights reserved.
+//
+
+#ifndef VoodooHCIAclScheduler_h
+#define VoodooHCIAclScheduler_h
+
+#include "VoodooUSBPipe.h"
+#include "VoodooHCITimerWheel.h"
+
+#define VOODOO_HCI_ACL_MAX_CONNECTIONS      8
+#define VOODOO_HCI_ACL_QUEUE_DEPTH          32      /* packets waiting per connection */
+#define VOODOO_HCI_ACL_MAX_WRITES           4       /* bulk writes outstanding at once */
+
+#define hci_handle(h)                       ((h) & 0x0fff)
+
+class VoodooHCIAclScheduler;
+
+/*
+ * Called once a packet has been written to the controller, or dropped: kIOReturnTimeout when its
+ * connection stalled, kIOReturnAborted when the connection went away.
+ */
+typedef void (*VoodooHCIAclAction)(void * owner, void * refCon, IOReturn status, UInt16 handle, IOMemoryDescriptor * packet);
+
+struct VoodooHCIAclCompletion
+{
+    void               * owner;
+    VoodooHCIAclAction   action;
+    void               * refCon;
+};
+
+struct VoodooHCIAclPacket
+{
+    IOMemoryDescriptor     * packet;        /* retained while queued */
+    UInt32                   length;
+    VoodooHCIAclCompletion   completion;
+};
+
+struct VoodooHCIAclConnection
+{
+    bool                     used;
+    UInt16                   handle;
+    UInt32                   quantum;       /* bytes added to the deficit every round */
+    UInt32                   deficit;
+    UInt32                   outstanding;   /* handed to the controller, not yet returned by HCI_EV_NUM_COMP_PKTS */
+    UInt64                   lastCompleted; /* last time the controller returned a packet, or the first went out */
+    UInt64                   packets;
+    UInt64                   bytes;
+    UInt32                   head;
+    UInt32                   count;
+    VoodooHCIAclPacket       queue[VOODOO_HCI_ACL_QUEUE_DEPTH];
+    VoodooHCITimer           timer;         /* armed while packets are outstanding, holds a reference on the scheduler */
+};
+
+struct VoodooHCIAclWrite
+{
+    VoodooHCIAclScheduler  * scheduler;
+    bool                     busy;
+    UInt16                   handle;
+    VoodooHCIAclPacket       packet;
+    USBCompletion            usbCompletion;
+};
+
+struct VoodooHCIAclStatistics
+{
+    UInt64    packets;
+    UInt64    bytes;
+    UInt32    creditStalls;     /* packets were waiting but every controller buffer was taken */
+    UInt32    timeouts;         /* connections that returned no packet within the timeout */
+    UInt32    dropped;          /* packets completed without being sent */
+    UInt32    writeErrors;
+};
+
+/*
+ * Transmit side of ACL data on the bulk OUT pipe.
+ * The controller has aclPackets buffers (HCI_OP_READ_BUFFER_SIZE); a packet takes one until the
+ * controller returns it with HCI_EV_NUM_COMP_PKTS, so no more than that are ever handed over.
+ * Each connection has its own queue and the queues are served by deficit round robin, so a bulk
+ * transfer on one link cannot hold back the packets of another.
+ * The client feeds HCI_EV_NUM_COMP_PKTS and HCI_EV_DISCONN_COMPLETE to handleEvent(), or subscribes
+ * handleEventAction to a VoodooHCIEventReassembler for both.
+ * A connection that returns no packet for the TX timeout times out on the timer wheel, usually the
+ * device's; checkTimeouts() is only needed when there is none.
+ */
+class VoodooHCIAclScheduler : public OSObject
+{
+    typedef OSObject super;
+    
+    OSDeclareDefaultStructors(VoodooHCIAclScheduler)
+    
+public:
+    static VoodooHCIAclScheduler * withPipe(VoodooUSBPipe * bulkOutPipe, UInt16 aclMtu, UInt16 aclPackets, VoodooHCITimerWheel * wheel = NULL);
+    
+    virtual bool initWithPipe(VoodooUSBPipe * bulkOutPipe, UInt16 aclMtu, UInt16 aclPackets, VoodooHCITimerWheel * wheel);
+    virtual void free() override;
+    
+    /* quantum of 0 gives the connection one maximum size packet per round */
+    IOReturn addConnection(UInt16 handle, UInt32 quantum = 0);
+    void     removeConnection(UInt16 handle, IOReturn status = kIOReturnAborted);
+    
+    /* packet is a whole ACL packet, header included; the handle is taken from the header */
+    IOReturn sendPacket(IOMemoryDescriptor * packet, VoodooHCIAclCompletion * completion = NULL);
+    
+    bool handleEvent(const HciEventHdr * event, UInt16 length);
+    static void handleEventAction(void * owner, void * refCon, const HciEventHdr * event, UInt16 length);
+    UInt32 checkTimeouts(UInt32 timeoutMS = HCI_ACL_TX_TIMEOUT);
+    void   setTxTimeout(UInt32 timeoutMS);
+    
+    UInt32 getCredits();
+    UInt32 getPacketsQueued(UInt16 handle);
+    void   getStatistics(VoodooHCIAclStatistics * statistics);
+    
+private:
+    VoodooHCIAclConnection * findConnection(UInt16 handle);
+    UInt32 flushConnection(VoodooHCIAclConnection * connection, VoodooHCIAclPacket * flushed);
+    void   completePacket(VoodooHCIAclPacket * packet, IOReturn status, UInt16 handle);
+    void   schedule();
+    bool   dispatchLocked(VoodooHCIAclConnection * connection, VoodooHCIAclWrite * write);
+    UInt32 expireLocked(VoodooHCIAclConnection * connection, VoodooHCIAclPacket * flushed);
+    void   armLocked(VoodooHCIAclConnection * connection);
+    bool   disarmLocked(VoodooHCIAclConnection * connection);
+    static void writeCompletionAction(void * owner, void * parameter, IOReturn status, UInt32 arg);
+    static void connectionTimerAction(void * owner, void * refCon);
+    
+    VoodooUSBPipe            * pipe;
+    IOLock                   * lock;
+    VoodooHCITimerWheel      * wheel;
+    UInt32                     txTimeoutMS;
+    
+    UInt16                     mtu;
+    UInt32                     totalCredits;
+    UInt32                     credits;
+    
+    VoodooHCIAclConnection     connections[VOODOO_HCI_ACL_MAX_CONNECTIONS];
+    UInt32                     current;        /* connection whose round is being served */
+    bool                       inRound;        /* its quantum has been added for this round */
+    
+    VoodooHCIAclWrite          writes[VOODOO_HCI_ACL_MAX_WRITES];
+    VoodooHCIAclStatistics     statistics;
+};
+
+#endif /* VoodooHCIAclScheduler_h */
@@ -0,0 +1,337 @@
+//
+//  VoodooHCICapture.cpp
+//  VoodooUSBProvider
+//
+//  Copyright © 2021 Charlie Jiang. All rights reserved.
+//
+
+#include "VoodooHCICapture.h"
+#include <kern/cpu_number.h>
+#include <machine/machine_routines.h>
+
+#define BTSNOOP_EPOCH_DELTA                 0x00dcddb30f2f8000ULL   /* microseconds from 0 AD to 1970 */
+#define BTSNOOP_VERSION                     1
+#define BTSNOOP_DATALINK_H4                 1002
+
+#define BTSNOOP_FLAG_RECEIVED               (1 << 0)
+#define BTSNOOP_FLAG_COMMAND_EVENT          (1 << 1)
+
+struct BtsnoopFileHeader
+{
+    char      magic[8];
+    UInt32    version;
+    UInt32    datalink;
+} __packed;
+
+struct BtsnoopRecordHeader
+{
+    UInt32    originalLength;
+    UInt32    includedLength;
+    UInt32    flags;
+    UInt32    drops;
+    UInt64    timestamp;
+} __packed;
+
+OSDefineMetaClassAndStructors(VoodooHCICapture, OSObject)
+
+VoodooHCICapture * VoodooHCICapture::withCapacity(UInt32 recordsPerCPU)
+{
+    VoodooHCICapture * capture = new VoodooHCICapture;
+    
+    if (capture && !capture->initWithCapacity(recordsPerCPU))
+    {
+        OSSafeReleaseNULL(capture);
+    }
+    return capture;
+}
+
+bool VoodooHCICapture::initWithCapacity(UInt32 recordsPerCPU)
+{
+    if (!super::init() || !recordsPerCPU || recordsPerCPU > (1U << 20))
+    {
+        return false;
+    }
+    
+    // A power of 2, so the slot is the index masked
+    recordCount = 1;
+    while (recordCount < recordsPerCPU)
+    {
+        recordCount <<= 1;
+    }
+    
+    ringCount = ml_get_max_cpus();
+    if (!ringCount || ringCount > VOODOO_HCI_CAPTURE_MAX_CPUS)
+    {
+        ringCount = VOODOO_HCI_CAPTURE_MAX_CPUS;
+    }
+    
+    drainLock  = IOLockAlloc();
+    drainHeads = IONew(VoodooHCICaptureRecord, ringCount);
+    drainValid = IONew(bool, ringCount);
+    rings      = IONew(VoodooHCICaptureRing, ringCount);
+    if (!drainLock || !drainHeads || !drainValid || !rings)
+    {
+        VoodooUSBErrorLog("VoodooHCICapture::initWithCapacity() - Unable to allocate the rings!!!\n");
+        return false;
+    }
+    
+    bzero(rings, sizeof(VoodooHCICaptureRing) * ringCount);
+    for (UInt32 i = 0; i < ringCount; ++i)
+    {
+        rings[i].records = IONew(VoodooHCICaptureRecord, recordCount);
+        if (!rings[i].records)
+        {
+            VoodooUSBErrorLog("VoodooHCICapture::initWithCapacity() - Unable to allocate %u records for CPU %u!!!\n", recordCount, i);
+            return false;
+        }
+        bzero(rings[i].records, sizeof(VoodooHCICaptureRecord) * recordCount);
+    }
+    
+    bzero(&statistics, sizeof(statistics));
+    
+    clock_sec_t  seconds;
+    clock_usec_t microseconds;
+    clock_get_calendar_microtime(&seconds, &microseconds);
+    calendarStartUS = (UInt64) seconds * 1000000ULL + microseconds;
+    absoluteStart   = mach_absolute_time();
+    lastTimestamp   = absoluteStart;
+    
+    enabled = true;
+    return true;
+}
+
+void VoodooHCICapture::free()
+{
+    if (rings)
+    {
+        for (UInt32 i = 0; i < ringCount; ++i)
+        {
+            if (rings[i].records)
+            {
+                IODelete(rings[i].records, VoodooHCICaptureRecord, recordCount);
+            }
+        }
+        IODelete(rings, VoodooHCICaptureRing, ringCount);
+        rings = NULL;
+    }
+    if (drainHeads)
+    {
+        IODelete(drainHeads, VoodooHCICaptureRecord, ringCount);
+        drainHeads = NULL;
+    }
+    if (drainValid)
+    {
+        IODelete(drainValid, bool, ringCount);
+        drainValid = NULL;
+    }
+    if (drainLock)
+    {
+        IOLockFree(drainLock);
+        drainLock = NULL;
+    }
+    super::free();
+}
+
+void VoodooHCICapture::setEnabled(bool enabled)
+{
+    this->enabled = enabled;
+}
+
+bool VoodooHCICapture::isEnabled()
+{
+    return enabled;
+}
+
+// A writer preempted on its CPU may share the ring with the next one, the atomic keeps them apart
+inline VoodooHCICaptureRecord * VoodooHCICapture::reserve(UInt64 * index)
+{
+    VoodooHCICaptureRing * ring = &rings[(UInt32) cpu_number() % ringCount];
+    
+    *index = (UInt64) OSIncrementAtomic64(&ring->head);
+    VoodooHCICaptureRecord * record = &ring->records[*index & (recordCount - 1)];
+    
+    record->sequence = 0;
+    OSMemoryBarrier();
+    record->timestamp = mach_absolute_time();
+    return record;
+}
+
+void VoodooHCICapture::record(UInt8 type, bool received, const void * packet, UInt32 length)
+{
+    if (!enabled || !packet || !length)
+    {
+        return;
+    }
+    
+    UInt64 index;
+    VoodooHCICaptureRecord * record = reserve(&index);
+    
+    record->originalLength = length;
+    record->includedLength = (UInt16) min(length, VOODOO_HCI_CAPTURE_SNAP_LENGTH);
+    record->type           = type;
+    record->received       = received;
+    memcpy(record->data, packet, record->includedLength);
+    
+    OSMemoryBarrier();
+    record->sequence = index + 1;
+}
+
+void VoodooHCICapture::recordDescriptor(UInt8 type, bool received, IOMemoryDescriptor * packet, UInt32 length)
+{
+    if (!enabled || !packet || !length)
+    {
+        return;
+    }
+    
+    UInt64 index;
+    VoodooHCICaptureRecord * record = reserve(&index);
+    
+    record->originalLength = length;
+    record->includedLength = (UInt16) packet->readBytes(0, record->data, min(length, VOODOO_HCI_CAPTURE_SNAP_LENGTH));
+    record->type           = type;
+    record->received       = received;
+    
+    OSMemoryBarrier();
+    record->sequence = index + 1;
+}
+
+// Called with drainLock held; copies the next finished record of the ring, skipping those wrapped over
+bool VoodooHCICapture::peek(UInt32 ring, VoodooHCICaptureRecord * record)
+{
+    VoodooHCICaptureRing * cur = &rings[ring];
+    
+    while (1)
+    {
+        UInt64 head = (UInt64) cur->head;
+        OSMemoryBarrier();
+        if (cur->tail == head)
+        {
+            return false;
+        }
+        
+        if (head - cur->tail > recordCount)
+        {
+            statistics.overwritten += head - recordCount - cur->tail;
+            cur->tail = head - recordCount;
+        }
+        
+        VoodooHCICaptureRecord * slot = &cur->records[cur->tail & (recordCount - 1)];
+        UInt64 sequence = slot->sequence;
+        OSMemoryBarrier();
+        
+        // Still being written: leave it, and everything after it, for the next drain
+        if (sequence == 0 || sequence < cur->tail + 1)
+        {
+            return false;
+        }
+        
+        if (sequence == cur->tail + 1)
+        {
+            memcpy(record, slot, sizeof(*record));
+            OSMemoryBarrier();
+            if (slot->sequence == sequence)
+            {
+                return true;
+            }
+        }
+        
+        // A writer came round the ring and took the slot
+        ++statistics.overwritten;
+        ++cur->tail;
+    }
+}
+
+inline UInt64 VoodooHCICapture::btsnoopTime(UInt64 timestamp)
+{
+    UInt64 elapsedNS;
+    absolutetime_to_nanoseconds(timestamp - absoluteStart, &elapsedNS);
+    return BTSNOOP_EPOCH_DELTA + calendarStartUS + elapsedNS / 1000;
+}
+
+OSData * VoodooHCICapture::copyBtsnoop(bool fileHeader)
+{
+    OSData * data = OSData::withCapacity(4096);
+    if (!data)
+    {
+        return NULL;
+    }
+    
+    if (fileHeader)
+    {
+        BtsnoopFileHeader header = { { 'b', 't', 's', 'n', 'o', 'o', 'p', '\0' }, OSSwapHostToBigInt32(BTSNOOP_VERSION), OSSwapHostToBigInt32(BTSNOOP_DATALINK_H4) };
+        data->appendBytes(&header, sizeof(header));
+    }
+    
+    IOLockLock(drainLock);
+    for (UInt32 i = 0; i < ringCount; ++i)
+    {
+        drainValid[i] = peek(i, &drainHeads[i]);
+    }
+    
+    // Each ring is in order already, so merging the heads orders the whole capture
+    while (1)
+    {
+        SInt32 oldest = -1;
+        for (UInt32 i = 0; i < ringCount; ++i)
+        {
+            if (drainValid[i] && (oldest < 0 || drainHeads[i].timestamp < drainHeads[oldest].timestamp))
+            {
+                oldest = i;
+            }
+        }
+        if (oldest < 0)
+        {
+            break;
+        }
+        
+        VoodooHCICaptureRecord * record = &drainHeads[oldest];
+        lastTimestamp = max(lastTimestamp, record->timestamp);
+        UInt32 flags = record->received ? BTSNOOP_FLAG_RECEIVED : 0;
+        if (record->type == kVoodooHCICaptureCommand || record->type == kVoodooHCICaptureEvent)
+        {
+            flags |= BTSNOOP_FLAG_COMMAND_EVENT;
+        }
+        
+        // Lengths count the packet indicator in front of the packet
+        BtsnoopRecordHeader header =
+        {
+            .originalLength = OSSwapHostToBigInt32(record->originalLength + 1),
+            .includedLength = OSSwapHostToBigInt32(record->includedLength + 1),
+            .flags          = OSSwapHostToBigInt32(flags),
+            .drops          = OSSwapHostToBigInt32((UInt32) statistics.overwritten),
+            .timestamp      = OSSwapHostToBigInt64(btsnoopTime(lastTimestamp))
+        };
+        data->appendBytes(&header, sizeof(header));
+        data->appendBytes(&record->type, 1);
+        data->appendBytes(record->data, record->includedLength);
+        
+        ++statistics.drained;
+        if (record->includedLength < record->originalLength)
+        {
+            ++statistics.truncated;
+        }
+        
+        ++rings[oldest].tail;
+        drainValid[oldest] = peek(oldest, &drainHeads[oldest]);
+    }
+    IOLockUnlock(drainLock);
+    return data;
+}
+
+void VoodooHCICapture::getStatistics(VoodooHCICaptureStatistics * statistics)
+{
+    if (!statistics)
+    {
+        return;
+    }
+    
+    IOLockLock(drainLock);
+    *statistics = this->statistics;
+    IOLockUnlock(drainLock);
+    
+    statistics->recorded = 0;
+    for (UInt32 i = 0; i < ringCount; ++i)
+    {
+        statistics->recorded += (UInt64) rings[i].head;
+    }
+}
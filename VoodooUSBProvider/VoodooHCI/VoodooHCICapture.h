@@ -0,0 +1,104 @@
+//
+//  VoodooHCICapture.h
+//  VoodooUSBProvider
+//
+//  Copyright © 2021 Charlie Jiang. All rights reserved.
+//
+
+#ifndef VoodooHCICapture_h
+#define VoodooHCICapture_h
+
+#include "VoodooUSBCommon.h"
+#include <libkern/c++/OSData.h>
+
+#define VOODOO_HCI_CAPTURE_SNAP_LENGTH      (HCI_COMMAND_HDR_SIZE + 255)    /* whole commands and events, ACL cut short */
+#define VOODOO_HCI_CAPTURE_DEFAULT_RECORDS  512                             /* per CPU, rounded up to a power of 2 */
+#define VOODOO_HCI_CAPTURE_MAX_CPUS         64
+
+/* H4 packet indicators, which is what the btsnoop records carry in front of each packet */
+enum VoodooHCICaptureType
+{
+    kVoodooHCICaptureCommand    = 1,
+    kVoodooHCICaptureAcl        = 2,
+    kVoodooHCICaptureSco        = 3,
+    kVoodooHCICaptureEvent      = 4
+};
+
+struct VoodooHCICaptureRecord
+{
+    volatile UInt64   sequence;         /* index + 1 once written, 0 while a writer fills it */
+    UInt64            timestamp;        /* mach_absolute_time() */
+    UInt32            originalLength;
+    UInt16            includedLength;
+    UInt8             type;
+    bool              received;
+    UInt8             data[VOODOO_HCI_CAPTURE_SNAP_LENGTH];
+};
+
+struct VoodooHCICaptureRing
+{
+    volatile SInt64            head;    /* records ever reserved on this CPU */
+    UInt64                     tail;    /* drained up to here */
+    VoodooHCICaptureRecord   * records;
+} __attribute__((aligned(64)));
+
+struct VoodooHCICaptureStatistics
+{
+    UInt64    recorded;
+    UInt64    drained;
+    UInt64    overwritten;      /* wrapped over before a drain got to them */
+    UInt64    truncated;        /* drained with less than the whole packet */
+};
+
+/*
+ * Always-on capture of the HCI traffic of a device, drained in btsnoop format (datalink 1002, H4)
+ * for Wireshark, btmon or any other analyzer.
+ * Every CPU writes into its own ring of fixed-size records, so recording takes one atomic
+ * increment on a CPU-local line and a copy of at most VOODOO_HCI_CAPTURE_SNAP_LENGTH bytes; no
+ * lock is taken. When a ring wraps the oldest records are lost, and the drops are reported in
+ * the btsnoop records. Draining merges the rings by time and never blocks the writers.
+ * A writer preempted between taking its slot and its timestamp can stamp a record later than
+ * the one after it; such a record is written out with the time of the record before it.
+ */
+class VoodooHCICapture : public OSObject
+{
+    typedef OSObject super;
+    
+    OSDeclareDefaultStructors(VoodooHCICapture)
+    
+public:
+    static VoodooHCICapture * withCapacity(UInt32 recordsPerCPU = VOODOO_HCI_CAPTURE_DEFAULT_RECORDS);
+    
+    virtual bool initWithCapacity(UInt32 recordsPerCPU);
+    virtual void free() override;
+    
+    void setEnabled(bool enabled);
+    bool isEnabled();
+    
+    void record(UInt8 type, bool received, const void * packet, UInt32 length);
+    void recordDescriptor(UInt8 type, bool received, IOMemoryDescriptor * packet, UInt32 length);
+    
+    /* Everything recorded since the last drain; fileHeader for the first chunk of a capture file */
+    OSData * copyBtsnoop(bool fileHeader = true);
+    void     getStatistics(VoodooHCICaptureStatistics * statistics);
+    
+private:
+    VoodooHCICaptureRecord * reserve(UInt64 * index);
+    bool   peek(UInt32 ring, VoodooHCICaptureRecord * record);
+    UInt64 btsnoopTime(UInt64 timestamp);
+    
+    VoodooHCICaptureRing     * rings;
+    UInt32                     ringCount;
+    UInt32                     recordCount;
+    volatile bool              enabled;
+    
+    IOLock                   * drainLock;
+    VoodooHCICaptureRecord   * drainHeads;          /* next record of each ring while merging */
+    bool                     * drainValid;
+    UInt64                     calendarStartUS;     /* wall clock at creation, microseconds since 1970 */
+    UInt64                     absoluteStart;
+    UInt64                     lastTimestamp;       /* of the last record drained */
+    VoodooHCICaptureStatistics statistics;          /* drain side only, recorded is summed on demand */
+};
+
+#endif /* VoodooHCICapture_h */
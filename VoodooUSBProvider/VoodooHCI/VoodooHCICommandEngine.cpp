@@ -0,0 +1,852 @@
+//
+//  VoodooHCICommandEngine.cpp
+//  VoodooUSBProvider
+//
+//  Copyright © 2021 Charlie Jiang. All rights reserved.
+//
+
+#include "VoodooHCICommandEngine.h"
+
+OSDefineMetaClassAndStructors(VoodooHCICommandEngine, OSObject)
+
+struct VoodooHCISyncContext
+{
+    void          * response;
+    UInt16          responseCapacity;
+    UInt16          responseLength;
+    IOReturn        status;
+    volatile bool   done;
+};
+
+struct VoodooHCIStreamContext
+{
+    VoodooHCICommandEngine   * engine;
+    VoodooHCICommandSource   * source;
+    UInt32                     depth;
+    UInt32                     inFlight;
+    UInt32                     peakInFlight;
+    bool                       queueing;        /* one thread at a time refills the engine */
+    IOReturn                   status;
+};
+
+VoodooHCICommandEngine * VoodooHCICommandEngine::withDevice(VoodooUSBDevice * device, IOService * forClient)
+{
+    VoodooHCICommandEngine * engine = new VoodooHCICommandEngine;
+
+    if (engine && !engine->initWithDevice(device, forClient))
+    {
+        OSSafeReleaseNULL(engine);
+    }
+    return engine;
+}
+
+bool VoodooHCICommandEngine::initWithDevice(VoodooUSBDevice * device, IOService * forClient)
+{
+    if (!super::init() || !device)
+    {
+        return false;
+    }
+
+    lock = IOLockAlloc();
+    if (!lock)
+    {
+        return false;
+    }
+
+    // One wired buffer per request slot, so a free slot always has a buffer
+    pool = VoodooHCICommandPool::withCapacity(VOODOO_HCI_COMMAND_ENGINE_SLOTS);
+    if (!pool)
+    {
+        VoodooUSBErrorLog("VoodooHCICommandEngine::initWithDevice() - Unable to allocate command pool!!!\n");
+        return false;
+    }
+
+    bzero(requests, sizeof(requests));
+    freeList = NULL;
+    for (int i = VOODOO_HCI_COMMAND_ENGINE_SLOTS - 1; i >= 0; --i)
+    {
+        requests[i].engine = this;
+        requests[i].next   = freeList;
+        VoodooHCITimerWheel::initTimer(&requests[i].timer, commandTimerAction, this, &requests[i]);
+        freeList = &requests[i];
+    }
+
+    pendingHead  = pendingTail  = NULL;
+    inFlightHead = inFlightTail = NULL;
+
+    // The controller always accepts one command after power on / reset
+    credits  = 1;
+    inFlight = 0;
+    queued   = 0;
+
+    this->device = device;
+    this->device->retain();
+    client = forClient;
+
+    wheel = device->getTimerWheel();
+    if (wheel)
+    {
+        wheel->retain();
+    }
+    commandTimeoutMS = HCI_CMD_TIMEOUT;
+    pollPipe         = NULL;
+    return true;
+}
+
+void VoodooHCICommandEngine::free()
+{
+    if (lock)
+    {
+        abortAll(kIOReturnAborted);
+    }
+
+    OSSafeReleaseNULL(pool);
+    OSSafeReleaseNULL(wheel);
+    OSSafeReleaseNULL(pollPipe);
+    OSSafeReleaseNULL(device);
+
+    if (lock)
+    {
+        IOLockFree(lock);
+        lock = NULL;
+    }
+    super::free();
+}
+
+VoodooHCICommandRequest * VoodooHCICommandEngine::allocateRequest()
+{
+    IOLockLock(lock);
+    VoodooHCICommandRequest * request = freeList;
+    if (request)
+    {
+        freeList = request->next;
+        request->next  = NULL;
+        request->state = kVoodooHCICommandFree;
+    }
+    IOLockUnlock(lock);
+    return request;
+}
+
+void VoodooHCICommandEngine::freeRequest(VoodooHCICommandRequest * request)
+{
+    if (request->buffer)
+    {
+        pool->returnCommandBuffer(request->buffer);
+        request->buffer = NULL;
+    }
+    request->frame = NULL;
+    request->completion.action = NULL;
+
+    IOLockLock(lock);
+    request->state = kVoodooHCICommandFree;
+    request->next  = freeList;
+    freeList = request;
+    IOLockUnlock(lock);
+}
+
+void VoodooHCICommandEngine::queueRequest(VoodooHCICommandRequest * request)
+{
+    IOLockLock(lock);
+    request->state = kVoodooHCICommandQueued;
+    request->next  = NULL;
+    if (pendingTail)
+    {
+        pendingTail->next = request;
+    }
+    else
+    {
+        pendingHead = request;
+    }
+    pendingTail = request;
+    ++queued;
+    IOLockUnlock(lock);
+
+    issuePending();
+}
+
+// Called with lock held
+void VoodooHCICommandEngine::removeInFlight(VoodooHCICommandRequest * request)
+{
+    VoodooHCICommandRequest * prev = NULL;
+
+    for (VoodooHCICommandRequest * cur = inFlightHead; cur; prev = cur, cur = cur->next)
+    {
+        if (cur != request)
+        {
+            continue;
+        }
+
+        if (prev)
+        {
+            prev->next = cur->next;
+        }
+        else
+        {
+            inFlightHead = cur->next;
+        }
+
+        if (inFlightTail == cur)
+        {
+            inFlightTail = prev;
+        }
+        cur->next = NULL;
+        cur->state &= ~kVoodooHCICommandSubmitted;
+        --inFlight;
+        return;
+    }
+}
+
+// A slot is recycled once both the control transfer and the completion are done, whichever comes last
+void VoodooHCICommandEngine::retireRequest(VoodooHCICommandRequest * request, UInt32 state)
+{
+    IOLockLock(lock);
+    request->state |= state;
+    bool done = (request->state & (kVoodooHCICommandSent | kVoodooHCICommandAnswered)) == (kVoodooHCICommandSent | kVoodooHCICommandAnswered);
+    IOLockUnlock(lock);
+
+    if (done)
+    {
+        freeRequest(request);
+    }
+}
+
+void VoodooHCICommandEngine::completeRequest(VoodooHCICommandRequest * request, IOReturn status, const HciEventHdr * event, UInt16 eventLength)
+{
+    IOLockLock(lock);
+    VoodooHCICommandCompletion completion = request->completion;
+    request->completion.action = NULL;
+    IOLockUnlock(lock);
+    
+    // Command to Command Complete / Status, which is what the stack above actually waits for
+    if (event)
+    {
+        device->recordHCIResponse(request->submitTime, eventLength, status);
+    }
+
+    if (completion.action)
+    {
+        completion.action(completion.owner, completion.refCon, status, event, eventLength);
+    }
+}
+
+// Called without the lock, before the request is retired so the slot cannot be armed again meanwhile
+void VoodooHCICommandEngine::disarmRequest(VoodooHCICommandRequest * request)
+{
+    if (wheel && wheel->cancelTimer(&request->timer))
+    {
+        release();
+    }
+}
+
+void VoodooHCICommandEngine::commandTimerAction(void * owner, void * refCon)
+{
+    VoodooHCICommandEngine  * that    = (VoodooHCICommandEngine *) owner;
+    VoodooHCICommandRequest * request = (VoodooHCICommandRequest *) refCon;
+    UInt64 interval;
+
+    nanoseconds_to_absolutetime((UInt64) that->commandTimeoutMS * 1000000ULL, &interval);
+
+    // A timer picked just as the answer came in may find its slot already reused by a younger command
+    IOLockLock(that->lock);
+    bool expired = (request->state & kVoodooHCICommandSubmitted) && mach_absolute_time() - request->submitTime >= interval;
+    if (expired)
+    {
+        that->removeInFlight(request);
+
+        // Same recovery as a command timeout on Linux: assume the controller can take one more
+        if (!that->credits)
+        {
+            that->credits = 1;
+        }
+    }
+    IOLockUnlock(that->lock);
+
+    if (expired)
+    {
+        VoodooUSBErrorLog("VoodooHCICommandEngine::commandTimerAction() - Opcode 0x%04x timed out!!!\n", request->opCode);
+        that->completeRequest(request, kIOReturnTimeout, NULL, 0);
+        that->retireRequest(request, kVoodooHCICommandAnswered);
+        that->issuePending();
+    }
+    that->release();
+}
+
+void VoodooHCICommandEngine::setCommandTimeout(UInt32 timeoutMS)
+{
+    commandTimeoutMS = timeoutMS;
+}
+
+void VoodooHCICommandEngine::setPollPipe(VoodooUSBPipe * pipe)
+{
+    if (pipe)
+    {
+        pipe->retain();
+    }
+    OSSafeReleaseNULL(pollPipe);
+    pollPipe = pipe;
+}
+
+void VoodooHCICommandEngine::issuePending()
+{
+    while (1)
+    {
+        IOLockLock(lock);
+        VoodooHCICommandRequest * request = pendingHead;
+
+        if (!request || !credits)
+        {
+            IOLockUnlock(lock);
+            return;
+        }
+
+        pendingHead = request->next;
+        if (!pendingHead)
+        {
+            pendingTail = NULL;
+        }
+        --queued;
+        --credits;
+
+        request->next = NULL;
+        if (inFlightTail)
+        {
+            inFlightTail->next = request;
+        }
+        else
+        {
+            inFlightHead = request;
+        }
+        inFlightTail = request;
+        ++inFlight;
+
+        request->state      = kVoodooHCICommandSubmitted;
+        request->submitTime = mach_absolute_time();
+        request->usbCompletion = { this, usbCompletionAction, request };
+        if (wheel && !wheel->armTimer(&request->timer, commandTimeoutMS))
+        {
+            retain();
+        }
+        IOLockUnlock(lock);
+
+        // The control transfer holds a reference until usbCompletionAction() is done with the engine
+        retain();
+        IOReturn result = device->sendHCICommandAsync(client, request->frame, request->length, &request->deviceRequest, &request->usbCompletion);
+
+        if (result != kIOReturnSuccess)
+        {
+            VoodooUSBErrorLog("VoodooHCICommandEngine::issuePending() - Unable to submit opcode 0x%04x: 0x%08x!!!\n", request->opCode, result);
+
+            IOLockLock(lock);
+            removeInFlight(request);
+            ++credits;
+            IOLockUnlock(lock);
+
+            disarmRequest(request);
+            completeRequest(request, result, NULL, 0);
+            retireRequest(request, kVoodooHCICommandSent | kVoodooHCICommandAnswered);
+            release();
+        }
+    }
+}
+
+void VoodooHCICommandEngine::usbCompletionAction(void * owner, void * parameter, IOReturn status, UInt32 bytesTransferred)
+{
+    VoodooHCICommandEngine  * that    = (VoodooHCICommandEngine *) owner;
+    VoodooHCICommandRequest * request = (VoodooHCICommandRequest *) parameter;
+
+    if (status == kIOReturnSuccess)
+    {
+        that->retireRequest(request, kVoodooHCICommandSent);
+        that->release();
+        return;
+    }
+
+    // The controller never saw the command, so no event will answer it
+    IOLockLock(that->lock);
+    bool pending = request->state & kVoodooHCICommandSubmitted;
+    if (pending)
+    {
+        that->removeInFlight(request);
+        ++that->credits;
+    }
+    IOLockUnlock(that->lock);
+
+    if (pending)
+    {
+        that->disarmRequest(request);
+        that->completeRequest(request, status, NULL, 0);
+        that->retireRequest(request, kVoodooHCICommandSent | kVoodooHCICommandAnswered);
+    }
+    else
+    {
+        that->retireRequest(request, kVoodooHCICommandSent);
+    }
+
+    that->issuePending();
+    that->release();
+}
+
+IOReturn VoodooHCICommandEngine::submitCommand(UInt16 opCode, UInt8 paramLen, const void * param, UInt8 tailLen, const void * tail, VoodooHCICommandCompletion * completion, VoodooHCICommandRequest ** outRequest)
+{
+    if ((UInt32) paramLen + tailLen > sizeof(HciCommandHdr) - HCI_COMMAND_HDR_SIZE)
+    {
+        return kIOReturnBadArgument;
+    }
+    
+    VoodooHCICommandRequest * request = allocateRequest();
+
+    if (!request)
+    {
+        return kIOReturnNoResources;
+    }
+
+    request->buffer = pool->getCommandBuffer();
+    if (!request->buffer)
+    {
+        freeRequest(request);
+        return kIOReturnNoResources;
+    }
+
+    HciCommandHdr * command = request->buffer->command;
+    command->opCode  = opCode;
+    command->pLength = paramLen + tailLen;
+    if (paramLen && param)
+    {
+        memcpy(command->pData, param, paramLen);
+    }
+    if (tailLen && tail)
+    {
+        memcpy(command->pData + paramLen, tail, tailLen);
+    }
+
+    request->frame  = command;
+    request->opCode = opCode;
+    request->length = HCI_COMMAND_HDR_SIZE + command->pLength;
+
+    if (completion)
+    {
+        request->completion = *completion;
+    }
+
+    if (outRequest)
+    {
+        *outRequest = request;
+    }
+
+    queueRequest(request);
+    return kIOReturnSuccess;
+}
+
+IOReturn VoodooHCICommandEngine::enqueueCommand(UInt16 opCode, UInt8 paramLen, const void * param, VoodooHCICommandCompletion * completion)
+{
+    return submitCommand(opCode, paramLen, param, 0, NULL, completion, NULL);
+}
+
+IOReturn VoodooHCICommandEngine::enqueueCommandGather(UInt16 opCode, UInt8 headLen, const void * head, UInt8 tailLen, const void * tail, VoodooHCICommandCompletion * completion)
+{
+    return submitCommand(opCode, headLen, head, tailLen, tail, completion, NULL);
+}
+
+IOReturn VoodooHCICommandEngine::enqueueCommandFrame(const void * frame, UInt16 length, VoodooHCICommandCompletion * completion)
+{
+    const FwCommandHdr * header = (const FwCommandHdr *) frame;
+
+    if (!frame || length < HCI_COMMAND_HDR_SIZE || length != HCI_COMMAND_HDR_SIZE + header->pLength)
+    {
+        return kIOReturnBadArgument;
+    }
+
+    VoodooHCICommandRequest * request = allocateRequest();
+    if (!request)
+    {
+        return kIOReturnNoResources;
+    }
+
+    // The frame is sent straight from caller memory, which must stay valid until completion
+    request->buffer = NULL;
+    request->frame  = (void *) frame;
+    request->opCode = header->opCode;
+    request->length = length;
+
+    if (completion)
+    {
+        request->completion = *completion;
+    }
+
+    queueRequest(request);
+    return kIOReturnSuccess;
+}
+
+void VoodooHCICommandEngine::syncCompletionAction(void * owner, void * refCon, IOReturn status, const HciEventHdr * event, UInt16 eventLength)
+{
+    VoodooHCICommandEngine * that    = (VoodooHCICommandEngine *) owner;
+    VoodooHCISyncContext   * context = (VoodooHCISyncContext *) refCon;
+
+    context->status = status;
+    if (event && context->response)
+    {
+        context->responseLength = min(eventLength, context->responseCapacity);
+        memcpy(context->response, event, context->responseLength);
+    }
+
+    IOLockLock(that->lock);
+    context->done = true;
+    IOLockWakeup(that->lock, context, false);
+    IOLockUnlock(that->lock);
+}
+
+IOReturn VoodooHCICommandEngine::sendCommandSync(UInt16 opCode, UInt8 paramLen, const void * param, void * response, UInt16 * responseLength, UInt32 timeoutMS)
+{
+    VoodooHCISyncContext context =
+    {
+        .response         = response,
+        .responseCapacity = (UInt16) ((response && responseLength) ? *responseLength : 0),
+        .responseLength   = 0,
+        .status           = kIOReturnSuccess,
+        .done             = false
+    };
+
+    VoodooHCICommandCompletion completion = { this, syncCompletionAction, &context };
+    VoodooHCICommandRequest * request = NULL;
+    UInt64 deadline;
+
+    IOReturn result = submitCommand(opCode, paramLen, param, 0, NULL, &completion, &request);
+    if (result != kIOReturnSuccess)
+    {
+        return result;
+    }
+
+    // Caught while spinning, the answer is taken below without this thread ever going to sleep
+    if (pollPipe)
+    {
+        pollPipe->pollForCompletion(&context.done);
+    }
+
+    clock_interval_to_deadline(timeoutMS, kMillisecondScale, &deadline);
+
+    IOLockLock(lock);
+    while (!context.done)
+    {
+        if (IOLockSleepDeadline(lock, &context, deadline, THREAD_UNINT) != THREAD_TIMED_OUT)
+        {
+            continue;
+        }
+
+        // Detach the context unless the completion is already being delivered
+        if (request->completion.action == syncCompletionAction && request->completion.refCon == &context)
+        {
+            request->completion.action = NULL;
+            IOLockUnlock(lock);
+            VoodooUSBErrorLog("VoodooHCICommandEngine::sendCommandSync() - Opcode 0x%04x timed out!!!\n", opCode);
+            return kIOReturnTimeout;
+        }
+        deadline = UINT64_MAX;
+    }
+    IOLockUnlock(lock);
+
+    if (responseLength)
+    {
+        *responseLength = context.responseLength;
+    }
+    return context.status;
+}
+
+// Called with lock held, which is dropped around every enqueue
+void VoodooHCICommandEngine::queueStream(VoodooHCIStreamContext * context)
+{
+    VoodooHCICommandSource * source = context->source;
+    VoodooHCIStreamCommand command;
+
+    // Commands have to reach the engine in stream order, so only one thread queues at a time; the
+    // others leave their free slot to it, and it picks the slot up before it gives up the lock
+    if (context->queueing)
+    {
+        return;
+    }
+    context->queueing = true;
+
+    while (context->status == kIOReturnSuccess && context->inFlight < context->depth && source->next(source->owner, &command))
+    {
+        if (++context->inFlight > context->peakInFlight)
+        {
+            context->peakInFlight = context->inFlight;
+        }
+        IOLockUnlock(lock);
+
+        // The completion may run before this returns
+        VoodooHCICommandCompletion completion = { context, streamCompletionAction, command.refCon };
+        IOReturn result;
+        if (command.frame)
+        {
+            result = enqueueCommandFrame(command.frame, command.frameLength, &completion);
+        }
+        else
+        {
+            result = enqueueCommandGather(command.opCode, command.headLen, command.head, command.tailLen, command.tail, &completion);
+        }
+
+        IOLockLock(lock);
+        if (result == kIOReturnSuccess)
+        {
+            continue;
+        }
+
+        --context->inFlight;
+        if (result == kIOReturnNoResources)
+        {
+            // Out of slots or buffers: the next completion of the stream tries this command again,
+            // and with none of ours left the slots are held by other commands that retire soon
+            source->rewind(source->owner, &command);
+            if (context->inFlight)
+            {
+                break;
+            }
+            IOLockUnlock(lock);
+            IOSleep(1);
+            IOLockLock(lock);
+            continue;
+        }
+        if (context->status == kIOReturnSuccess)
+        {
+            context->status = result;
+        }
+    }
+
+    context->queueing = false;
+    if (!context->inFlight)
+    {
+        IOLockWakeup(lock, context, false);
+    }
+}
+
+void VoodooHCICommandEngine::streamCompletionAction(void * owner, void * refCon, IOReturn status, const HciEventHdr * event, UInt16 eventLength)
+{
+    VoodooHCIStreamContext * context = (VoodooHCIStreamContext *) owner;
+    VoodooHCICommandEngine * that    = context->engine;
+
+    IOLockLock(that->lock);
+    --context->inFlight;
+    if (context->source->answered)
+    {
+        context->source->answered(context->source->owner, refCon, status);
+    }
+    if (status != kIOReturnSuccess && context->status == kIOReturnSuccess)
+    {
+        // Nothing more is queued; the commands already with the engine still complete
+        context->status = status;
+    }
+
+    // The context lives on the stack of sendCommandStream(), which returns as soon as it sees the
+    // stream drained: the refill has to happen before the lock is given up, and nothing touches it afterwards
+    that->queueStream(context);
+    IOLockUnlock(that->lock);
+}
+
+IOReturn VoodooHCICommandEngine::sendCommandStream(VoodooHCICommandSource * source, UInt32 depth, UInt32 * peakInFlight)
+{
+    if (!source || !source->next || !source->rewind || !depth)
+    {
+        return kIOReturnBadArgument;
+    }
+
+    VoodooHCIStreamContext context =
+    {
+        .engine       = this,
+        .source       = source,
+        .depth        = depth,
+        .inFlight     = 0,
+        .peakInFlight = 0,
+        .queueing     = false,
+        .status       = kIOReturnSuccess
+    };
+
+    // Completions keep the engine fed until the source runs out
+    IOLockLock(lock);
+    queueStream(&context);
+    while (context.inFlight || context.queueing)
+    {
+        IOLockSleep(lock, &context, THREAD_UNINT);
+    }
+    IOLockUnlock(lock);
+
+    if (peakInFlight)
+    {
+        *peakInFlight = context.peakInFlight;
+    }
+    return context.status;
+}
+
+bool VoodooHCICommandEngine::handleEvent(const HciEventHdr * event, UInt16 length)
+{
+    UInt8  numCommands;
+    UInt16 opCode;
+    UInt8  status;
+
+    if (!event || length < HCI_EVENT_HDR_SIZE || length < HCI_EVENT_HDR_SIZE + event->pLength)
+    {
+        return false;
+    }
+
+    const UInt8 * param = (const UInt8 *) event + HCI_EVENT_HDR_SIZE;
+
+    switch (event->event)
+    {
+        case HCI_EV_CMD_COMPLETE:
+            if (event->pLength < 3)
+            {
+                return false;
+            }
+            numCommands = param[0];
+            opCode      = OSReadLittleInt16(param, 1);
+            status      = kIOReturnSuccess;
+            break;
+
+        case HCI_EV_CMD_STATUS:
+            if (event->pLength < 4)
+            {
+                return false;
+            }
+            numCommands = param[1];
+            opCode      = OSReadLittleInt16(param, 2);
+            status      = param[0];
+            break;
+
+        default:
+            return false;
+    }
+
+    IOLockLock(lock);
+    credits = numCommands;
+
+    VoodooHCICommandRequest * request = NULL;
+    if (opCode != HCI_OP_NOP)
+    {
+        for (request = inFlightHead; request; request = request->next)
+        {
+            if (request->opCode == opCode)
+            {
+                removeInFlight(request);
+                break;
+            }
+        }
+    }
+    IOLockUnlock(lock);
+
+    if (request)
+    {
+        disarmRequest(request);
+        completeRequest(request, status ? kIOReturnError : kIOReturnSuccess, event, HCI_EVENT_HDR_SIZE + event->pLength);
+        retireRequest(request, kVoodooHCICommandAnswered);
+    }
+    else if (opCode != HCI_OP_NOP)
+    {
+        VoodooUSBWarningLog("VoodooHCICommandEngine::handleEvent() - Unsolicited answer for opcode 0x%04x!\n", opCode);
+    }
+
+    issuePending();
+    return true;
+}
+
+void VoodooHCICommandEngine::handleEventAction(void * owner, void * refCon, const HciEventHdr * event, UInt16 length)
+{
+    ((VoodooHCICommandEngine *) owner)->handleEvent(event, length);
+}
+
+void VoodooHCICommandEngine::abortAll(IOReturn status)
+{
+    IOLockLock(lock);
+    VoodooHCICommandRequest * pending = pendingHead;
+    pendingHead = pendingTail = NULL;
+    queued = 0;
+
+    VoodooHCICommandRequest * submitted = inFlightHead;
+    for (VoodooHCICommandRequest * cur = submitted; cur; cur = cur->next)
+    {
+        cur->state &= ~kVoodooHCICommandSubmitted;
+    }
+    inFlightHead = inFlightTail = NULL;
+    inFlight = 0;
+    credits  = 1;
+    IOLockUnlock(lock);
+
+    while (pending)
+    {
+        VoodooHCICommandRequest * next = pending->next;
+        completeRequest(pending, status, NULL, 0);
+        retireRequest(pending, kVoodooHCICommandSent | kVoodooHCICommandAnswered);
+        pending = next;
+    }
+
+    // The control transfers of these are still owned by the USB stack
+    while (submitted)
+    {
+        VoodooHCICommandRequest * next = submitted->next;
+        disarmRequest(submitted);
+        completeRequest(submitted, status, NULL, 0);
+        retireRequest(submitted, kVoodooHCICommandAnswered);
+        submitted = next;
+    }
+}
+
+UInt32 VoodooHCICommandEngine::checkTimeouts(UInt32 timeoutMS)
+{
+    VoodooHCICommandRequest * expired = NULL;
+    UInt64 now = mach_absolute_time();
+    UInt64 interval;
+    UInt32 count = 0;
+
+    nanoseconds_to_absolutetime((UInt64) timeoutMS * 1000000ULL, &interval);
+
+    IOLockLock(lock);
+    VoodooHCICommandRequest * cur = inFlightHead;
+    while (cur)
+    {
+        VoodooHCICommandRequest * next = cur->next;
+        if (now - cur->submitTime >= interval)
+        {
+            removeInFlight(cur);
+            cur->next = expired;
+            expired = cur;
+            ++count;
+        }
+        cur = next;
+    }
+
+    // Same recovery as a command timeout on Linux: assume the controller can take one more
+    if (count && !credits)
+    {
+        credits = 1;
+    }
+    IOLockUnlock(lock);
+
+    while (expired)
+    {
+        VoodooHCICommandRequest * next = expired->next;
+        VoodooUSBErrorLog("VoodooHCICommandEngine::checkTimeouts() - Opcode 0x%04x timed out!!!\n", expired->opCode);
+        disarmRequest(expired);
+        completeRequest(expired, kIOReturnTimeout, NULL, 0);
+        retireRequest(expired, kVoodooHCICommandAnswered);
+        expired = next;
+    }
+
+    if (count)
+    {
+        issuePending();
+    }
+    return count;
+}
+
+UInt32 VoodooHCICommandEngine::getCredits()
+{
+    return credits;
+}
+
+UInt32 VoodooHCICommandEngine::getCommandsInFlight()
+{
+    return inFlight;
+}
+
+UInt32 VoodooHCICommandEngine::getCommandsQueued()
+{
+    return queued;
+}
@@ -0,0 +1,164 @@
+//
+//  VoodooHCICommandEngine.h
+//  VoodooUSBProvider
+//
+//  Copyright © 2021 Charlie Jiang. All rights reserved.
+//
+
+#ifndef VoodooHCICommandEngine_h
+#define VoodooHCICommandEngine_h
+
+#include "VoodooUSBDevice.h"
+
+#define VOODOO_HCI_COMMAND_ENGINE_SLOTS     32
+
+class VoodooHCICommandEngine;
+
+/*
+ * Called once the controller answers a command with HCI_EV_CMD_COMPLETE or HCI_EV_CMD_STATUS.
+ * event points at the raw event (header included) and is only valid for the duration of the call.
+ * event is NULL when the command never reached the controller or was aborted.
+ */
+typedef void (*VoodooHCICommandAction)(void * owner, void * refCon, IOReturn status, const HciEventHdr * event, UInt16 eventLength);
+
+struct VoodooHCICommandCompletion
+{
+    void                   * owner;
+    VoodooHCICommandAction   action;
+    void                   * refCon;
+};
+
+/* One command of a stream: frame is sent as it is when set, otherwise the parameters are gathered from head and tail */
+struct VoodooHCIStreamCommand
+{
+    const void   * frame;
+    UInt16         frameLength;
+    UInt16         opCode;
+    UInt8          headLen;
+    const void   * head;
+    UInt8          tailLen;
+    const void   * tail;
+    void         * refCon;          /* handed to answered */
+};
+
+/*
+ * Feeds sendCommandStream(). Every call is made with the engine locked, so none of them may call back into it.
+ * next describes the command after the last one and moves past it, and returns false at the end of the stream;
+ * rewind moves back before a command the engine had no room for, which next then hands out again.
+ * answered is optional and sees the status of every command the controller answered or the engine gave up on.
+ */
+struct VoodooHCICommandSource
+{
+    void   * owner;
+    bool   (*next)(void * owner, VoodooHCIStreamCommand * command);
+    void   (*rewind)(void * owner, const VoodooHCIStreamCommand * command);
+    void   (*answered)(void * owner, void * refCon, IOReturn status);
+};
+
+struct VoodooHCIStreamContext;
+
+enum VoodooHCICommandState
+{
+    kVoodooHCICommandFree       = 0,
+    kVoodooHCICommandQueued     = (1 << 0),
+    kVoodooHCICommandSubmitted  = (1 << 1),     /* on the in-flight list */
+    kVoodooHCICommandSent       = (1 << 2),     /* control transfer finished (or never started) */
+    kVoodooHCICommandAnswered   = (1 << 3)      /* completion delivered */
+};
+
+struct VoodooHCICommandRequest
+{
+    VoodooHCICommandRequest    * next;
+    VoodooHCICommandEngine     * engine;
+    UInt16                       opCode;
+    UInt16                       length;
+    VoodooHCICommandBuffer     * buffer;        /* engine-owned copy, NULL when sending a caller frame */
+    void                       * frame;         /* bytes actually sent on the control pipe */
+    VoodooHCICommandCompletion   completion;
+    USBDeviceRequest             deviceRequest;
+    USBCompletion                usbCompletion;
+    UInt64                       submitTime;
+    VoodooHCITimer               timer;         /* armed while in flight, holds a reference on the engine */
+    volatile UInt32              state;
+};
+
+/*
+ * Pipelined HCI command issue.
+ * Commands are queued in order and handed to the controller as long as it grants credits
+ * (Num_HCI_Command_Packets of the last Command Complete / Command Status event).
+ * The client feeds every HCI event it reads from the interrupt pipe to handleEvent(), or subscribes
+ * handleEventAction to a VoodooHCIEventReassembler for HCI_EV_CMD_COMPLETE and HCI_EV_CMD_STATUS.
+ * Commands left unanswered time out on the device's timer wheel; checkTimeouts() is only
+ * needed when the device has none.
+ */
+class VoodooHCICommandEngine : public OSObject
+{
+    typedef OSObject super;
+
+    OSDeclareDefaultStructors(VoodooHCICommandEngine)
+
+public:
+    static VoodooHCICommandEngine * withDevice(VoodooUSBDevice * device, IOService * forClient);
+
+    virtual bool initWithDevice(VoodooUSBDevice * device, IOService * forClient);
+    virtual void free() override;
+
+    IOReturn enqueueCommand(UInt16 opCode, UInt8 paramLen, const void * param, VoodooHCICommandCompletion * completion);
+    IOReturn enqueueCommandFrame(const void * frame, UInt16 length, VoodooHCICommandCompletion * completion);
+    /* Parameters gathered from two places straight into the wired command buffer, e.g. a type byte and a slice of an image */
+    IOReturn enqueueCommandGather(UInt16 opCode, UInt8 headLen, const void * head, UInt8 tailLen, const void * tail, VoodooHCICommandCompletion * completion);
+    IOReturn sendCommandSync(UInt16 opCode, UInt8 paramLen, const void * param, void * response = NULL, UInt16 * responseLength = NULL, UInt32 timeoutMS = HCI_CMD_TIMEOUT);
+    /* Queues the commands of source in order, up to depth at once, and returns once all of them are answered; the first failure ends the stream */
+    IOReturn sendCommandStream(VoodooHCICommandSource * source, UInt32 depth, UInt32 * peakInFlight = NULL);
+
+    bool handleEvent(const HciEventHdr * event, UInt16 length);
+    static void handleEventAction(void * owner, void * refCon, const HciEventHdr * event, UInt16 length);
+    void abortAll(IOReturn status = kIOReturnAborted);
+    UInt32 checkTimeouts(UInt32 timeoutMS = HCI_CMD_TIMEOUT);
+    void   setCommandTimeout(UInt32 timeoutMS);
+
+    /* Synchronous commands spin for their answer on pipe, the event endpoint, while its poll window is open */
+    void   setPollPipe(VoodooUSBPipe * pipe);
+
+    UInt32 getCredits();
+    UInt32 getCommandsInFlight();
+    UInt32 getCommandsQueued();
+
+private:
+    IOReturn submitCommand(UInt16 opCode, UInt8 paramLen, const void * param, UInt8 tailLen, const void * tail, VoodooHCICommandCompletion * completion, VoodooHCICommandRequest ** outRequest);
+    VoodooHCICommandRequest * allocateRequest();
+    void freeRequest(VoodooHCICommandRequest * request);
+    void queueRequest(VoodooHCICommandRequest * request);
+    void removeInFlight(VoodooHCICommandRequest * request);
+    void retireRequest(VoodooHCICommandRequest * request, UInt32 state);
+    void issuePending();
+    void completeRequest(VoodooHCICommandRequest * request, IOReturn status, const HciEventHdr * event, UInt16 eventLength);
+    void disarmRequest(VoodooHCICommandRequest * request);
+    void queueStream(VoodooHCIStreamContext * context);
+
+    static void usbCompletionAction(void * owner, void * parameter, IOReturn status, UInt32 bytesTransferred);
+    static void syncCompletionAction(void * owner, void * refCon, IOReturn status, const HciEventHdr * event, UInt16 eventLength);
+    static void streamCompletionAction(void * owner, void * refCon, IOReturn status, const HciEventHdr * event, UInt16 eventLength);
+    static void commandTimerAction(void * owner, void * refCon);
+
+    VoodooUSBDevice         * device;
+    IOService               * client;
+    IOLock                  * lock;
+    VoodooHCICommandPool    * pool;
+    VoodooHCITimerWheel     * wheel;
+    UInt32                    commandTimeoutMS;
+    VoodooUSBPipe           * pollPipe;
+
+    VoodooHCICommandRequest   requests[VOODOO_HCI_COMMAND_ENGINE_SLOTS];
+    VoodooHCICommandRequest * freeList;
+    VoodooHCICommandRequest * pendingHead;      /* waiting for a credit */
+    VoodooHCICommandRequest * pendingTail;
+    VoodooHCICommandRequest * inFlightHead;     /* sent, waiting for CC / CS, oldest first */
+    VoodooHCICommandRequest * inFlightTail;
+
+    UInt32                    credits;
+    UInt32                    inFlight;
+    UInt32                    queued;
+};
+
+#endif /* VoodooHCICommandEngine_h */
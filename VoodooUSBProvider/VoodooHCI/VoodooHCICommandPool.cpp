@@ -0,0 +1,152 @@
+//
+//  VoodooHCICommandPool.cpp
+//  VoodooUSBProvider
+//
+//  Copyright © 2021 Charlie Jiang. All rights reserved.
+//
+
+#include "VoodooHCICommandPool.h"
+
+OSDefineMetaClassAndStructors(VoodooHCICommandPool, OSObject)
+
+VoodooHCICommandPool * VoodooHCICommandPool::withCapacity(UInt32 capacity)
+{
+    VoodooHCICommandPool * pool = new VoodooHCICommandPool;
+
+    if (pool && !pool->initWithCapacity(capacity))
+    {
+        OSSafeReleaseNULL(pool);
+    }
+    return pool;
+}
+
+bool VoodooHCICommandPool::initWithCapacity(UInt32 capacity)
+{
+    if (!super::init())
+    {
+        return false;
+    }
+
+    if (!capacity || capacity > VOODOO_HCI_COMMAND_POOL_MAX)
+    {
+        VoodooUSBErrorLog("VoodooHCICommandPool::initWithCapacity() - Invalid capacity %u!!!\n", capacity);
+        return false;
+    }
+
+    bzero(buffers, sizeof(buffers));
+    this->capacity = 0;
+
+    for (UInt32 i = 0; i < capacity; ++i)
+    {
+        IOBufferMemoryDescriptor * descriptor = IOBufferMemoryDescriptor::withCapacity(sizeof(HciCommandHdr), kIODirectionInOut);
+
+        if (!descriptor)
+        {
+            VoodooUSBErrorLog("VoodooHCICommandPool::initWithCapacity() - Unable to allocate buffer %u!!!\n", i);
+            return false;
+        }
+
+        if (descriptor->prepare() != kIOReturnSuccess)
+        {
+            VoodooUSBErrorLog("VoodooHCICommandPool::initWithCapacity() - Unable to wire buffer %u!!!\n", i);
+            OSSafeReleaseNULL(descriptor);
+            return false;
+        }
+
+        descriptor->setLength(sizeof(HciCommandHdr));
+        buffers[i].descriptor = descriptor;
+        buffers[i].command    = (HciCommandHdr *) descriptor->getBytesNoCopy();
+        buffers[i].index      = i;
+        this->capacity++;
+    }
+
+    freeMask       = (capacity == 32) ? 0xFFFFFFFF : ((1U << capacity) - 1);
+    buffersInUse   = 0;
+    highWaterMark  = 0;
+    exhaustedCount = 0;
+    return true;
+}
+
+void VoodooHCICommandPool::free()
+{
+    for (UInt32 i = 0; i < capacity; ++i)
+    {
+        if (buffers[i].descriptor)
+        {
+            buffers[i].descriptor->complete();
+            OSSafeReleaseNULL(buffers[i].descriptor);
+        }
+        buffers[i].command = NULL;
+    }
+    capacity = 0;
+
+    super::free();
+}
+
+VoodooHCICommandBuffer * VoodooHCICommandPool::getCommandBuffer()
+{
+    UInt32 mask;
+    UInt32 index;
+
+    do
+    {
+        mask = freeMask;
+        if (!mask)
+        {
+            OSIncrementAtomic(&exhaustedCount);
+            return NULL;
+        }
+        index = __builtin_ctz(mask);
+    } while (!OSCompareAndSwap(mask, mask & ~(1U << index), &freeMask));
+
+    UInt32 inUse = (UInt32) OSIncrementAtomic(&buffersInUse) + 1;
+    UInt32 mark;
+
+    do
+    {
+        mark = highWaterMark;
+        if (inUse <= mark)
+        {
+            break;
+        }
+    } while (!OSCompareAndSwap(mark, inUse, &highWaterMark));
+
+    return &buffers[index];
+}
+
+void VoodooHCICommandPool::returnCommandBuffer(VoodooHCICommandBuffer * buffer)
+{
+    if (!buffer || buffer->index >= capacity || buffer != &buffers[buffer->index])
+    {
+        VoodooUSBErrorLog("VoodooHCICommandPool::returnCommandBuffer() - Buffer %p does not belong to this pool!!!\n", buffer);
+        return;
+    }
+
+    UInt32 mask;
+    do
+    {
+        mask = freeMask;
+    } while (!OSCompareAndSwap(mask, mask | (1U << buffer->index), &freeMask));
+
+    OSDecrementAtomic(&buffersInUse);
+}
+
+UInt32 VoodooHCICommandPool::getCapacity()
+{
+    return capacity;
+}
+
+UInt32 VoodooHCICommandPool::getBuffersInUse()
+{
+    return (UInt32) buffersInUse;
+}
+
+UInt32 VoodooHCICommandPool::getHighWaterMark()
+{
+    return highWaterMark;
+}
+
+UInt32 VoodooHCICommandPool::getExhaustedCount()
+{
+    return (UInt32) exhaustedCount;
+}
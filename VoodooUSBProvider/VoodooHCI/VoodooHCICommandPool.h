@@ -0,0 +1,59 @@
+//
+//  VoodooHCICommandPool.h
+//  VoodooUSBProvider
+//
+//  Copyright © 2021 Charlie Jiang. All rights reserved.
+//
+
+#ifndef VoodooHCICommandPool_h
+#define VoodooHCICommandPool_h
+
+#include "VoodooUSBCommon.h"
+#include <IOKit/IOBufferMemoryDescriptor.h>
+
+#define VOODOO_HCI_COMMAND_POOL_DEFAULT     16
+#define VOODOO_HCI_COMMAND_POOL_MAX         32      /* one bit per buffer in freeMask */
+
+struct VoodooHCICommandBuffer
+{
+    HciCommandHdr            * command;
+    IOBufferMemoryDescriptor * descriptor;      /* prepared (wired) for the lifetime of the pool */
+    UInt32                     index;
+};
+
+/*
+ * Fixed set of wired HCI command buffers.
+ * getCommandBuffer() / returnCommandBuffer() never allocate and never take a lock,
+ * so they can be used from any HCI send path.
+ */
+class VoodooHCICommandPool : public OSObject
+{
+    typedef OSObject super;
+
+    OSDeclareDefaultStructors(VoodooHCICommandPool)
+
+public:
+    static VoodooHCICommandPool * withCapacity(UInt32 capacity = VOODOO_HCI_COMMAND_POOL_DEFAULT);
+
+    virtual bool initWithCapacity(UInt32 capacity);
+    virtual void free() override;
+
+    VoodooHCICommandBuffer * getCommandBuffer();
+    void returnCommandBuffer(VoodooHCICommandBuffer * buffer);
+
+    UInt32 getCapacity();
+    UInt32 getBuffersInUse();
+    UInt32 getHighWaterMark();
+    UInt32 getExhaustedCount();
+
+private:
+    VoodooHCICommandBuffer buffers[VOODOO_HCI_COMMAND_POOL_MAX];
+    UInt32                 capacity;
+
+    volatile UInt32        freeMask;
+    volatile SInt32        buffersInUse;
+    volatile UInt32        highWaterMark;
+    volatile SInt32        exhaustedCount;
+};
+
+#endif /* VoodooHCICommandPool_h */
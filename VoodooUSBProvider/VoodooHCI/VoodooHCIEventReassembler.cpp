@@ -0,0 +1,348 @@
+//
+//  VoodooHCIEventReassembler.cpp
+//  VoodooUSBProvider
+//
+//  Copyright © 2021 Charlie Jiang. All rights reserved.
+//
+
+#include "VoodooHCIEventReassembler.h"
+
+OSDefineMetaClassAndStructors(VoodooHCIEventReassembler, OSObject)
+
+VoodooHCIEventReassembler * VoodooHCIEventReassembler::withPipe(VoodooUSBPipe * interruptPipe, UInt32 ringSize)
+{
+    VoodooHCIEventReassembler * reassembler = new VoodooHCIEventReassembler;
+    
+    if (reassembler && !reassembler->initWithPipe(interruptPipe, ringSize))
+    {
+        OSSafeReleaseNULL(reassembler);
+    }
+    return reassembler;
+}
+
+bool VoodooHCIEventReassembler::initWithPipe(VoodooUSBPipe * interruptPipe, UInt32 ringSize)
+{
+    if (!super::init() || !interruptPipe)
+    {
+        return false;
+    }
+    
+    packetSize = interruptPipe->getMaxPacketSize();
+    if (!packetSize)
+    {
+        packetSize = 64;
+    }
+    
+    if (ringSize < 2 * HCI_MAX_EVENT_SIZE + packetSize)
+    {
+        VoodooUSBErrorLog("VoodooHCIEventReassembler::initWithPipe() - Ring of %u bytes is too small!!!\n", ringSize);
+        return false;
+    }
+    
+    lock = IOLockAlloc();
+    if (!lock)
+    {
+        return false;
+    }
+    
+    ring = IOBufferMemoryDescriptor::withCapacity(ringSize, kIODirectionIn);
+    if (!ring || ring->prepare() != kIOReturnSuccess)
+    {
+        VoodooUSBErrorLog("VoodooHCIEventReassembler::initWithPipe() - Unable to allocate ring!!!\n");
+        OSSafeReleaseNULL(ring);
+        return false;
+    }
+    ring->setLength(ringSize);
+    ringBytes = (UInt8 *) ring->getBytesNoCopy();
+    
+    for (int i = 0; i < 2; ++i)
+    {
+        window[i] = IOSubMemoryDescriptor::withSubRange(ring, 0, packetSize, kIODirectionIn);
+        if (!window[i])
+        {
+            return false;
+        }
+    }
+    
+    this->ringSize = ringSize;
+    frameStart  = 0;
+    tail        = 0;
+    windowIndex = 0;
+    running     = false;
+    posted      = false;
+    completion  = { this, readCompletionAction, NULL };
+    
+    bzero(subscribers, sizeof(subscribers));
+    bzero(&statistics, sizeof(statistics));
+    
+    pipe = interruptPipe;
+    pipe->retain();
+    return true;
+}
+
+void VoodooHCIEventReassembler::free()
+{
+    if (pipe)
+    {
+        stop();
+    }
+    
+    OSSafeReleaseNULL(window[0]);
+    OSSafeReleaseNULL(window[1]);
+    
+    if (ring)
+    {
+        ring->complete();
+        OSSafeReleaseNULL(ring);
+    }
+    OSSafeReleaseNULL(pipe);
+    
+    if (lock)
+    {
+        IOLockFree(lock);
+        lock = NULL;
+    }
+    super::free();
+}
+
+IOReturn VoodooHCIEventReassembler::subscribe(UInt8 event, VoodooHCIEventAction action, void * owner, void * refCon)
+{
+    if (!action)
+    {
+        return kIOReturnBadArgument;
+    }
+    
+    IOReturn result = kIOReturnNoSpace;
+    
+    IOLockLock(lock);
+    for (int i = 0; i < VOODOO_HCI_EVENT_MAX_SUBSCRIBERS; ++i)
+    {
+        if (!subscribers[i].action)
+        {
+            subscribers[i] = { event, action, owner, refCon };
+            result = kIOReturnSuccess;
+            break;
+        }
+    }
+    IOLockUnlock(lock);
+    
+    return result;
+}
+
+void VoodooHCIEventReassembler::unsubscribe(VoodooHCIEventAction action, void * owner)
+{
+    IOLockLock(lock);
+    for (int i = 0; i < VOODOO_HCI_EVENT_MAX_SUBSCRIBERS; ++i)
+    {
+        if (subscribers[i].action == action && subscribers[i].owner == owner)
+        {
+            bzero(&subscribers[i], sizeof(VoodooHCIEventSubscriber));
+        }
+    }
+    IOLockUnlock(lock);
+}
+
+IOReturn VoodooHCIEventReassembler::start()
+{
+    if (running)
+    {
+        return kIOReturnSuccess;
+    }
+    
+    frameStart = 0;
+    tail       = 0;
+    running    = true;
+    
+    IOReturn result = postRead();
+    if (result != kIOReturnSuccess)
+    {
+        running = false;
+    }
+    return result;
+}
+
+void VoodooHCIEventReassembler::stop()
+{
+    if (!running && !posted)
+    {
+        return;
+    }
+    
+    running = false;
+    pipe->abort();
+    
+    // The ring is only reset once the read writing into it has come back aborted
+    while (posted)
+    {
+        IOSleep(1);
+    }
+    
+    if (tail != frameStart)
+    {
+        ++statistics.truncated;
+    }
+    frameStart = tail = 0;
+}
+
+IOReturn VoodooHCIEventReassembler::postRead()
+{
+    // Keep the frame being assembled contiguous: move its head back to the start of the ring when there is no room behind it
+    if (tail + packetSize > ringSize || frameStart + HCI_MAX_EVENT_SIZE > ringSize)
+    {
+        UInt32 pending = tail - frameStart;
+        if (pending)
+        {
+            memmove(ringBytes, ringBytes + frameStart, pending);
+            ++statistics.wraps;
+        }
+        frameStart = 0;
+        tail = pending;
+    }
+    
+    windowIndex ^= 1;
+    IOSubMemoryDescriptor * md = window[windowIndex];
+    if (!md->initSubRange(ring, tail, packetSize, kIODirectionIn))
+    {
+        return kIOReturnNoMemory;
+    }
+    
+    // The reassembler has to outlive the read; its completion writes into the ring
+    retain();
+    posted = true;
+    postTime = mach_absolute_time();
+    IOReturn result = pipe->read(md, 0, 0, packetSize, &completion);
+    if (result != kIOReturnSuccess)
+    {
+        posted = false;
+        release();
+    }
+    return result;
+}
+
+void VoodooHCIEventReassembler::readCompletionAction(void * owner, void * parameter, IOReturn status, UInt32 arg)
+{
+    VoodooHCIEventReassembler * that = (VoodooHCIEventReassembler *) owner;
+    
+    // The reference taken when the read was posted; a re-armed read holds its own
+    that->completeRead(status, arg);
+    that->release();
+}
+
+void VoodooHCIEventReassembler::completeRead(IOReturn status, UInt32 arg)
+{
+    // posted stays set until the subscribers have returned, stop() waits on it
+    if (status == kIOReturnAborted || !running)
+    {
+        posted = false;
+        return;
+    }
+    
+    if (status == kIOReturnSuccess || status == kIOReturnUnderrun)
+    {
+        UInt32 length = (UInt32) USBCompletionBytes(packetSize, arg);
+        pipe->recordTransfer(kIODirectionIn, postTime, length, kIOReturnSuccess);
+        ++statistics.transfers;
+        tail += min(length, packetSize);
+        processFrames();
+    }
+    else
+    {
+        VoodooUSBErrorLog("VoodooHCIEventReassembler::completeRead() - Read failed: 0x%08x!!!\n", status);
+        pipe->recordTransfer(kIODirectionIn, postTime, 0, status);
+        
+        // Whatever was assembled so far can no longer be trusted
+        if (tail != frameStart)
+        {
+            ++statistics.truncated;
+        }
+        frameStart = tail = 0;
+        
+        if (status == kIOReturnNoDevice || status == kIOReturnNotResponding)
+        {
+            running = false;
+            posted = false;
+            return;
+        }
+    }
+    
+    if (!running)
+    {
+        posted = false;
+        return;
+    }
+    
+    if (postRead() != kIOReturnSuccess)
+    {
+        VoodooUSBErrorLog("VoodooHCIEventReassembler::completeRead() - Unable to re-arm interrupt read!!!\n");
+        running = false;
+    }
+}
+
+UInt32 VoodooHCIEventReassembler::processFrames()
+{
+    UInt32 delivered = 0;
+    
+    while (tail - frameStart >= HCI_EVENT_HDR_SIZE)
+    {
+        const HciEventHdr * event = (const HciEventHdr *) (ringBytes + frameStart);
+        
+        // Event code 0x00 is reserved; the stream lost sync, drop everything buffered
+        if (!event->event)
+        {
+            ++statistics.malformed;
+            frameStart = tail;
+            break;
+        }
+        
+        UInt16 length = HCI_EVENT_HDR_SIZE + event->pLength;
+        if (tail - frameStart < length)
+        {
+            break;
+        }
+        
+        deliver(event, length);
+        
+        ++statistics.frames;
+        statistics.bytes += length;
+        frameStart += length;
+        ++delivered;
+    }
+    
+    // Nothing partial left: restart at the head of the ring for free
+    if (frameStart == tail)
+    {
+        frameStart = tail = 0;
+    }
+    return delivered;
+}
+
+void VoodooHCIEventReassembler::deliver(const HciEventHdr * event, UInt16 length)
+{
+    VoodooHCIEventSubscriber snapshot[VOODOO_HCI_EVENT_MAX_SUBSCRIBERS];
+    VoodooHCICapture * capture = pipe->getCapture();
+    
+    if (capture)
+    {
+        capture->record(kVoodooHCICaptureEvent, true, event, length);
+    }
+    
+    IOLockLock(lock);
+    memcpy(snapshot, subscribers, sizeof(snapshot));
+    IOLockUnlock(lock);
+    
+    for (int i = 0; i < VOODOO_HCI_EVENT_MAX_SUBSCRIBERS; ++i)
+    {
+        if (snapshot[i].action && (snapshot[i].event == VOODOO_HCI_EVENT_ANY || snapshot[i].event == event->event))
+        {
+            snapshot[i].action(snapshot[i].owner, snapshot[i].refCon, event, length);
+        }
+    }
+}
+
+void VoodooHCIEventReassembler::getStatistics(VoodooHCIEventStatistics * statistics)
+{
+    if (statistics)
+    {
+        *statistics = this->statistics;
+    }
+}
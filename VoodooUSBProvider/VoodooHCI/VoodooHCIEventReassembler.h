@@ -0,0 +1,94 @@
+//
+//  VoodooHCIEventReassembler.h
+//  VoodooUSBProvider
+//
+//  Copyright © 2021 Charlie Jiang. All rights reserved.
+//
+
+#ifndef VoodooHCIEventReassembler_h
+#define VoodooHCIEventReassembler_h
+
+#include "VoodooUSBPipe.h"
+#include <IOKit/IOSubMemoryDescriptor.h>
+
+#define HCI_MAX_EVENT_SIZE                          (HCI_EVENT_HDR_SIZE + 255)
+
+#define VOODOO_HCI_EVENT_RING_DEFAULT               4096
+#define VOODOO_HCI_EVENT_MAX_SUBSCRIBERS            8
+#define VOODOO_HCI_EVENT_ANY                        0x00
+
+/* event points into the ring and is only valid for the duration of the call */
+typedef void (*VoodooHCIEventAction)(void * owner, void * refCon, const HciEventHdr * event, UInt16 length);
+
+struct VoodooHCIEventSubscriber
+{
+    UInt8                  event;          /* VOODOO_HCI_EVENT_ANY for every event */
+    VoodooHCIEventAction   action;
+    void                 * owner;
+    void                 * refCon;
+};
+
+struct VoodooHCIEventStatistics
+{
+    UInt64    frames;
+    UInt64    bytes;
+    UInt32    transfers;
+    UInt32    malformed;
+    UInt32    truncated;
+    UInt32    wraps;            /* partial frame moved back to the start of the ring */
+};
+
+/*
+ * Reads the interrupt endpoint straight into a contiguous ring and cuts it into complete
+ * HciEventHdr frames, however the controller split them over USB packets.
+ * Frames are never copied except for a partial one sitting at the end of the ring when it wraps.
+ */
+class VoodooHCIEventReassembler : public OSObject
+{
+    typedef OSObject super;
+    
+    OSDeclareDefaultStructors(VoodooHCIEventReassembler)
+    
+public:
+    static VoodooHCIEventReassembler * withPipe(VoodooUSBPipe * interruptPipe, UInt32 ringSize = VOODOO_HCI_EVENT_RING_DEFAULT);
+    
+    virtual bool initWithPipe(VoodooUSBPipe * interruptPipe, UInt32 ringSize);
+    virtual void free() override;
+    
+    IOReturn subscribe(UInt8 event, VoodooHCIEventAction action, void * owner, void * refCon = NULL);
+    void     unsubscribe(VoodooHCIEventAction action, void * owner);
+    
+    IOReturn start();
+    void     stop();
+    
+    void     getStatistics(VoodooHCIEventStatistics * statistics);
+    
+private:
+    IOReturn postRead();
+    UInt32   processFrames();
+    void     deliver(const HciEventHdr * event, UInt16 length);
+    void     completeRead(IOReturn status, UInt32 arg);
+    static void readCompletionAction(void * owner, void * parameter, IOReturn status, UInt32 arg);
+    
+    VoodooUSBPipe            * pipe;
+    IOLock                   * lock;
+    
+    IOBufferMemoryDescriptor * ring;
+    UInt8                    * ringBytes;
+    UInt32                     ringSize;
+    UInt32                     frameStart;     /* first byte of the frame being assembled */
+    UInt32                     tail;           /* next byte the endpoint writes to */
+    
+    IOSubMemoryDescriptor    * window[2];      /* alternated so the completed one is never re-initialised in use */
+    UInt32                     windowIndex;
+    UInt32                     packetSize;     /* one interrupt packet per read, as the USB HCI transport expects */
+    USBCompletion              completion;
+    UInt64                     postTime;
+    volatile bool              running;
+    volatile bool              posted;
+    
+    VoodooHCIEventSubscriber   subscribers[VOODOO_HCI_EVENT_MAX_SUBSCRIBERS];
+    VoodooHCIEventStatistics   statistics;
+};
+
+#endif /* VoodooHCIEventReassembler_h */
@@ -0,0 +1,272 @@
+//
+//  VoodooHCITimerWheel.cpp
+//  VoodooUSBProvider
+//
+//  Copyright © 2021 Charlie Jiang. All rights reserved.
+//
+
+#include "VoodooHCITimerWheel.h"
+
+OSDefineMetaClassAndStructors(VoodooHCITimerWheel, OSObject)
+
+VoodooHCITimerWheel * VoodooHCITimerWheel::withTick(UInt32 tickMS)
+{
+    VoodooHCITimerWheel * wheel = new VoodooHCITimerWheel;
+    
+    if (wheel && !wheel->initWithTick(tickMS))
+    {
+        OSSafeReleaseNULL(wheel);
+    }
+    return wheel;
+}
+
+bool VoodooHCITimerWheel::initWithTick(UInt32 tickMS)
+{
+    if (!super::init() || !tickMS)
+    {
+        return false;
+    }
+    
+    lock = IOLockAlloc();
+    tickCall = thread_call_allocate(tickAction, this);
+    if (!lock || !tickCall)
+    {
+        VoodooUSBErrorLog("VoodooHCITimerWheel::initWithTick() - Unable to allocate the lock or tick call!!!\n");
+        return false;
+    }
+    
+    bzero(slots, sizeof(slots));
+    bzero(&statistics, sizeof(statistics));
+    this->tickMS = tickMS;
+    nanoseconds_to_absolutetime((UInt64) tickMS * 1000000ULL, &tickInterval);
+    baseTime = mach_absolute_time();
+    lastTick = 0;
+    pending  = 0;
+    ticking  = false;
+    return true;
+}
+
+void VoodooHCITimerWheel::free()
+{
+    // The tick call holds a reference on the wheel, so at most the tick that dropped it is still returning
+    if (tickCall)
+    {
+        thread_call_free(tickCall);
+        tickCall = NULL;
+    }
+    if (lock)
+    {
+        IOLockFree(lock);
+        lock = NULL;
+    }
+    super::free();
+}
+
+void VoodooHCITimerWheel::initTimer(VoodooHCITimer * timer, VoodooHCITimerAction action, void * owner, void * refCon)
+{
+    bzero(timer, sizeof(*timer));
+    timer->action = action;
+    timer->owner  = owner;
+    timer->refCon = refCon;
+}
+
+inline UInt64 VoodooHCITimerWheel::currentTick()
+{
+    return (mach_absolute_time() - baseTime) / tickInterval;
+}
+
+// Called with lock held
+void VoodooHCITimerWheel::unlinkLocked(VoodooHCITimer * timer)
+{
+    if (timer->prev)
+    {
+        timer->prev->next = timer->next;
+    }
+    else
+    {
+        slots[timer->expiryTick & (VOODOO_HCI_TIMER_WHEEL_SLOTS - 1)] = timer->next;
+    }
+    if (timer->next)
+    {
+        timer->next->prev = timer->prev;
+    }
+    timer->next  = timer->prev = NULL;
+    timer->armed = false;
+    --pending;
+}
+
+bool VoodooHCITimerWheel::armTimer(VoodooHCITimer * timer, UInt32 timeoutMS)
+{
+    if (!timer || !timer->action)
+    {
+        return false;
+    }
+    
+    IOLockLock(lock);
+    bool wasArmed = timer->armed;
+    if (wasArmed)
+    {
+        unlinkLocked(timer);
+    }
+    
+    // The current tick is already partly over, so one more keeps the timer from firing early
+    timer->expiryTick = currentTick() + (timeoutMS + tickMS - 1) / tickMS + 1;
+    
+    VoodooHCITimer ** slot = &slots[timer->expiryTick & (VOODOO_HCI_TIMER_WHEEL_SLOTS - 1)];
+    timer->prev  = NULL;
+    timer->next  = *slot;
+    if (*slot)
+    {
+        (*slot)->prev = timer;
+    }
+    *slot = timer;
+    timer->armed = true;
+    ++pending;
+    ++statistics.armed;
+    
+    if (!ticking)
+    {
+        // Nothing ticked while the wheel was empty; slots behind the current tick are all empty
+        lastTick = currentTick();
+        ticking  = true;
+        retain();
+        thread_call_enter_delayed(tickCall, baseTime + (lastTick + 1) * tickInterval);
+    }
+    IOLockUnlock(lock);
+    return wasArmed;
+}
+
+bool VoodooHCITimerWheel::cancelTimer(VoodooHCITimer * timer)
+{
+    if (!timer)
+    {
+        return false;
+    }
+    
+    IOLockLock(lock);
+    bool wasArmed = timer->armed;
+    if (wasArmed)
+    {
+        unlinkLocked(timer);
+        ++statistics.cancelled;
+    }
+    IOLockUnlock(lock);
+    
+    // The tick keeps running until it finds the wheel empty, no need to cancel it here
+    return wasArmed;
+}
+
+bool VoodooHCITimerWheel::isArmed(VoodooHCITimer * timer)
+{
+    return timer && timer->armed;
+}
+
+void VoodooHCITimerWheel::tick()
+{
+    VoodooHCITimer * expired = NULL;
+    VoodooHCITimer * expiredTail = NULL;
+    UInt32 count = 0;
+    
+    IOLockLock(lock);
+    UInt64 now = currentTick();
+    if (now > lastTick + 1)
+    {
+        ++statistics.lateTicks;
+    }
+    
+    // Every slot passed since the last tick, but each slot only once however late we are
+    UInt64 passed = now - lastTick;
+    if (passed > VOODOO_HCI_TIMER_WHEEL_SLOTS)
+    {
+        passed = VOODOO_HCI_TIMER_WHEEL_SLOTS;
+    }
+    
+    for (UInt64 t = now - passed + 1; t <= now; ++t)
+    {
+        VoodooHCITimer * timer = slots[t & (VOODOO_HCI_TIMER_WHEEL_SLOTS - 1)];
+        while (timer)
+        {
+            VoodooHCITimer * next = timer->next;
+            
+            // Timers more than a turn away share the slot and wait for a later round
+            if (timer->expiryTick <= now)
+            {
+                unlinkLocked(timer);
+                timer->fireNext = NULL;
+                if (expiredTail)
+                {
+                    expiredTail->fireNext = timer;
+                }
+                else
+                {
+                    expired = timer;
+                }
+                expiredTail = timer;
+                ++count;
+            }
+            timer = next;
+        }
+    }
+    lastTick = now;
+    
+    ++statistics.ticks;
+    statistics.fired += count;
+    if (count)
+    {
+        ++statistics.batches;
+        statistics.maxBatch = max(statistics.maxBatch, count);
+    }
+    
+    IOLockUnlock(lock);
+    
+    // The whole batch fires without the lock, so actions are free to arm and cancel timers
+    while (expired)
+    {
+        VoodooHCITimer * next = expired->fireNext;
+        expired->action(expired->owner, expired->refCon);
+        expired = next;
+    }
+    
+    // Only now is the next tick entered, so ticks never overlap and a batch is never fired twice
+    IOLockLock(lock);
+    bool stop = !pending;
+    if (stop)
+    {
+        ticking = false;
+    }
+    else
+    {
+        thread_call_enter_delayed(tickCall, baseTime + (lastTick + 1) * tickInterval);
+    }
+    IOLockUnlock(lock);
+    
+    if (stop)
+    {
+        release();
+    }
+}
+
+void VoodooHCITimerWheel::tickAction(thread_call_param_t param0, thread_call_param_t param1)
+{
+    ((VoodooHCITimerWheel *) param0)->tick();
+}
+
+UInt32 VoodooHCITimerWheel::getTickMS()
+{
+    return tickMS;
+}
+
+UInt32 VoodooHCITimerWheel::getPending()
+{
+    return pending;
+}
+
+void VoodooHCITimerWheel::getStatistics(VoodooHCITimerStatistics * statistics)
+{
+    if (statistics)
+    {
+        IOLockLock(lock);
+        *statistics = this->statistics;
+        IOLockUnlock(lock);
+    }
+}
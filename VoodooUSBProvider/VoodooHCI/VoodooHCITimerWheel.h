@@ -0,0 +1,95 @@
+//
+//  VoodooHCITimerWheel.h
+//  VoodooUSBProvider
+//
+//  Copyright © 2021 Charlie Jiang. All rights reserved.
+//
+
+#ifndef VoodooHCITimerWheel_h
+#define VoodooHCITimerWheel_h
+
+#include "VoodooUSBCommon.h"
+#include <kern/thread_call.h>
+
+#define VOODOO_HCI_TIMER_WHEEL_SLOTS        256     /* power of 2; 2.56 s at the default tick, longer timers wrap */
+#define VOODOO_HCI_TIMER_TICK_MS            10
+
+/* Called without any wheel lock held; the timer is disarmed and may be armed again from here */
+typedef void (*VoodooHCITimerAction)(void * owner, void * refCon);
+
+/* Embedded in whatever it times out, so arming never allocates */
+struct VoodooHCITimer
+{
+    VoodooHCITimer        * next;
+    VoodooHCITimer        * prev;
+    VoodooHCITimer        * fireNext;       /* batch being fired, apart so actions can re-arm any timer */
+    UInt64                  expiryTick;
+    VoodooHCITimerAction    action;
+    void                  * owner;
+    void                  * refCon;
+    bool                    armed;
+};
+
+struct VoodooHCITimerStatistics
+{
+    UInt64    armed;
+    UInt64    cancelled;
+    UInt64    fired;
+    UInt64    ticks;
+    UInt64    batches;          /* ticks that fired at least one timer */
+    UInt32    maxBatch;
+    UInt32    lateTicks;        /* ticks caught up because the tick source ran late */
+};
+
+/*
+ * Hashed timing wheel for the per-device HCI deadlines (HCI_CMD_TIMEOUT, HCI_DISCONN_TIMEOUT,
+ * HCI_PAIRING_TIMEOUT, HCI_LE_CONN_TIMEOUT...).
+ * A timer hashes to the slot of its expiry tick, so arm and cancel are O(1) however many are
+ * pending. A single thread call ticks the wheel while any timer is armed and fires everything
+ * that expired in that tick as one batch. Timers never fire early and at most two ticks late.
+ * cancelTimer() returns false once the timer has been picked for firing; its action still runs.
+ */
+class VoodooHCITimerWheel : public OSObject
+{
+    typedef OSObject super;
+    
+    OSDeclareDefaultStructors(VoodooHCITimerWheel)
+    
+public:
+    static VoodooHCITimerWheel * withTick(UInt32 tickMS = VOODOO_HCI_TIMER_TICK_MS);
+    
+    virtual bool initWithTick(UInt32 tickMS);
+    virtual void free() override;
+    
+    static void initTimer(VoodooHCITimer * timer, VoodooHCITimerAction action, void * owner, void * refCon = NULL);
+    
+    /* Re-arming a pending timer moves its deadline; returns true if it was pending */
+    bool armTimer(VoodooHCITimer * timer, UInt32 timeoutMS);
+    bool cancelTimer(VoodooHCITimer * timer);
+    bool isArmed(VoodooHCITimer * timer);
+    
+    UInt32 getTickMS();
+    UInt32 getPending();
+    void   getStatistics(VoodooHCITimerStatistics * statistics);
+    
+private:
+    UInt64 currentTick();
+    void   unlinkLocked(VoodooHCITimer * timer);
+    void   tick();
+    static void tickAction(thread_call_param_t param0, thread_call_param_t param1);
+    
+    IOLock                   * lock;
+    thread_call_t              tickCall;
+    bool                       ticking;        /* tickCall is entered and holds a reference */
+    
+    UInt32                     tickMS;
+    UInt64                     tickInterval;   /* absolute time */
+    UInt64                     baseTime;
+    UInt64                     lastTick;       /* every slot up to this tick has been fired */
+    UInt32                     pending;
+    
+    VoodooHCITimer           * slots[VOODOO_HCI_TIMER_WHEEL_SLOTS];
+    VoodooHCITimerStatistics   statistics;
+};
+
+#endif /* VoodooHCITimerWheel_h */
@@ -30,7 +30,7 @@
 #include "VoodooHCI.h"
 #include <IOKit/usb/USB.h>
 
-#if defined(TARGET_ELCAPITAN) || defined(TARGET_CATALINA)
+#if defined(TARGET_ELCAPITAN) || defined(TARGET_CATALINA) || defined(TARGET_SIMULATOR)
 
 #include <IOKit/usb/IOUSBHostInterface.h>
 #include <sys/utfconv.h>
@@ -40,10 +40,22 @@
 #define USBPipe                         IOUSBHostPipe
 
 #define USBCompletion                   IOUSBHostCompletion
+#define USBDeviceRequest                StandardUSB::DeviceRequest
 #define USBConfigurationDescriptor      StandardUSB::ConfigurationDescriptor
 #define USBEndpointDescriptor           StandardUSB::EndpointDescriptor
 #define USBStatus                       UInt16
 
+/* IOUSBHostCompletionAction reports bytes transferred */
+#define USBCompletionBytes(requested, arg)    (arg)
+#define USBCompletionInvoke(completion, status, arg)    ((completion).action((completion).owner, (completion).parameter, status, arg))
+
+#define USBIsocFrame                    IOUSBHostIsochronousFrame
+#define USBIsocCompletion               IOUSBHostIsochronousCompletion
+
+#define USBIsocFrameStatus(frame)       ((frame).status)
+#define USBIsocFrameRequest(frame)      ((frame).requestCount)
+#define USBIsocFrameActual(frame)       ((frame).completeCount)
+
 #else
 
 #include <IOKit/usb/IOUSBInterface.h>
@@ -53,9 +65,21 @@
 #define USBPipe                         IOUSBPipe
 
 #define USBCompletion                   IOUSBCompletion
+#define USBDeviceRequest                IOUSBDevRequest
 #define USBConfigurationDescriptor      IOUSBConfigurationDescriptor
 #define USBEndpointDescriptor           IOUSBEndpointDescriptor
 
+/* IOUSBCompletionAction reports the residue of the buffer */
+#define USBCompletionBytes(requested, arg)    ((requested) - (arg))
+#define USBCompletionInvoke(completion, status, arg)    ((completion).action((completion).target, (completion).parameter, status, arg))
+
+#define USBIsocFrame                    IOUSBIsocFrame
+#define USBIsocCompletion               IOUSBIsocCompletion
+
+#define USBIsocFrameStatus(frame)       ((frame).frStatus)
+#define USBIsocFrameRequest(frame)      ((frame).frReqCount)
+#define USBIsocFrameActual(frame)       ((frame).frActCount)
+
 #endif
 
 #define VoodooUSBSafeDeleteNULL(x) do { if (x) { delete x; x = NULL; } } while (0)
@@ -100,6 +124,11 @@ struct Ath3KVersion
 } __packed;
 
 /* QCA request */
+
+#define QCA_DFU_DOWNLOAD            0x01
+#define QCA_DFU_PACKET_LEN          4096
+#define QCA_DFU_TIMEOUT             3000
+
 struct QCADeviceInfo
 {
     UInt32       romVersion;
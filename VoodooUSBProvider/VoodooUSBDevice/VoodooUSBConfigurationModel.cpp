@@ -0,0 +1,168 @@
+//
+//  VoodooUSBConfigurationModel.cpp
+//  VoodooUSBProvider
+//
+//  Copyright © 2021 Charlie Jiang. All rights reserved.
+//
+
+#include "VoodooUSBConfigurationModel.h"
+
+#define USB_DESCRIPTOR_TYPE_CONFIGURATION   0x02
+#define USB_DESCRIPTOR_TYPE_INTERFACE       0x04
+#define USB_DESCRIPTOR_TYPE_ENDPOINT        0x05
+
+#define USB_CONFIGURATION_DESCRIPTOR_SIZE   9
+#define USB_INTERFACE_DESCRIPTOR_SIZE       9
+#define USB_ENDPOINT_DESCRIPTOR_SIZE        7
+
+IOReturn VoodooUSBConfigurationModel::parse(const USBConfigurationDescriptor * descriptor)
+{
+    const UInt8 * bytes = (const UInt8 *) descriptor;
+    
+    if (!bytes || bytes[0] < USB_CONFIGURATION_DESCRIPTOR_SIZE || bytes[1] != USB_DESCRIPTOR_TYPE_CONFIGURATION)
+    {
+        return kIOReturnBadArgument;
+    }
+    
+    UInt32 totalLength = bytes[2] | ((UInt32) bytes[3] << 8);
+    if (totalLength < bytes[0])
+    {
+        return kIOReturnBadArgument;
+    }
+    
+    // Built aside, so a descriptor that fails halfway leaves the current model as it was
+    VoodooUSBConfigurationModel model;
+    model.reset();
+    model.configurationValue = bytes[5];
+    
+    UInt8 setting = VOODOO_USB_CONFIG_NOT_FOUND;
+    for (UInt32 offset = bytes[0]; offset < totalLength; offset += bytes[offset])
+    {
+        // Every descriptor needs its length and type, and a zero length would never advance
+        if (totalLength - offset < 2 || bytes[offset] < 2 || bytes[offset] > totalLength - offset)
+        {
+            VoodooUSBErrorLog("VoodooUSBConfigurationModel::parse() - Malformed descriptor at offset %u of %u!!!\n", offset, totalLength);
+            return kIOReturnUnderrun;
+        }
+        
+        const UInt8 * current = bytes + offset;
+        if (current[1] == USB_DESCRIPTOR_TYPE_INTERFACE && current[0] >= USB_INTERFACE_DESCRIPTOR_SIZE)
+        {
+            if (model.settingCount == VOODOO_USB_CONFIG_MAX_SETTINGS)
+            {
+                VoodooUSBErrorLog("VoodooUSBConfigurationModel::parse() - More than %u interface settings!!!\n", VOODOO_USB_CONFIG_MAX_SETTINGS);
+                return kIOReturnNoResources;
+            }
+            
+            setting = model.settingCount++;
+            model.interfaceNumber[setting]   = current[2];
+            model.alternateSetting[setting]  = current[3];
+            model.interfaceClass[setting]    = current[5];
+            model.interfaceSubClass[setting] = current[6];
+            model.interfaceProtocol[setting] = current[7];
+            model.firstEndpoint[setting]     = model.endpointCount;
+            model.settingEndpoints[setting]  = 0;
+            
+            if (current[2] < VOODOO_USB_CONFIG_MAX_INTERFACES && model.interfaceIndex[current[2]] == VOODOO_USB_CONFIG_NOT_FOUND)
+            {
+                model.interfaceIndex[current[2]] = setting;
+                ++model.interfaceCount;
+            }
+        }
+        else if (current[1] == USB_DESCRIPTOR_TYPE_ENDPOINT && current[0] >= USB_ENDPOINT_DESCRIPTOR_SIZE && setting != VOODOO_USB_CONFIG_NOT_FOUND)
+        {
+            if (model.endpointCount == VOODOO_USB_CONFIG_MAX_ENDPOINTS)
+            {
+                VoodooUSBErrorLog("VoodooUSBConfigurationModel::parse() - More than %u endpoints!!!\n", VOODOO_USB_CONFIG_MAX_ENDPOINTS);
+                return kIOReturnNoResources;
+            }
+            
+            UInt8 endpoint = model.endpointCount++;
+            model.endpointAddress[endpoint]       = current[2];
+            model.endpointAttributes[endpoint]    = current[3];
+            model.endpointMaxPacketSize[endpoint] = current[4] | ((UInt16) current[5] << 8);
+            model.endpointInterval[endpoint]      = current[6];
+            ++model.settingEndpoints[setting];
+        }
+        // Class specific and other descriptors are skipped
+    }
+    
+    // Readers check valid first, so it goes down before and comes up after everything else
+    valid = false;
+    OSMemoryBarrier();
+    memcpy((void *) this, &model, sizeof(model));
+    OSMemoryBarrier();
+    valid = true;
+    return kIOReturnSuccess;
+}
+
+void VoodooUSBConfigurationModel::reset()
+{
+    bzero((void *) this, sizeof(*this));
+    memset(interfaceIndex, VOODOO_USB_CONFIG_NOT_FOUND, sizeof(interfaceIndex));
+}
+
+UInt8 VoodooUSBConfigurationModel::findSetting(UInt8 interfaceNumber, UInt8 alternateSetting) const
+{
+    if (!valid)
+    {
+        return VOODOO_USB_CONFIG_NOT_FOUND;
+    }
+    
+    UInt8 setting = 0;
+    if (interfaceNumber < VOODOO_USB_CONFIG_MAX_INTERFACES)
+    {
+        setting = interfaceIndex[interfaceNumber];
+        if (setting == VOODOO_USB_CONFIG_NOT_FOUND)
+        {
+            return VOODOO_USB_CONFIG_NOT_FOUND;
+        }
+    }
+    
+    // Alternate settings of an interface follow its first one
+    for (; setting < settingCount; ++setting)
+    {
+        if (this->interfaceNumber[setting] == interfaceNumber && this->alternateSetting[setting] == alternateSetting)
+        {
+            return setting;
+        }
+    }
+    return VOODOO_USB_CONFIG_NOT_FOUND;
+}
+
+UInt8 VoodooUSBConfigurationModel::findSetting(UInt16 interfaceClass, UInt16 interfaceSubClass, UInt16 interfaceProtocol, UInt8 startSetting) const
+{
+    if (!valid)
+    {
+        return VOODOO_USB_CONFIG_NOT_FOUND;
+    }
+    
+    for (UInt8 setting = startSetting; setting < settingCount; ++setting)
+    {
+        if ((interfaceClass == VOODOO_USB_CONFIG_MATCH_ANY || this->interfaceClass[setting] == interfaceClass) &&
+            (interfaceSubClass == VOODOO_USB_CONFIG_MATCH_ANY || this->interfaceSubClass[setting] == interfaceSubClass) &&
+            (interfaceProtocol == VOODOO_USB_CONFIG_MATCH_ANY || this->interfaceProtocol[setting] == interfaceProtocol))
+        {
+            return setting;
+        }
+    }
+    return VOODOO_USB_CONFIG_NOT_FOUND;
+}
+
+UInt8 VoodooUSBConfigurationModel::findEndpoint(UInt8 setting, UInt8 type, UInt8 direction) const
+{
+    if (!valid || setting >= settingCount)
+    {
+        return VOODOO_USB_CONFIG_NOT_FOUND;
+    }
+    
+    UInt8 end = firstEndpoint[setting] + settingEndpoints[setting];
+    for (UInt8 endpoint = firstEndpoint[setting]; endpoint < end; ++endpoint)
+    {
+        if ((endpointAttributes[endpoint] & 0x03) == type && (endpointAddress[endpoint] >> 7) == direction)
+        {
+            return endpoint;
+        }
+    }
+    return VOODOO_USB_CONFIG_NOT_FOUND;
+}
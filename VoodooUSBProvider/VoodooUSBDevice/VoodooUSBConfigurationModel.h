@@ -0,0 +1,67 @@
+//
+//  VoodooUSBConfigurationModel.h
+//  VoodooUSBProvider
+//
+//  Copyright © 2021 Charlie Jiang. All rights reserved.
+//
+
+#ifndef VoodooUSBConfigurationModel_h
+#define VoodooUSBConfigurationModel_h
+
+#include "VoodooUSBCommon.h"
+
+#define VOODOO_USB_CONFIG_MAX_INTERFACES    16      /* bInterfaceNumber below this is indexed directly */
+#define VOODOO_USB_CONFIG_MAX_SETTINGS      32      /* interface and alternate setting pairs */
+#define VOODOO_USB_CONFIG_MAX_ENDPOINTS     64
+
+#define VOODOO_USB_CONFIG_MATCH_ANY         0xFFFF  /* wildcard for findSetting() class, subclass and protocol */
+#define VOODOO_USB_CONFIG_NOT_FOUND         0xFF
+
+/*
+ * Interfaces, alternate settings and endpoints of one configuration descriptor, parsed in a single
+ * pass into parallel arrays. A query scans at most VOODOO_USB_CONFIG_MAX_SETTINGS bytes of the one
+ * field it matches on, or reads one entry of the per-interface index, and never touches the device
+ * or the registry.
+ * Settings are kept in descriptor order, so every alternate setting of an interface follows its
+ * setting 0 and the endpoints of a setting are contiguous.
+ * Embedded by value in the device; all-zero is the empty model.
+ */
+struct VoodooUSBConfigurationModel
+{
+    UInt8     configurationValue;
+    UInt8     settingCount;
+    UInt8     endpointCount;
+    UInt8     interfaceCount;
+    volatile bool valid;
+    
+    /* Per interface number: its first setting, VOODOO_USB_CONFIG_NOT_FOUND for numbers never seen */
+    UInt8     interfaceIndex[VOODOO_USB_CONFIG_MAX_INTERFACES];
+    
+    /* Per setting */
+    UInt8     interfaceNumber[VOODOO_USB_CONFIG_MAX_SETTINGS];
+    UInt8     alternateSetting[VOODOO_USB_CONFIG_MAX_SETTINGS];
+    UInt8     interfaceClass[VOODOO_USB_CONFIG_MAX_SETTINGS];
+    UInt8     interfaceSubClass[VOODOO_USB_CONFIG_MAX_SETTINGS];
+    UInt8     interfaceProtocol[VOODOO_USB_CONFIG_MAX_SETTINGS];
+    UInt8     firstEndpoint[VOODOO_USB_CONFIG_MAX_SETTINGS];
+    UInt8     settingEndpoints[VOODOO_USB_CONFIG_MAX_SETTINGS];
+    
+    /* Per endpoint */
+    UInt8     endpointAddress[VOODOO_USB_CONFIG_MAX_ENDPOINTS];
+    UInt8     endpointAttributes[VOODOO_USB_CONFIG_MAX_ENDPOINTS];
+    UInt8     endpointInterval[VOODOO_USB_CONFIG_MAX_ENDPOINTS];
+    UInt16    endpointMaxPacketSize[VOODOO_USB_CONFIG_MAX_ENDPOINTS];
+    
+    /* Fails without touching the current model if the descriptor is malformed or does not fit */
+    IOReturn parse(const USBConfigurationDescriptor * descriptor);
+    void     reset();
+    
+    /* Setting indexes, VOODOO_USB_CONFIG_NOT_FOUND when nothing matches */
+    UInt8 findSetting(UInt8 interfaceNumber, UInt8 alternateSetting = 0) const;
+    UInt8 findSetting(UInt16 interfaceClass, UInt16 interfaceSubClass, UInt16 interfaceProtocol, UInt8 startSetting = 0) const;
+    
+    /* Endpoint index within the whole model for the given setting, type (kUSBBulk...) and direction (kUSBIn / kUSBOut) */
+    UInt8 findEndpoint(UInt8 setting, UInt8 type, UInt8 direction) const;
+};
+
+#endif /* VoodooUSBConfigurationModel_h */
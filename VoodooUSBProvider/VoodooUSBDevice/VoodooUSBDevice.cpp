@@ -10,17 +10,17 @@
 
 OSDefineMetaClassAndAbstractStructors(VoodooUSBDevice, USBDevice)
 
-inline UInt16 VoodooUSBDevice::getVendorID()
+UInt16 VoodooUSBDevice::getVendorID()
 {
     return super::GetVendorID();
 }
 
-inline UInt16 VoodooUSBDevice::getProductID()
+UInt16 VoodooUSBDevice::getProductID()
 {
     return super::GetProductID();
 }
 
-inline IOReturn VoodooUSBDevice::getStringDescriptor(UInt8 index, char * buf, int maxLen, UInt16 lang)
+inline IOReturn VoodooUSBDevice::fetchStringDescriptor(UInt8 index, char * buf, int maxLen, UInt16 lang)
 {
     return super::GetStringDescriptor(index, buf, maxLen, lang);
 }
@@ -38,84 +38,100 @@ inline IOReturn VoodooUSBDevice::getDeviceStatus(IOService * forClient, USBStatu
 inline IOReturn VoodooUSBDevice::resetDevice()
 {
     sendHCIRequestOut((IOService *) this, HCI_OP_RESET, 0, NULL);
+    invalidateStringCache();
+    configurationModel.valid = false;
     return super::ResetDevice();
 }
 
-inline UInt8 VoodooUSBDevice::getNumConfigurations()
+UInt8 VoodooUSBDevice::getNumConfigurations()
 {
     return super::GetNumConfigurations();
 }
 
-inline const USBConfigurationDescriptor* VoodooUSBDevice::getFullConfigurationDescriptor(UInt8 configIndex)
+const USBConfigurationDescriptor* VoodooUSBDevice::getFullConfigurationDescriptor(UInt8 configIndex)
 {
     return super::GetFullConfigurationDescriptor(configIndex);
 }
 
-inline IOReturn VoodooUSBDevice::getConfiguration(IOService * forClient, UInt8 * configNumber)
+IOReturn VoodooUSBDevice::getConfiguration(IOService * forClient, UInt8 * configNumber)
 {
     return super::GetConfiguration(configNumber);
 }
 
-inline IOReturn VoodooUSBDevice::setConfiguration(IOService * forClient, UInt8 configValue, bool startInterfaceMatching)
+IOReturn VoodooUSBDevice::setConfiguration(IOService * forClient, UInt8 configValue, bool startInterfaceMatching)
 {
+    configurationModel.valid = false;
     return super::SetConfiguration(forClient, configValue, startInterfaceMatching);
 }
 
-inline UInt8 VoodooUSBDevice::getManufacturerStringIndex()
+UInt8 VoodooUSBDevice::getManufacturerStringIndex()
 {
     return super::GetManufacturerStringIndex();
 }
 
-inline UInt8 VoodooUSBDevice::getProductStringIndex()
+UInt8 VoodooUSBDevice::getProductStringIndex()
 {
     return super::GetProductStringIndex();
 }
 
-inline UInt8 VoodooUSBDevice::getSerialNumberStringIndex()
+UInt8 VoodooUSBDevice::getSerialNumberStringIndex()
 {
     return super::GetSerialNumberStringIndex();
 }
 
-bool VoodooUSBDevice::findFirstInterface(VoodooUSBInterface * interface)
+bool VoodooUSBDevice::findInterface(VoodooUSBInterface *& interface, UInt16 interfaceClass, UInt16 interfaceSubClass, UInt16 interfaceProtocol)
 {
-    VoodooUSBFuncLog("findFirstInterface");
+    VoodooUSBFuncLog("findInterface");
+    
+    const VoodooUSBConfigurationModel * model = getConfigurationModel();
+    UInt8 setting = model ? model->findSetting(interfaceClass, interfaceSubClass, interfaceProtocol) : VOODOO_USB_CONFIG_NOT_FOUND;
+    
+    if (setting == VOODOO_USB_CONFIG_NOT_FOUND)
+    {
+        setInterface(interface, NULL);
+        return false;
+    }
+    
+    // The model says the interface exists, so one exact request finds it
     IOUSBFindInterfaceRequest request =
     {
-        .bAlternateSetting  = kIOUSBFindInterfaceDontCare,
-        .bInterfaceClass    = kIOUSBFindInterfaceDontCare,
-        .bInterfaceSubClass = kIOUSBFindInterfaceDontCare,
-        .bInterfaceProtocol = kIOUSBFindInterfaceDontCare
+        .bInterfaceClass    = model->interfaceClass[setting],
+        .bInterfaceSubClass = model->interfaceSubClass[setting],
+        .bInterfaceProtocol = model->interfaceProtocol[setting],
+        .bAlternateSetting  = kIOUSBFindInterfaceDontCare
     };
     setInterface(interface, super::FindNextInterface(NULL, &request));
     
-    VoodooUSBInfoLog("findFirstInterface() - FindNextInterface() returns %p.\n", interface);
-    
-    IOService * result = interface;
-    VoodooUSBInfoLog("findFirstInterface() - getInterface returns %p.\n", result);
-    return result;
+    VoodooUSBInfoLog("findInterface() - FindNextInterface() returns %p.\n", interface);
+    return interface != NULL;
 }
 
-IOReturn VoodooUSBDevice::sendRequest(IOService * forClient, UInt8 bRequest, void * dataBuffer, UInt16 size, UInt8 direction, UInt8 type, UInt8 recipient)
+IOReturn VoodooUSBDevice::sendRequest(IOService * forClient, UInt8 bRequest, void * dataBuffer, UInt16 size, UInt8 direction, UInt8 type, UInt8 recipient, UInt16 value, UInt16 index)
 {
     IOUSBDevRequest request =
     {
         .bmRequestType  = static_cast<UInt8> (USBmakebmRequestType(direction, type, recipient)),
         .bRequest       = bRequest,
-        .wValue         = 0,
-        .wIndex         = 0,
+        .wValue         = value,
+        .wIndex         = index,
         .wLength        = size,
         .pData          = dataBuffer
     };
     
-    return super::DeviceRequest(&request);
+    closeCommandGate();
+    UInt64 startTime = mach_absolute_time();
+    IOReturn result = super::DeviceRequest(&request);
+    controlLatency.record(startTime, request.wLenDone, result);
+    openCommandGate();
+    return result;
 }
 
-inline IOReturn VoodooUSBDevice::sendVendorRequestIn(IOService * forClient, UInt8 bRequest, void * dataBuffer, UInt16 size)
+IOReturn VoodooUSBDevice::sendVendorRequestIn(IOService * forClient, UInt8 bRequest, void * dataBuffer, UInt16 size)
 {
     return sendRequest(forClient, bRequest, dataBuffer, size, kIOUSBDeviceRequestDirectionIn, kIOUSBDeviceRequestTypeVendor, kIOUSBDeviceRequestRecipientDevice);
 }
 
-inline IOReturn VoodooUSBDevice::sendVendorRequestOut(IOService * forClient, UInt8 bRequest, void * dataBuffer, UInt16 size)
+IOReturn VoodooUSBDevice::sendVendorRequestOut(IOService * forClient, UInt8 bRequest, void * dataBuffer, UInt16 size)
 {
     return sendRequest(forClient, bRequest, dataBuffer, size, kIOUSBDeviceRequestDirectionOut, kIOUSBDeviceRequestTypeVendor, kIOUSBDeviceRequestRecipientDevice);
 }
@@ -132,11 +148,46 @@ inline IOReturn VoodooUSBDevice::sendStandardRequestOut(IOService * forClient, U
 
 IOReturn VoodooUSBDevice::sendHCIRequest(IOService * forClient, UInt16 opCode, UInt8 paramLen, const void * param, UInt8 direction)
 {
-    HciCommandHdr * command = NULL;
-    bzero(command, sizeof(HciCommandHdr));
+    IOReturn result;
+    
+    // Draw a wired buffer from the pool; only fall back to the stack if the pool is missing or exhausted
+    VoodooHCICommandBuffer * buffer = commandPool ? commandPool->getCommandBuffer() : NULL;
+    HciCommandHdr stackCommand;
+    HciCommandHdr * command = buffer ? buffer->command : &stackCommand;
+    
     command->opCode = opCode;
     command->pLength = paramLen;
-    memcpy((void *) command->pData, param, paramLen);
+    if (paramLen && param)
+    {
+        memcpy((void *) command->pData, param, paramLen);
+    }
+    
+    if (direction == kUSBOut)
+    {
+        captureCommand(command, HCI_COMMAND_HDR_SIZE + paramLen);
+    }
+    
+    closeCommandGate();
+    UInt64 startTime = mach_absolute_time();
+    
+    if (buffer)
+    {
+        IOUSBDevRequestDesc requestDesc =
+        {
+            .bmRequestType = static_cast<UInt8> (USBmakebmRequestType(direction, kUSBClass, kUSBDevice)),
+            .bRequest = 0,
+            .wValue = 0,
+            .wIndex = 0,
+            .wLength = (UInt16)(HCI_COMMAND_HDR_SIZE + paramLen),
+            .pData = buffer->descriptor
+        };
+        
+        result = super::DeviceRequest(&requestDesc);
+        commandPool->returnCommandBuffer(buffer);
+        hciLatency.record(startTime, requestDesc.wLenDone, result);
+        openCommandGate();
+        return result;
+    }
     
     IOUSBDevRequest request =
     {
@@ -148,7 +199,10 @@ IOReturn VoodooUSBDevice::sendHCIRequest(IOService * forClient, UInt16 opCode, U
         .pData = command
     };
     
-    return super::DeviceRequest(&request);
+    result = super::DeviceRequest(&request);
+    hciLatency.record(startTime, request.wLenDone, result);
+    openCommandGate();
+    return result;
 }
 
 inline IOReturn VoodooUSBDevice::sendHCIRequestIn(IOService * forClient, UInt16 opCode, UInt8 paramLen, const void * param)
@@ -156,7 +210,7 @@ inline IOReturn VoodooUSBDevice::sendHCIRequestIn(IOService * forClient, UInt16
     return sendHCIRequest(forClient, opCode, paramLen, param, kUSBIn);
 }
 
-inline IOReturn VoodooUSBDevice::sendHCIRequestOut(IOService * forClient, UInt16 opCode, UInt8 paramLen, const void * param)
+IOReturn VoodooUSBDevice::sendHCIRequestOut(IOService * forClient, UInt16 opCode, UInt8 paramLen, const void * param)
 {
     return sendHCIRequest(forClient, opCode, paramLen, param, kUSBOut);
 }
@@ -172,7 +226,18 @@ IOReturn VoodooUSBDevice::sendHCICommand(IOService * forClient, void * command,
         .wLength = length,
         .pData = command
     };
-    return super::DeviceRequest(&request);
+    
+    if (direction == kUSBOut)
+    {
+        captureCommand(command, length);
+    }
+    
+    closeCommandGate();
+    UInt64 startTime = mach_absolute_time();
+    IOReturn result = super::DeviceRequest(&request);
+    hciLatency.record(startTime, request.wLenDone, result);
+    openCommandGate();
+    return result;
 }
 
 inline IOReturn VoodooUSBDevice::sendHCICommandIn(IOService * forClient, void * command, UInt16 length)
@@ -184,3 +249,35 @@ inline IOReturn VoodooUSBDevice::sendHCICommandOut(IOService * forClient, void *
 {
     return sendHCICommand(forClient, command, length, kUSBOut);
 }
+
+
+IOReturn VoodooUSBDevice::sendHCICommandAsync(IOService * forClient, void * command, UInt16 length, USBDeviceRequest * request, USBCompletion * completion)
+{
+    // request is owned by the caller and must stay valid until completion fires
+    request->bmRequestType = static_cast<UInt8> (USBmakebmRequestType(kUSBOut, kUSBClass, kUSBDevice));
+    request->bRequest      = 0;
+    request->wValue        = 0;
+    request->wIndex        = 0;
+    request->wLength       = length;
+    request->pData         = command;
+    
+    captureCommand(command, length);
+    return super::DeviceRequest(request, completion);
+}
+
+IOReturn VoodooUSBDevice::submitBatchStep(VoodooUSBControlBatch * batch, UInt32 step)
+{
+    const VoodooUSBControlStep * current = &batch->steps[step];
+    USBDeviceRequest * request = &batch->requests[step];
+    
+    request->bmRequestType = current->bmRequestType;
+    request->bRequest      = current->bRequest;
+    request->wValue        = current->wValue;
+    request->wIndex        = current->wIndex;
+    request->wLength       = current->wLength;
+    request->pData         = current->data;
+    request->wLenDone      = 0;
+    batch->usbCompletions[step] = { batch, batchStepAction, (void *) (uintptr_t) step };
+    
+    return super::DeviceRequest(request, &batch->usbCompletions[step]);
+}
@@ -10,6 +10,135 @@
 #define VoodooUSBDevice_h
 
 #include "VoodooUSBInterface.h"
+#include "VoodooHCICommandPool.h"
+#include "VoodooHCITimerWheel.h"
+#include "VoodooHCICapture.h"
+#include "VoodooChipRegistry.h"
+#include "VoodooUSBConfigurationModel.h"
+#include <IOKit/IOCommandGate.h>
+#include <kern/thread_call.h>
+
+#define VOODOO_USB_STRING_CACHE_ENTRIES     8
+#define VOODOO_USB_STRING_MAX               384     /* 126 UTF-16 code units, up to 3 UTF-8 bytes each */
+#define VOODOO_USB_WORK_QUEUE_DEPTH         16
+#define VOODOO_USB_CONTROL_BATCH_MAX        32
+#define VOODOO_USB_SNAPSHOT_INTERFACES      4
+#define VOODOO_USB_INTERFACE_PUBLISH_MS     1000    /* how long restoreState() waits for a reconfigured interface */
+
+/* bmRequestType for VoodooUSBControlStep; direction 1 is IN, type 2 vendor, recipient 0 device on either backend */
+#define VoodooUSBRequestType(direction, type, recipient)    ((UInt8) ((((direction) & 0x1) << 7) | (((type) & 0x3) << 5) | ((recipient) & 0x1f)))
+
+class VoodooUSBDevice;
+class VoodooFirmwareCache;
+class VoodooHCICommandEngine;
+
+/* Runs with the device's command gate closed */
+typedef IOReturn (*VoodooUSBDeviceAction)(VoodooUSBDevice * device, void * refCon);
+
+struct VoodooUSBWorkItem
+{
+    VoodooUSBDeviceAction   action;
+    void                  * refCon;
+};
+
+struct VoodooUSBStringCacheEntry
+{
+    UInt16  langID;
+    UInt8   index;          /* 0 marks a free entry, string index 0 is never a string */
+    char    string[VOODOO_USB_STRING_MAX];
+};
+
+enum
+{
+    kVoodooUSBControlStepBarrier        = 0x01,     /* goes out only once every earlier step completed */
+    kVoodooUSBControlStepIgnoreError    = 0x02,     /* a failure does not stop the steps after it */
+};
+
+/* One control transfer of a batch; a sequence is usually a static const table of these */
+struct VoodooUSBControlStep
+{
+    UInt8     bmRequestType;
+    UInt8     bRequest;
+    UInt16    wValue;
+    UInt16    wIndex;
+    UInt16    wLength;
+    void    * data;
+    UInt8     flags;
+};
+
+struct VoodooUSBControlResult
+{
+    IOReturn  status;               /* kIOReturnAborted for steps never sent because an earlier one failed */
+    UInt32    bytesTransferred;
+};
+
+/* status is that of the step that stopped the batch, success if none did */
+typedef void (*VoodooUSBControlBatchAction)(void * owner, void * refCon, IOReturn status, const VoodooUSBControlResult * results, UInt32 count);
+
+struct VoodooUSBControlBatchCompletion
+{
+    void                        * owner;
+    VoodooUSBControlBatchAction   action;
+    void                        * refCon;
+};
+
+struct VoodooUSBControlBatch
+{
+    VoodooUSBDevice                 * device;
+    IOService                       * client;
+    const VoodooUSBControlStep      * steps;
+    VoodooUSBControlResult          * results;
+    UInt32                            count;
+    VoodooUSBControlBatchCompletion   completion;
+    
+    IOLock                          * lock;
+    UInt32                            submitted;
+    UInt32                            finished;
+    IOReturn                          status;
+    bool                              submitting;     /* one thread at a time hands steps out, so they stay in order */
+    
+    USBDeviceRequest                  requests[VOODOO_USB_CONTROL_BATCH_MAX];
+    USBCompletion                     usbCompletions[VOODOO_USB_CONTROL_BATCH_MAX];
+};
+
+struct VoodooUSBInterfaceBinding
+{
+    UInt8     interfaceNumber;
+    UInt8     alternateSetting;
+    UInt8     endpoints[VOODOO_USB_ENDPOINT_TYPES][VOODOO_USB_ENDPOINT_DIRECTIONS];    /* address each pipe was bound to, 0 for none */
+};
+
+enum
+{
+    kVoodooUSBSnapshotVendorVersion     = 0x01,
+    kVoodooUSBSnapshotLocalVersion      = 0x02,
+    kVoodooUSBSnapshotBufferSize        = 0x04,
+};
+
+/* What a client found out about the device once, kept across sleep and soft resets; owned by the client */
+struct VoodooUSBDeviceSnapshot
+{
+    UInt8                       configuration;
+    UInt8                       interfaceCount;
+    VoodooUSBInterfaceBinding   interfaces[VOODOO_USB_SNAPSHOT_INTERFACES];
+    
+    UInt8                       contents;               /* kVoodooUSBSnapshot* of the fields below that are filled in */
+    union
+    {
+        QCAVersion              qca;
+        Ath3KVersion            ath3k;
+    } vendorVersion;
+    UInt8                       localVersion[8];        /* HCI_OP_READ_LOCAL_VERSION return parameters after the status */
+    UInt8                       bufferSize[7];          /* HCI_OP_READ_BUFFER_SIZE return parameters after the status */
+};
+
+struct VoodooUSBResumeResult
+{
+    UInt64    wakeToReadyNS;
+    UInt32    reissued;             /* requests sent because the device no longer matched the snapshot */
+    UInt32    skipped;              /* requests not sent because it still did */
+    bool      reconfigured;         /* the configuration was set again, so interfaces and pipes are new objects */
+};
 
 class VoodooUSBDevice : public USBDevice
 {
@@ -20,10 +149,13 @@ class VoodooUSBDevice : public USBDevice
 public:
     virtual bool open(IOService * forClient, IOOptionBits options = 0, void * arg = 0 ) override;
     virtual void close(IOService * forClient, IOOptionBits options = 0) override;
+    virtual void free() override;
     
     UInt16 getVendorID();
     UInt16 getProductID();
     IOReturn getStringDescriptor(UInt8 index, char * buf, int maxLen, UInt16 lang = 0x409);
+    IOReturn prefetchStringDescriptors(UInt16 lang = 0x409);
+    void invalidateStringCache();
     UInt16 getDeviceRelease();
     IOReturn getDeviceStatus(IOService * forClient, USBStatus * status);
     IOReturn resetDevice();
@@ -35,8 +167,13 @@ public:
     UInt8 getProductStringIndex();
     UInt8 getSerialNumberStringIndex();
     
-    bool findFirstInterface(VoodooUSBInterface * interface);
-    IOReturn sendRequest(IOService * forClient, UInt8 bRequest, void * dataBuffer, UInt16 size, UInt8 direction, UInt8 type, UInt8 recipient);
+    /* Interfaces, alternate settings and endpoints of the active configuration, parsed again after it changes */
+    const VoodooUSBConfigurationModel * getConfigurationModel();
+    
+    /* Looked up in the configuration model first, so only an interface that exists is searched for */
+    bool findFirstInterface(VoodooUSBInterface *& interface);
+    bool findInterface(VoodooUSBInterface *& interface, UInt16 interfaceClass, UInt16 interfaceSubClass = VOODOO_USB_CONFIG_MATCH_ANY, UInt16 interfaceProtocol = VOODOO_USB_CONFIG_MATCH_ANY);
+    IOReturn sendRequest(IOService * forClient, UInt8 bRequest, void * dataBuffer, UInt16 size, UInt8 direction, UInt8 type, UInt8 recipient, UInt16 value = 0, UInt16 index = 0);
     IOReturn sendVendorRequestIn(IOService * forClient, UInt8 bRequest, void * dataBuffer, UInt16 size);
     IOReturn sendVendorRequestOut(IOService * forClient, UInt8 bRequest, void * dataBuffer, UInt16 size);
     IOReturn sendStandardRequestIn(IOService * forClient, UInt8 bRequest, void * dataBuffer, UInt16 size);
@@ -47,6 +184,42 @@ public:
     IOReturn sendHCICommand(IOService * forClient, void * command, UInt16 length, UInt8 direction);
     IOReturn sendHCICommandIn(IOService * forClient, void * command, UInt16 length);
     IOReturn sendHCICommandOut(IOService * forClient, void * command, UInt16 length);
+    IOReturn sendHCICommandAsync(IOService * forClient, void * command, UInt16 length, USBDeviceRequest * request, USBCompletion * completion);
+    
+    template <UInt8 ParamLength>
+    IOReturn sendHCICommandOut(IOService * forClient, const HciCommandFrame<ParamLength> & frame)
+    {
+        // OUT transfers only read the buffer, so the frame is sent from read-only storage as is
+        return sendHCICommandOut(forClient, (void *) frame.bytes, frame.size());
+    }
+    
+    /*
+     * Sends the steps in order, back to back, without waiting for one to complete before the next
+     * goes out, and calls completion once when all of them are done. A failing step stops the ones
+     * not yet sent unless it is marked kVoodooUSBControlStepIgnoreError. steps, their data and
+     * results must stay valid until completion is called.
+     */
+    IOReturn sendRequestBatch(IOService * forClient, const VoodooUSBControlStep * steps, UInt32 count, VoodooUSBControlResult * results, VoodooUSBControlBatchCompletion * completion);
+    IOReturn sendRequestBatchSync(IOService * forClient, const VoodooUSBControlStep * steps, UInt32 count, VoodooUSBControlResult * results = NULL);
+    
+    /*
+     * saveState() records the configuration, the alternate setting and pipe bindings of every interface,
+     * the vendor version and, given an engine, the controller's version and buffer sizes.
+     * restoreState() after a wake or a soft reset checks the device against the snapshot and sends only
+     * the requests for what no longer matches; the vendor version is not read again unless the device
+     * lost its configuration, in which case the interfaces published again are opened for forClient.
+     * wakeTime is when the wake started, 0 for now.
+     * restoreCapabilities() follows it: the saved capabilities are used as they are, unless result says
+     * the device was reconfigured. Then they are read again through engine, which has to be built on the
+     * new interfaces, and compared.
+     * A failure means the device changed under the snapshot and has to be set up from scratch.
+     */
+    IOReturn saveState(IOService * forClient, VoodooUSBDeviceSnapshot * snapshot, VoodooHCICommandEngine * engine = NULL);
+    IOReturn restoreState(IOService * forClient, const VoodooUSBDeviceSnapshot * snapshot, UInt64 wakeTime = 0, VoodooUSBResumeResult * result = NULL);
+    IOReturn restoreCapabilities(const VoodooUSBDeviceSnapshot * snapshot, VoodooHCICommandEngine * engine, VoodooUSBResumeResult * result);
+    
+    /* HCI reset that keeps the configuration, interfaces and pipes, unlike resetDevice() */
+    IOReturn resetDevice(IOService * forClient, const VoodooUSBDeviceSnapshot * snapshot, VoodooUSBResumeResult * result = NULL);
     
     IOReturn getVendorState(IOService * forClient, VendorState * state);
     IOReturn getAth3kVendorVersion(IOService * forClient, Ath3KVersion * version);
@@ -54,10 +227,91 @@ public:
     IOReturn setAth3kNormalMode(IOService * forClient);
     IOReturn getQcaUsbVendorVersion(IOService * forClient, QCAVersion * version);
     bool     getQcaUsbDeviceInfo(QCAVersion * version, QCADeviceInfo * info);
-    bool     getQcaUsbRamPatchVersion(OSData * firmwareData, QCADeviceInfo * devInfo, QCARamPatchVersion * version);
+    /* Static so an image can be parsed before any device is at hand */
+    static bool getQcaUsbRamPatchVersion(OSData * firmwareData, const QCADeviceInfo * devInfo, QCARamPatchVersion * version);
+    
+    /* Registry entry for this VID / PID, NULL for chips the provider does not know */
+    const VoodooChipEntry * getChipEntry();
+    
+    VoodooHCICommandPool * getCommandPool();
+    
+    /* One wheel per device for every HCI command, connection and pairing deadline */
+    VoodooHCITimerWheel * getTimerWheel();
+    
+    /* Commands sent through this device are recorded into capture; set it before traffic starts */
+    void setCapture(VoodooHCICapture * capture);
+    VoodooHCICapture * getCapture();
+    
+    /* The provider wide firmware cache, held by this device from the first call until it is freed */
+    VoodooFirmwareCache * getFirmwareCache();
+    
+    /*
+     * Every device serializes its own synchronous requests behind its command gate, so clients need
+     * no locks of their own and two adapters never wait on each other.
+     */
+    IOWorkLoop    * getDeviceWorkLoop();
+    IOCommandGate * getCommandGate();
+    IOReturn runGated(VoodooUSBDeviceAction action, void * refCon);
+    
+    /* Queued work runs in order, one item at a time, on a thread call owned by this device */
+    IOReturn enqueueWork(VoodooUSBDeviceAction action, void * refCon);
+    void drainWork();
+    
+    /* Runs action once per device, each on the device's own work queue, and waits for all of them */
+    static IOReturn initializeInParallel(VoodooUSBDevice * const * devices, UInt32 count, VoodooUSBDeviceAction action, void * refCon, IOReturn * results = NULL);
+    
+    void recordHCIResponse(UInt64 startTime, UInt64 bytes, IOReturn status);
+    OSDictionary * copyStatistics();
+    void publishStatistics();
+    
+private:
+    IOReturn fetchStringDescriptor(UInt8 index, char * buf, int maxLen, UInt16 lang);
+    IOReturn readVendorVersion(IOService * forClient, VoodooUSBDeviceSnapshot * snapshot);
+    VoodooUSBInterface * copyInterface(UInt8 interfaceNumber);
+    bool waitForInterface(UInt8 interfaceNumber, UInt32 timeoutMS);
+    void captureCommand(const void * command, UInt16 length);
+    
+    IOReturn submitBatchStep(VoodooUSBControlBatch * batch, UInt32 step);
+    void     advanceBatch(VoodooUSBControlBatch * batch);
+    bool     finishBatchStepLocked(VoodooUSBControlBatch * batch, UInt32 step, IOReturn status, UInt32 bytesTransferred);
+    void     completeBatch(VoodooUSBControlBatch * batch);
+    static void batchStepAction(void * owner, void * parameter, IOReturn status, UInt32 arg);
+    
+    bool initWorkQueue();
+    void closeCommandGate();
+    void openCommandGate();
+    void processWork();
+    static void workCallAction(thread_call_param_t param0, thread_call_param_t param1);
+    static IOReturn runGatedAction(OSObject * owner, void * arg0, void * arg1, void * arg2, void * arg3);
+    
+    VoodooHCICommandPool      * commandPool;
+    VoodooHCITimerWheel       * timerWheel;
+    VoodooHCICapture          * capture;
+    VoodooFirmwareCache       * firmwareCache;
+    
+    VoodooUSBConfigurationModel configurationModel;
+    
+    IOWorkLoop                * workLoop;
+    IOCommandGate             * commandGate;
+    
+    VoodooUSBWorkItem         * workQueue;
+    IOLock                    * workLock;
+    thread_call_t               workCall;
+    UInt32                      workHead;
+    UInt32                      workCount;
+    bool                        workRunning;            /* workCall is entered or draining the queue */
+    
+    VoodooUSBStringCacheEntry * stringCache;
+    IOLock                    * stringCacheLock;
+    UInt32                      stringCacheNext;        /* round-robin victim once the cache is full */
+    
+    VoodooUSBLatencyHistogram   controlLatency;         /* sendRequest() */
+    VoodooUSBLatencyHistogram   hciLatency;             /* sendHCIRequest() / sendHCICommand() control transfers */
+    VoodooUSBLatencyHistogram   hciResponseLatency;     /* command sent to Command Complete / Status received */
+    VoodooUSBLatencyHistogram   resumeLatency;          /* wake or soft reset to restoreState() done */
 };
 
-inline void setDevice(VoodooUSBDevice * device, IOService * provider)
+inline void setDevice(VoodooUSBDevice *& device, IOService * provider)
 {
     OSSafeReleaseNULL(device);
     
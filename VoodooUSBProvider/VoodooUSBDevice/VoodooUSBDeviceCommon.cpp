@@ -7,13 +7,73 @@
 //
 
 #include "VoodooUSBDevice.h"
+#include "VoodooFirmwareCache.h"
+#include "VoodooHCICommandEngine.h"
 
-inline bool VoodooUSBDevice::open(IOService * forClient, IOOptionBits options, void * arg)
+bool VoodooUSBDevice::open(IOService * forClient, IOOptionBits options, void * arg)
 {
-    return super::open(forClient, options, arg);
+    if (!super::open(forClient, options, arg))
+    {
+        return false;
+    }
+    
+    if (!initWorkQueue())
+    {
+        VoodooUSBWarningLog("open() - Unable to create the command gate, requests will not be serialized!\n");
+    }
+    
+    if (!commandPool)
+    {
+        commandPool = VoodooHCICommandPool::withCapacity();
+        if (!commandPool)
+        {
+            VoodooUSBWarningLog("open() - Unable to allocate HCI command pool, falling back to stack buffers!\n");
+        }
+    }
+    
+    if (!timerWheel)
+    {
+        timerWheel = VoodooHCITimerWheel::withTick();
+        if (!timerWheel)
+        {
+            VoodooUSBWarningLog("open() - Unable to allocate the timer wheel, HCI deadlines will not be enforced!\n");
+        }
+    }
+    
+    if (!getConfigurationModel())
+    {
+        VoodooUSBWarningLog("open() - Unable to parse the configuration descriptor, interfaces will not be found!\n");
+    }
+    
+    if (!stringCache)
+    {
+        stringCacheLock = IOLockAlloc();
+        stringCache = IONew(VoodooUSBStringCacheEntry, VOODOO_USB_STRING_CACHE_ENTRIES);
+        if (!stringCacheLock || !stringCache)
+        {
+            VoodooUSBWarningLog("open() - Unable to allocate string descriptor cache, strings will be read from the device!\n");
+            if (stringCache)
+            {
+                IODelete(stringCache, VoodooUSBStringCacheEntry, VOODOO_USB_STRING_CACHE_ENTRIES);
+                stringCache = NULL;
+            }
+            if (stringCacheLock)
+            {
+                IOLockFree(stringCacheLock);
+                stringCacheLock = NULL;
+            }
+        }
+        else
+        {
+            bzero(stringCache, sizeof(VoodooUSBStringCacheEntry) * VOODOO_USB_STRING_CACHE_ENTRIES);
+            stringCacheNext = 0;
+            prefetchStringDescriptors();
+        }
+    }
+    return true;
 }
 
-inline void VoodooUSBDevice::close(IOService * forClient, IOOptionBits options)
+void VoodooUSBDevice::close(IOService * forClient, IOOptionBits options)
 {
     if (isOpen(forClient))
     {
@@ -21,6 +81,712 @@ inline void VoodooUSBDevice::close(IOService * forClient, IOOptionBits options)
     }
 }
 
+void VoodooUSBDevice::free()
+{
+    // Queued work holds a reference on the device, so at most the call that dropped it is still returning
+    if (workCall)
+    {
+        thread_call_free(workCall);
+        workCall = NULL;
+    }
+    if (workQueue)
+    {
+        IODelete(workQueue, VoodooUSBWorkItem, VOODOO_USB_WORK_QUEUE_DEPTH);
+        workQueue = NULL;
+    }
+    if (workLock)
+    {
+        IOLockFree(workLock);
+        workLock = NULL;
+    }
+    if (commandGate)
+    {
+        workLoop->removeEventSource(commandGate);
+        OSSafeReleaseNULL(commandGate);
+    }
+    OSSafeReleaseNULL(workLoop);
+    
+    if (commandPool)
+    {
+        VoodooUSBDebugLog("free() - HCI command pool high water mark = %u, exhausted = %u\n", commandPool->getHighWaterMark(), commandPool->getExhaustedCount());
+    }
+    OSSafeReleaseNULL(commandPool);
+    OSSafeReleaseNULL(timerWheel);
+    OSSafeReleaseNULL(capture);
+    VoodooFirmwareCache::releaseSharedCache(firmwareCache);
+    
+    if (stringCache)
+    {
+        IODelete(stringCache, VoodooUSBStringCacheEntry, VOODOO_USB_STRING_CACHE_ENTRIES);
+        stringCache = NULL;
+    }
+    if (stringCacheLock)
+    {
+        IOLockFree(stringCacheLock);
+        stringCacheLock = NULL;
+    }
+    
+    super::free();
+}
+
+VoodooHCICommandPool * VoodooUSBDevice::getCommandPool()
+{
+    return commandPool;
+}
+
+VoodooHCITimerWheel * VoodooUSBDevice::getTimerWheel()
+{
+    return timerWheel;
+}
+
+void VoodooUSBDevice::setCapture(VoodooHCICapture * capture)
+{
+    if (capture)
+    {
+        capture->retain();
+    }
+    OSSafeReleaseNULL(this->capture);
+    this->capture = capture;
+}
+
+VoodooHCICapture * VoodooUSBDevice::getCapture()
+{
+    return capture;
+}
+
+VoodooFirmwareCache * VoodooUSBDevice::getFirmwareCache()
+{
+    if (!firmwareCache)
+    {
+        // Two loads starting at once may both take a reference; only one is kept
+        VoodooFirmwareCache * cache = VoodooFirmwareCache::copySharedCache();
+        if (cache && !OSCompareAndSwapPtr(NULL, cache, (void * volatile *) &firmwareCache))
+        {
+            VoodooFirmwareCache::releaseSharedCache(cache);
+        }
+    }
+    return firmwareCache;
+}
+
+void VoodooUSBDevice::captureCommand(const void * command, UInt16 length)
+{
+    if (capture)
+    {
+        capture->record(kVoodooHCICaptureCommand, false, command, length);
+    }
+}
+
+bool VoodooUSBDevice::initWorkQueue()
+{
+    if (workLoop)
+    {
+        return true;
+    }
+    
+    workLoop = IOWorkLoop::workLoop();
+    commandGate = IOCommandGate::commandGate(this);
+    workLock = IOLockAlloc();
+    workQueue = IONew(VoodooUSBWorkItem, VOODOO_USB_WORK_QUEUE_DEPTH);
+    workCall = thread_call_allocate(workCallAction, this);
+    
+    if (!workLoop || !commandGate || !workLock || !workQueue || !workCall || workLoop->addEventSource(commandGate) != kIOReturnSuccess)
+    {
+        VoodooUSBErrorLog("initWorkQueue() - Unable to allocate the work loop, command gate or work queue!!!\n");
+        if (workCall)
+        {
+            thread_call_free(workCall);
+            workCall = NULL;
+        }
+        if (workQueue)
+        {
+            IODelete(workQueue, VoodooUSBWorkItem, VOODOO_USB_WORK_QUEUE_DEPTH);
+            workQueue = NULL;
+        }
+        if (workLock)
+        {
+            IOLockFree(workLock);
+            workLock = NULL;
+        }
+        OSSafeReleaseNULL(commandGate);
+        OSSafeReleaseNULL(workLoop);
+        return false;
+    }
+    
+    workHead = 0;
+    workCount = 0;
+    workRunning = false;
+    return true;
+}
+
+IOWorkLoop * VoodooUSBDevice::getDeviceWorkLoop()
+{
+    return workLoop;
+}
+
+IOCommandGate * VoodooUSBDevice::getCommandGate()
+{
+    return commandGate;
+}
+
+void VoodooUSBDevice::closeCommandGate()
+{
+    // Recursive, so a gated action may issue requests of its own
+    if (workLoop)
+    {
+        workLoop->closeGate();
+    }
+}
+
+void VoodooUSBDevice::openCommandGate()
+{
+    if (workLoop)
+    {
+        workLoop->openGate();
+    }
+}
+
+IOReturn VoodooUSBDevice::runGatedAction(OSObject * owner, void * arg0, void * arg1, void * arg2, void * arg3)
+{
+    VoodooUSBDeviceAction action = (VoodooUSBDeviceAction) arg0;
+    return action((VoodooUSBDevice *) owner, arg1);
+}
+
+IOReturn VoodooUSBDevice::runGated(VoodooUSBDeviceAction action, void * refCon)
+{
+    if (!action)
+    {
+        return kIOReturnBadArgument;
+    }
+    
+    if (!commandGate)
+    {
+        return kIOReturnNotReady;
+    }
+    
+    return commandGate->runAction(runGatedAction, (void *) action, refCon);
+}
+
+IOReturn VoodooUSBDevice::enqueueWork(VoodooUSBDeviceAction action, void * refCon)
+{
+    if (!action)
+    {
+        return kIOReturnBadArgument;
+    }
+    
+    if (!workQueue)
+    {
+        return kIOReturnNotReady;
+    }
+    
+    IOLockLock(workLock);
+    if (workCount == VOODOO_USB_WORK_QUEUE_DEPTH)
+    {
+        IOLockUnlock(workLock);
+        return kIOReturnNoSpace;
+    }
+    
+    VoodooUSBWorkItem * item = &workQueue[(workHead + workCount) % VOODOO_USB_WORK_QUEUE_DEPTH];
+    item->action = action;
+    item->refCon = refCon;
+    ++workCount;
+    
+    bool start = !workRunning;
+    workRunning = true;
+    IOLockUnlock(workLock);
+    
+    if (start)
+    {
+        // Dropped by workCallAction() once the queue is empty
+        retain();
+        thread_call_enter(workCall);
+    }
+    return kIOReturnSuccess;
+}
+
+void VoodooUSBDevice::workCallAction(thread_call_param_t param0, thread_call_param_t param1)
+{
+    VoodooUSBDevice * that = (VoodooUSBDevice *) param0;
+    that->processWork();
+    that->release();
+}
+
+void VoodooUSBDevice::processWork()
+{
+    IOLockLock(workLock);
+    while (workCount)
+    {
+        VoodooUSBWorkItem item = workQueue[workHead];
+        workHead = (workHead + 1) % VOODOO_USB_WORK_QUEUE_DEPTH;
+        --workCount;
+        IOLockUnlock(workLock);
+        
+        commandGate->runAction(runGatedAction, (void *) item.action, item.refCon);
+        
+        IOLockLock(workLock);
+    }
+    workRunning = false;
+    IOLockWakeup(workLock, &workRunning, false);
+    IOLockUnlock(workLock);
+}
+
+void VoodooUSBDevice::drainWork()
+{
+    if (!workLock)
+    {
+        return;
+    }
+    
+    IOLockLock(workLock);
+    while (workRunning)
+    {
+        IOLockSleep(workLock, &workRunning, THREAD_UNINT);
+    }
+    IOLockUnlock(workLock);
+}
+
+struct VoodooUSBParallelInit
+{
+    VoodooUSBDeviceAction   action;
+    void                  * refCon;
+    IOReturn              * results;
+    IOLock                * lock;
+    UInt32                  remaining;
+};
+
+struct VoodooUSBParallelInitSlot
+{
+    VoodooUSBParallelInit * init;
+    UInt32                  index;
+};
+
+static IOReturn parallelInitAction(VoodooUSBDevice * device, void * refCon)
+{
+    VoodooUSBParallelInitSlot * slot = (VoodooUSBParallelInitSlot *) refCon;
+    VoodooUSBParallelInit * init = slot->init;
+    
+    IOReturn result = init->action(device, init->refCon);
+    
+    IOLockLock(init->lock);
+    init->results[slot->index] = result;
+    if (!--init->remaining)
+    {
+        IOLockWakeup(init->lock, &init->remaining, false);
+    }
+    IOLockUnlock(init->lock);
+    return result;
+}
+
+IOReturn VoodooUSBDevice::initializeInParallel(VoodooUSBDevice * const * devices, UInt32 count, VoodooUSBDeviceAction action, void * refCon, IOReturn * results)
+{
+    if (!devices || !count || !action)
+    {
+        return kIOReturnBadArgument;
+    }
+    
+    VoodooUSBParallelInit init =
+    {
+        .action     = action,
+        .refCon     = refCon,
+        .results    = results ? results : IONew(IOReturn, count),
+        .lock       = IOLockAlloc(),
+        .remaining  = count
+    };
+    VoodooUSBParallelInitSlot * slots = IONew(VoodooUSBParallelInitSlot, count);
+    
+    if (!init.results || !init.lock || !slots)
+    {
+        VoodooUSBErrorLog("initializeInParallel() - Unable to allocate the completion state!!!\n");
+        if (init.results && !results)
+        {
+            IODelete(init.results, IOReturn, count);
+        }
+        if (init.lock)
+        {
+            IOLockFree(init.lock);
+        }
+        if (slots)
+        {
+            IODelete(slots, VoodooUSBParallelInitSlot, count);
+        }
+        return kIOReturnNoMemory;
+    }
+    
+    for (UInt32 i = 0; i < count; ++i)
+    {
+        // Attach-time work may run before any client opened the device
+        IOReturn result = kIOReturnNotReady;
+        
+        slots[i].init = &init;
+        slots[i].index = i;
+        if (devices[i] && devices[i]->initWorkQueue())
+        {
+            result = devices[i]->enqueueWork(parallelInitAction, &slots[i]);
+        }
+        
+        if (result != kIOReturnSuccess)
+        {
+            IOLockLock(init.lock);
+            init.results[i] = result;
+            --init.remaining;
+            IOLockUnlock(init.lock);
+        }
+    }
+    
+    // No timeout: the actions write into the slots and results until the last one has returned
+    IOLockLock(init.lock);
+    while (init.remaining)
+    {
+        IOLockSleep(init.lock, &init.remaining, THREAD_UNINT);
+    }
+    IOLockUnlock(init.lock);
+    
+    IOReturn status = kIOReturnSuccess;
+    for (UInt32 i = 0; i < count && status == kIOReturnSuccess; ++i)
+    {
+        status = init.results[i];
+    }
+    
+    if (!results)
+    {
+        IODelete(init.results, IOReturn, count);
+    }
+    IOLockFree(init.lock);
+    IODelete(slots, VoodooUSBParallelInitSlot, count);
+    return status;
+}
+
+void VoodooUSBDevice::recordHCIResponse(UInt64 startTime, UInt64 bytes, IOReturn status)
+{
+    hciResponseLatency.record(startTime, bytes, status);
+}
+
+OSDictionary * VoodooUSBDevice::copyStatistics()
+{
+    OSDictionary * dictionary = OSDictionary::withCapacity(4);
+    if (!dictionary)
+    {
+        return NULL;
+    }
+    
+    const struct
+    {
+        const char                * key;
+        VoodooUSBLatencyHistogram * histogram;
+    } classes[] =
+    {
+        { "Control",     &controlLatency },
+        { "HCI",         &hciLatency },
+        { "HCIResponse", &hciResponseLatency },
+        { "Resume",      &resumeLatency },
+    };
+    
+    for (UInt32 i = 0; i < ARRAY_SIZE(classes); ++i)
+    {
+        OSDictionary * histogram = classes[i].histogram->copyDictionary();
+        if (histogram)
+        {
+            dictionary->setObject(classes[i].key, histogram);
+            histogram->release();
+        }
+    }
+    return dictionary;
+}
+
+void VoodooUSBDevice::publishStatistics()
+{
+    OSDictionary * dictionary = copyStatistics();
+    if (dictionary)
+    {
+        setProperty("VoodooUSBStatistics", dictionary);
+        dictionary->release();
+    }
+}
+
+IOReturn VoodooUSBDevice::getStringDescriptor(UInt8 index, char * buf, int maxLen, UInt16 lang)
+{
+    if (!buf || maxLen <= 0)
+    {
+        return kIOReturnBadArgument;
+    }
+    
+    if (!index)
+    {
+        memset(buf, 0, maxLen);
+        return kIOReturnBadArgument;
+    }
+    
+    if (!stringCache)
+    {
+        return fetchStringDescriptor(index, buf, maxLen, lang);
+    }
+    
+    IOLockLock(stringCacheLock);
+    for (int i = 0; i < VOODOO_USB_STRING_CACHE_ENTRIES; ++i)
+    {
+        if (stringCache[i].index == index && stringCache[i].langID == lang)
+        {
+            strlcpy(buf, stringCache[i].string, maxLen);
+            IOLockUnlock(stringCacheLock);
+            return kIOReturnSuccess;
+        }
+    }
+    IOLockUnlock(stringCacheLock);
+    
+    // Miss: always decode the full string so later callers with a larger buffer are served from the cache too
+    char string[VOODOO_USB_STRING_MAX];
+    IOReturn result = fetchStringDescriptor(index, string, sizeof(string), lang);
+    if (result != kIOReturnSuccess)
+    {
+        memset(buf, 0, maxLen);
+        return result;
+    }
+    strlcpy(buf, string, maxLen);
+    
+    IOLockLock(stringCacheLock);
+    VoodooUSBStringCacheEntry * entry = NULL;
+    for (int i = 0; i < VOODOO_USB_STRING_CACHE_ENTRIES; ++i)
+    {
+        // Another thread may have filled it in while the bus was busy
+        if (stringCache[i].index == index && stringCache[i].langID == lang)
+        {
+            IOLockUnlock(stringCacheLock);
+            return kIOReturnSuccess;
+        }
+        if (!entry && !stringCache[i].index)
+        {
+            entry = &stringCache[i];
+        }
+    }
+    if (!entry)
+    {
+        entry = &stringCache[stringCacheNext++ % VOODOO_USB_STRING_CACHE_ENTRIES];
+    }
+    entry->index  = index;
+    entry->langID = lang;
+    strlcpy(entry->string, string, sizeof(entry->string));
+    IOLockUnlock(stringCacheLock);
+    
+    return kIOReturnSuccess;
+}
+
+IOReturn VoodooUSBDevice::prefetchStringDescriptors(UInt16 lang)
+{
+    const UInt8 indices[] = { getManufacturerStringIndex(), getProductStringIndex(), getSerialNumberStringIndex() };
+    char string[VOODOO_USB_STRING_MAX];
+    IOReturn result = kIOReturnSuccess;
+    
+    for (int i = 0; i < (int) sizeof(indices); ++i)
+    {
+        if (!indices[i])
+        {
+            continue;
+        }
+        
+        IOReturn status = getStringDescriptor(indices[i], string, sizeof(string), lang);
+        if (status != kIOReturnSuccess)
+        {
+            VoodooUSBWarningLog("prefetchStringDescriptors() - Unable to read string %d: 0x%08x!\n", indices[i], status);
+            result = status;
+        }
+    }
+    return result;
+}
+
+void VoodooUSBDevice::invalidateStringCache()
+{
+    if (!stringCache)
+    {
+        return;
+    }
+    
+    IOLockLock(stringCacheLock);
+    bzero(stringCache, sizeof(VoodooUSBStringCacheEntry) * VOODOO_USB_STRING_CACHE_ENTRIES);
+    stringCacheNext = 0;
+    IOLockUnlock(stringCacheLock);
+}
+
+IOReturn VoodooUSBDevice::sendRequestBatch(IOService * forClient, const VoodooUSBControlStep * steps, UInt32 count, VoodooUSBControlResult * results, VoodooUSBControlBatchCompletion * completion)
+{
+    if (!steps || !results || !count || count > VOODOO_USB_CONTROL_BATCH_MAX || !completion || !completion->action)
+    {
+        return kIOReturnBadArgument;
+    }
+    
+    VoodooUSBControlBatch * batch = IONew(VoodooUSBControlBatch, 1);
+    if (!batch)
+    {
+        return kIOReturnNoMemory;
+    }
+    bzero(batch, sizeof(VoodooUSBControlBatch));
+    
+    batch->lock = IOLockAlloc();
+    if (!batch->lock)
+    {
+        IODelete(batch, VoodooUSBControlBatch, 1);
+        return kIOReturnNoMemory;
+    }
+    
+    batch->device     = this;
+    batch->client     = forClient;
+    batch->steps      = steps;
+    batch->results    = results;
+    batch->count      = count;
+    batch->completion = *completion;
+    batch->status     = kIOReturnSuccess;
+    for (UInt32 i = 0; i < count; ++i)
+    {
+        results[i].status           = kIOReturnNotReady;
+        results[i].bytesTransferred = 0;
+    }
+    
+    // Held until the completion has been called
+    retain();
+    advanceBatch(batch);
+    return kIOReturnSuccess;
+}
+
+void VoodooUSBDevice::advanceBatch(VoodooUSBControlBatch * batch)
+{
+    IOLockLock(batch->lock);
+    if (batch->submitting)
+    {
+        IOLockUnlock(batch->lock);
+        return;
+    }
+    batch->submitting = true;
+    
+    while (batch->submitted < batch->count)
+    {
+        UInt32 step = batch->submitted;
+        if ((batch->steps[step].flags & kVoodooUSBControlStepBarrier) && batch->finished < step)
+        {
+            break;
+        }
+        ++batch->submitted;
+        IOLockUnlock(batch->lock);
+        
+        // Control requests to the device class with bRequest 0 are HCI commands
+        const VoodooUSBControlStep * current = &batch->steps[step];
+        if (current->bmRequestType == VoodooUSBRequestType(0, 1, 0) && !current->bRequest)
+        {
+            captureCommand(current->data, current->wLength);
+        }
+        IOReturn result = submitBatchStep(batch, step);
+        
+        IOLockLock(batch->lock);
+        if (result != kIOReturnSuccess)
+        {
+            finishBatchStepLocked(batch, step, result, 0);
+        }
+    }
+    
+    // Whatever completed while steps were being handed out left the last word to us
+    batch->submitting = false;
+    bool done = batch->finished == batch->count;
+    IOLockUnlock(batch->lock);
+    
+    if (done)
+    {
+        completeBatch(batch);
+    }
+}
+
+// Called with the batch lock held; true once every step is done and nobody is handing steps out
+bool VoodooUSBDevice::finishBatchStepLocked(VoodooUSBControlBatch * batch, UInt32 step, IOReturn status, UInt32 bytesTransferred)
+{
+    batch->results[step].status           = status;
+    batch->results[step].bytesTransferred = bytesTransferred;
+    ++batch->finished;
+    
+    if (status != kIOReturnSuccess && !(batch->steps[step].flags & kVoodooUSBControlStepIgnoreError) && batch->status == kIOReturnSuccess)
+    {
+        VoodooUSBErrorLog("VoodooUSBDevice::finishBatchStepLocked() - Step %u of %u failed (0x%08x), stopping the batch!!!\n", step, batch->count, status);
+        batch->status = status;
+        for (UInt32 i = batch->submitted; i < batch->count; ++i)
+        {
+            batch->results[i].status = kIOReturnAborted;
+        }
+        batch->finished += batch->count - batch->submitted;
+        batch->submitted = batch->count;
+    }
+    return batch->finished == batch->count && !batch->submitting;
+}
+
+void VoodooUSBDevice::batchStepAction(void * owner, void * parameter, IOReturn status, UInt32 arg)
+{
+    VoodooUSBControlBatch * batch = (VoodooUSBControlBatch *) owner;
+    UInt32 step = (UInt32) (uintptr_t) parameter;
+    
+    IOLockLock(batch->lock);
+    bool done = batch->device->finishBatchStepLocked(batch, step, status, USBCompletionBytes(batch->steps[step].wLength, arg));
+    bool more = !done && !batch->submitting && batch->submitted < batch->count;
+    IOLockUnlock(batch->lock);
+    
+    // A barrier step may be free to go now
+    if (done)
+    {
+        batch->device->completeBatch(batch);
+    }
+    else if (more)
+    {
+        batch->device->advanceBatch(batch);
+    }
+}
+
+void VoodooUSBDevice::completeBatch(VoodooUSBControlBatch * batch)
+{
+    batch->completion.action(batch->completion.owner, batch->completion.refCon, batch->status, batch->results, batch->count);
+    
+    IOLockFree(batch->lock);
+    IODelete(batch, VoodooUSBControlBatch, 1);
+    release();
+}
+
+struct VoodooUSBControlBatchWaiter
+{
+    IOLock    * lock;
+    bool        done;
+    IOReturn    status;
+};
+
+static void wakeBatchWaiter(void * owner, void * refCon, IOReturn status, const VoodooUSBControlResult * results, UInt32 count)
+{
+    VoodooUSBControlBatchWaiter * waiter = (VoodooUSBControlBatchWaiter *) refCon;
+    
+    IOLockLock(waiter->lock);
+    waiter->status = status;
+    waiter->done   = true;
+    IOLockWakeup(waiter->lock, &waiter->done, false);
+    IOLockUnlock(waiter->lock);
+}
+
+IOReturn VoodooUSBDevice::sendRequestBatchSync(IOService * forClient, const VoodooUSBControlStep * steps, UInt32 count, VoodooUSBControlResult * results)
+{
+    VoodooUSBControlResult scratch[VOODOO_USB_CONTROL_BATCH_MAX];
+    VoodooUSBControlBatchWaiter waiter = { IOLockAlloc(), false, kIOReturnSuccess };
+    VoodooUSBControlBatchCompletion completion = { this, wakeBatchWaiter, &waiter };
+    
+    if (!waiter.lock)
+    {
+        return kIOReturnNoMemory;
+    }
+    
+    // Not locked around the send: a batch whose every step fails to go out completes right here
+    IOReturn result = sendRequestBatch(forClient, steps, count, results ? results : scratch, &completion);
+    if (result == kIOReturnSuccess)
+    {
+        IOLockLock(waiter.lock);
+        while (!waiter.done)
+        {
+            IOLockSleep(waiter.lock, &waiter.done, THREAD_UNINT);
+        }
+        IOLockUnlock(waiter.lock);
+        result = waiter.status;
+    }
+    IOLockFree(waiter.lock);
+    return result;
+}
+
 inline IOReturn VoodooUSBDevice::getVendorState(IOService * forClient, VendorState * state)
 {
     return sendVendorRequestIn(forClient, VENDOR_GETSTATE, state, sizeof(VendorState));
@@ -38,14 +804,14 @@ inline IOReturn VoodooUSBDevice::switchAth3kPID(IOService * forClient)
 
 IOReturn VoodooUSBDevice::setAth3kNormalMode(IOService * forClient)
 {
-    VendorState * state;
-    if (getVendorState(forClient, state))
+    VendorState state;
+    if (getVendorState(forClient, &state))
     {
         VoodooUSBErrorLog("Unable to get vendor state!!!\n");
         return kIOReturnError;
     }
     
-    if ((*state & ATH3K_MODE_MASK) == ATH3K_NORMAL_MODE)
+    if ((state & ATH3K_MODE_MASK) == ATH3K_NORMAL_MODE)
     {
         VoodooUSBWarningLog("Firmware is already in normal mode!\n");
         return kIOReturnSuccess;
@@ -54,38 +820,406 @@ IOReturn VoodooUSBDevice::setAth3kNormalMode(IOService * forClient)
     return sendVendorRequestIn(forClient, ATH3K_SET_NORMAL_MODE, (void *) NULL, 0);
 }
 
-inline IOReturn VoodooUSBDevice::getQcaUsbVendorVersion(IOService * forClient, QCAVersion * version)
+IOReturn VoodooUSBDevice::getQcaUsbVendorVersion(IOService * forClient, QCAVersion * version)
 {
     return sendVendorRequestIn(forClient, VENDOR_QCA_GETVERSION, version, sizeof(QCAVersion));
 }
 
 bool VoodooUSBDevice::getQcaUsbDeviceInfo(QCAVersion * version, QCADeviceInfo * info)
 {
-    static QCADeviceInfo QCADevicesTable[] =
+    if (!version || !info)
+    {
+        return false;
+    }
+    
+    UInt32 romVersion = (UInt32) version->romVersion;
+    const VoodooChipEntry * entry = VoodooChipRegistry::lookupQcaRomVersion(romVersion);
+    if (!entry)
+    {
+        VoodooUSBErrorLog("getQcaUsbDeviceInfo() - Unknown ROM version 0x%08x!!!\n", romVersion);
+        return false;
+    }
+    
+    info->romVersion    = romVersion;
+    info->ramPatchHdr   = entry->layout.ramPatchHdr;
+    info->nvmHdr        = entry->layout.nvmHdr;
+    info->versionOffset = entry->layout.versionOffset;
+    return true;
+}
+
+const VoodooUSBConfigurationModel * VoodooUSBDevice::getConfigurationModel()
+{
+    if (configurationModel.valid)
+    {
+        return &configurationModel;
+    }
+    
+    // The active configuration need not be the first one; an unconfigured device has no model
+    UInt8 configuration = 0;
+    const USBConfigurationDescriptor * descriptor = NULL;
+    if (getConfiguration((IOService *) this, &configuration) == kIOReturnSuccess && configuration)
+    {
+        for (UInt8 index = 0; index < getNumConfigurations() && !descriptor; ++index)
+        {
+            const USBConfigurationDescriptor * candidate = getFullConfigurationDescriptor(index);
+            if (candidate && candidate->bConfigurationValue == configuration)
+            {
+                descriptor = candidate;
+            }
+        }
+    }
+    
+    if (!descriptor || configurationModel.parse(descriptor) != kIOReturnSuccess)
+    {
+        return NULL;
+    }
+    return &configurationModel;
+}
+
+bool VoodooUSBDevice::findFirstInterface(VoodooUSBInterface *& interface)
+{
+    return findInterface(interface, VOODOO_USB_CONFIG_MATCH_ANY, VOODOO_USB_CONFIG_MATCH_ANY, VOODOO_USB_CONFIG_MATCH_ANY);
+}
+
+const VoodooChipEntry * VoodooUSBDevice::getChipEntry()
+{
+    return VoodooChipRegistry::lookupDevice(getVendorID(), getProductID());
+}
+
+bool VoodooUSBDevice::getQcaUsbRamPatchVersion(OSData * firmwareData, const QCADeviceInfo * devInfo, QCARamPatchVersion * version)
+{
+    if (!firmwareData || !devInfo || !version)
+    {
+        return false;
+    }
+    
+    // The version lives inside the image itself; read it in place rather than offsetting the OSData object
+    const QCARamPatchVersion * patchVersion = (const QCARamPatchVersion *) firmwareData->getBytesNoCopy(devInfo->versionOffset, sizeof(QCARamPatchVersion));
+    if (!patchVersion)
+    {
+        VoodooUSBErrorLog("VoodooUSBDevice::getQcaUsbRamPatchVersion() - Firmware is too short for the version at offset %d!!!\n", devInfo->versionOffset);
+        return false;
+    }
+    
+    *version = *patchVersion;
+    return true;
+}
+
+VoodooUSBInterface * VoodooUSBDevice::copyInterface(UInt8 interfaceNumber)
+{
+    OSIterator * iterator = getChildIterator(gIOServicePlane);
+    VoodooUSBInterface * match = NULL;
+    OSObject * child;
+    
+    while (iterator && (child = iterator->getNextObject()))
+    {
+        VoodooUSBInterface * interface = OSDynamicCast(VoodooUSBInterface, child);
+        if (interface && interface->getInterfaceNumber() == interfaceNumber)
+        {
+            match = interface;
+            match->retain();
+            break;
+        }
+    }
+    OSSafeReleaseNULL(iterator);
+    return match;
+}
+
+bool VoodooUSBDevice::waitForInterface(UInt8 interfaceNumber, UInt32 timeoutMS)
+{
+    // A new configuration attaches its interfaces asynchronously; match the interface number under this device
+    OSDictionary * matching = OSDictionary::withCapacity(2);
+    OSDictionary * device = registryEntryIDMatching(getRegistryEntryID());
+    OSDictionary * properties = OSDictionary::withCapacity(1);
+    OSNumber * number = OSNumber::withNumber(interfaceNumber, 8);
+    IOService * service = NULL;
+    
+    if (matching && device && properties && number)
+    {
+        properties->setObject("bInterfaceNumber", number);
+        matching->setObject(kIOParentMatchKey, device);
+        matching->setObject(kIOPropertyMatchKey, properties);
+        service = waitForMatchingService(matching, (UInt64) timeoutMS * kMillisecondScale);
+    }
+    OSSafeReleaseNULL(number);
+    OSSafeReleaseNULL(properties);
+    OSSafeReleaseNULL(device);
+    OSSafeReleaseNULL(matching);
+    
+    bool published = service != NULL;
+    OSSafeReleaseNULL(service);
+    return published;
+}
+
+IOReturn VoodooUSBDevice::readVendorVersion(IOService * forClient, VoodooUSBDeviceSnapshot * snapshot)
+{
+    const VoodooChipEntry * chip = getChipEntry();
+    
+    switch (chip ? chip->family : kVoodooChipUnknown)
+    {
+        case kVoodooChipAth3k:
+        case kVoodooChipAth3012:
+            return getAth3kVendorVersion(forClient, &snapshot->vendorVersion.ath3k);
+        
+        case kVoodooChipQcaRome:
+        case kVoodooChipQcaWcn6855:
+            return getQcaUsbVendorVersion(forClient, &snapshot->vendorVersion.qca);
+        
+        default:
+            return kIOReturnUnsupported;
+    }
+}
+
+static bool readControllerCapability(VoodooHCICommandEngine * engine, UInt16 opCode, UInt8 * parameters, UInt16 length)
+{
+    UInt8 response[HCI_EVENT_HDR_SIZE + 255];
+    UInt16 responseLength = sizeof(response);
+    
+    if (engine->sendCommandSync(opCode, 0, NULL, response, &responseLength) != kIOReturnSuccess || responseLength < sizeof(HciResponse) + length)
+    {
+        return false;
+    }
+    memcpy(parameters, response + sizeof(HciResponse), length);
+    return true;
+}
+
+IOReturn VoodooUSBDevice::saveState(IOService * forClient, VoodooUSBDeviceSnapshot * snapshot, VoodooHCICommandEngine * engine)
+{
+    if (!snapshot)
+    {
+        return kIOReturnBadArgument;
+    }
+    
+    bzero(snapshot, sizeof(*snapshot));
+    IOReturn result = getConfiguration(forClient, &snapshot->configuration);
+    if (result != kIOReturnSuccess)
+    {
+        VoodooUSBErrorLog("VoodooUSBDevice::saveState() - Unable to read the configuration: 0x%08x!!!\n", result);
+        return result;
+    }
+    
+    OSIterator * iterator = getChildIterator(gIOServicePlane);
+    OSObject * child;
+    while (iterator && (child = iterator->getNextObject()) && snapshot->interfaceCount < VOODOO_USB_SNAPSHOT_INTERFACES)
+    {
+        VoodooUSBInterface * interface = OSDynamicCast(VoodooUSBInterface, child);
+        if (!interface)
+        {
+            continue;
+        }
+        
+        VoodooUSBInterfaceBinding * binding = &snapshot->interfaces[snapshot->interfaceCount++];
+        binding->interfaceNumber  = interface->getInterfaceNumber();
+        binding->alternateSetting = interface->getAlternateSetting();
+        for (int type = 0; type < VOODOO_USB_ENDPOINT_TYPES; ++type)
+        {
+            for (int direction = 0; direction < VOODOO_USB_ENDPOINT_DIRECTIONS; ++direction)
+            {
+                VoodooUSBEndpointEntry entry;
+                if (interface->copyEndpointEntry(type, direction, &entry))
+                {
+                    binding->endpoints[type][direction] = entry.address;
+                    entry.pipe->release();
+                }
+            }
+        }
+    }
+    OSSafeReleaseNULL(iterator);
+    
+    if (readVendorVersion(forClient, snapshot) == kIOReturnSuccess)
+    {
+        snapshot->contents |= kVoodooUSBSnapshotVendorVersion;
+    }
+    
+    if (engine && readControllerCapability(engine, HCI_OP_READ_LOCAL_VERSION, snapshot->localVersion, sizeof(snapshot->localVersion)))
+    {
+        snapshot->contents |= kVoodooUSBSnapshotLocalVersion;
+    }
+    if (engine && readControllerCapability(engine, HCI_OP_READ_BUFFER_SIZE, snapshot->bufferSize, sizeof(snapshot->bufferSize)))
     {
-        { 0x00000100, 20, 4,  8 },      /* Rome 1.0 */
-        { 0x00000101, 20, 4,  8 },      /* Rome 1.1 */
-        { 0x00000200, 28, 4, 16 },      /* Rome 2.0 */
-        { 0x00000201, 28, 4, 16 },      /* Rome 2.1 */
-        { 0x00000300, 28, 4, 16 },      /* Rome 3.0 */
-        { 0x00000302, 28, 4, 16 },      /* Rome 3.2 */
-        { 0x00130100, 40, 4, 16 },      /* WCN6855 1.0 */
-        { 0x00130200, 40, 4, 16 },      /* WCN6855 2.0 */
+        snapshot->contents |= kVoodooUSBSnapshotBufferSize;
+    }
+    return kIOReturnSuccess;
+}
+
+IOReturn VoodooUSBDevice::restoreState(IOService * forClient, const VoodooUSBDeviceSnapshot * snapshot, UInt64 wakeTime, VoodooUSBResumeResult * result)
+{
+    if (!snapshot)
+    {
+        return kIOReturnBadArgument;
+    }
+    
+    UInt64 startTime = wakeTime ? wakeTime : mach_absolute_time();
+    VoodooUSBResumeResult resume = { };
+    UInt8 configuration = 0;
+    
+    IOReturn status = getConfiguration(forClient, &configuration);
+    if (status == kIOReturnSuccess && configuration == snapshot->configuration)
+    {
+        ++resume.skipped;
+    }
+    else
+    {
+        // The device lost power over sleep; its interfaces come back as new objects
+        status = setConfiguration(forClient, snapshot->configuration);
+        resume.reconfigured = true;
+        ++resume.reissued;
+    }
+    
+    for (UInt32 i = 0; i < snapshot->interfaceCount && status == kIOReturnSuccess; ++i)
+    {
+        const VoodooUSBInterfaceBinding * binding = &snapshot->interfaces[i];
+        if (resume.reconfigured && !waitForInterface(binding->interfaceNumber, VOODOO_USB_INTERFACE_PUBLISH_MS))
+        {
+            VoodooUSBErrorLog("VoodooUSBDevice::restoreState() - Interface %d was not published again!!!\n", binding->interfaceNumber);
+            status = kIOReturnTimeout;
+            break;
+        }
+        
+        VoodooUSBInterface * interface = copyInterface(binding->interfaceNumber);
+        if (!interface)
+        {
+            VoodooUSBErrorLog("VoodooUSBDevice::restoreState() - Interface %d is gone!!!\n", binding->interfaceNumber);
+            status = kIOReturnNotFound;
+            break;
+        }
+        
+        // The new objects are not open yet, and their pipes and endpoint table only exist once they are
+        if (resume.reconfigured && !interface->isOpen(forClient) && !interface->open(forClient))
+        {
+            VoodooUSBErrorLog("VoodooUSBDevice::restoreState() - Unable to open interface %d again!!!\n", binding->interfaceNumber);
+            interface->release();
+            status = kIOReturnExclusiveAccess;
+            break;
+        }
+        
+        if (interface->getAlternateSetting() == binding->alternateSetting)
+        {
+            ++resume.skipped;
+        }
+        else
+        {
+            status = interface->selectAlternateSetting(forClient, binding->alternateSetting);
+            ++resume.reissued;
+        }
+        
+        // The endpoint table follows the alternate setting, so this only reads it back
+        for (int type = 0; type < VOODOO_USB_ENDPOINT_TYPES && status == kIOReturnSuccess; ++type)
+        {
+            for (int direction = 0; direction < VOODOO_USB_ENDPOINT_DIRECTIONS && status == kIOReturnSuccess; ++direction)
+            {
+                if (!binding->endpoints[type][direction])
+                {
+                    continue;
+                }
+                
+                VoodooUSBEndpointEntry entry = { };
+                bool found = interface->copyEndpointEntry(type, direction, &entry);
+                OSSafeReleaseNULL(entry.pipe);
+                if (!found || entry.address != binding->endpoints[type][direction])
+                {
+                    VoodooUSBErrorLog("VoodooUSBDevice::restoreState() - Endpoint 0x%02x of interface %d is gone!!!\n", binding->endpoints[type][direction], binding->interfaceNumber);
+                    status = kIOReturnNotFound;
+                }
+            }
+        }
+        interface->release();
+    }
+    
+    // Without power the chip may have been swapped or lost its patch; the cached version is only trusted again if it matches
+    if (status == kIOReturnSuccess && resume.reconfigured && (snapshot->contents & kVoodooUSBSnapshotVendorVersion))
+    {
+        // Only one member of the union is read; the rest has to match the zeros saveState() left
+        VoodooUSBDeviceSnapshot current;
+        bzero(&current, sizeof(current));
+        status = readVendorVersion(forClient, &current);
+        ++resume.reissued;
+        if (status == kIOReturnSuccess && memcmp(&current.vendorVersion, &snapshot->vendorVersion, sizeof(current.vendorVersion)))
+        {
+            VoodooUSBErrorLog("VoodooUSBDevice::restoreState() - Vendor version changed!!!\n");
+            status = kIOReturnNoDevice;
+        }
+    }
+    else if (snapshot->contents & kVoodooUSBSnapshotVendorVersion)
+    {
+        ++resume.skipped;
+    }
+    
+    absolutetime_to_nanoseconds(mach_absolute_time() - startTime, &resume.wakeToReadyNS);
+    resumeLatency.record(startTime, 0, status);
+    
+    VoodooUSBDebugLog("VoodooUSBDevice::restoreState() - Ready after %llu us, %u requests sent, %u skipped, status 0x%08x\n", resume.wakeToReadyNS / 1000, resume.reissued, resume.skipped, status);
+    if (result)
+    {
+        *result = resume;
+    }
+    return status;
+}
+
+IOReturn VoodooUSBDevice::restoreCapabilities(const VoodooUSBDeviceSnapshot * snapshot, VoodooHCICommandEngine * engine, VoodooUSBResumeResult * result)
+{
+    const struct
+    {
+        UInt8           content;
+        UInt16          opCode;
+        const UInt8   * saved;
+        UInt16          length;
+    } capabilities[] =
+    {
+        { kVoodooUSBSnapshotLocalVersion, HCI_OP_READ_LOCAL_VERSION, snapshot ? snapshot->localVersion : NULL, sizeof(snapshot->localVersion) },
+        { kVoodooUSBSnapshotBufferSize,   HCI_OP_READ_BUFFER_SIZE,   snapshot ? snapshot->bufferSize : NULL,   sizeof(snapshot->bufferSize) },
     };
     
-    for (int i = 0; i < ARRAY_SIZE(QCADevicesTable); ++i)
+    if (!snapshot || !result)
     {
-        if ((UInt32)(SInt32)(version->romVersion) == QCADevicesTable[i].romVersion)
+        return kIOReturnBadArgument;
+    }
+    
+    for (UInt32 i = 0; i < ARRAY_SIZE(capabilities); ++i)
+    {
+        if (!(snapshot->contents & capabilities[i].content))
+        {
+            continue;
+        }
+        
+        // Same controller and same configuration: what it reported before still holds
+        if (!result->reconfigured)
+        {
+            ++result->skipped;
+            continue;
+        }
+        
+        UInt8 current[sizeof(snapshot->localVersion)];
+        ++result->reissued;
+        if (!engine || !readControllerCapability(engine, capabilities[i].opCode, current, capabilities[i].length))
+        {
+            VoodooUSBErrorLog("VoodooUSBDevice::restoreCapabilities() - Unable to read capability 0x%04x again!!!\n", capabilities[i].opCode);
+            return engine ? kIOReturnNotResponding : kIOReturnBadArgument;
+        }
+        if (memcmp(current, capabilities[i].saved, capabilities[i].length))
         {
-            info = &QCADevicesTable[i];
-            return true;
+            VoodooUSBErrorLog("VoodooUSBDevice::restoreCapabilities() - Capability 0x%04x changed!!!\n", capabilities[i].opCode);
+            return kIOReturnNoDevice;
         }
     }
-    return false;
+    return kIOReturnSuccess;
 }
 
-inline bool VoodooUSBDevice::getQcaUsbRamPatchVersion(OSData * firmwareData, QCADeviceInfo * devInfo, QCARamPatchVersion * version)
+IOReturn VoodooUSBDevice::resetDevice(IOService * forClient, const VoodooUSBDeviceSnapshot * snapshot, VoodooUSBResumeResult * result)
 {
-    version = (QCARamPatchVersion *) (firmwareData + devInfo->versionOffset);
-    return version ? true : false;
+    if (!snapshot)
+    {
+        return kIOReturnBadArgument;
+    }
+    
+    UInt64 startTime = mach_absolute_time();
+    
+    // Only the controller resets; the USB side keeps its configuration, so it is checked and not set up again
+    IOReturn status = sendHCIRequestOut(forClient, HCI_OP_RESET, 0, NULL);
+    if (status != kIOReturnSuccess)
+    {
+        VoodooUSBErrorLog("VoodooUSBDevice::resetDevice() - HCI reset failed: 0x%08x!!!\n", status);
+        return status;
+    }
+    return restoreState(forClient, snapshot, startTime, result);
 }
@@ -10,21 +10,21 @@
 
 OSDefineMetaClassAndAbstractStructors(VoodooUSBDevice, USBDevice)
 
-inline UInt16 VoodooUSBDevice::getVendorID()
+UInt16 VoodooUSBDevice::getVendorID()
 {
     return USBToHost16(super::getDeviceDescriptor()->idVendor);
 }
 
-inline UInt16 VoodooUSBDevice::getProductID()
+UInt16 VoodooUSBDevice::getProductID()
 {
     return USBToHost16(super::getDeviceDescriptor()->idProduct);
 }
 
-IOReturn VoodooUSBDevice::getStringDescriptor(UInt8 index, char * buf, int maxLen, UInt16 lang)
+IOReturn VoodooUSBDevice::fetchStringDescriptor(UInt8 index, char * buf, int maxLen, UInt16 lang)
 {
     memset(buf, 0, maxLen);
     
-    const StringDescriptor * desc = super::getStringDescriptor(index);
+    const StringDescriptor * desc = super::getStringDescriptor(index, lang);
     
     if (!desc)
     {
@@ -60,6 +60,8 @@ inline IOReturn VoodooUSBDevice::getDeviceStatus(IOService * forClient, USBStatu
 inline IOReturn VoodooUSBDevice::resetDevice()
 {
     sendHCIRequestOut((IOService *) this, HCI_OP_RESET, 0, NULL);
+    invalidateStringCache();
+    configurationModel.valid = false;
     
     // Setting configuration value 0 (unconfigured) releases all opened interfaces / pipes
     super::setConfiguration(0);
@@ -67,17 +69,17 @@ inline IOReturn VoodooUSBDevice::resetDevice()
     return kIOReturnSuccess;
 }
 
-inline UInt8 VoodooUSBDevice::getNumConfigurations()
+UInt8 VoodooUSBDevice::getNumConfigurations()
 {
     return super::getDeviceDescriptor()->bNumConfigurations;
 }
 
-inline const USBConfigurationDescriptor * VoodooUSBDevice::getFullConfigurationDescriptor(UInt8 configIndex)
+const USBConfigurationDescriptor * VoodooUSBDevice::getFullConfigurationDescriptor(UInt8 configIndex)
 {
     return super::getConfigurationDescriptor(configIndex);
 }
 
-inline IOReturn VoodooUSBDevice::getConfiguration(IOService * forClient, UInt8 * configNumber)
+IOReturn VoodooUSBDevice::getConfiguration(IOService * forClient, UInt8 * configNumber)
 {
     UInt8 config;
     IOReturn result = sendStandardRequestIn(forClient, kDeviceRequestGetConfiguration, &config, sizeof(config));
@@ -85,76 +87,94 @@ inline IOReturn VoodooUSBDevice::getConfiguration(IOService * forClient, UInt8 *
     return result;
 }
 
-inline IOReturn VoodooUSBDevice::setConfiguration(IOService * forClient, UInt8 configValue, bool startInterfaceMatching)
+IOReturn VoodooUSBDevice::setConfiguration(IOService * forClient, UInt8 configValue, bool startInterfaceMatching)
 {
+    configurationModel.valid = false;
     return super::setConfiguration(configValue, startInterfaceMatching);
 }
 
-inline UInt8 VoodooUSBDevice::getManufacturerStringIndex()
+UInt8 VoodooUSBDevice::getManufacturerStringIndex()
 {
     return super::getDeviceDescriptor()->iManufacturer;
 }
 
-inline UInt8 VoodooUSBDevice::getProductStringIndex()
+UInt8 VoodooUSBDevice::getProductStringIndex()
 {
     return super::getDeviceDescriptor()->iProduct;
 }
 
-inline UInt8 VoodooUSBDevice::getSerialNumberStringIndex()
+UInt8 VoodooUSBDevice::getSerialNumberStringIndex()
 {
     return super::getDeviceDescriptor()->iSerialNumber;
 }
 
-bool VoodooUSBDevice::findFirstInterface(VoodooUSBInterface * interface)
+bool VoodooUSBDevice::findInterface(VoodooUSBInterface *& interface, UInt16 interfaceClass, UInt16 interfaceSubClass, UInt16 interfaceProtocol)
 {
-    VoodooUSBFuncLog("findFirstInterface");
+    VoodooUSBFuncLog("findInterface");
+    
+    const VoodooUSBConfigurationModel * model = getConfigurationModel();
+    UInt8 setting = model ? model->findSetting(interfaceClass, interfaceSubClass, interfaceProtocol) : VOODOO_USB_CONFIG_NOT_FOUND;
+    
+    if (setting == VOODOO_USB_CONFIG_NOT_FOUND)
+    {
+        setInterface(interface, NULL);
+        return false;
+    }
     
     OSIterator * iterator = super::getChildIterator(gIOServicePlane);
     
     if (!iterator)
     {
-        return NULL;
+        setInterface(interface, NULL);
+        return false;
     }
     
-    while (1)
+    // Each child is looked at once; the walk ends with the children even if the interface is not published yet
+    IOService * match = NULL;
+    OSObject * child;
+    while ((child = iterator->getNextObject()))
     {
-        setInterface(interface, OSDynamicCast(IOUSBHostInterface, iterator->getNextObject()));
-        
-        if (interface)
+        VoodooUSBInterface * candidate = OSDynamicCast(VoodooUSBInterface, child);
+        if (candidate && candidate->getInterfaceNumber() == model->interfaceNumber[setting])
         {
+            match = candidate;
             break;
         }
     }
-    
+    setInterface(interface, match);
     OSSafeReleaseNULL(iterator);
-
-    IOService * result = interface;
-    VoodooUSBInfoLog("findFirstInterface() - getInterface() returns %p.\n", result);
-    return result;
+    
+    VoodooUSBInfoLog("findInterface() - Interface %u returns %p.\n", model->interfaceNumber[setting], interface);
+    return interface != NULL;
 }
 
-IOReturn VoodooUSBDevice::sendRequest(IOService * forClient, UInt8 bRequest, void * dataBuffer, UInt16 size, UInt8 direction, UInt8 type, UInt8 recipient)
+IOReturn VoodooUSBDevice::sendRequest(IOService * forClient, UInt8 bRequest, void * dataBuffer, UInt16 size, UInt8 direction, UInt8 type, UInt8 recipient, UInt16 value, UInt16 index)
 {
-    UInt32 bytesTransferred;
+    UInt32 bytesTransferred = 0;
     
     StandardUSB::DeviceRequest request =
     {
         .bmRequestType  = static_cast <UInt8> (USBmakebmRequestType(direction, type, recipient)),
         .bRequest       = bRequest,
-        .wValue         = 0,
-        .wIndex         = 0,
+        .wValue         = value,
+        .wIndex         = index,
         .wLength        = size
     };
     
-    return super::deviceRequest(forClient, request, dataBuffer, bytesTransferred, kUSBHostStandardRequestCompletionTimeout);
+    closeCommandGate();
+    UInt64 startTime = mach_absolute_time();
+    IOReturn result = super::deviceRequest(forClient, request, dataBuffer, bytesTransferred, kUSBHostStandardRequestCompletionTimeout);
+    controlLatency.record(startTime, bytesTransferred, result);
+    openCommandGate();
+    return result;
 }
 
-inline IOReturn VoodooUSBDevice::sendVendorRequestIn(IOService * forClient, UInt8 bRequest, void * dataBuffer, UInt16 size)
+IOReturn VoodooUSBDevice::sendVendorRequestIn(IOService * forClient, UInt8 bRequest, void * dataBuffer, UInt16 size)
 {
     return sendRequest(forClient, bRequest, dataBuffer, size, kRequestDirectionIn, kRequestTypeVendor, kRequestRecipientDevice);
 }
 
-inline IOReturn VoodooUSBDevice::sendVendorRequestOut(IOService * forClient, UInt8 bRequest, void * dataBuffer, UInt16 size)
+IOReturn VoodooUSBDevice::sendVendorRequestOut(IOService * forClient, UInt8 bRequest, void * dataBuffer, UInt16 size)
 {
     return sendRequest(forClient, bRequest, dataBuffer, size, kRequestDirectionOut, kRequestTypeVendor, kRequestRecipientDevice);
 }
@@ -171,13 +191,25 @@ inline IOReturn VoodooUSBDevice::sendStandardRequestOut(IOService * forClient, U
 
 IOReturn VoodooUSBDevice::sendHCIRequest(IOService * forClient, UInt16 opCode, UInt8 paramLen, const void * param, UInt8 direction)
 {
-    UInt32 bytesTransferred;
+    UInt32 bytesTransferred = 0;
+    IOReturn result;
+    
+    // Draw a wired buffer from the pool; only fall back to the stack if the pool is missing or exhausted
+    VoodooHCICommandBuffer * buffer = commandPool ? commandPool->getCommandBuffer() : NULL;
+    HciCommandHdr stackCommand;
+    HciCommandHdr * command = buffer ? buffer->command : &stackCommand;
     
-    HciCommandHdr * command = NULL;
-    bzero(command, sizeof(HciCommandHdr));
     command->opCode = opCode;
     command->pLength = paramLen;
-    memcpy((void *) command->pData, param, paramLen);
+    if (paramLen && param)
+    {
+        memcpy((void *) command->pData, param, paramLen);
+    }
+    
+    if (direction == kRequestDirectionOut)
+    {
+        captureCommand(command, HCI_COMMAND_HDR_SIZE + paramLen);
+    }
     
     StandardUSB::DeviceRequest request =
     {
@@ -188,7 +220,22 @@ IOReturn VoodooUSBDevice::sendHCIRequest(IOService * forClient, UInt16 opCode, U
         .wLength = (UInt16)(HCI_COMMAND_HDR_SIZE + paramLen)
     };
     
-    return super::deviceRequest(forClient, request, (void *) command, bytesTransferred);
+    closeCommandGate();
+    UInt64 startTime = mach_absolute_time();
+    
+    if (buffer)
+    {
+        result = super::deviceRequest(forClient, request, buffer->descriptor, bytesTransferred);
+        commandPool->returnCommandBuffer(buffer);
+    }
+    else
+    {
+        result = super::deviceRequest(forClient, request, (void *) command, bytesTransferred);
+    }
+    
+    hciLatency.record(startTime, bytesTransferred, result);
+    openCommandGate();
+    return result;
 }
 
 inline IOReturn VoodooUSBDevice::sendHCIRequestIn(IOService * forClient, UInt16 opCode, UInt8 paramLen, const void * param)
@@ -196,14 +243,14 @@ inline IOReturn VoodooUSBDevice::sendHCIRequestIn(IOService * forClient, UInt16
     return sendHCIRequest(forClient, opCode, paramLen, param, kRequestDirectionIn);
 }
 
-inline IOReturn VoodooUSBDevice::sendHCIRequestOut(IOService * forClient, UInt16 opCode, UInt8 paramLen, const void * param)
+IOReturn VoodooUSBDevice::sendHCIRequestOut(IOService * forClient, UInt16 opCode, UInt8 paramLen, const void * param)
 {
     return sendHCIRequest(forClient, opCode, paramLen, param, kRequestDirectionOut);
 }
 
 IOReturn VoodooUSBDevice::sendHCICommand(IOService * forClient, void * command, UInt16 length, UInt8 direction)
 {
-    UInt32 bytesTransfered;
+    UInt32 bytesTransfered = 0;
     
     StandardUSB::DeviceRequest request =
     {
@@ -214,7 +261,17 @@ IOReturn VoodooUSBDevice::sendHCICommand(IOService * forClient, void * command,
         .wLength = length
     };
     
-    return super::deviceRequest(forClient, request, command, bytesTransfered, 0);
+    if (direction == kRequestDirectionOut)
+    {
+        captureCommand(command, length);
+    }
+    
+    closeCommandGate();
+    UInt64 startTime = mach_absolute_time();
+    IOReturn result = super::deviceRequest(forClient, request, command, bytesTransfered, 0);
+    hciLatency.record(startTime, bytesTransfered, result);
+    openCommandGate();
+    return result;
 }
 
 inline IOReturn VoodooUSBDevice::sendHCICommandIn(IOService * forClient, void * command, UInt16 length)
@@ -226,3 +283,32 @@ inline IOReturn VoodooUSBDevice::sendHCICommandOut(IOService * forClient, void *
 {
     return sendHCICommand(forClient, command, length, kRequestDirectionOut);
 }
+
+
+IOReturn VoodooUSBDevice::sendHCICommandAsync(IOService * forClient, void * command, UInt16 length, USBDeviceRequest * request, USBCompletion * completion)
+{
+    // request is owned by the caller and must stay valid until completion fires
+    request->bmRequestType = makeDeviceRequestbmRequestType(kRequestDirectionOut, kRequestTypeClass, kRequestRecipientDevice);
+    request->bRequest      = 0;
+    request->wValue        = 0;
+    request->wIndex        = 0;
+    request->wLength       = length;
+    
+    captureCommand(command, length);
+    return super::deviceRequest(forClient, *request, command, completion, HCI_CMD_TIMEOUT);
+}
+
+IOReturn VoodooUSBDevice::submitBatchStep(VoodooUSBControlBatch * batch, UInt32 step)
+{
+    const VoodooUSBControlStep * current = &batch->steps[step];
+    USBDeviceRequest * request = &batch->requests[step];
+    
+    request->bmRequestType = current->bmRequestType;
+    request->bRequest      = current->bRequest;
+    request->wValue        = current->wValue;
+    request->wIndex        = current->wIndex;
+    request->wLength       = current->wLength;
+    batch->usbCompletions[step] = { batch, batchStepAction, (void *) (uintptr_t) step };
+    
+    return super::deviceRequest(batch->client, *request, current->data, &batch->usbCompletions[step], kUSBHostStandardRequestCompletionTimeout);
+}
@@ -10,7 +10,7 @@
 
 OSDefineMetaClassAndAbstractStructors(VoodooUSBInterface, USBInterface)
 
-inline UInt8 VoodooUSBInterface::getInterfaceNumber()
+UInt8 VoodooUSBInterface::getInterfaceNumber()
 {
     return super::getInterfaceDescriptor()->bInterfaceNumber;
 }
@@ -30,46 +30,98 @@ inline UInt8 VoodooUSBInterface::getInterfaceProtocol()
     return super::getInterfaceDescriptor()->bInterfaceProtocol;
 }
 
-bool VoodooUSBInterface::findPipe(VoodooUSBPipe * pipe, UInt8 type, UInt8 direction)
+UInt8 VoodooUSBInterface::getAlternateSetting()
+{
+    return super::getInterfaceDescriptor()->bAlternateSetting;
+}
+
+IOReturn VoodooUSBInterface::selectAlternateSetting(IOService * forClient, UInt8 alternateSetting)
+{
+    invalidateEndpointTable();
+    return super::selectAlternateSetting(alternateSetting);
+}
+
+void VoodooUSBInterface::buildEndpointTable()
 {
-    VoodooUSBInfoLog("findPipe() - direction = %d, type = %d\n", direction, type);
-    
     const StandardUSB::ConfigurationDescriptor * configDesc = super::getConfigurationDescriptor();
     const StandardUSB::InterfaceDescriptor     * ifaceDesc  = super::getInterfaceDescriptor();
     
     if (!configDesc || !ifaceDesc)
     {
-        VoodooUSBErrorLog("findPipe() - Descriptor(s) invalid!!!\n");
-        VoodooUSBInfoLog("findPipe() - configDesc = %p, ifaceDesc = %p\n", configDesc, ifaceDesc);
-        return false;
+        VoodooUSBErrorLog("buildEndpointTable() - Descriptor(s) invalid!!!\n");
+        VoodooUSBInfoLog("buildEndpointTable() - configDesc = %p, ifaceDesc = %p\n", configDesc, ifaceDesc);
+        return;
     }
     
     const EndpointDescriptor * ep = NULL;
-    IOUSBHostPipe * tempPipe = NULL;
     
     while ((ep = StandardUSB::getNextEndpointDescriptor(configDesc, ifaceDesc, ep)))
     {
-        // Check if endpoint matches type and direction
         UInt8 epDirection = StandardUSB::getEndpointDirection(ep);
         UInt8 epType      = StandardUSB::getEndpointType(ep);
-        VoodooUSBInfoLog("findPipe() - Endpoint found! epDirection = %d, epType = %d\n", epDirection, epType);
-        if (direction == epDirection && type == epType)
+        VoodooUSBEndpointEntry * entry = &endpointTable[epType][epDirection];
+        
+        // Keep the first endpoint of each kind, as the old walk did
+        if (entry->pipe)
         {
-            VoodooUSBDebugLog("findPipe() - Found matching endpoint!\n");
-            
-            // Try to make a pipe from the endpoint address after it is matched
-            tempPipe = super::copyPipe(StandardUSB::getEndpointAddress(ep));
-            if (!tempPipe)
+            continue;
+        }
+        
+        IOUSBHostPipe * hostPipe = super::copyPipe(StandardUSB::getEndpointAddress(ep));
+        VoodooUSBPipe * pipe = OSDynamicCast(VoodooUSBPipe, hostPipe);
+        if (!pipe)
+        {
+            VoodooUSBErrorLog("buildEndpointTable() - copyPipe() failed for endpoint 0x%02x!!!\n", StandardUSB::getEndpointAddress(ep));
+            OSSafeReleaseNULL(hostPipe);
+            continue;
+        }
+        
+        // copyPipe() returned a reference, the table keeps it
+        entry->pipe          = pipe;
+        entry->address       = StandardUSB::getEndpointAddress(ep);
+        entry->interval      = ep->bInterval;
+        entry->maxPacketSize = USBToHost16(ep->wMaxPacketSize) & 0x7FF;
+        VoodooUSBDebugLog("buildEndpointTable() - Endpoint 0x%02x: type = %d, direction = %d\n", entry->address, epType, epDirection);
+    }
+}
+
+bool VoodooUSBInterface::getIsochronousMaxPacketSize(UInt8 alternateSetting, UInt16 * maxPacketSize)
+{
+    const StandardUSB::ConfigurationDescriptor * configDesc = super::getConfigurationDescriptor();
+    const StandardUSB::InterfaceDescriptor     * ifaceDesc  = NULL;
+    UInt8 interfaceNumber = getInterfaceNumber();
+    
+    if (!configDesc)
+    {
+        return false;
+    }
+    
+    while ((ifaceDesc = StandardUSB::getNextInterfaceDescriptor(configDesc, ifaceDesc)))
+    {
+        if (ifaceDesc->bInterfaceNumber != interfaceNumber || ifaceDesc->bAlternateSetting != alternateSetting)
+        {
+            continue;
+        }
+        
+        // Both directions have to fit, so the smaller endpoint decides
+        const EndpointDescriptor * ep = NULL;
+        bool found = false;
+        UInt16 size = 0;
+        
+        while ((ep = StandardUSB::getNextEndpointDescriptor(configDesc, ifaceDesc, ep)))
+        {
+            if (StandardUSB::getEndpointType(ep) != kUSBIsoc)
             {
-                VoodooUSBErrorLog("findPipe() - copyPipe() failed!!!\n");
-                return false;
+                continue;
             }
             
-            setPipe(pipe, tempPipe);
-            OSSafeReleaseNULL(tempPipe);
-            return true;
+            UInt16 epSize = USBToHost16(ep->wMaxPacketSize) & 0x7FF;
+            size = (found && size < epSize) ? size : epSize;
+            found = true;
         }
+        
+        *maxPacketSize = size;
+        return true;
     }
-    VoodooUSBErrorLog("findPipe() - No matching endpoint found!!!\n");
     return false;
 }
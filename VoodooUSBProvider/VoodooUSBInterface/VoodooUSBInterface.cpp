@@ -10,7 +10,7 @@
 
 OSDefineMetaClassAndAbstractStructors(VoodooUSBInterface, USBInterface)
 
-inline UInt8 VoodooUSBInterface::getInterfaceNumber()
+UInt8 VoodooUSBInterface::getInterfaceNumber()
 {
     return super::GetInterfaceNumber();
 }
@@ -30,24 +30,105 @@ inline UInt8 VoodooUSBInterface::getInterfaceProtocol()
     return super::GetInterfaceProtocol();
 }
 
-bool VoodooUSBInterface::findPipe(VoodooUSBPipe * pipe, UInt8 type, UInt8 direction)
+UInt8 VoodooUSBInterface::getAlternateSetting()
 {
-    VoodooUSBInfoLog("findPipe() - direction = %d, type = %d\n", direction, type);
-    IOUSBFindEndpointRequest findEndpointRequest =
+    return super::GetAlternateSetting();
+}
+
+IOReturn VoodooUSBInterface::selectAlternateSetting(IOService * forClient, UInt8 alternateSetting)
+{
+    invalidateEndpointTable();
+    return super::SetAlternateInterface(forClient, alternateSetting);
+}
+
+void VoodooUSBInterface::buildEndpointTable()
+{
+    IOUSBFindEndpointRequest findEndpointRequest;
+    IOUSBPipe * current = NULL;
+    
+    while (1)
+    {
+        // FindNextPipe() overwrites the request with the properties of the pipe it found
+        findEndpointRequest.type      = kUSBAnyType;
+        findEndpointRequest.direction = kUSBAnyDirn;
+        
+        if (!(current = super::FindNextPipe(current, &findEndpointRequest)))
+        {
+            break;
+        }
+        
+        const IOUSBEndpointDescriptor * ep = current->GetEndpointDescriptor();
+        if (!ep)
+        {
+            continue;
+        }
+        
+        UInt8 epType      = ep->bmAttributes & 0x03;
+        UInt8 epDirection = (ep->bEndpointAddress & 0x80) ? kUSBIn : kUSBOut;
+        VoodooUSBEndpointEntry * entry = &endpointTable[epType][epDirection];
+        
+        VoodooUSBPipe * pipe = OSDynamicCast(VoodooUSBPipe, current);
+        if (entry->pipe || !pipe)
+        {
+            continue;
+        }
+        
+        pipe->retain();
+        entry->pipe          = pipe;
+        entry->address       = ep->bEndpointAddress;
+        entry->interval      = ep->bInterval;
+        entry->maxPacketSize = USBToHostWord(ep->wMaxPacketSize) & 0x7FF;
+        VoodooUSBDebugLog("buildEndpointTable() - Endpoint 0x%02x: type = %d, direction = %d\n", entry->address, epType, epDirection);
+    }
+}
+
+bool VoodooUSBInterface::getIsochronousMaxPacketSize(UInt8 alternateSetting, UInt16 * maxPacketSize)
+{
+    // The interface belongs to the active configuration, which need not be the first one
+    IOUSBDevice * device = super::GetDevice();
+    const IOUSBConfigurationDescriptor * configDesc = device ? device->FindConfig(super::GetConfigValue()) : NULL;
+    IOUSBInterfaceDescriptor * ifaceDesc = NULL;
+    IOUSBFindInterfaceRequest request =
     {
-        .type = type,
-        .direction = direction
+        .bInterfaceClass    = kIOUSBFindInterfaceDontCare,
+        .bInterfaceSubClass = kIOUSBFindInterfaceDontCare,
+        .bInterfaceProtocol = kIOUSBFindInterfaceDontCare,
+        .bAlternateSetting  = alternateSetting
     };
     
-    IOUSBPipe * tempPipe;
+    if (!configDesc)
+    {
+        return false;
+    }
     
-    if ((tempPipe = super::FindNextPipe(NULL, &findEndpointRequest)))
+    const UInt8 * end = (const UInt8 *) configDesc + USBToHostWord(configDesc->wTotalLength);
+    
+    while (device->FindNextInterfaceDescriptor(configDesc, ifaceDesc, &request, &ifaceDesc) == kIOReturnSuccess)
     {
-        VoodooUSBDebugLog("findPipe() - Found matching endpoint!\n");
-        setPipe(pipe, tempPipe);
+        if (ifaceDesc->bInterfaceNumber != getInterfaceNumber())
+        {
+            continue;
+        }
+        
+        // Both directions have to fit, so the smaller endpoint decides
+        const UInt8 * current = (const UInt8 *) ifaceDesc + ifaceDesc->bLength;
+        bool found = false;
+        UInt16 size = 0;
+        
+        while (current + sizeof(IOUSBDescriptorHeader) <= end && current[0] && current[1] != kUSBInterfaceDesc)
+        {
+            const IOUSBEndpointDescriptor * ep = (const IOUSBEndpointDescriptor *) current;
+            if (current[1] == kUSBEndpointDesc && (ep->bmAttributes & 0x03) == kUSBIsoc)
+            {
+                UInt16 epSize = USBToHostWord(ep->wMaxPacketSize) & 0x7FF;
+                size = (found && size < epSize) ? size : epSize;
+                found = true;
+            }
+            current += current[0];
+        }
+        
+        *maxPacketSize = size;
         return true;
     }
-    
-    VoodooUSBErrorLog("findPipe() - No matching endpoint found!!!\n");
     return false;
 }
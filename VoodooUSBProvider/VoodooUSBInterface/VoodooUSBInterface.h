@@ -11,6 +11,23 @@
 
 #include "VoodooUSBPipe.h"
 
+#define VOODOO_USB_ENDPOINT_TYPES           4       /* control, isochronous, bulk, interrupt */
+#define VOODOO_USB_ENDPOINT_DIRECTIONS      2       /* out, in */
+
+/* Bytes every 1 ms frame carries for the given number of 8 kHz SCO voice links at 8 or 16 bits per sample */
+constexpr UInt32 voodooScoBytesPerFrame(UInt8 links, bool sixteenBit)
+{
+    return links * (sixteenBit ? 16 : 8);
+}
+
+struct VoodooUSBEndpointEntry
+{
+    VoodooUSBPipe * pipe;           /* retained while the table is valid */
+    UInt8           address;
+    UInt8           interval;
+    UInt16          maxPacketSize;
+};
+
 class VoodooUSBInterface : public USBInterface
 {
     typedef USBInterface super;
@@ -20,16 +37,37 @@ class VoodooUSBInterface : public USBInterface
 public:
     virtual bool open(IOService * forClient, IOOptionBits options = 0, void * arg = 0) override;
     virtual void close(IOService * forClient, IOOptionBits options = 0) override;
+    virtual void free() override;
     
     UInt8 getInterfaceNumber();
     UInt8 getInterfaceClass();
     UInt8 getInterfaceSubClass();
     UInt8 getInterfaceProtocol();
+    UInt8 getAlternateSetting();
+    IOReturn selectAlternateSetting(IOService * forClient, UInt8 alternateSetting);
+    
+    /* Switches to the smallest alternate setting whose isochronous endpoints carry bytesPerFrame */
+    IOReturn selectAlternateSettingForBandwidth(IOService * forClient, UInt32 bytesPerFrame, UInt8 * alternateSetting = NULL);
+    
+    bool findPipe(VoodooUSBPipe *& pipe, UInt8 type, UInt8 direction);
+    
+    /* Copies the entry under the table lock; its pipe is retained for the caller, who releases it */
+    bool copyEndpointEntry(UInt8 type, UInt8 direction, VoodooUSBEndpointEntry * entry);
+    void invalidateEndpointTable();
+    void publishStatistics();
+    
+private:
+    bool validateEndpointTableLocked();
+    void buildEndpointTable();
+    bool getIsochronousMaxPacketSize(UInt8 alternateSetting, UInt16 * maxPacketSize);
     
-    bool findPipe(VoodooUSBPipe * pipe, UInt8 type, UInt8 direction);
+    VoodooUSBEndpointEntry  endpointTable[VOODOO_USB_ENDPOINT_TYPES][VOODOO_USB_ENDPOINT_DIRECTIONS];
+    IOLock                * endpointLock;               /* allocated by the first open(), guards the table */
+    bool                    endpointTableValid;
+    UInt8                   endpointTableAltSetting;
 };
 
-inline void setInterface(VoodooUSBInterface * interface, IOService * provider)
+inline void setInterface(VoodooUSBInterface *& interface, IOService * provider)
 {
     OSSafeReleaseNULL(interface);
 
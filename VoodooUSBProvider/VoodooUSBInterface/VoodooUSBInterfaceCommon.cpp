@@ -8,15 +8,223 @@
 
 #include "VoodooUSBInterface.h"
 
-inline bool VoodooUSBInterface::open(IOService * forClient, IOOptionBits options, void * arg)
+bool VoodooUSBInterface::open(IOService * forClient, IOOptionBits options, void * arg)
 {
-    return super::open(forClient, options, arg);
+    if (!super::open(forClient, options, arg))
+    {
+        return false;
+    }
+    
+    // Two clients opening at once may both get here; only one lock is kept
+    if (!endpointLock)
+    {
+        IOLock * lock = IOLockAlloc();
+        if (lock && !OSCompareAndSwapPtr(NULL, lock, (void * volatile *) &endpointLock))
+        {
+            IOLockFree(lock);
+        }
+    }
+    
+    if (!endpointLock)
+    {
+        super::close(forClient, options);
+        return false;
+    }
+    return true;
 }
 
-inline void VoodooUSBInterface::close(IOService * forClient, IOOptionBits options)
+void VoodooUSBInterface::close(IOService * forClient, IOOptionBits options)
 {
     if (isOpen(forClient))
     {
         super::close(forClient, options);
     }
+    
+    // Pipes are only valid while the interface is open
+    invalidateEndpointTable();
+}
+
+void VoodooUSBInterface::free()
+{
+    invalidateEndpointTable();
+    
+    if (endpointLock)
+    {
+        IOLockFree(endpointLock);
+        endpointLock = NULL;
+    }
+    super::free();
+}
+
+void VoodooUSBInterface::invalidateEndpointTable()
+{
+    if (endpointLock)
+    {
+        IOLockLock(endpointLock);
+    }
+    
+    endpointTableValid = false;
+    for (int type = 0; type < VOODOO_USB_ENDPOINT_TYPES; ++type)
+    {
+        for (int direction = 0; direction < VOODOO_USB_ENDPOINT_DIRECTIONS; ++direction)
+        {
+            OSSafeReleaseNULL(endpointTable[type][direction].pipe);
+        }
+    }
+    bzero(endpointTable, sizeof(endpointTable));
+    
+    if (endpointLock)
+    {
+        IOLockUnlock(endpointLock);
+    }
+}
+
+bool VoodooUSBInterface::validateEndpointTableLocked()
+{
+    UInt8 alternateSetting = getAlternateSetting();
+    
+    // The endpoints are parsed once per alternate setting; lookups after that are a table index
+    if (!endpointTableValid || endpointTableAltSetting != alternateSetting)
+    {
+        for (int type = 0; type < VOODOO_USB_ENDPOINT_TYPES; ++type)
+        {
+            for (int direction = 0; direction < VOODOO_USB_ENDPOINT_DIRECTIONS; ++direction)
+            {
+                OSSafeReleaseNULL(endpointTable[type][direction].pipe);
+            }
+        }
+        bzero(endpointTable, sizeof(endpointTable));
+        
+        buildEndpointTable();
+        endpointTableAltSetting = alternateSetting;
+        endpointTableValid = true;
+    }
+    return endpointTableValid;
+}
+
+bool VoodooUSBInterface::copyEndpointEntry(UInt8 type, UInt8 direction, VoodooUSBEndpointEntry * entry)
+{
+    bool found = false;
+    
+    // No lock before the first open(), and no pipes either
+    if (type >= VOODOO_USB_ENDPOINT_TYPES || direction >= VOODOO_USB_ENDPOINT_DIRECTIONS || !endpointLock || !entry)
+    {
+        return false;
+    }
+    
+    // The table entry is released and cleared by an alternate setting change, so only a copy leaves the lock
+    IOLockLock(endpointLock);
+    if (validateEndpointTableLocked() && endpointTable[type][direction].pipe)
+    {
+        *entry = endpointTable[type][direction];
+        entry->pipe->retain();
+        found = true;
+    }
+    IOLockUnlock(endpointLock);
+    return found;
+}
+
+IOReturn VoodooUSBInterface::selectAlternateSettingForBandwidth(IOService * forClient, UInt32 bytesPerFrame, UInt8 * alternateSetting)
+{
+    UInt16 bestSize = 0;
+    SInt32 best = -1;
+    UInt16 size;
+    
+    // Alternate settings are numbered from 0 without gaps; the walk stops at the first one missing
+    for (UInt32 setting = 0; setting <= 0xFF && getIsochronousMaxPacketSize((UInt8) setting, &size); ++setting)
+    {
+        if (size >= bytesPerFrame && (best < 0 || size < bestSize))
+        {
+            best = setting;
+            bestSize = size;
+        }
+    }
+    
+    if (best < 0)
+    {
+        VoodooUSBErrorLog("selectAlternateSettingForBandwidth() - No alternate setting carries %u bytes per frame!!!\n", bytesPerFrame);
+        return kIOReturnNoBandwidth;
+    }
+    
+    if (alternateSetting)
+    {
+        *alternateSetting = (UInt8) best;
+    }
+    
+    if (best == getAlternateSetting())
+    {
+        return kIOReturnSuccess;
+    }
+    
+    VoodooUSBDebugLog("selectAlternateSettingForBandwidth() - %u bytes per frame, alternate setting %d (%u bytes)\n", bytesPerFrame, best, bestSize);
+    return selectAlternateSetting(forClient, (UInt8) best);
+}
+
+bool VoodooUSBInterface::findPipe(VoodooUSBPipe *& pipe, UInt8 type, UInt8 direction)
+{
+    VoodooUSBPipe * found = NULL;
+    
+    // The pipe is retained before the lock is dropped, an invalidation could release it otherwise
+    if (type < VOODOO_USB_ENDPOINT_TYPES && direction < VOODOO_USB_ENDPOINT_DIRECTIONS && endpointLock)
+    {
+        IOLockLock(endpointLock);
+        if (validateEndpointTableLocked() && (found = endpointTable[type][direction].pipe))
+        {
+            found->retain();
+        }
+        IOLockUnlock(endpointLock);
+    }
+    
+    if (!found)
+    {
+        VoodooUSBErrorLog("findPipe() - No matching endpoint found (type = %d, direction = %d)!!!\n", type, direction);
+        return false;
+    }
+    
+    setPipe(pipe, found);
+    found->release();
+    return true;
+}
+
+void VoodooUSBInterface::publishStatistics()
+{
+    if (!endpointLock)
+    {
+        return;
+    }
+    
+    OSDictionary * dictionary = OSDictionary::withCapacity(VOODOO_USB_ENDPOINT_TYPES * VOODOO_USB_ENDPOINT_DIRECTIONS);
+    if (!dictionary)
+    {
+        return;
+    }
+    
+    IOLockLock(endpointLock);
+    validateEndpointTableLocked();
+    
+    for (int type = 0; type < VOODOO_USB_ENDPOINT_TYPES; ++type)
+    {
+        for (int direction = 0; direction < VOODOO_USB_ENDPOINT_DIRECTIONS; ++direction)
+        {
+            VoodooUSBEndpointEntry * entry = &endpointTable[type][direction];
+            if (!entry->pipe)
+            {
+                continue;
+            }
+            
+            OSDictionary * statistics = entry->pipe->copyStatistics();
+            if (statistics)
+            {
+                char key[16];
+                snprintf(key, sizeof(key), "Endpoint 0x%02x", entry->address);
+                dictionary->setObject(key, statistics);
+                statistics->release();
+            }
+        }
+    }
+    
+    IOLockUnlock(endpointLock);
+    
+    setProperty("VoodooUSBStatistics", dictionary);
+    dictionary->release();
 }
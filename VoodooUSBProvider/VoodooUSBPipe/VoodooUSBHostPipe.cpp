@@ -10,7 +10,7 @@
 
 OSDefineMetaClassAndAbstractStructors(VoodooUSBPipe, USBPipe)
 
-inline IOReturn VoodooUSBPipe::abort()
+IOReturn VoodooUSBPipe::abort()
 {
     return super::abort();
 }
@@ -19,11 +19,28 @@ IOReturn VoodooUSBPipe::read(IOMemoryDescriptor * buffer, UInt32 noDataTimeout,
 {
     if (completion)
     {
-        return super::io(buffer, (UInt32) reqCount, completion, completionTimeout);
+        // The bytes received are only known to the completion, so a capture records them from there
+        IOReturn result = wrapCapturedRead(buffer, reqCount, &completion);
+        if (result != kIOReturnSuccess)
+        {
+            return result;
+        }
+        result = super::io(buffer, (UInt32) reqCount, completion, completionTimeout);
+        if (result != kIOReturnSuccess)
+        {
+            unwrapCapturedRead(completion);
+        }
+        return result;
     }
         
-    UInt32 bytesTransfered;
+    UInt32 bytesTransfered = 0;
+    UInt64 startTime = mach_absolute_time();
     IOReturn result = super::io(buffer, (UInt32) reqCount, bytesTransfered, completionTimeout);
+    readLatency.record(startTime, bytesTransfered, result);
+    if (result == kIOReturnSuccess)
+    {
+        captureAcl(kIODirectionIn, buffer, bytesTransfered);
+    }
     if (bytesRead)
     {
         *bytesRead = bytesTransfered;
@@ -35,19 +52,40 @@ IOReturn VoodooUSBPipe::write(IOMemoryDescriptor * buffer, UInt32 noDataTimeout,
 {
     if (completion)
     {
+        // Recorded when handed to the controller; the completion may run before this returns
+        captureAcl(kIODirectionOut, buffer, reqCount);
         return super::io(buffer, (UInt32) reqCount, completion, completionTimeout);
     }
     
-    UInt32 bytesTransfered;
-    return super::io(buffer, (UInt32) reqCount, bytesTransfered, completionTimeout);
+    UInt32 bytesTransfered = 0;
+    UInt64 startTime = mach_absolute_time();
+    IOReturn result = super::io(buffer, (UInt32) reqCount, bytesTransfered, completionTimeout);
+    writeLatency.record(startTime, bytesTransfered, result);
+    if (result == kIOReturnSuccess)
+    {
+        captureAcl(kIODirectionOut, buffer, bytesTransfered);
+    }
+    return result;
 }
 
-inline const USBEndpointDescriptor * VoodooUSBPipe::getEndpointDescriptor()
+const USBEndpointDescriptor * VoodooUSBPipe::getEndpointDescriptor()
 {
     return super::getEndpointDescriptor();
 }
 
+UInt16 VoodooUSBPipe::getMaxPacketSize()
+{
+    const USBEndpointDescriptor * ep = super::getEndpointDescriptor();
+    return ep ? (USBToHost16(ep->wMaxPacketSize) & 0x7FF) : 0;
+}
+
 inline IOReturn VoodooUSBPipe::clearStall()
 {
     return super::clearStall(false);
 }
+
+IOReturn VoodooUSBPipe::isochronousIO(IOMemoryDescriptor * buffer, USBIsocFrame * frames, UInt32 frameCount, USBIsocCompletion * completion)
+{
+    // Frame number 0 appends the transfer to whatever the endpoint already has scheduled
+    return super::io(buffer, frames, frameCount, 0, completion);
+}
@@ -10,27 +10,127 @@
 
 OSDefineMetaClassAndAbstractStructors(VoodooUSBPipe, USBPipe)
 
-inline IOReturn VoodooUSBPipe::abort()
+struct VoodooUSBWriteWaiter
+{
+    IOLock    * lock;
+    bool        done;
+    IOReturn    status;
+    UInt32      residue;
+};
+
+static void wakeWriteWaiter(void * owner, void * parameter, IOReturn status, UInt32 arg)
+{
+    VoodooUSBWriteWaiter * waiter = (VoodooUSBWriteWaiter *) parameter;
+    
+    IOLockLock(waiter->lock);
+    waiter->status  = status;
+    waiter->residue = arg;
+    waiter->done    = true;
+    IOLockWakeup(waiter->lock, &waiter->done, false);
+    IOLockUnlock(waiter->lock);
+}
+
+IOReturn VoodooUSBPipe::abort()
 {
     return super::Abort();
 }
 
-inline IOReturn VoodooUSBPipe::read(IOMemoryDescriptor * buffer, UInt32 noDataTimeout, UInt32 completionTimeout, IOByteCount reqCount, USBCompletion *    completion, IOByteCount * bytesRead)
+IOReturn VoodooUSBPipe::read(IOMemoryDescriptor * buffer, UInt32 noDataTimeout, UInt32 completionTimeout, IOByteCount reqCount, USBCompletion *    completion, IOByteCount * bytesRead)
 {
-    return super::Read(buffer, noDataTimeout, completionTimeout, reqCount, completion, bytesRead);
+    if (completion)
+    {
+        // The bytes received are only known to the completion, so a capture records them from there
+        IOReturn result = wrapCapturedRead(buffer, reqCount, &completion);
+        if (result != kIOReturnSuccess)
+        {
+            return result;
+        }
+        result = super::Read(buffer, noDataTimeout, completionTimeout, reqCount, completion, bytesRead);
+        if (result != kIOReturnSuccess)
+        {
+            unwrapCapturedRead(completion);
+        }
+        return result;
+    }
+    
+    IOByteCount bytesTransfered = 0;
+    UInt64 startTime = mach_absolute_time();
+    IOReturn result = super::Read(buffer, noDataTimeout, completionTimeout, reqCount, completion, &bytesTransfered);
+    readLatency.record(startTime, bytesTransfered, result);
+    if (result == kIOReturnSuccess)
+    {
+        captureAcl(kIODirectionIn, buffer, bytesTransfered);
+    }
+    if (bytesRead)
+    {
+        *bytesRead = bytesTransfered;
+    }
+    return result;
 }
 
-inline IOReturn VoodooUSBPipe::write(IOMemoryDescriptor * buffer, UInt32 noDataTimeout, UInt32 completionTimeout, IOByteCount reqCount, USBCompletion *    completion)
+IOReturn VoodooUSBPipe::write(IOMemoryDescriptor * buffer, UInt32 noDataTimeout, UInt32 completionTimeout, IOByteCount reqCount, USBCompletion *    completion)
 {
-    return super::Write(buffer, noDataTimeout, completionTimeout, reqCount, completion);
+    if (completion)
+    {
+        // Recorded when handed to the controller; the completion may run before this returns
+        captureAcl(kIODirectionOut, buffer, reqCount);
+        return super::Write(buffer, noDataTimeout, completionTimeout, reqCount, completion);
+    }
+    
+    VoodooUSBWriteWaiter waiter = { IOLockAlloc(), false, kIOReturnSuccess, (UInt32) reqCount };
+    USBCompletion internal = { this, wakeWriteWaiter, &waiter };
+    
+    if (!waiter.lock)
+    {
+        return kIOReturnNoMemory;
+    }
+    
+    // The synchronous Write() keeps the residue to itself, so the transfer is waited for here instead
+    UInt64 startTime = mach_absolute_time();
+    IOReturn result = super::Write(buffer, noDataTimeout, completionTimeout, reqCount, &internal);
+    if (result == kIOReturnSuccess)
+    {
+        IOLockLock(waiter.lock);
+        while (!waiter.done)
+        {
+            IOLockSleep(waiter.lock, &waiter.done, THREAD_UNINT);
+        }
+        IOLockUnlock(waiter.lock);
+        result = waiter.status;
+    }
+    IOLockFree(waiter.lock);
+    
+    IOByteCount bytesTransfered = USBCompletionBytes(reqCount, waiter.residue);
+    writeLatency.record(startTime, bytesTransfered, result);
+    if (result == kIOReturnSuccess)
+    {
+        captureAcl(kIODirectionOut, buffer, bytesTransfered);
+    }
+    return result;
 }
 
-inline const USBEndpointDescriptor * VoodooUSBPipe::getEndpointDescriptor()
+const USBEndpointDescriptor * VoodooUSBPipe::getEndpointDescriptor()
 {
     return super::GetEndpointDescriptor();
 }
 
+UInt16 VoodooUSBPipe::getMaxPacketSize()
+{
+    const USBEndpointDescriptor * ep = super::GetEndpointDescriptor();
+    return ep ? (USBToHostWord(ep->wMaxPacketSize) & 0x7FF) : 0;
+}
+
 inline IOReturn VoodooUSBPipe::clearStall()
 {
     return super::Reset();
 }
+
+IOReturn VoodooUSBPipe::isochronousIO(IOMemoryDescriptor * buffer, USBIsocFrame * frames, UInt32 frameCount, USBIsocCompletion * completion)
+{
+    // Continuous frame numbering appends the transfer to whatever the endpoint already has scheduled
+    if (getEndpointDescriptor()->bEndpointAddress & 0x80)
+    {
+        return super::Read(buffer, kAppleUSBSSIsocContinuousFrame, frameCount, frames, completion);
+    }
+    return super::Write(buffer, kAppleUSBSSIsocContinuousFrame, frameCount, frames, completion);
+}
@@ -9,7 +9,117 @@
 #ifndef VoodooUSBPipe_h
 #define VoodooUSBPipe_h
 
-#include "VoodooUSBCommon.h"
+#include "VoodooUSBLatencyHistogram.h"
+#include "VoodooHCICapture.h"
+#include <IOKit/IOBufferMemoryDescriptor.h>
+#include <IOKit/IOMultiMemoryDescriptor.h>
+#include <kern/thread_call.h>
+
+#define VOODOO_USB_READ_PUMP_MAX_DEPTH      32
+#define VOODOO_USB_READ_PUMP_MAX_BATCH      16      /* completions handed over in one coalesced call */
+#define VOODOO_USB_WRITE_MAX_SEGMENTS       8       /* e.g. ACL header, L2CAP header and payload fragments */
+
+#define VOODOO_USB_ISOC_RING_MAX_DEPTH      8
+#define VOODOO_USB_ISOC_MAX_FRAMES          16      /* frames in one transfer of the ring */
+#define VOODOO_USB_SCO_FIFO_SIZE            2048    /* SCO bytes queued for the OUT frames */
+
+#define HCI_MAX_SCO_SIZE                    (HCI_SCO_HDR_SIZE + 255)
+
+class VoodooUSBPipe;
+
+/* buffer is owned by the pump and re-armed as soon as the action returns */
+typedef void (*VoodooUSBReadPumpAction)(void * owner, void * refCon, IOReturn status, IOBufferMemoryDescriptor * buffer, UInt32 length);
+
+struct VoodooUSBReadCompletion
+{
+    IOBufferMemoryDescriptor * buffer;
+    UInt32                     length;
+    IOReturn                   status;
+};
+
+/* completions are in the order the reads finished; their buffers are re-armed once the action returns */
+typedef void (*VoodooUSBReadBatchAction)(void * owner, void * refCon, const VoodooUSBReadCompletion * completions, UInt32 count);
+
+struct VoodooUSBReadPumpSlot
+{
+    VoodooUSBPipe            * pipe;
+    IOBufferMemoryDescriptor * buffer;
+    USBCompletion              completion;
+    UInt32                     index;
+    UInt64                     postTime;
+};
+
+/* One asynchronous writeSegments(), alive until the caller's completion has run */
+struct VoodooUSBGatherWrite
+{
+    VoodooUSBPipe           * pipe;
+    IOMultiMemoryDescriptor * buffer;
+    USBCompletion             completion;       /* the caller's */
+    USBCompletion             internal;
+    UInt32                    completionTimeout;
+    UInt32                    arg;              /* of the data stage, handed on once the zero length packet is done */
+    UInt64                    startTime;
+    bool                      zeroLengthPacket; /* the data stage ends on a packet boundary */
+    bool                      dataDone;         /* the completion running is the zero length packet's */
+};
+
+/* One asynchronous read() of a captured bulk endpoint, alive until the caller's completion has run */
+struct VoodooUSBCapturedRead
+{
+    VoodooUSBPipe      * pipe;
+    IOMemoryDescriptor * buffer;
+    IOByteCount          reqCount;
+    USBCompletion        completion;        /* the caller's */
+    USBCompletion        internal;
+};
+
+/* packet is a whole HCI SCO packet, header included, reassembled from the IN frames */
+typedef void (*VoodooUSBScoPacketAction)(void * owner, void * refCon, const UInt8 * packet, UInt16 length);
+
+/* Reports every transfer of the ring as it retires, before its frame list is scheduled again */
+typedef void (*VoodooUSBIsocFrameAction)(void * owner, void * refCon, IOReturn status, const USBIsocFrame * frames, UInt32 frameCount);
+
+struct VoodooUSBIsocSlot
+{
+    VoodooUSBPipe            * pipe;
+    IOBufferMemoryDescriptor * buffer;
+    USBIsocFrame               frames[VOODOO_USB_ISOC_MAX_FRAMES];
+    USBIsocCompletion          completion;
+    UInt32                     index;
+};
+
+struct VoodooUSBIsocStatistics
+{
+    UInt64    transfers;
+    UInt64    frames;
+    UInt64    bytes;
+    UInt32    frameErrors;      /* frames that completed with an error status */
+    UInt32    emptyFrames;      /* IN frames without data, OUT frames sent with nothing queued */
+    UInt32    underruns;        /* a completion left no transfer scheduled on the endpoint */
+    UInt32    resubmitFailures;
+    UInt32    scoPackets;
+    UInt32    scoDropped;       /* IN packets cut short by a frame error */
+};
+
+struct VoodooUSBReadPumpStatistics
+{
+    UInt64    transfers;
+    UInt64    bytes;
+    UInt32    underruns;        /* a completion left no read posted on the endpoint */
+    UInt32    errors;
+    UInt32    resubmitFailures;
+    UInt64    batches;          /* coalesced deliveries */
+    UInt32    timerFlushes;     /* batches handed over because the oldest completion reached the latency bound */
+    UInt32    batchSizes[VOODOO_USB_READ_PUMP_MAX_BATCH + 1];   /* batches delivered, by number of completions */
+};
+
+struct VoodooUSBPollStatistics
+{
+    UInt64    hits;             /* the completion came in while spinning */
+    UInt64    misses;           /* the window ran out and the waiter blocked */
+    UInt64    overBudget;       /* not spun at all, the phase had used up its budget */
+    UInt64    spinNS;
+};
 
 class VoodooUSBPipe : public USBPipe
 {
@@ -18,15 +128,153 @@ class VoodooUSBPipe : public USBPipe
     OSDeclareDefaultStructors(VoodooUSBPipe)
     
 public:
+    virtual void free() override;
+    
     IOReturn abort();
     
     IOReturn read(IOMemoryDescriptor * buffer, UInt32 noDataTimeout, UInt32 completionTimeout, IOByteCount reqCount, USBCompletion * completion = 0, IOByteCount * bytesRead = 0);
     IOReturn write(IOMemoryDescriptor * buffer, UInt32 noDataTimeout, UInt32 completionTimeout, IOByteCount reqCount, USBCompletion * completion = 0);
     const USBEndpointDescriptor * getEndpointDescriptor();
+    UInt16   getMaxPacketSize();
     IOReturn clearStall();
+    
+    /*
+     * Sends the segments, in order, as one transfer without copying them. A transfer that ends
+     * on a packet boundary is followed by a zero length packet, so the device sees where it ends.
+     */
+    IOReturn writeSegments(IOMemoryDescriptor ** segments, UInt32 segmentCount, UInt32 completionTimeout, USBCompletion * completion = 0);
+    bool     needsZeroLengthPacket(IOByteCount length);
+    
+    IOReturn startReadPump(UInt32 depth, UInt32 bufferSize, VoodooUSBReadPumpAction action, void * owner, void * refCon = NULL);
+    
+    /*
+     * A read pump that hands completed reads over in batches of up to maxBatch, no later than
+     * maxLatencyUS after the oldest of them finished. An error or an endpoint left without a
+     * read posted flushes the batch at once. depth should leave reads posted while a batch waits.
+     */
+    IOReturn startCoalescedReadPump(UInt32 depth, UInt32 bufferSize, UInt32 maxBatch, UInt32 maxLatencyUS, VoodooUSBReadBatchAction action, void * owner, void * refCon = NULL);
+    void     stopReadPump();
+    bool     isReadPumpRunning();
+    void     getReadPumpStatistics(VoodooUSBReadPumpStatistics * statistics);
+    
+    IOReturn isochronousIO(IOMemoryDescriptor * buffer, USBIsocFrame * frames, UInt32 frameCount, USBIsocCompletion * completion);
+    
+    /*
+     * Keeps depth transfers of framesPerTransfer frames scheduled back to back on an isochronous
+     * endpoint; each one is resubmitted from its own completion, so the bus never sees a gap.
+     * IN streams reassemble HCI SCO packets for packetAction, OUT streams send what queueScoPacket() left.
+     */
+    IOReturn startIsochronousStream(UInt32 depth, UInt32 framesPerTransfer, VoodooUSBScoPacketAction packetAction, VoodooUSBIsocFrameAction frameAction, void * owner, void * refCon = NULL);
+    void     stopIsochronousStream();
+    bool     isIsochronousStreamRunning();
+    IOReturn queueScoPacket(const void * packet, UInt16 length);
+    void     getIsochronousStatistics(VoodooUSBIsocStatistics * statistics);
+    
+    /*
+     * Hybrid polling for the event endpoint during bring-up: a thread waiting for a completion delivered
+     * from this pipe spins for up to windowUS before it blocks, which saves the wakeup on every round trip.
+     * Spinning stops for the rest of the phase once it has taken budgetUS of CPU in total, and never
+     * starts on a single CPU machine, where it would hold off the very completion it waits for.
+     * Set for a phase such as a firmware download or the init command burst, and 0 after it; off by default.
+     */
+    void     setPollWindow(UInt32 windowUS, UInt32 budgetUS);
+    bool     pollForCompletion(volatile bool * done);      /* true if done was set while spinning */
+    void     getPollStatistics(VoodooUSBPollStatistics * statistics);
+    
+    /*
+     * Bulk endpoints record every ACL packet they move: writes when submitted, reads as the read pump
+     * or read() gets them, an asynchronous read() just before its caller's completion runs. SCO packets are recorded by the isochronous stream, and
+     * events, which span several interrupt transfers, by VoodooHCIEventReassembler once whole.
+     * Set it before traffic starts.
+     */
+    void     setCapture(VoodooHCICapture * capture);
+    VoodooHCICapture * getCapture();
+    
+    /* Synchronous read() / write() record themselves; asynchronous callers record from their completion */
+    void     recordTransfer(IODirection direction, UInt64 startTime, UInt64 bytes, IOReturn status);
+    OSDictionary * copyStatistics();
+    
+private:
+    IOReturn postPumpRead(VoodooUSBReadPumpSlot * slot);
+    void     freeReadPump();
+    static void pumpCompletionAction(void * owner, void * parameter, IOReturn status, UInt32 arg);
+    void     completePumpRead(VoodooUSBReadPumpSlot * slot, IOReturn status, UInt32 length);
+    IOReturn armReadPump(UInt32 depth, UInt32 bufferSize);
+    void     coalesceRead(VoodooUSBReadPumpSlot * slot, IOReturn status, UInt32 length);
+    void     deliverBatches(bool byTimer);
+    static void coalesceTimerAction(thread_call_param_t param0, thread_call_param_t param1);
+    static void gatherWriteAction(void * owner, void * parameter, IOReturn status, UInt32 arg);
+    void     captureAcl(IODirection direction, IOMemoryDescriptor * buffer, IOByteCount length);
+    IOReturn wrapCapturedRead(IOMemoryDescriptor * buffer, IOByteCount reqCount, USBCompletion ** completion);
+    void     unwrapCapturedRead(USBCompletion * completion);
+    static void capturedReadAction(void * owner, void * parameter, IOReturn status, UInt32 arg);
+    
+    IOReturn postIsochronous(VoodooUSBIsocSlot * slot);
+    void     completeIsochronous(VoodooUSBIsocSlot * slot, IOReturn status);
+    void     fillIsochronousOut(VoodooUSBIsocSlot * slot);
+    void     reassembleSco(const UInt8 * data, UInt32 length);
+    void     freeIsochronousStream();
+    static void isocCompletionAction(void * owner, void * parameter, IOReturn status, USBIsocFrame * frames);
+    
+    VoodooUSBReadPumpSlot       * pumpSlots;
+    UInt32                        pumpDepth;
+    UInt32                        pumpBufferSize;
+    volatile SInt32               pumpPosted;
+    volatile bool                 pumpRunning;
+    
+    VoodooUSBReadPumpAction       pumpAction;
+    void                        * pumpOwner;
+    void                        * pumpRefCon;
+    
+    VoodooUSBReadPumpStatistics   pumpStatistics;
+    
+    VoodooUSBReadBatchAction      batchAction;                      /* NULL unless the pump coalesces */
+    UInt32                        batchMax;
+    UInt32                        batchLatencyUS;
+    UInt32                        batchCount;
+    VoodooUSBReadCompletion       batch[VOODOO_USB_READ_PUMP_MAX_DEPTH];     /* may run past batchMax while a batch is delivered */
+    VoodooUSBReadPumpSlot       * batchSlots[VOODOO_USB_READ_PUMP_MAX_DEPTH];
+    bool                          batchFlush;                       /* the waiting reads are due for delivery */
+    bool                          batchDelivering;                  /* one thread at a time delivers, so batches never overlap */
+    IOLock                      * batchLock;
+    thread_call_t                 batchTimer;
+    
+    VoodooUSBIsocSlot           * isocSlots;
+    UInt32                        isocDepth;
+    UInt32                        isocFrames;
+    UInt16                        isocPacketSize;
+    bool                          isocIn;
+    volatile SInt32               isocPosted;
+    volatile bool                 isocRunning;
+    
+    VoodooUSBScoPacketAction      isocPacketAction;
+    VoodooUSBIsocFrameAction      isocFrameAction;
+    void                        * isocOwner;
+    void                        * isocRefCon;
+    
+    UInt8                         scoPacket[HCI_MAX_SCO_SIZE];     /* IN packet being reassembled */
+    UInt16                        scoPacketLength;
+    
+    UInt8                       * scoFifo;                          /* OUT bytes waiting for a frame */
+    UInt32                        scoFifoHead;
+    UInt32                        scoFifoCount;
+    IOSimpleLock                * scoFifoLock;
+    
+    VoodooUSBIsocStatistics       isocStatistics;
+    
+    volatile UInt64               pollWindowNS;                     /* 0 while polling is off */
+    volatile UInt64               pollBudgetNS;
+    volatile UInt64               pollSpentNS;                      /* in the current phase */
+    VoodooUSBPollStatistics       pollStatistics;
+    
+    VoodooUSBLatencyHistogram     readLatency;
+    VoodooUSBLatencyHistogram     writeLatency;
+    
+    VoodooHCICapture            * capture;
+    bool                          captureBulk;
 };
 
-void setPipe(VoodooUSBPipe * pipe, OSObject * provider)
+inline void setPipe(VoodooUSBPipe *& pipe, OSObject * provider)
 {
     OSSafeReleaseNULL(pipe);
     pipe = OSDynamicCast(VoodooUSBPipe, provider);
@@ -0,0 +1,664 @@
+//
+//  VoodooUSBPipeCommon.cpp
+//  VoodooUSBProvider
+//
+//  Copyright © 2021 Charlie Jiang. All rights reserved.
+//
+
+#include "VoodooUSBPipe.h"
+#include <machine/machine_routines.h>
+
+void VoodooUSBPipe::free()
+{
+    stopReadPump();
+    stopIsochronousStream();
+    
+    if (batchTimer)
+    {
+        thread_call_free(batchTimer);
+        batchTimer = NULL;
+    }
+    if (batchLock)
+    {
+        IOLockFree(batchLock);
+        batchLock = NULL;
+    }
+    OSSafeReleaseNULL(capture);
+    super::free();
+}
+
+IOReturn VoodooUSBPipe::startReadPump(UInt32 depth, UInt32 bufferSize, VoodooUSBReadPumpAction action, void * owner, void * refCon)
+{
+    if (!depth || depth > VOODOO_USB_READ_PUMP_MAX_DEPTH || !bufferSize || !action)
+    {
+        return kIOReturnBadArgument;
+    }
+    
+    if (pumpRunning || pumpSlots)
+    {
+        VoodooUSBErrorLog("startReadPump() - Read pump is already running!!!\n");
+        return kIOReturnBusy;
+    }
+    
+    pumpAction  = action;
+    batchAction = NULL;
+    pumpOwner   = owner;
+    pumpRefCon  = refCon;
+    return armReadPump(depth, bufferSize);
+}
+
+IOReturn VoodooUSBPipe::startCoalescedReadPump(UInt32 depth, UInt32 bufferSize, UInt32 maxBatch, UInt32 maxLatencyUS, VoodooUSBReadBatchAction action, void * owner, void * refCon)
+{
+    if (!depth || depth > VOODOO_USB_READ_PUMP_MAX_DEPTH || !bufferSize || !action || !maxBatch || maxBatch > VOODOO_USB_READ_PUMP_MAX_BATCH || maxBatch > depth)
+    {
+        return kIOReturnBadArgument;
+    }
+    
+    if (pumpRunning || pumpSlots)
+    {
+        VoodooUSBErrorLog("startCoalescedReadPump() - Read pump is already running!!!\n");
+        return kIOReturnBusy;
+    }
+    
+    if (!batchLock)
+    {
+        batchLock = IOLockAlloc();
+    }
+    if (!batchTimer)
+    {
+        batchTimer = thread_call_allocate(coalesceTimerAction, this);
+    }
+    if (!batchLock || !batchTimer)
+    {
+        return kIOReturnNoResources;
+    }
+    
+    pumpAction      = NULL;
+    batchAction     = action;
+    batchMax        = maxBatch;
+    batchLatencyUS  = maxLatencyUS;
+    batchCount      = 0;
+    batchFlush      = false;
+    batchDelivering = false;
+    pumpOwner       = owner;
+    pumpRefCon      = refCon;
+    return armReadPump(depth, bufferSize);
+}
+
+IOReturn VoodooUSBPipe::armReadPump(UInt32 depth, UInt32 bufferSize)
+{
+    pumpSlots = IONew(VoodooUSBReadPumpSlot, depth);
+    if (!pumpSlots)
+    {
+        return kIOReturnNoMemory;
+    }
+    bzero(pumpSlots, sizeof(VoodooUSBReadPumpSlot) * depth);
+    
+    pumpDepth      = depth;
+    pumpBufferSize = bufferSize;
+    pumpPosted     = 0;
+    bzero(&pumpStatistics, sizeof(pumpStatistics));
+    
+    for (UInt32 i = 0; i < depth; ++i)
+    {
+        VoodooUSBReadPumpSlot * slot = &pumpSlots[i];
+        
+        slot->buffer = IOBufferMemoryDescriptor::withCapacity(bufferSize, kIODirectionIn);
+        if (!slot->buffer || slot->buffer->prepare() != kIOReturnSuccess)
+        {
+            VoodooUSBErrorLog("armReadPump() - Unable to allocate buffer %u!!!\n", i);
+            OSSafeReleaseNULL(slot->buffer);
+            freeReadPump();
+            return kIOReturnNoMemory;
+        }
+        
+        slot->pipe       = this;
+        slot->index      = i;
+        slot->completion = { this, pumpCompletionAction, slot };
+    }
+    
+    pumpRunning = true;
+    
+    for (UInt32 i = 0; i < depth; ++i)
+    {
+        IOReturn result = postPumpRead(&pumpSlots[i]);
+        if (result != kIOReturnSuccess)
+        {
+            VoodooUSBErrorLog("armReadPump() - Unable to post read %u: 0x%08x!!!\n", i, result);
+            stopReadPump();
+            return result;
+        }
+    }
+    
+    VoodooUSBDebugLog("armReadPump() - %u reads of %u bytes posted\n", depth, bufferSize);
+    return kIOReturnSuccess;
+}
+
+IOReturn VoodooUSBPipe::postPumpRead(VoodooUSBReadPumpSlot * slot)
+{
+    // The pipe has to outlive every read still on the bus
+    retain();
+    OSIncrementAtomic(&pumpPosted);
+    slot->postTime = mach_absolute_time();
+    
+    IOReturn result = read(slot->buffer, 0, 0, pumpBufferSize, &slot->completion);
+    if (result != kIOReturnSuccess)
+    {
+        OSDecrementAtomic(&pumpPosted);
+        release();
+    }
+    return result;
+}
+
+void VoodooUSBPipe::pumpCompletionAction(void * owner, void * parameter, IOReturn status, UInt32 arg)
+{
+    VoodooUSBPipe         * that = (VoodooUSBPipe *) owner;
+    VoodooUSBReadPumpSlot * slot = (VoodooUSBReadPumpSlot *) parameter;
+    UInt32 length = (status == kIOReturnSuccess || status == kIOReturnUnderrun) ? (UInt32) USBCompletionBytes(that->pumpBufferSize, arg) : 0;
+    
+    // Only the read just completed was left on the endpoint
+    if (that->pumpPosted == 1 && that->pumpRunning)
+    {
+        OSIncrementAtomic((volatile SInt32 *) &that->pumpStatistics.underruns);
+    }
+    
+    // The read keeps its count until the action has returned and the slot is re-armed, stopReadPump() waits on it
+    that->completePumpRead(slot, status, length);
+    OSDecrementAtomic(&that->pumpPosted);
+    that->release();
+}
+
+void VoodooUSBPipe::completePumpRead(VoodooUSBReadPumpSlot * slot, IOReturn status, UInt32 length)
+{
+    if (status == kIOReturnAborted || !pumpRunning)
+    {
+        return;
+    }
+    
+    // For a standing read this is mostly the time spent waiting for the device to have data
+    readLatency.record(slot->postTime, length, (status == kIOReturnUnderrun) ? kIOReturnSuccess : status);
+    
+    if (length)
+    {
+        OSIncrementAtomic64((volatile SInt64 *) &pumpStatistics.transfers);
+        OSAddAtomic64(length, (volatile SInt64 *) &pumpStatistics.bytes);
+        captureAcl(kIODirectionIn, slot->buffer, length);
+    }
+    
+    if (status != kIOReturnSuccess && status != kIOReturnUnderrun)
+    {
+        OSIncrementAtomic((volatile SInt32 *) &pumpStatistics.errors);
+    }
+    
+    // The slot waits in the batch; it is re-armed once the batch has been delivered
+    if (batchAction)
+    {
+        coalesceRead(slot, status, length);
+        return;
+    }
+    
+    pumpAction(pumpOwner, pumpRefCon, status, slot->buffer, length);
+    
+    if (status == kIOReturnNoDevice || status == kIOReturnNotResponding || !pumpRunning)
+    {
+        return;
+    }
+    
+    if (postPumpRead(slot) != kIOReturnSuccess)
+    {
+        OSIncrementAtomic((volatile SInt32 *) &pumpStatistics.resubmitFailures);
+    }
+}
+
+void VoodooUSBPipe::coalesceRead(VoodooUSBReadPumpSlot * slot, IOReturn status, UInt32 length)
+{
+    IOLockLock(batchLock);
+    batch[batchCount]      = { slot->buffer, length, status };
+    batchSlots[batchCount] = slot;
+    ++batchCount;
+    
+    // Once every read is waiting in the batch nothing else will complete, so holding on only adds latency;
+    // the read being completed still counts as posted here
+    if (batchCount >= batchMax || pumpPosted <= 1 || (status != kIOReturnSuccess && status != kIOReturnUnderrun))
+    {
+        batchFlush = true;
+    }
+    else if (batchCount == 1)
+    {
+        UInt64 deadline;
+        clock_interval_to_deadline(batchLatencyUS, kMicrosecondScale, &deadline);
+        thread_call_enter_delayed(batchTimer, deadline);
+    }
+    bool flush = batchFlush;
+    IOLockUnlock(batchLock);
+    
+    if (flush)
+    {
+        deliverBatches(false);
+    }
+}
+
+void VoodooUSBPipe::deliverBatches(bool byTimer)
+{
+    VoodooUSBReadCompletion completions[VOODOO_USB_READ_PUMP_MAX_BATCH];
+    VoodooUSBReadPumpSlot * slots[VOODOO_USB_READ_PUMP_MAX_BATCH];
+    
+    // Batches are handed over in order and never overlap, so only one thread delivers at a time; reads
+    // completing meanwhile wait in the next batch, and the deliverer picks it up before it gives up
+    IOLockLock(batchLock);
+    if (batchDelivering)
+    {
+        IOLockUnlock(batchLock);
+        return;
+    }
+    batchDelivering = true;
+    
+    while (batchFlush && batchCount)
+    {
+        UInt32 count = min(batchCount, batchMax);
+        
+        memcpy(completions, batch, sizeof(VoodooUSBReadCompletion) * count);
+        memcpy(slots, batchSlots, sizeof(VoodooUSBReadPumpSlot *) * count);
+        batchCount -= count;
+        memmove(batch, batch + count, sizeof(VoodooUSBReadCompletion) * batchCount);
+        memmove(batchSlots, batchSlots + count, sizeof(VoodooUSBReadPumpSlot *) * batchCount);
+        
+        // What completed during the last delivery goes right after it
+        if (!batchCount)
+        {
+            batchFlush = false;
+            if (!byTimer)
+            {
+                thread_call_cancel(batchTimer);
+            }
+        }
+        IOLockUnlock(batchLock);
+        
+        OSIncrementAtomic64((volatile SInt64 *) &pumpStatistics.batches);
+        OSIncrementAtomic((volatile SInt32 *) &pumpStatistics.batchSizes[count]);
+        
+        batchAction(pumpOwner, pumpRefCon, completions, count);
+        
+        for (UInt32 i = 0; i < count; ++i)
+        {
+            if (completions[i].status == kIOReturnNoDevice || completions[i].status == kIOReturnNotResponding || !pumpRunning)
+            {
+                continue;
+            }
+            
+            if (postPumpRead(slots[i]) != kIOReturnSuccess)
+            {
+                OSIncrementAtomic((volatile SInt32 *) &pumpStatistics.resubmitFailures);
+            }
+        }
+        
+        IOLockLock(batchLock);
+    }
+    
+    batchDelivering = false;
+    IOLockUnlock(batchLock);
+}
+
+void VoodooUSBPipe::coalesceTimerAction(thread_call_param_t param0, thread_call_param_t param1)
+{
+    VoodooUSBPipe * that = (VoodooUSBPipe *) param0;
+    bool flush = false;
+    
+    IOLockLock(that->batchLock);
+    if (that->batchCount && that->pumpRunning && !that->batchFlush)
+    {
+        OSIncrementAtomic((volatile SInt32 *) &that->pumpStatistics.timerFlushes);
+        that->batchFlush = true;
+        flush = true;
+    }
+    IOLockUnlock(that->batchLock);
+    
+    if (flush)
+    {
+        that->deliverBatches(true);
+    }
+}
+
+void VoodooUSBPipe::stopReadPump()
+{
+    if (!pumpSlots)
+    {
+        return;
+    }
+    
+    pumpRunning = false;
+    abort();
+    
+    // Every posted read completes with kIOReturnAborted, and the slots are only freed once none is left
+    while (pumpPosted > 0)
+    {
+        IOSleep(1);
+    }
+    
+    // A batch still waiting is dropped along with the reads the abort cancelled. Only once no
+    // completion is running can the timer no longer be armed again
+    if (batchTimer)
+    {
+        thread_call_cancel_wait(batchTimer);
+        IOLockLock(batchLock);
+        batchCount = 0;
+        batchFlush = false;
+        IOLockUnlock(batchLock);
+    }
+    
+    freeReadPump();
+}
+
+void VoodooUSBPipe::freeReadPump()
+{
+    if (!pumpSlots)
+    {
+        return;
+    }
+    
+    for (UInt32 i = 0; i < pumpDepth; ++i)
+    {
+        if (pumpSlots[i].buffer)
+        {
+            pumpSlots[i].buffer->complete();
+            OSSafeReleaseNULL(pumpSlots[i].buffer);
+        }
+    }
+    
+    IODelete(pumpSlots, VoodooUSBReadPumpSlot, pumpDepth);
+    pumpSlots = NULL;
+    pumpDepth = 0;
+    pumpRunning = false;
+}
+
+bool VoodooUSBPipe::isReadPumpRunning()
+{
+    return pumpRunning;
+}
+
+void VoodooUSBPipe::getReadPumpStatistics(VoodooUSBReadPumpStatistics * statistics)
+{
+    if (statistics)
+    {
+        *statistics = pumpStatistics;
+    }
+}
+
+void VoodooUSBPipe::setPollWindow(UInt32 windowUS, UInt32 budgetUS)
+{
+    // Every phase starts with its own budget
+    pollWindowNS = 0;
+    pollSpentNS  = 0;
+    pollBudgetNS = (UInt64) budgetUS * 1000;
+    
+    // With one CPU the completion only comes in once the spinner gives it up, so spinning only adds latency
+    if (ml_get_max_cpus() > 1)
+    {
+        pollWindowNS = (UInt64) windowUS * 1000;
+    }
+}
+
+bool VoodooUSBPipe::pollForCompletion(volatile bool * done)
+{
+    UInt64 windowNS = pollWindowNS;
+    UInt64 budgetNS = pollBudgetNS;
+    UInt64 spentNS  = pollSpentNS;
+    
+    if (!windowNS || !done)
+    {
+        return false;
+    }
+    
+    if (spentNS >= budgetNS)
+    {
+        OSAddAtomic64(1, (volatile SInt64 *) &pollStatistics.overBudget);
+        return false;
+    }
+    
+    UInt64 window;
+    nanoseconds_to_absolutetime(min(windowNS, budgetNS - spentNS), &window);
+    
+    UInt64 startTime = mach_absolute_time();
+    UInt64 now = startTime;
+    while (!*done && now - startTime < window)
+    {
+        now = mach_absolute_time();
+    }
+    bool hit = *done;
+    
+    absolutetime_to_nanoseconds(now - startTime, &spentNS);
+    OSAddAtomic64(spentNS, (volatile SInt64 *) &pollSpentNS);
+    OSAddAtomic64(spentNS, (volatile SInt64 *) &pollStatistics.spinNS);
+    OSAddAtomic64(1, (volatile SInt64 *) (hit ? &pollStatistics.hits : &pollStatistics.misses));
+    return hit;
+}
+
+void VoodooUSBPipe::getPollStatistics(VoodooUSBPollStatistics * statistics)
+{
+    if (statistics)
+    {
+        *statistics = pollStatistics;
+    }
+}
+
+bool VoodooUSBPipe::needsZeroLengthPacket(IOByteCount length)
+{
+    const USBEndpointDescriptor * ep = getEndpointDescriptor();
+    UInt16 packetSize = getMaxPacketSize();
+    
+    // Only bulk and interrupt transfers end on a short packet
+    if (!ep || !length || !packetSize || !(ep->bmAttributes & 0x02))
+    {
+        return false;
+    }
+    return !(length % packetSize);
+}
+
+IOReturn VoodooUSBPipe::writeSegments(IOMemoryDescriptor ** segments, UInt32 segmentCount, UInt32 completionTimeout, USBCompletion * completion)
+{
+    if (!segments || !segmentCount || segmentCount > VOODOO_USB_WRITE_MAX_SEGMENTS)
+    {
+        return kIOReturnBadArgument;
+    }
+    
+    // The controller walks the segments one after the other, so nothing is copied into a bounce buffer
+    IOMultiMemoryDescriptor * buffer = IOMultiMemoryDescriptor::withDescriptors(segments, segmentCount, kIODirectionOut, false);
+    if (!buffer)
+    {
+        return kIOReturnNoMemory;
+    }
+    
+    IOReturn result = buffer->prepare();
+    if (result != kIOReturnSuccess)
+    {
+        VoodooUSBErrorLog("writeSegments() - Unable to prepare %u segments: 0x%08x!!!\n", segmentCount, result);
+        buffer->release();
+        return result;
+    }
+    
+    IOByteCount length = buffer->getLength();
+    
+    if (!completion)
+    {
+        result = write(buffer, 0, completionTimeout, length);
+        if (result == kIOReturnSuccess && needsZeroLengthPacket(length))
+        {
+            result = write(buffer, 0, completionTimeout, 0);
+        }
+        buffer->complete();
+        buffer->release();
+        return result;
+    }
+    
+    VoodooUSBGatherWrite * request = IONew(VoodooUSBGatherWrite, 1);
+    if (!request)
+    {
+        buffer->complete();
+        buffer->release();
+        return kIOReturnNoMemory;
+    }
+    
+    request->pipe              = this;
+    request->buffer            = buffer;
+    request->completion        = *completion;
+    request->internal          = { this, gatherWriteAction, request };
+    request->completionTimeout = completionTimeout;
+    request->arg               = 0;
+    request->startTime         = mach_absolute_time();
+    request->zeroLengthPacket  = needsZeroLengthPacket(length);
+    request->dataDone          = false;
+    
+    result = write(buffer, 0, completionTimeout, length, &request->internal);
+    if (result != kIOReturnSuccess)
+    {
+        buffer->complete();
+        buffer->release();
+        IODelete(request, VoodooUSBGatherWrite, 1);
+    }
+    return result;
+}
+
+void VoodooUSBPipe::gatherWriteAction(void * owner, void * parameter, IOReturn status, UInt32 arg)
+{
+    VoodooUSBPipe        * that    = (VoodooUSBPipe *) owner;
+    VoodooUSBGatherWrite * request = (VoodooUSBGatherWrite *) parameter;
+    IOByteCount length = request->buffer->getLength();
+    
+    if (request->dataDone)
+    {
+        // The zero length packet is back; the caller is told what the data stage moved
+        arg = request->arg;
+    }
+    else if (request->zeroLengthPacket && status == kIOReturnSuccess)
+    {
+        request->dataDone = true;
+        request->arg      = arg;
+        
+        status = that->write(request->buffer, 0, request->completionTimeout, 0, &request->internal);
+        if (status == kIOReturnSuccess)
+        {
+            return;
+        }
+        VoodooUSBErrorLog("writeSegments() - Unable to send the zero length packet: 0x%08x!!!\n", status);
+    }
+    
+    that->recordTransfer(kIODirectionOut, request->startTime, (status == kIOReturnSuccess) ? length : 0, status);
+    
+    USBCompletion completion = request->completion;
+    request->buffer->complete();
+    request->buffer->release();
+    IODelete(request, VoodooUSBGatherWrite, 1);
+    
+    USBCompletionInvoke(completion, status, arg);
+}
+
+void VoodooUSBPipe::setCapture(VoodooHCICapture * capture)
+{
+    const USBEndpointDescriptor * ep = getEndpointDescriptor();
+    
+    if (capture)
+    {
+        capture->retain();
+    }
+    OSSafeReleaseNULL(this->capture);
+    this->capture = capture;
+    captureBulk   = ep && (ep->bmAttributes & 0x03) == kUSBBulk;
+}
+
+VoodooHCICapture * VoodooUSBPipe::getCapture()
+{
+    return capture;
+}
+
+void VoodooUSBPipe::captureAcl(IODirection direction, IOMemoryDescriptor * buffer, IOByteCount length)
+{
+    if (capture && captureBulk && length)
+    {
+        capture->recordDescriptor(kVoodooHCICaptureAcl, direction == kIODirectionIn, buffer, (UInt32) length);
+    }
+}
+
+// On a captured bulk endpoint *completion is swapped for one that records the bytes received first
+IOReturn VoodooUSBPipe::wrapCapturedRead(IOMemoryDescriptor * buffer, IOByteCount reqCount, USBCompletion ** completion)
+{
+    // The read pump records its own reads, once it knows the pump is still running
+    if (!capture || !captureBulk || (*completion)->action == pumpCompletionAction)
+    {
+        return kIOReturnSuccess;
+    }
+    
+    VoodooUSBCapturedRead * request = IONew(VoodooUSBCapturedRead, 1);
+    if (!request)
+    {
+        return kIOReturnNoMemory;
+    }
+    
+    request->pipe       = this;
+    request->buffer     = buffer;
+    request->reqCount   = reqCount;
+    request->completion = **completion;
+    request->internal   = { this, capturedReadAction, request };
+    *completion = &request->internal;
+    return kIOReturnSuccess;
+}
+
+// For a read that never went out
+void VoodooUSBPipe::unwrapCapturedRead(USBCompletion * completion)
+{
+    if (completion->action == capturedReadAction)
+    {
+        IODelete((VoodooUSBCapturedRead *) completion->parameter, VoodooUSBCapturedRead, 1);
+    }
+}
+
+void VoodooUSBPipe::capturedReadAction(void * owner, void * parameter, IOReturn status, UInt32 arg)
+{
+    VoodooUSBPipe         * that    = (VoodooUSBPipe *) owner;
+    VoodooUSBCapturedRead * request = (VoodooUSBCapturedRead *) parameter;
+    
+    // Recorded before the caller sees the buffer, which it may reuse straight away
+    if (status == kIOReturnSuccess || status == kIOReturnUnderrun)
+    {
+        that->captureAcl(kIODirectionIn, request->buffer, USBCompletionBytes(request->reqCount, arg));
+    }
+    
+    USBCompletion completion = request->completion;
+    IODelete(request, VoodooUSBCapturedRead, 1);
+    
+    USBCompletionInvoke(completion, status, arg);
+}
+
+void VoodooUSBPipe::recordTransfer(IODirection direction, UInt64 startTime, UInt64 bytes, IOReturn status)
+{
+    if (direction == kIODirectionIn)
+    {
+        readLatency.record(startTime, bytes, status);
+    }
+    else
+    {
+        writeLatency.record(startTime, bytes, status);
+    }
+}
+
+OSDictionary * VoodooUSBPipe::copyStatistics()
+{
+    OSDictionary * dictionary = OSDictionary::withCapacity(2);
+    if (!dictionary)
+    {
+        return NULL;
+    }
+    
+    OSDictionary * read  = readLatency.copyDictionary();
+    OSDictionary * write = writeLatency.copyDictionary();
+    if (read)
+    {
+        dictionary->setObject("Read", read);
+        read->release();
+    }
+    if (write)
+    {
+        dictionary->setObject("Write", write);
+        write->release();
+    }
+    return dictionary;
+}
@@ -0,0 +1,404 @@
+//
+//  VoodooUSBPipeIsochronous.cpp
+//  VoodooUSBProvider
+//
+//  Copyright © 2021 Charlie Jiang. All rights reserved.
+//
+
+#include "VoodooUSBPipe.h"
+
+IOReturn VoodooUSBPipe::startIsochronousStream(UInt32 depth, UInt32 framesPerTransfer, VoodooUSBScoPacketAction packetAction, VoodooUSBIsocFrameAction frameAction, void * owner, void * refCon)
+{
+    const USBEndpointDescriptor * ep = getEndpointDescriptor();
+    
+    if (!depth || depth > VOODOO_USB_ISOC_RING_MAX_DEPTH || !framesPerTransfer || framesPerTransfer > VOODOO_USB_ISOC_MAX_FRAMES)
+    {
+        return kIOReturnBadArgument;
+    }
+    
+    if (!ep || (ep->bmAttributes & 0x03) != kUSBIsoc)
+    {
+        VoodooUSBErrorLog("startIsochronousStream() - Not an isochronous endpoint!!!\n");
+        return kIOReturnBadArgument;
+    }
+    
+    if (isocRunning || isocSlots)
+    {
+        VoodooUSBErrorLog("startIsochronousStream() - Stream is already running!!!\n");
+        return kIOReturnBusy;
+    }
+    
+    // Alternate setting 0 of the SCO interface reserves no bandwidth
+    UInt16 packetSize = getMaxPacketSize();
+    if (!packetSize)
+    {
+        VoodooUSBErrorLog("startIsochronousStream() - Endpoint 0x%02x has no bandwidth in this alternate setting!!!\n", ep->bEndpointAddress);
+        return kIOReturnNoBandwidth;
+    }
+    
+    bool in = ep->bEndpointAddress & 0x80;
+    if (in && !packetAction)
+    {
+        return kIOReturnBadArgument;
+    }
+    
+    isocSlots = IONew(VoodooUSBIsocSlot, depth);
+    if (!isocSlots)
+    {
+        return kIOReturnNoMemory;
+    }
+    bzero(isocSlots, sizeof(VoodooUSBIsocSlot) * depth);
+    
+    isocDepth        = depth;
+    isocFrames       = framesPerTransfer;
+    isocPacketSize   = packetSize;
+    isocIn           = in;
+    isocPacketAction = packetAction;
+    isocFrameAction  = frameAction;
+    isocOwner        = owner;
+    isocRefCon       = refCon;
+    isocPosted       = 0;
+    scoPacketLength  = 0;
+    scoFifoHead      = 0;
+    scoFifoCount     = 0;
+    bzero(&isocStatistics, sizeof(isocStatistics));
+    
+    if (!in)
+    {
+        scoFifo = IONew(UInt8, VOODOO_USB_SCO_FIFO_SIZE);
+        scoFifoLock = IOSimpleLockAlloc();
+        if (!scoFifo || !scoFifoLock)
+        {
+            freeIsochronousStream();
+            return kIOReturnNoMemory;
+        }
+    }
+    
+    for (UInt32 i = 0; i < depth; ++i)
+    {
+        VoodooUSBIsocSlot * slot = &isocSlots[i];
+        
+        slot->buffer = IOBufferMemoryDescriptor::withCapacity(framesPerTransfer * packetSize, in ? kIODirectionIn : kIODirectionOut);
+        if (!slot->buffer || slot->buffer->prepare() != kIOReturnSuccess)
+        {
+            VoodooUSBErrorLog("startIsochronousStream() - Unable to allocate buffer %u!!!\n", i);
+            OSSafeReleaseNULL(slot->buffer);
+            freeIsochronousStream();
+            return kIOReturnNoMemory;
+        }
+        
+        slot->pipe       = this;
+        slot->index      = i;
+        slot->completion = { this, isocCompletionAction, slot };
+    }
+    
+    isocRunning = true;
+    
+    // Every transfer is queued before the first one completes, so the frames follow each other from the start
+    for (UInt32 i = 0; i < depth; ++i)
+    {
+        IOReturn result = postIsochronous(&isocSlots[i]);
+        if (result != kIOReturnSuccess)
+        {
+            VoodooUSBErrorLog("startIsochronousStream() - Unable to schedule transfer %u: 0x%08x!!!\n", i, result);
+            stopIsochronousStream();
+            return result;
+        }
+    }
+    
+    VoodooUSBDebugLog("startIsochronousStream() - %u transfers of %u x %u byte frames scheduled\n", depth, framesPerTransfer, packetSize);
+    return kIOReturnSuccess;
+}
+
+IOReturn VoodooUSBPipe::postIsochronous(VoodooUSBIsocSlot * slot)
+{
+    if (isocIn)
+    {
+        for (UInt32 i = 0; i < isocFrames; ++i)
+        {
+            USBIsocFrameStatus(slot->frames[i])  = kIOReturnSuccess;
+            USBIsocFrameRequest(slot->frames[i]) = isocPacketSize;
+            USBIsocFrameActual(slot->frames[i])  = 0;
+        }
+    }
+    else
+    {
+        fillIsochronousOut(slot);
+    }
+    
+    // Each scheduled transfer holds the pipe until its completion is done
+    retain();
+    OSIncrementAtomic(&isocPosted);
+    IOReturn result = isochronousIO(slot->buffer, slot->frames, isocFrames, &slot->completion);
+    if (result != kIOReturnSuccess)
+    {
+        OSDecrementAtomic(&isocPosted);
+        release();
+    }
+    return result;
+}
+
+void VoodooUSBPipe::fillIsochronousOut(VoodooUSBIsocSlot * slot)
+{
+    UInt8 * bytes = (UInt8 *) slot->buffer->getBytesNoCopy();
+    UInt32 offset = 0;
+    UInt32 empty = 0;
+    
+    // SCO packets run across frame boundaries; a frame with nothing queued still goes out, empty
+    IOSimpleLockLock(scoFifoLock);
+    for (UInt32 i = 0; i < isocFrames; ++i)
+    {
+        UInt32 count = scoFifoCount < isocPacketSize ? scoFifoCount : isocPacketSize;
+        UInt32 first = VOODOO_USB_SCO_FIFO_SIZE - scoFifoHead;
+        
+        if (count <= first)
+        {
+            memcpy(bytes + offset, scoFifo + scoFifoHead, count);
+        }
+        else
+        {
+            memcpy(bytes + offset, scoFifo + scoFifoHead, first);
+            memcpy(bytes + offset + first, scoFifo, count - first);
+        }
+        scoFifoHead   = (scoFifoHead + count) % VOODOO_USB_SCO_FIFO_SIZE;
+        scoFifoCount -= count;
+        offset       += count;
+        
+        USBIsocFrameStatus(slot->frames[i])  = kIOReturnSuccess;
+        USBIsocFrameRequest(slot->frames[i]) = count;
+        USBIsocFrameActual(slot->frames[i])  = 0;
+        empty += !count;
+    }
+    IOSimpleLockUnlock(scoFifoLock);
+    
+    if (empty)
+    {
+        OSAddAtomic(empty, (volatile SInt32 *) &isocStatistics.emptyFrames);
+    }
+}
+
+IOReturn VoodooUSBPipe::queueScoPacket(const void * packet, UInt16 length)
+{
+    const HciScoHdr * header = (const HciScoHdr *) packet;
+    
+    if (!packet || length < HCI_SCO_HDR_SIZE || length != HCI_SCO_HDR_SIZE + header->dLength)
+    {
+        return kIOReturnBadArgument;
+    }
+    
+    if (!isocRunning || isocIn)
+    {
+        return kIOReturnNotReady;
+    }
+    
+    IOSimpleLockLock(scoFifoLock);
+    if (VOODOO_USB_SCO_FIFO_SIZE - scoFifoCount < length)
+    {
+        IOSimpleLockUnlock(scoFifoLock);
+        return kIOReturnNoSpace;
+    }
+    
+    UInt32 tail  = (scoFifoHead + scoFifoCount) % VOODOO_USB_SCO_FIFO_SIZE;
+    UInt32 first = VOODOO_USB_SCO_FIFO_SIZE - tail;
+    if (length <= first)
+    {
+        memcpy(scoFifo + tail, packet, length);
+    }
+    else
+    {
+        memcpy(scoFifo + tail, packet, first);
+        memcpy(scoFifo, (const UInt8 *) packet + first, length - first);
+    }
+    scoFifoCount += length;
+    IOSimpleLockUnlock(scoFifoLock);
+    
+    if (capture)
+    {
+        capture->record(kVoodooHCICaptureSco, false, packet, length);
+    }
+    OSIncrementAtomic((volatile SInt32 *) &isocStatistics.scoPackets);
+    return kIOReturnSuccess;
+}
+
+void VoodooUSBPipe::reassembleSco(const UInt8 * data, UInt32 length)
+{
+    const HciScoHdr * header = (const HciScoHdr *) scoPacket;
+    
+    while (length)
+    {
+        // The header tells how much more belongs to this packet
+        UInt32 want = (scoPacketLength < HCI_SCO_HDR_SIZE) ? HCI_SCO_HDR_SIZE : HCI_SCO_HDR_SIZE + header->dLength;
+        UInt32 take = (want - scoPacketLength < length) ? want - scoPacketLength : length;
+        
+        memcpy(scoPacket + scoPacketLength, data, take);
+        scoPacketLength += take;
+        data            += take;
+        length          -= take;
+        
+        if (scoPacketLength >= HCI_SCO_HDR_SIZE && scoPacketLength == HCI_SCO_HDR_SIZE + header->dLength)
+        {
+            OSIncrementAtomic((volatile SInt32 *) &isocStatistics.scoPackets);
+            if (capture)
+            {
+                capture->record(kVoodooHCICaptureSco, true, scoPacket, scoPacketLength);
+            }
+            isocPacketAction(isocOwner, isocRefCon, scoPacket, scoPacketLength);
+            scoPacketLength = 0;
+        }
+    }
+}
+
+void VoodooUSBPipe::isocCompletionAction(void * owner, void * parameter, IOReturn status, USBIsocFrame * frames)
+{
+    VoodooUSBPipe     * that = (VoodooUSBPipe *) owner;
+    VoodooUSBIsocSlot * slot = (VoodooUSBIsocSlot *) parameter;
+    
+    // Nothing else was scheduled: the endpoint idles until this transfer is back on the bus
+    if (that->isocPosted == 1 && that->isocRunning)
+    {
+        OSIncrementAtomic((volatile SInt32 *) &that->isocStatistics.underruns);
+    }
+    
+    // The transfer keeps its count until it is rescheduled, stopIsochronousStream() waits on it
+    that->completeIsochronous(slot, status);
+    OSDecrementAtomic(&that->isocPosted);
+    that->release();
+}
+
+void VoodooUSBPipe::completeIsochronous(VoodooUSBIsocSlot * slot, IOReturn status)
+{
+    if (status == kIOReturnAborted || !isocRunning)
+    {
+        return;
+    }
+    
+    const UInt8 * bytes = isocIn ? (const UInt8 *) slot->buffer->getBytesNoCopy() : NULL;
+    UInt32 offset = 0;
+    UInt32 bytesDone = 0;
+    UInt32 errors = 0;
+    UInt32 empty = 0;
+    
+    for (UInt32 i = 0; i < isocFrames; ++i)
+    {
+        const USBIsocFrame & frame = slot->frames[i];
+        IOReturn frameStatus = USBIsocFrameStatus(frame);
+        UInt32 actual = USBIsocFrameActual(frame);
+        
+        if (frameStatus != kIOReturnSuccess && frameStatus != kIOReturnUnderrun)
+        {
+            ++errors;
+            
+            // The rest of a packet cut by a lost frame would be misread as the next header
+            if (isocIn && scoPacketLength)
+            {
+                OSIncrementAtomic((volatile SInt32 *) &isocStatistics.scoDropped);
+                scoPacketLength = 0;
+            }
+        }
+        else if (isocIn)
+        {
+            if (actual)
+            {
+                reassembleSco(bytes + offset, actual);
+            }
+            else
+            {
+                ++empty;
+            }
+        }
+        
+        bytesDone += actual;
+        offset += USBIsocFrameRequest(frame);
+    }
+    
+    OSIncrementAtomic64((volatile SInt64 *) &isocStatistics.transfers);
+    OSAddAtomic64(isocFrames, (volatile SInt64 *) &isocStatistics.frames);
+    OSAddAtomic64(bytesDone, (volatile SInt64 *) &isocStatistics.bytes);
+    if (errors)
+    {
+        OSAddAtomic(errors, (volatile SInt32 *) &isocStatistics.frameErrors);
+    }
+    if (empty)
+    {
+        OSAddAtomic(empty, (volatile SInt32 *) &isocStatistics.emptyFrames);
+    }
+    
+    if (isocFrameAction)
+    {
+        isocFrameAction(isocOwner, isocRefCon, status, slot->frames, isocFrames);
+    }
+    
+    if (status == kIOReturnNoDevice || status == kIOReturnNotResponding || !isocRunning)
+    {
+        return;
+    }
+    
+    if (postIsochronous(slot) != kIOReturnSuccess)
+    {
+        OSIncrementAtomic((volatile SInt32 *) &isocStatistics.resubmitFailures);
+    }
+}
+
+void VoodooUSBPipe::stopIsochronousStream()
+{
+    if (!isocSlots)
+    {
+        return;
+    }
+    
+    isocRunning = false;
+    abort();
+    
+    // Every scheduled transfer completes with kIOReturnAborted; the slots and FIFO go once none is left
+    while (isocPosted > 0)
+    {
+        IOSleep(1);
+    }
+    
+    freeIsochronousStream();
+}
+
+void VoodooUSBPipe::freeIsochronousStream()
+{
+    if (isocSlots)
+    {
+        for (UInt32 i = 0; i < isocDepth; ++i)
+        {
+            if (isocSlots[i].buffer)
+            {
+                isocSlots[i].buffer->complete();
+                OSSafeReleaseNULL(isocSlots[i].buffer);
+            }
+        }
+        
+        IODelete(isocSlots, VoodooUSBIsocSlot, isocDepth);
+        isocSlots = NULL;
+    }
+    
+    if (scoFifo)
+    {
+        IODelete(scoFifo, UInt8, VOODOO_USB_SCO_FIFO_SIZE);
+        scoFifo = NULL;
+    }
+    if (scoFifoLock)
+    {
+        IOSimpleLockFree(scoFifoLock);
+        scoFifoLock = NULL;
+    }
+    
+    isocDepth = 0;
+    isocRunning = false;
+}
+
+bool VoodooUSBPipe::isIsochronousStreamRunning()
+{
+    return isocRunning;
+}
+
+void VoodooUSBPipe::getIsochronousStatistics(VoodooUSBIsocStatistics * statistics)
+{
+    if (statistics)
+    {
+        *statistics = isocStatistics;
+    }
+}
@@ -0,0 +1,127 @@
+//
+//  VoodooUSBLatencyHistogram.cpp
+//  VoodooUSBProvider
+//
+//  Copyright © 2021 Charlie Jiang. All rights reserved.
+//
+
+#include "VoodooUSBLatencyHistogram.h"
+#include <libkern/c++/OSArray.h>
+#include <libkern/c++/OSNumber.h>
+
+void VoodooUSBLatencyHistogram::record(UInt64 startTime, UInt64 byteCount, IOReturn status)
+{
+    UInt64 elapsedNS;
+    absolutetime_to_nanoseconds(mach_absolute_time() - startTime, &elapsedNS);
+    
+    UInt64 elapsedUS = elapsedNS / 1000;
+    UInt32 bucket = elapsedUS ? 63 - __builtin_clzll(elapsedUS) : 0;
+    if (bucket >= VOODOO_USB_LATENCY_BUCKETS)
+    {
+        bucket = VOODOO_USB_LATENCY_BUCKETS - 1;
+    }
+    
+    OSIncrementAtomic64((volatile SInt64 *) &buckets[bucket]);
+    OSIncrementAtomic64((volatile SInt64 *) &count);
+    OSAddAtomic64(elapsedNS, (volatile SInt64 *) &totalNS);
+    
+    if (status != kIOReturnSuccess)
+    {
+        OSIncrementAtomic64((volatile SInt64 *) &errors);
+    }
+    else if (byteCount)
+    {
+        OSAddAtomic64(byteCount, (volatile SInt64 *) &bytes);
+    }
+    
+    UInt64 mark;
+    do
+    {
+        mark = maxNS;
+        if (elapsedNS <= mark)
+        {
+            break;
+        }
+    } while (!OSCompareAndSwap64(mark, elapsedNS, &maxNS));
+}
+
+void VoodooUSBLatencyHistogram::reset()
+{
+    bzero((void *) this, sizeof(VoodooUSBLatencyHistogram));
+}
+
+UInt64 VoodooUSBLatencyHistogram::getPercentileUS(UInt32 permille)
+{
+    UInt64 total = count;
+    if (!total)
+    {
+        return 0;
+    }
+    
+    // Reported as the upper bound of the bucket the percentile falls into
+    UInt64 target = (total * permille + 999) / 1000;
+    UInt64 seen = 0;
+    for (UInt32 i = 0; i < VOODOO_USB_LATENCY_BUCKETS; ++i)
+    {
+        seen += buckets[i];
+        if (seen >= target)
+        {
+            return 1ULL << (i + 1);
+        }
+    }
+    return maxNS / 1000;
+}
+
+OSDictionary * VoodooUSBLatencyHistogram::copyDictionary()
+{
+    OSDictionary * dictionary = OSDictionary::withCapacity(10);
+    OSArray * histogram = OSArray::withCapacity(VOODOO_USB_LATENCY_BUCKETS);
+    
+    if (!dictionary || !histogram)
+    {
+        OSSafeReleaseNULL(dictionary);
+        OSSafeReleaseNULL(histogram);
+        return NULL;
+    }
+    
+    // Counters keep moving while the snapshot is taken; each value is read once and is self-consistent
+    const struct
+    {
+        const char * key;
+        UInt64       value;
+    } fields[] =
+    {
+        { "Count",   count },
+        { "Errors",  errors },
+        { "Bytes",   bytes },
+        { "TotalUS", totalNS / 1000 },
+        { "MaxUS",   maxNS / 1000 },
+        { "P50US",   getPercentileUS(500) },
+        { "P99US",   getPercentileUS(990) },
+        { "P999US",  getPercentileUS(999) },
+    };
+    
+    for (UInt32 i = 0; i < ARRAY_SIZE(fields); ++i)
+    {
+        OSNumber * number = OSNumber::withNumber(fields[i].value, 64);
+        if (number)
+        {
+            dictionary->setObject(fields[i].key, number);
+            number->release();
+        }
+    }
+    
+    for (UInt32 i = 0; i < VOODOO_USB_LATENCY_BUCKETS; ++i)
+    {
+        OSNumber * number = OSNumber::withNumber(buckets[i], 64);
+        if (number)
+        {
+            histogram->setObject(number);
+            number->release();
+        }
+    }
+    dictionary->setObject("Histogram", histogram);
+    histogram->release();
+    
+    return dictionary;
+}
@@ -0,0 +1,38 @@
+//
+//  VoodooUSBLatencyHistogram.h
+//  VoodooUSBProvider
+//
+//  Copyright © 2021 Charlie Jiang. All rights reserved.
+//
+
+#ifndef VoodooUSBLatencyHistogram_h
+#define VoodooUSBLatencyHistogram_h
+
+#include "VoodooUSBCommon.h"
+#include <libkern/c++/OSDictionary.h>
+
+#define VOODOO_USB_LATENCY_BUCKETS          24      /* bucket n counts [2^n, 2^(n+1)) us, the last one everything above 8 s */
+
+/*
+ * Log2-bucketed latency histogram with a byte counter.
+ * record() only uses atomic adds, so it can be called from any completion or send path without a lock.
+ * Embedded by value in the objects it instruments; all-zero is the empty histogram.
+ */
+struct VoodooUSBLatencyHistogram
+{
+    volatile UInt64    buckets[VOODOO_USB_LATENCY_BUCKETS];
+    volatile UInt64    count;
+    volatile UInt64    errors;
+    volatile UInt64    bytes;
+    volatile UInt64    totalNS;
+    volatile UInt64    maxNS;
+    
+    /* startTime is a mach_absolute_time() taken before the request went out */
+    void record(UInt64 startTime, UInt64 byteCount, IOReturn status = kIOReturnSuccess);
+    void reset();
+    
+    UInt64 getPercentileUS(UInt32 permille);
+    OSDictionary * copyDictionary();
+};
+
+#endif /* VoodooUSBLatencyHistogram_h */